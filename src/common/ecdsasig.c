@@ -0,0 +1,192 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file ecdsasig.c
+ * @brief Conversion of ECDSA signatures between DER and plain r || s format
+ */
+
+#include <string.h>
+
+#include "ecdsasig.h"
+
+
+
+/*
+ * Move r and s within the same buffer. Both keep their order, so moving s
+ * first is safe if it moves to the right and moving r first otherwise.
+ */
+static void movePair(unsigned char *sig, int rsrc, int rdst, int rlen, int ssrc, int sdst, int slen)
+{
+	if (sdst >= ssrc) {
+		memmove(sig + sdst, sig + ssrc, slen);
+		memmove(sig + rdst, sig + rsrc, rlen);
+	} else {
+		memmove(sig + rdst, sig + rsrc, rlen);
+		memmove(sig + sdst, sig + ssrc, slen);
+	}
+}
+
+
+
+/**
+ * Convert a DER encoded ECDSA signature SEQUENCE { r INTEGER, s INTEGER }
+ * into the concatenation of r and s, each with fieldsize bytes.
+ *
+ * The conversion can be done in place with der == raw, in which case
+ * rawsize is the size of the buffer and must cover the DER encoding as well.
+ *
+ * @param der       the DER encoded signature
+ * @param derlen    the length of the DER encoded signature
+ * @param raw       the buffer receiving r and s
+ * @param rawsize   the size of the buffer, at least 2 * fieldsize
+ * @param fieldsize the length of r and s in bytes
+ * @return          2 * fieldsize or -1 if the encoding is invalid or does not fit
+ */
+int ecdsa_der_to_raw(const unsigned char *der, int derlen, unsigned char *raw, int rawsize, int fieldsize)
+{
+	int i, ofs, len, src[2], srclen[2];
+
+	if ((derlen < 8) || (rawsize < 2 * fieldsize) || (der[0] != 0x30)) {
+		return -1;
+	}
+
+	if ((der == raw) && (derlen > rawsize)) {
+		return -1;
+	}
+
+	ofs = 1;
+	len = der[ofs++];
+	if (len == 0x81) {
+		len = der[ofs++];
+	} else if (len > 0x80) {
+		return -1;
+	}
+
+	if (ofs + len != derlen) {
+		return -1;
+	}
+
+	for (i = 0; i < 2; i++) {
+		if ((ofs + 2 > derlen) || (der[ofs] != 0x02) || (der[ofs + 1] == 0) || (der[ofs + 1] > 0x7F)) {
+			return -1;
+		}
+		srclen[i] = der[ofs + 1];
+		src[i] = ofs + 2;
+		ofs = src[i] + srclen[i];
+		if (ofs > derlen) {
+			return -1;
+		}
+		while ((srclen[i] > 0) && (der[src[i]] == 0)) {		// Drop leading zeros
+			src[i]++;
+			srclen[i]--;
+		}
+		if (srclen[i] > fieldsize) {
+			return -1;
+		}
+	}
+
+	if (ofs != derlen) {
+		return -1;
+	}
+
+	if (der == raw) {
+		movePair(raw, src[0], fieldsize - srclen[0], srclen[0], src[1], 2 * fieldsize - srclen[1], srclen[1]);
+	} else {
+		memcpy(raw + fieldsize - srclen[0], der + src[0], srclen[0]);
+		memcpy(raw + 2 * fieldsize - srclen[1], der + src[1], srclen[1]);
+	}
+	memset(raw, 0, fieldsize - srclen[0]);
+	memset(raw + fieldsize, 0, fieldsize - srclen[1]);
+
+	return 2 * fieldsize;
+}
+
+
+
+/**
+ * Convert the concatenation of r and s, each with fieldsize bytes, in place
+ * into a DER encoded ECDSA signature SEQUENCE { r INTEGER, s INTEGER }.
+ *
+ * With fixed set, r and s are always encoded with a leading zero byte, so
+ * that all signatures have the same length ECDSA_DER_MAX_LEN(fieldsize).
+ * This violates DER, but not BER and is accepted by most crypto libraries.
+ *
+ * @param sig       the buffer containing r and s
+ * @param fieldsize the length of r and s in bytes
+ * @param bufsize   the size of the buffer
+ * @param fixed     encode r and s with fixed length
+ * @return          the length of the encoding or -1 if the buffer is too small
+ */
+int ecdsa_raw_to_der(unsigned char *sig, int fieldsize, int bufsize, int fixed)
+{
+	int i, len, hdr, src[2], srclen[2], pad[2], dst[2];
+
+	if ((fieldsize <= 0) || (fieldsize > 0x7E) || (bufsize < 2 * fieldsize)) {
+		return -1;
+	}
+
+	for (i = 0; i < 2; i++) {
+		src[i] = i * fieldsize;
+		srclen[i] = fieldsize;
+		if (fixed) {
+			pad[i] = 1;
+		} else {
+			while ((srclen[i] > 1) && (sig[src[i]] == 0)) {		// Strip leading zeros
+				src[i]++;
+				srclen[i]--;
+			}
+			pad[i] = (sig[src[i]] & 0x80) ? 1 : 0;			// Keep the value unsigned
+		}
+	}
+
+	len = 2 + pad[0] + srclen[0] + 2 + pad[1] + srclen[1];
+	hdr = len < 0x80 ? 2 : 3;
+	if (hdr + len > bufsize) {
+		return -1;
+	}
+
+	dst[0] = hdr + 2 + pad[0];
+	dst[1] = dst[0] + srclen[0] + 2 + pad[1];
+	movePair(sig, src[0], dst[0], srclen[0], src[1], dst[1], srclen[1]);
+
+	sig[0] = 0x30;
+	if (hdr == 3) {
+		sig[1] = 0x81;
+	}
+	sig[hdr - 1] = (unsigned char)len;
+
+	for (i = 0; i < 2; i++) {
+		sig[dst[i] - pad[i] - 2] = 0x02;
+		sig[dst[i] - pad[i] - 1] = (unsigned char)(pad[i] + srclen[i]);
+		if (pad[i]) {
+			sig[dst[i] - 1] = 0;
+		}
+	}
+
+	return hdr + len;
+}
@@ -38,6 +38,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifndef WIN32
+#include <time.h>
+#endif
+
 #include "ccidT1.h"
 #include "ccid_usb.h"
 #include "ctccid_debug.h"
@@ -69,6 +73,8 @@ int ccidT1Term (struct scr *ctx)
 	free(ctx->t1);
 	ctx->t1 = NULL;
 	ctx->CTModFunc = NULL;
+	ctx->ReadTimeout = 0;
+	ctx->ProbeTimeout = 0;
 	return 0;
 }
 
@@ -132,6 +138,83 @@ void ccidT1BlockInfo(unsigned char Nad, unsigned char Pcb, int InBuffLength, uns
 
 
 
+/**
+ * Return a monotonic time stamp in milliseconds
+ */
+static unsigned long ccidT1CurrentMillis()
+{
+#ifdef WIN32
+	return GetTickCount();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+
+
+/**
+ * Set the timeouts for the next block from the working block waiting time and the
+ * response time observed for the command in progress.
+ *
+ * The read timeout always covers the working BWT, so waiting time extensions granted
+ * to the card are honoured. If the command is known to complete quickly, the reader is
+ * probed after a multiple of the observed response time, so that a lost block is
+ * detected long before the block waiting time expires.
+ *
+ * @param ctx Reader context
+ */
+static void ccidT1SetTimeouts(scr_t *ctx)
+{
+	unsigned long probe;
+
+	ctx->ReadTimeout = MAX(USB_READ_TIMEOUT, ctx->t1->WorkBWT + 100);
+	ctx->ProbeTimeout = 0;
+
+	if (!ctx->t1->ResponseTime[ctx->t1->INS] || (ctx->t1->WorkBWT > ctx->t1->BlockWaitTime)) {
+		return;
+	}
+
+	probe = ctx->t1->ResponseTime[ctx->t1->INS] * RTFACTOR + RTMARGIN;
+
+	if (probe < ctx->t1->BlockWaitTime) {
+		ctx->ProbeTimeout = probe;
+	}
+}
+
+
+
+/**
+ * Update the observed response time for the command in progress
+ *
+ * Slower responses are taken over immediately, faster responses slowly decay the value.
+ *
+ * @param ctx Reader context
+ * @param elapsed Time in ms between sending a block and receiving the response
+ */
+static void ccidT1RecordResponseTime(scr_t *ctx, unsigned long elapsed)
+{
+	unsigned short *rt = &ctx->t1->ResponseTime[ctx->t1->INS];
+
+	if (elapsed == 0) {
+		elapsed = 1;
+	}
+
+	if (elapsed > 0xFFFF) {
+		elapsed = 0xFFFF;
+	}
+
+	if (elapsed >= *rt) {
+		*rt = (unsigned short)elapsed;
+	} else {
+		*rt = (unsigned short)((*rt * 7 + elapsed) / 8);
+	}
+}
+
+
+
 /**
  * Receive a block in T=1 protocol
  *
@@ -144,9 +227,13 @@ int ccidT1ReceiveBlock(scr_t *ctx)
 	unsigned int i, len;
 	unsigned char lrc = 0;
 	unsigned char buf[BUFFMAX];
+	unsigned long start;
 
 	ctx->t1->InBuffLength = -1;
 
+	ccidT1SetTimeouts(ctx);
+	start = ccidT1CurrentMillis();
+
 	len = BUFFMAX;
 	rc = RDR_to_PC_DataBlock(ctx, &len, buf, NULL, NULL, NULL);
 
@@ -154,6 +241,13 @@ int ccidT1ReceiveBlock(scr_t *ctx)
 		return -1;
 	}
 
+	/* The reader failed to receive a block from the card, e.g. mute or parity error */
+	if (len < 4) {
+		return -1;
+	}
+
+	ccidT1RecordResponseTime(ctx, ccidT1CurrentMillis() - start);
+
 #ifdef DEBUG
 	ctccid_debug("Received : \n");
 	ccidT1BlockInfo(buf[0], buf[1], buf[2], buf + 3);
@@ -161,15 +255,13 @@ int ccidT1ReceiveBlock(scr_t *ctx)
 
 	lrc = 0;
 
-	if (len != 0) {
-		/* Calculate checksum */
-		for (i = 0; i < (len - 1); i++) {
-			lrc ^= buf[i];
-		}
+	/* Calculate checksum */
+	for (i = 0; i < (len - 1); i++) {
+		lrc ^= buf[i];
+	}
 
-		if (lrc != buf[len - 1]) {
-			return ERR_EDC;
-		}
+	if (lrc != buf[len - 1]) {
+		return ERR_EDC;
 	}
 
 	ctx->t1->Nad = buf[0];
@@ -673,6 +765,8 @@ int ccidT1Process (struct scr *ctx,
 {
 	int rc;
 
+	ctx->t1->INS = lc >= 4 ? cmd[1] : 0;
+
 	rc = ccidT1Transport(ctx, 0, 0, cmd, lc, rsp, *lr);
 
 	if (rc < 0) {
@@ -66,6 +66,10 @@ typedef struct ccidT1 {
 	int              InBuffLength;
 	/** Buffer for incoming data          */
 	unsigned char   InBuff[BUFFMAX];
+	/** INS byte of the command in progress                */
+	unsigned char   INS;
+	/** Observed response time in ms per INS, 0 if unknown */
+	unsigned short  ResponseTime[256];
 } ccidT1_t;
 
 /**
@@ -94,6 +98,8 @@ typedef struct ccidT1 {
 #define BWT     9600                    /* Timeout between 2 blocks      1s  */
 #define BLEN    32                      /* Initial length of block           */
 #define RETRY   2                       /* Number of retries                 */
+#define RTMARGIN 20                     /* Minimum slack before probing  20ms*/
+#define RTFACTOR 4                      /* Probe at 4 times observed time    */
 
 #define RERR_NONE       0x00            /* No error indicated in R-block     */
 #define RERR_EDC        0x01            /* EDC error indicated in  R-block   */
@@ -33,8 +33,13 @@
  */
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
 #ifdef DEBUG
 #include <stdio.h>
 #include "ctccid_debug.h"
@@ -92,6 +97,248 @@ void CCIDDump(unsigned char *mem, int len)
 
 
 
+/**
+ * Check if a response is expected for the slot and sequence number
+ *
+ * Must be called with the device mutex held.
+ *
+ * @param device USB device
+ * @param slot Slot index
+ * @param seq Sequence number
+ * @return 1 if a request with this sequence number was sent to the slot and not yet answered
+ */
+static int CCID_IsOutstanding(usb_device_t *device, unsigned char slot, unsigned char seq)
+{
+        return (device->seqOutstanding[seq >> 3] & (1 << (seq & 7))) && (device->seqSlot[seq] == slot);
+}
+
+
+
+/**
+ * Mark a response as received
+ *
+ * Must be called with the device mutex held. A time extension request is not a response
+ * and leaves the slot busy. Responses to requests that were abandoned or never sent
+ * must be discarded, as they don't belong to the command currently processed.
+ *
+ * @param device USB device
+ * @param msg Message received
+ * @return 1 if the message answers an outstanding request, 0 if it must be discarded
+ */
+static int CCID_Completed(usb_device_t *device, unsigned char *msg)
+{
+        unsigned char slot = msg[5], seq = msg[6];
+
+        if (!CCID_IsOutstanding(device, slot, seq)) {
+#ifdef DEBUG
+                ctccid_debug("Discarding response with sequence number %d for slot %d\n", seq, slot);
+#endif
+                return 0;
+        }
+
+        if ((msg[7] & 0xC0) == 0x80) {
+                return 1;
+        }
+
+        device->seqOutstanding[seq >> 3] &= ~(1 << (seq & 7));
+
+        if (device->outstanding[slot] > 0) {
+                device->outstanding[slot]--;
+                if (device->outstanding[slot] == 0) {
+                        device->busy--;
+                }
+        }
+        return 1;
+}
+
+
+
+/**
+ * Give up waiting for outstanding responses of the slot, e.g. after a timeout
+ *
+ * A late response is then discarded rather than blocking other slots from becoming busy.
+ *
+ * @param ctx Reader context
+ */
+static void CCID_Abandon(scr_t *ctx)
+{
+        usb_device_t *device = ctx->device;
+        int seq;
+
+        mutex_lock(&device->mutex);
+
+        for (seq = 0; seq < 256; seq++) {
+                if (device->seqSlot[seq] == ctx->slot) {
+                        device->seqOutstanding[seq >> 3] &= ~(1 << (seq & 7));
+                }
+        }
+
+        if (device->outstanding[ctx->slot] > 0) {
+                device->outstanding[ctx->slot] = 0;
+                device->busy--;
+        }
+
+        mutex_unlock(&device->mutex);
+}
+
+
+
+/**
+ * Send a message to the slot of the reader context, tagging it with the slot index and
+ * a new sequence number
+ *
+ * If the reader already has bMaxCCIDBusySlots other slots processing a command, wait until
+ * one of them completes.
+ *
+ * @param ctx Reader context
+ * @param len Length of message
+ * @param msg Message with the slot and sequence number to be filled in
+ * @return 0 on success, negative value otherwise
+ */
+static int CCID_Send(scr_t *ctx, unsigned int len, unsigned char *msg)
+{
+
+        usb_device_t *device = ctx->device;
+        int rc;
+
+        mutex_lock(&device->mutex);
+
+        while ((device->outstanding[ctx->slot] == 0) && (device->busy >= device->bMaxCCIDBusySlots)) {
+                mutex_unlock(&device->mutex);
+                usleep(CCID_POLL_INTERVAL * 1000);
+                mutex_lock(&device->mutex);
+        }
+
+        msg[5] = ctx->slot;
+        msg[6] = device->bSeq++;
+        ctx->seq = msg[6];
+
+#ifdef DEBUG
+        CCIDDump(msg, len);
+#endif
+
+        rc = USB_Write(device, len, msg);
+
+        if (rc == 0) {
+                device->seqOutstanding[msg[6] >> 3] |= 1 << (msg[6] & 7);
+                device->seqSlot[msg[6]] = ctx->slot;
+                if (device->outstanding[ctx->slot]++ == 0) {
+                        device->busy++;
+                }
+        }
+
+        mutex_unlock(&device->mutex);
+
+        return rc;
+}
+
+
+
+/**
+ * Receive the next message for the slot of the reader context
+ *
+ * Messages for other slots of the same reader are queued for their reader context. If the
+ * reader has more than one slot, the bulk in pipe is read in short intervals, so that the
+ * contexts of other slots can pick up their responses while this slot is still busy.
+ *
+ * @param ctx Reader context
+ * @param len Size of buffer/length of message received
+ * @param msg Buffer for message
+ * @param timeout Timeout in milliseconds
+ * @return 0 on success, \ref ERR_TIMEOUT or other negative value on error
+ */
+static int CCID_Receive(scr_t *ctx, unsigned int *len, unsigned char *msg, unsigned int timeout)
+{
+
+        usb_device_t *device = ctx->device;
+        struct usb_message *pm, **ppm;
+        unsigned char buf[10 + BUFFMAX];
+        unsigned int l, wait;
+        int rc;
+
+        while (1) {
+                mutex_lock(&device->mutex);
+
+                for (ppm = &device->pending; *ppm; ppm = &(*ppm)->next) {
+                        if ((*ppm)->data[5] == ctx->slot) {
+                                break;
+                        }
+                }
+
+                if (*ppm) {
+                        pm = *ppm;
+                        *ppm = pm->next;
+
+                        /* The request may have been abandoned since the response was queued */
+                        if (!CCID_Completed(device, pm->data)) {
+                                mutex_unlock(&device->mutex);
+                                free(pm);
+                                continue;
+                        }
+                        mutex_unlock(&device->mutex);
+
+                        if (pm->length > *len) {
+                                free(pm);
+                                return -1;
+                        }
+                        memcpy(msg, pm->data, pm->length);
+                        *len = pm->length;
+                        free(pm);
+                        return 0;
+                }
+
+                wait = timeout;
+                if (device->bMaxSlotIndex > 0 && wait > CCID_POLL_INTERVAL) {
+                        wait = CCID_POLL_INTERVAL;
+                }
+
+                l = sizeof(buf);
+                rc = USB_ReadTimeout(device, &l, buf, wait);
+
+                if (rc == 0 && l >= 10 && buf[5] != ctx->slot) {
+                        /* Response for another slot, queue it unless nobody waits for it */
+                        if (CCID_IsOutstanding(device, buf[5], buf[6])) {
+                                pm = malloc(sizeof(struct usb_message) + l);
+                                if (pm) {
+                                        pm->next = NULL;
+                                        pm->length = l;
+                                        memcpy(pm->data, buf, l);
+                                        for (ppm = &device->pending; *ppm; ppm = &(*ppm)->next);
+                                        *ppm = pm;
+                                }
+                        }
+                        mutex_unlock(&device->mutex);
+                        continue;
+                }
+
+                if (rc == 0 && l >= 10 && !CCID_Completed(device, buf)) {
+                        mutex_unlock(&device->mutex);
+                        continue;
+                }
+
+                mutex_unlock(&device->mutex);
+
+                if (rc == ERR_TIMEOUT && timeout > wait) {
+                        timeout -= wait;
+                        continue;
+                }
+
+                if (rc < 0) {
+                        return rc;
+                }
+
+                if (l > *len) {
+                        return -1;
+                }
+
+                memcpy(msg, buf, l);
+                *len = l;
+                return 0;
+        }
+}
+
+
+
 /**
  * Power on the ICC in the reader and set the ATR and the communication parameters as specified
  *
@@ -108,19 +355,16 @@ int PC_to_RDR_IccPowerOn(scr_t *ctx)
         memset(msg, 0, 10);
         msg[0] = MSG_TYPE_PC_to_RDR_IccPowerOn;
 
-#ifdef DEBUG
-        CCIDDump(msg, 10);
-#endif
-
-        rc = USB_Write(ctx->device, 10, msg);
+        rc = CCID_Send(ctx, 10, msg);
 
         if (rc < 0) {
                 return rc;
         }
 
-        rc = USB_Read(ctx->device, &l, msg);
+        rc = CCID_Receive(ctx, &l, msg, USB_READ_TIMEOUT);
 
         if (rc < 0) {
+                CCID_Abandon(ctx);
                 return rc;
         }
 
@@ -129,7 +373,7 @@ int PC_to_RDR_IccPowerOn(scr_t *ctx)
 #endif
 
         /* check length, message type, slot and sequence number */
-        if (l < 10 || msg[0] != MSG_TYPE_RDR_to_PC_DataBlock || msg[5] != 0x00 || msg[6] != 0x00) {
+        if (l < 10 || msg[0] != MSG_TYPE_RDR_to_PC_DataBlock || msg[5] != ctx->slot || msg[6] != ctx->seq) {
                 return -1;
         }
 
@@ -319,20 +563,17 @@ int PC_to_RDR_SetParameters(scr_t *ctx)
         msg[15] = ctx->IFSC; /* Negotiated IFSC = 254 bytes */
         msg[16] = 0x00; /* Default value for NAD */
 
-#ifdef DEBUG
-        CCIDDump(msg, 17);
-#endif
-
-        rc = USB_Write(ctx->device, 17, msg);
+        rc = CCID_Send(ctx, 17, msg);
 
         if (rc < 0) {
                 return rc;
         }
 
         len = 17;
-        rc = USB_Read(ctx->device, &len, msg);
+        rc = CCID_Receive(ctx, &len, msg, USB_READ_TIMEOUT);
 
         if (rc < 0) {
+                CCID_Abandon(ctx);
                 return rc;
         }
 
@@ -362,19 +603,16 @@ int PC_to_RDR_GetSlotStatus(scr_t *ctx)
         memset(msg, 0, 10);
         msg[0] = MSG_TYPE_PC_to_RDR_GetSlotStatus;
 
-#ifdef DEBUG
-        CCIDDump(msg, 10);
-#endif
-
-        rc = USB_Write(ctx->device, 10, msg);
+        rc = CCID_Send(ctx, 10, msg);
 
         if (rc < 0) {
                 return rc;
         }
 
-        rc = USB_Read(ctx->device, &len, buf);
+        rc = CCID_Receive(ctx, &len, buf, USB_READ_TIMEOUT);
 
         if (rc < 0) {
+                CCID_Abandon(ctx);
                 return rc;
         }
 
@@ -383,7 +621,7 @@ int PC_to_RDR_GetSlotStatus(scr_t *ctx)
 #endif
 
         /* check length, message type, slot and sequence number */
-        if (len != 10 || buf[0] != MSG_TYPE_RDR_to_PC_SlotStatus || buf[5] != 0x00 || buf[6] != 0x00) {
+        if (len != 10 || buf[0] != MSG_TYPE_RDR_to_PC_SlotStatus || buf[5] != ctx->slot || buf[6] != ctx->seq) {
                 return -1;
         }
 
@@ -411,19 +649,16 @@ int PC_to_RDR_IccPowerOff(scr_t *ctx)
         memset(msg, 0, 10);
         msg[0] = MSG_TYPE_PC_to_RDR_IccPowerOff;
 
-#ifdef DEBUG
-        CCIDDump(msg, 10);
-#endif
-
-        rc = USB_Write(ctx->device, 10, msg);
+        rc = CCID_Send(ctx, 10, msg);
 
         if (rc < 0) {
                 return rc;
         }
 
-        rc = USB_Read(ctx->device, &len, buf);
+        rc = CCID_Receive(ctx, &len, buf, USB_READ_TIMEOUT);
 
         if (rc < 0) {
+                CCID_Abandon(ctx);
                 return rc;
         }
 
@@ -432,7 +667,7 @@ int PC_to_RDR_IccPowerOff(scr_t *ctx)
 #endif
 
         /* check length, message type, slot and sequence number */
-        if (len != 10 || buf[0] != MSG_TYPE_RDR_to_PC_SlotStatus || buf[5] != 0x00 || buf[6] != 0x00) {
+        if (len != 10 || buf[0] != MSG_TYPE_RDR_to_PC_SlotStatus || buf[5] != ctx->slot || buf[6] != ctx->seq) {
                 return -1;
         }
 
@@ -473,10 +708,7 @@ int PC_to_RDR_XfrBlock(scr_t *ctx, unsigned int outlen, unsigned char *outbuf, u
         msg[9] = (level >> 8) & 0xFF;
         memcpy(msg + 10, outbuf, outlen);
 
-#ifdef DEBUG
-        CCIDDump(msg, (10 + outlen));
-#endif
-        rc = USB_Write(ctx->device, (10 + outlen), msg);
+        rc = CCID_Send(ctx, (10 + outlen), msg);
 
         if (rc < 0) {
                 return rc;
@@ -487,9 +719,36 @@ int PC_to_RDR_XfrBlock(scr_t *ctx, unsigned int outlen, unsigned char *outbuf, u
 
 
 
+/**
+ * Ask the reader for the slot status without waiting for the response
+ *
+ * The response is collected by \ref RDR_to_PC_DataBlock, which uses it to tell a reader
+ * still busy with the card from a response block that got lost on the bus.
+ *
+ * @param ctx Reader context
+ * @return 0 on success, negative value otherwise
+ */
+static int PC_to_RDR_ProbeSlotStatus(scr_t *ctx)
+{
+
+        unsigned char msg[10];
+
+        memset(msg, 0, 10);
+        msg[0] = MSG_TYPE_PC_to_RDR_GetSlotStatus;
+
+        return CCID_Send(ctx, 10, msg);
+}
+
+
+
 /**
  * Exchange data block between reader and PC
  *
+ * If ctx->ProbeTimeout is set and no response arrived within that time, the reader is probed
+ * with a GetSlotStatus command. A reader still processing the command rejects the probe
+ * with CMD_SLOT_BUSY, in which case waiting continues for ctx->ReadTimeout. An idle reader
+ * means the response is lost and \ref ERR_TIMEOUT is returned immediately.
+ *
  * @param ctx Reader context
  * @param inlen Length of data buffer/actual length of incoming data
  * @param inbuf Incoming data buffer
@@ -498,8 +757,10 @@ int PC_to_RDR_XfrBlock(scr_t *ctx, unsigned int outlen, unsigned char *outbuf, u
 int RDR_to_PC_DataBlock(scr_t *ctx, unsigned int *inlen, unsigned char *inbuf, unsigned char *status, unsigned char *error, unsigned char *chain)
 {
 
-        unsigned int l;
+        unsigned int l, timeout, readtimeout, probed;
         unsigned char msg[10 + BUFFMAX];
+        unsigned char sts[10];
+        unsigned char seq;
         int rc;
 
         if (*inlen > BUFFMAX) {
@@ -509,11 +770,35 @@ int RDR_to_PC_DataBlock(scr_t *ctx, unsigned int *inlen, unsigned char *inbuf, u
                 return -1;
         }
 
+        readtimeout = ctx->ReadTimeout ? ctx->ReadTimeout : USB_READ_TIMEOUT;
+        timeout = (ctx->ProbeTimeout && ctx->ProbeTimeout < readtimeout) ? ctx->ProbeTimeout : readtimeout;
+        probed = 0;
+        seq = ctx->seq;
+
         while (1) {
                 l = sizeof(msg);
-                rc = USB_Read(ctx->device, &l, msg);
+                rc = CCID_Receive(ctx, &l, msg, timeout);
+
+                if ((rc == ERR_TIMEOUT) && !probed && (timeout < readtimeout)) {
+#ifdef DEBUG
+                        ctccid_debug("No response after %u ms, probing slot status\n", timeout);
+#endif
+                        rc = PC_to_RDR_ProbeSlotStatus(ctx);
+                        ctx->seq = seq;
+
+                        if (rc < 0) {
+                                CCID_Abandon(ctx);
+                                *inlen = 0;
+                                return rc;
+                        }
+
+                        probed = 1;
+                        timeout = readtimeout;
+                        continue;
+                }
 
                 if (rc < 0) {
+                        CCID_Abandon(ctx);
                         *inlen = 0;
                         return rc;
                 }
@@ -522,18 +807,52 @@ int RDR_to_PC_DataBlock(scr_t *ctx, unsigned int *inlen, unsigned char *inbuf, u
                 CCIDDump(msg, l);
 #endif
 
+                if ((probed == 1) && (l == 10) && (msg[0] == MSG_TYPE_RDR_to_PC_SlotStatus) && (msg[6] != seq)) {
+                        probed = 2;
+
+                        if ((msg[7] & 0x40) && (msg[8] == ERR_CMD_SLOT_BUSY)) {
+                                continue;               // Still waiting for the card
+                        }
+
+#ifdef DEBUG
+                        ctccid_debug("Reader idle, response block lost\n");
+#endif
+                        CCID_Abandon(ctx);
+                        *inlen = 0;
+                        return ERR_TIMEOUT;
+                }
+
                 /* check length, message type, slot and sequence number */
-                if (l < 10 || msg[0] != MSG_TYPE_RDR_to_PC_DataBlock || msg[5] != 0x00 || msg[6] != 0x00) {
+                if (l < 10 || msg[5] != ctx->slot) {
+                        *inlen = 0;
+                        return -1;
+                }
+
+                /* Late response to a command given up earlier */
+                if (msg[6] != seq) {
+                        continue;
+                }
+
+                if (msg[0] != MSG_TYPE_RDR_to_PC_DataBlock) {
                         *inlen = 0;
                         return -1;
                 }
 
                 if (msg[7] & 0x80) {			// Card requests waiting time extension
+                        timeout = readtimeout;
                         continue;
                 }
                 break;
         }
 
+        if (probed == 1) {
+                /* Response overtook the probe, so drop the pending slot status */
+                l = sizeof(sts);
+                if (CCID_Receive(ctx, &l, sts, readtimeout) < 0) {
+                        CCID_Abandon(ctx);
+                }
+        }
+
         if (status)
                 *status = msg[7];
         if (error)
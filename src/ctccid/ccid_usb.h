@@ -42,9 +42,15 @@
  */
 #define BUFFMAX    261
 
+/**
+ * Interval in ms at which a multi-slot reader is polled for responses
+ */
+#define CCID_POLL_INTERVAL 10
+
 #define ERR_ICC_MUTE				0xFE
 #define ERR_XFR_OVERRUN				0xFC
 #define ERR_HW_ERROR				0xFB
+#define ERR_CMD_SLOT_BUSY			0xE0
 
 #define MSG_TYPE_PC_to_RDR_SetParameters	0x61
 #define MSG_TYPE_PC_to_RDR_IccPowerOn		0x62
@@ -127,7 +127,7 @@ signed char CT_init(unsigned short ctn, unsigned short pn)
 		/*
 		 * No active reader yet - try to find one
 		 */
-		rc = USB_Open(pn, &(ctx->device));
+		rc = USB_Open(pn, &(ctx->device), &(ctx->slot));
 
 		if (rc != USB_OK) {
 			free(ctx);
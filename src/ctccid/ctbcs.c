@@ -32,7 +32,15 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif
 
 #include "scr.h"
 #include "ctbcs.h"
@@ -41,8 +49,183 @@
 #include "ctccid_debug.h"
 
 extern int ccidT1Init (struct scr *ctx);
+extern int ccidT1Term (struct scr *ctx);
+extern int ccidT1Resynch(scr_t *ctx, int SrcNode, int DestNode);
 extern int ccidAPDUInit (struct scr *ctx);
 
+/*
+ * Directory holding the ATR of cards left powered for warm attach. It is created per user
+ * below $XDG_RUNTIME_DIR or, if not set, as /tmp/sc-hsm-embedded-<uid>.
+ */
+#define ATR_CACHE_DIR "sc-hsm-embedded"
+
+
+
+/**
+ * Warm attach is enabled by setting CTCCID_WARM_ATTACH in the environment
+ *
+ * With warm attach, the ATR of each card powered on is saved and a card found active on the
+ * first REQUEST ICC is used without reset, preserving its authentication state. All processes
+ * using the reader should agree on the setting, as only they keep the saved ATR up to date.
+ * The ATR is saved per user, so warm attach only works between processes of the same user.
+ *
+ * @return 1 if enabled, 0 otherwise
+ */
+static int isWarmAttachEnabled()
+{
+	char *po = getenv("CTCCID_WARM_ATTACH");
+
+	return (po != NULL) && (*po != '0');
+}
+
+
+
+/**
+ * Build the name of the ATR cache file for the slot
+ *
+ * The file is keyed by bus number and device address, which change whenever the
+ * reader is reattached and thereby the card power cycled.
+ *
+ * The directory is created if missing. It is only used if it is a directory owned by
+ * the user and not accessible by others, so that no other user can plant an ATR.
+ *
+ * @param ctx Reader context
+ * @param fn Buffer receiving the file name
+ * @param fnlen Size of buffer
+ * @return 0 on success, -1 if no safe directory is available
+ */
+static int getATRCacheFileName(struct scr *ctx, char *fn, size_t fnlen)
+{
+#ifdef WIN32
+	return -1;
+#else
+	char dir[256], *po;
+	struct stat st;
+	int bus, address, rc;
+
+	po = getenv("XDG_RUNTIME_DIR");
+
+	if ((po != NULL) && (*po == '/')) {
+		rc = snprintf(dir, sizeof(dir), "%s/%s", po, ATR_CACHE_DIR);
+	} else {
+		rc = snprintf(dir, sizeof(dir), "/tmp/%s-%lu", ATR_CACHE_DIR, (unsigned long)getuid());
+	}
+
+	if ((rc < 0) || (rc >= sizeof(dir))) {
+		return -1;
+	}
+
+	if ((mkdir(dir, 0700) < 0) && (errno != EEXIST)) {
+#ifdef DEBUG
+		ctccid_debug("Can't create ATR cache directory %s\n", dir);
+#endif
+		return -1;
+	}
+
+	if ((lstat(dir, &st) < 0) || !S_ISDIR(st.st_mode) || (st.st_uid != getuid()) || (st.st_mode & 077)) {
+#ifdef DEBUG
+		ctccid_debug("ATR cache directory %s is not private to the user\n", dir);
+#endif
+		return -1;
+	}
+
+	USB_GetLocation(ctx->device, &bus, &address);
+	rc = snprintf(fn, fnlen, "%s/ctccid-%03d-%03d-%d.atr", dir, bus, address, ctx->slot);
+
+	if ((rc < 0) || (rc >= fnlen)) {
+		return -1;
+	}
+
+	return 0;
+#endif
+}
+
+
+
+/**
+ * Save the ATR of the card just powered on, so that a later process can attach to it
+ *
+ * @param ctx Reader context
+ */
+static void saveATR(struct scr *ctx)
+{
+	char fn[256];
+	FILE *fp;
+
+	if (getATRCacheFileName(ctx, fn, sizeof(fn)) < 0) {
+		return;
+	}
+
+	fp = fopen(fn, "wb");
+
+	if (fp == NULL) {
+#ifdef DEBUG
+		ctccid_debug("Can't write ATR cache %s\n", fn);
+#endif
+		return;
+	}
+
+	fwrite(ctx->ATR, 1, ctx->LenOfATR, fp);
+	fclose(fp);
+}
+
+
+
+/**
+ * Restore ATR and protocol parameters of a card that is still powered from a previous session
+ *
+ * @param ctx Reader context
+ * @return 0 on success, -1 if no cached ATR or the card did not respond
+ */
+static int WarmAttach(struct scr *ctx)
+{
+	char fn[256];
+	FILE *fp;
+	size_t len;
+
+	if (getATRCacheFileName(ctx, fn, sizeof(fn)) < 0) {
+		return -1;
+	}
+
+	fp = fopen(fn, "rb");
+
+	if (fp == NULL) {
+		return -1;
+	}
+
+	memset(ctx->ATR, 0, sizeof(ctx->ATR));
+	len = fread(ctx->ATR, 1, sizeof(ctx->ATR), fp);
+	fclose(fp);
+
+	if (len < 2) {
+		return -1;
+	}
+
+	ctx->LenOfATR = (unsigned char)len;
+
+	if (DecodeATRValues(ctx) < 0) {
+		return -1;
+	}
+
+	if (RDR_APDUTransferMode(ctx)) {
+		ccidAPDUInit(ctx);
+		return 0;
+	}
+
+	ccidT1Init(ctx);
+
+	/* Sequence numbers of the card are unknown, so start over with both sides at zero */
+	if (ccidT1Resynch(ctx, 0, 0) < 0) {
+		ccidT1Term(ctx);
+		return -1;
+	}
+
+#ifdef DEBUG
+	ctccid_debug("Warm attach to active card in slot %d\n", ctx->slot);
+#endif
+	return 0;
+}
+
 
 /**
  * Set requested response of CT-BCS command
@@ -129,6 +312,10 @@ int ResetCard(struct scr *ctx, unsigned int lc, unsigned char *cmd,
 	else
 		ccidT1Init(ctx);
 
+	if (isWarmAttachEnabled()) {
+		saveATR(ctx);
+	}
+
 	if ((response = setResponse(ctx, cmd, lr, rsp)) < 0) {
 		return response;
 	}
@@ -196,6 +383,13 @@ int RequestICC(struct scr *ctx, unsigned int lc, unsigned char *cmd,
 		return OK;
 	}
 
+	/* Card still powered from a previous session, attach without reset */
+	if ((status == ICC_PRESENT_AND_ACTIVE) && !ctx->CTModFunc && isWarmAttachEnabled()) {
+		if (WarmAttach(ctx) == 0) {
+			return setResponse(ctx, cmd, lr, rsp);
+		}
+	}
+
 	if ((status = ResetCard(ctx, lc, cmd, lr, rsp)) < 0) {
 		return status;
 	}
@@ -83,6 +83,11 @@ struct scr {
 	/** Context structure for USB device */
 	struct usb_device	*device;
 
+	/** CCID slot index within the USB device */
+	unsigned char     slot;
+	/** Sequence number of the last command sent to the slot */
+	unsigned char     seq;
+
 	/** Last ATR received from the card    */
 	unsigned char     ATR[MAX_ATR];
 	/** Length of ATR                      */
@@ -105,6 +110,10 @@ struct scr {
 	unsigned char     IFSC;
 	/** Current baudrate                   */
 	int               Baud;
+	/** Timeout waiting for a data block in ms, 0 for the USB default            */
+	unsigned int      ReadTimeout;
+	/** Expected response time in ms after which the reader is probed, 0 if none */
+	unsigned int      ProbeTimeout;
 
 	CTModFunc_t       CTModFunc; /* response */
 
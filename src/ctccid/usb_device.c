@@ -108,20 +108,56 @@ static libusb_context *context = NULL;
  */
 static int refcnt = 0;
 
+/*
+ * Devices currently opened, shared by the reader contexts of all slots
+ */
+static usb_device_t *openDevices = NULL;
+
+
+
+/**
+ * Determine the slot configuration from the CCID class descriptor
+ *
+ * @param config Configuration descriptor of the device
+ * @param maxSlotIndex Highest slot index supported by the device
+ * @param maxBusySlots Maximum number of simultaneously busy slots
+ */
+static void getSlotConfiguration(struct libusb_config_descriptor *config, uint8_t *maxSlotIndex, uint8_t *maxBusySlots)
+{
+	const unsigned char *desc = config->interface->altsetting->extra;
+
+	*maxSlotIndex = 0;
+	*maxBusySlots = 1;
+
+	if (config->interface->altsetting->extra_length == 54) {
+		*maxSlotIndex = desc[4];
+		if (desc[53] > 0) {
+			*maxBusySlots = desc[53];
+		}
+	}
+}
+
 
 
 /**
  * Open USB device at the specified port and allocate necessary resources
  *
+ * Each slot of a multi-slot reader is addressed by its own port number. Ports are
+ * numbered consecutively over all slots of all readers found. Contexts for slots of
+ * the same reader share the device structure.
+ *
  * @param pn Port number
  * @param device Structure holding device specific data
+ * @param slot CCID slot index of the port within the device
  * @return Status code \ref USB_OK, \ref ERR_NO_READER, \ref ERR_USB
  */
-int USB_Open(unsigned short pn, usb_device_t **device)
+int USB_Open(unsigned short pn, usb_device_t **device, unsigned char *slot)
 {
 
-	int rc, cnt, i;
+	int rc, cnt, i, slots;
 	libusb_device **devs, *dev;
+	struct libusb_config_descriptor *config;
+	uint8_t maxSlotIndex, maxBusySlots;
 
 	/*
 	 * We implement our own context handling to avoid a bug in the default context implementation
@@ -153,7 +189,7 @@ int USB_Open(unsigned short pn, usb_device_t **device)
 		return ERR_NO_READER;
 	}
 
-	/* Iterate through all devices to find a reader */
+	/* Iterate through all devices to find a reader, counting each slot as a port */
 	i = 0;
 	cnt = 0;
 
@@ -183,25 +219,56 @@ int USB_Open(unsigned short pn, usb_device_t **device)
 
 #endif
 
+			slots = 1;
+
+			if (libusb_get_active_config_descriptor(dev, &config) == LIBUSB_SUCCESS) {
+				getSlotConfiguration(config, &maxSlotIndex, &maxBusySlots);
+				libusb_free_config_descriptor(config);
+				slots = maxSlotIndex + 1;
+			}
+
 			/*
 			 * Found the desired reader?
 			 */
-			if (cnt == pn) {
+			if (pn < cnt + slots) {
 #ifdef DEBUG
-				ctccid_debug("Reader index (%i) and requested port number (%i) match.\n", cnt, pn);
+				ctccid_debug("Reader ports (%i-%i) and requested port number (%i) match.\n", cnt, cnt + slots - 1, pn);
 #endif
-				*device = calloc(1, sizeof(usb_device_t));
+				*slot = (unsigned char)(pn - cnt);
 				break;
 			} else {
 #ifdef DEBUG
-				ctccid_debug("Reader index (%i) and requested port number (%i) do not match.\n", cnt, pn);
+				ctccid_debug("Reader ports (%i-%i) and requested port number (%i) do not match.\n", cnt, cnt + slots - 1, pn);
 #endif
-				cnt++;
+				cnt += slots;
 			}
 		}
 	}
 
 	if (dev != NULL ) { /* reader found */
+		/*
+		 * Another slot of the same reader already opened the device?
+		 */
+		for (*device = openDevices; *device; *device = (*device)->next) {
+			if (libusb_get_device((*device)->handle) == dev) {
+				(*device)->refcnt++;
+				libusb_free_device_list(devs, 1);
+				return USB_OK;
+			}
+		}
+
+		*device = calloc(1, sizeof(usb_device_t));
+
+		if (*device == NULL) {
+			libusb_free_device_list(devs, 1);
+			refcnt--;
+			if (refcnt == 0) {
+				libusb_exit(context);
+				context = NULL;
+			}
+			return ERR_USB;
+		}
+
 		rc = libusb_open(dev, &((*device)->handle));
 
 		if (rc != LIBUSB_SUCCESS) {
@@ -286,6 +353,13 @@ int USB_Open(unsigned short pn, usb_device_t **device)
 			}
 		}
 
+		getSlotConfiguration((*device)->configuration_descriptor, &(*device)->bMaxSlotIndex, &(*device)->bMaxCCIDBusySlots);
+
+		mutex_init(&(*device)->mutex);
+		(*device)->refcnt = 1;
+		(*device)->next = openDevices;
+		openDevices = *device;
+
 		rc = USB_OK;
 
 	} else { /* no reader found */
@@ -323,6 +397,23 @@ void USB_GetCCIDDescriptor(usb_device_t *device, unsigned char const **desc, int
 
 
 
+/**
+ * Return the bus number and device address identifying the device while attached
+ *
+ * @param device Structure with device specific data
+ * @param bus Bus number
+ * @param address Device address on the bus
+ */
+void USB_GetLocation(usb_device_t *device, int *bus, int *address)
+{
+	libusb_device *dev = libusb_get_device(device->handle);
+
+	*bus = libusb_get_bus_number(dev);
+	*address = libusb_get_device_address(dev);
+}
+
+
+
 /**
  * Close USB device and free allocated resources
  *
@@ -333,6 +424,29 @@ int USB_Close(usb_device_t **device)
 {
 
 	int rc;
+	usb_device_t **pdev;
+	struct usb_message *msg;
+
+	if (--(*device)->refcnt > 0) {
+		*device = NULL;
+		refcnt--;
+		return USB_OK;
+	}
+
+	for (pdev = &openDevices; *pdev; pdev = &(*pdev)->next) {
+		if (*pdev == *device) {
+			*pdev = (*device)->next;
+			break;
+		}
+	}
+
+	while ((*device)->pending) {
+		msg = (*device)->pending;
+		(*device)->pending = msg->next;
+		free(msg);
+	}
+
+	mutex_destroy(&(*device)->mutex);
 
 	rc = libusb_release_interface((*device)->handle,
 								  (*device)->configuration_descriptor->interface->altsetting->bInterfaceNumber);
@@ -396,18 +510,34 @@ int USB_Write(usb_device_t *device, unsigned int length, unsigned char *buffer)
  * @return Status code \ref USB_OK, \ref ERR_USB
  */
 int USB_Read(usb_device_t *device, unsigned int *length, unsigned char *buffer)
+{
+	return USB_ReadTimeout(device, length, buffer, USB_READ_TIMEOUT);
+}
+
+
+
+/**
+ * Read data block from specified USB device using bulk transfer with a given timeout
+ *
+ * @param device Device specific data
+ * @param length Length of data buffer
+ * @param buffer Data buffer
+ * @param timeout Timeout in milliseconds
+ * @return Status code \ref USB_OK, \ref ERR_TIMEOUT, \ref ERR_USB
+ */
+int USB_ReadTimeout(usb_device_t *device, unsigned int *length, unsigned char *buffer, unsigned int timeout)
 {
 	int rc;
 	int read;
 
-	rc = libusb_bulk_transfer(device->handle, device->bulk_in, buffer, *length, &read, USB_READ_TIMEOUT);
+	rc = libusb_bulk_transfer(device->handle, device->bulk_in, buffer, *length, &read, timeout);
 
 	if (rc != LIBUSB_SUCCESS) {
 		*length = 0;
 #ifdef DEBUG
 		ctccid_debug("libusb_bulk_transfer (read) failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
 #endif
-		return ERR_USB;
+		return rc == LIBUSB_ERROR_TIMEOUT ? ERR_TIMEOUT : ERR_USB;
 	}
 
 	*length = read;
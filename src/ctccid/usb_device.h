@@ -36,6 +36,8 @@
 
 #include <stdint.h>
 
+#include <common/mutex.h>
+
 /**
  * Vendor ID for SCM Microsystems
  */
@@ -65,6 +67,17 @@
 #define USB_OK               0             /* Successful completion           */
 #define ERR_NO_READER       -1             /* Invalid parameter or value      */
 #define ERR_USB             -2             /* USB error                       */
+#define ERR_TIMEOUT         -3             /* No data received within timeout */
+
+/**
+ * Message received from the device for a slot other than the one being served,
+ * waiting to be picked up by the reader context of that slot
+ */
+struct usb_message {
+        struct usb_message *next;
+        unsigned int length;
+        unsigned char data[1];
+};
 
 /**
  * Data structure encapsulating all information necessary
@@ -92,13 +105,70 @@ typedef struct usb_device {
          */
         uint8_t bulk_out;
 
+        /**
+         * Number of reader contexts sharing this device, one per slot
+         */
+        int refcnt;
+
+        /**
+         * Mutex serializing access to the bulk pipes and the fields below
+         */
+        MUTEX mutex;
+
+        /**
+         * Highest slot index supported by the device (bMaxSlotIndex)
+         */
+        uint8_t bMaxSlotIndex;
+
+        /**
+         * Maximum number of slots that can process a command simultaneously (bMaxCCIDBusySlots)
+         */
+        uint8_t bMaxCCIDBusySlots;
+
+        /**
+         * Sequence number for the next message sent to the device
+         */
+        uint8_t bSeq;
+
+        /**
+         * Number of slots with outstanding responses
+         */
+        int busy;
+
+        /**
+         * Number of outstanding responses per slot
+         */
+        uint8_t outstanding[256];
+
+        /**
+         * Bit map of sequence numbers with a response outstanding
+         */
+        uint8_t seqOutstanding[32];
+
+        /**
+         * Slot a sequence number was sent to
+         */
+        uint8_t seqSlot[256];
+
+        /**
+         * Responses received for slots not currently reading
+         */
+        struct usb_message *pending;
+
+        /**
+         * Next device in the list of opened devices
+         */
+        struct usb_device *next;
+
 } usb_device_t;
 
-int USB_Open(unsigned short pn, usb_device_t **device);
+int USB_Open(unsigned short pn, usb_device_t **device, unsigned char *slot);
 int USB_Close(usb_device_t **device);
 void USB_GetCCIDDescriptor(usb_device_t *device, unsigned char const **desc, int *length);
+void USB_GetLocation(usb_device_t *device, int *bus, int *address);
 int USB_Write(usb_device_t *device, unsigned int length, unsigned char *buffer);
 int USB_Read(usb_device_t *device, unsigned int *length, unsigned char *buffer);
+int USB_ReadTimeout(usb_device_t *device, unsigned int *length, unsigned char *buffer, unsigned int timeout);
 
 #endif
 
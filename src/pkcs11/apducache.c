@@ -0,0 +1,625 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    apducache.c
+ * @brief   Cache for responses to read-only command APDUs
+ *
+ * Drivers read the same files again and again, e.g. when probing for the token type,
+ * when creating tokens for virtual slots or when reloading objects after login. The
+ * cache returns the response to a read command, if the same command was already sent
+ * with the same file selection on the card.
+ *
+ * SELECT commands are always sent to the card, as they change the card state. The
+ * cache tracks the sequence of SELECT commands since the last absolute selection
+ * (by DF name, path or MF) and uses it as part of the key. Reads with an implicit
+ * file reference also include the command that made the EF current.
+ *
+ * Commands not known to leave card content and file selection unchanged flush the
+ * cache. Responses read while a PIN was verified are removed when the security
+ * status is reset. The cache is bound to the ATR and flushed on card removal, reset
+ * or communication errors.
+ *
+ * With PC/SC other applications may change the card between transactions, so the
+ * cache only stores and serves responses read in the current transaction. Commands
+ * sent outside of a transaction still update the security status and selection state.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <pkcs11/p11generic.h>
+#include <pkcs11/apducache.h>
+
+#ifdef DEBUG
+#include <pkcs11/debug.h>
+#endif
+
+#define APDU_CACHE_ENTRIES		64
+#define APDU_CACHE_MAX_BYTES	(128 * 1024)
+#define MAX_SELECT_PATH			96
+#define MAX_EF_REFERENCE		32
+#define MAX_CACHED_COMMAND		64
+#define MAX_KEY					(2 + MAX_SELECT_PATH + MAX_EF_REFERENCE + MAX_CACHED_COMMAND)
+
+#define CMD_UNKNOWN				0		/* Changes card content or state in an unknown way     */
+#define CMD_SELECT				1		/* Changes the file selection                          */
+#define CMD_READ_FILE			2		/* Reads from the file referenced in the command       */
+#define CMD_READ_CURRENT		3		/* Reads from the current EF                           */
+#define CMD_READ				4		/* Reads data bound to the selected application        */
+#define CMD_VERIFY				5		/* Changes the security status                         */
+#define CMD_NEUTRAL				6		/* Changes neither card content nor file selection     */
+
+struct apduCacheEntry {
+	unsigned char *key;                 /**< Selection state and command APDU               */
+	size_t keylen;                      /**< Length of key                                  */
+	unsigned char *rsp;                 /**< Response APDU including SW1/SW2                */
+	size_t rsplen;                      /**< Length of response                             */
+	int authenticated;                  /**< Read while a PIN was verified                  */
+};
+
+struct p11ApduCache_t {
+	void *mutex;                        /**< Serialize access from concurrent threads       */
+	unsigned char atr[36];              /**< ATR of the card the cache is bound to          */
+	size_t atrlen;                      /**< Length of ATR                                  */
+	unsigned char path[MAX_SELECT_PATH];/**< SELECT commands since last absolute selection  */
+	size_t pathlen;                     /**< Length of path                                 */
+	int pathValid;                      /**< The file selection on the card is known        */
+	unsigned char ef[MAX_EF_REFERENCE]; /**< Command that made the current EF current       */
+	size_t eflen;                       /**< Length of ef                                   */
+	int efValid;                        /**< The current EF is known                        */
+	int authenticated;                  /**< A PIN was verified                             */
+	struct apduCacheEntry entry[APDU_CACHE_ENTRIES];
+	int next;                           /**< Next entry to replace                          */
+	size_t size;                        /**< Total size of keys and responses               */
+};
+
+
+
+static int cacheDisabled = -1;
+
+
+
+/**
+ * Get the cache of the primary slot, creating it if required
+ */
+static struct p11ApduCache_t *getApduCache(struct p11Slot_t *slot, int create)
+{
+	struct p11ApduCache_t *cache;
+	char *po;
+
+	if (slot->primarySlot)
+		slot = slot->primarySlot;
+
+	if (slot->apduCache || !create)
+		return slot->apduCache;
+
+	if (cacheDisabled < 0) {
+		po = getenv("PKCS11_APDU_CACHE");
+		cacheDisabled = po && (*po == '0');
+	}
+
+	if (cacheDisabled)
+		return NULL;
+
+	cache = (struct p11ApduCache_t *)calloc(1, sizeof(struct p11ApduCache_t));
+
+	if (cache == NULL)
+		return NULL;
+
+	if (p11CreateMutex(&cache->mutex) != CKR_OK) {
+		free(cache);
+		return NULL;
+	}
+
+	slot->apduCache = cache;
+	return cache;
+}
+
+
+
+static int classifyCommand(unsigned char *capdu, size_t capdu_len)
+{
+	unsigned char cla, ins, p1, p2;
+
+	if (capdu_len < 4)
+		return CMD_UNKNOWN;
+
+	cla = capdu[0];
+	ins = capdu[1];
+	p1 = capdu[2];
+	p2 = capdu[3];
+
+	if (cla == 0x80) {
+		// SmartCard-HSM
+		switch(ins) {
+		case 0x58:					// ENUMERATE OBJECTS
+			return CMD_READ;
+		case 0x62:					// DECIPHER
+		case 0x68:					// SIGN
+			return CMD_NEUTRAL;
+		}
+		return CMD_UNKNOWN;
+	}
+
+	// Basic logical channel without secure messaging. Command chaining is allowed.
+	if ((cla & 0xEF) != 0x00)
+		return CMD_UNKNOWN;
+
+	switch(ins) {
+	case 0xA4:						// SELECT
+		return CMD_SELECT;
+	case 0xB0:						// READ BINARY with SFI in P1 or from current EF
+		return (p1 & 0x80) ? CMD_READ_FILE : CMD_READ_CURRENT;
+	case 0xB1:						// READ BINARY with FID in P1/P2 or from current EF
+		return (p1 || p2) ? CMD_READ_FILE : CMD_READ_CURRENT;
+	case 0xB2:						// READ RECORD with SFI in P2 or from current EF
+	case 0xB3:
+		return (p2 & 0xF8) ? CMD_READ_FILE : CMD_READ_CURRENT;
+	case 0x20:						// VERIFY
+	case 0x24:						// CHANGE REFERENCE DATA
+	case 0x2C:						// RESET RETRY COUNTER
+		return CMD_VERIFY;
+	case 0x22:						// MANAGE SECURITY ENVIRONMENT
+	case 0x2A:						// PERFORM SECURITY OPERATION
+	case 0x84:						// GET CHALLENGE
+	case 0x88:						// INTERNAL AUTHENTICATE
+	case 0xC0:						// GET RESPONSE
+	case 0xCA:						// GET DATA
+	case 0xCB:
+		return CMD_NEUTRAL;
+	}
+	return CMD_UNKNOWN;
+}
+
+
+
+/**
+ * Determine if the SELECT command does not depend on the current selection
+ */
+static int isAbsoluteSelect(unsigned char *capdu, size_t capdu_len)
+{
+	switch(capdu[2]) {
+	case 0x04:						// By DF name
+	case 0x08:						// By path from MF
+		return TRUE;
+	case 0x00:						// MF if no FID or FID 3F00
+		if (capdu_len <= 5)
+			return TRUE;
+		return (capdu_len >= 7) && (capdu[4] == 2) && (capdu[5] == 0x3F) && (capdu[6] == 0x00);
+	}
+	return FALSE;
+}
+
+
+
+static void removeEntry(struct p11ApduCache_t *cache, struct apduCacheEntry *entry)
+{
+	if (entry->key) {
+		cache->size -= entry->keylen + entry->rsplen;
+		free(entry->key);
+		free(entry->rsp);
+		memset(entry, 0, sizeof(*entry));
+	}
+}
+
+
+
+static void removeEntries(struct p11ApduCache_t *cache, int authenticatedOnly)
+{
+	int i;
+
+	for (i = 0; i < APDU_CACHE_ENTRIES; i++) {
+		if (!authenticatedOnly || cache->entry[i].authenticated) {
+			removeEntry(cache, &cache->entry[i]);
+		}
+	}
+}
+
+
+
+/**
+ * Forget all entries and the file selection
+ */
+static void resetCache(struct p11ApduCache_t *cache)
+{
+	removeEntries(cache, FALSE);
+	cache->pathValid = FALSE;
+	cache->efValid = FALSE;
+	cache->authenticated = FALSE;
+}
+
+
+
+/**
+ * Build the cache key from the file selection and the command APDU
+ *
+ * @return the length of the key or 0 if the command can not be cached
+ */
+static size_t buildKey(struct p11ApduCache_t *cache, int cls, unsigned char *capdu, size_t capdu_len, unsigned char *key)
+{
+	unsigned char *po = key;
+
+	if (!cache->pathValid || (capdu_len > MAX_CACHED_COMMAND))
+		return 0;
+
+	*po++ = (unsigned char)cache->pathlen;
+	memcpy(po, cache->path, cache->pathlen);
+	po += cache->pathlen;
+
+	if (cls == CMD_READ_CURRENT) {
+		if (!cache->efValid)
+			return 0;
+		*po++ = (unsigned char)cache->eflen;
+		memcpy(po, cache->ef, cache->eflen);
+		po += cache->eflen;
+	}
+
+	memcpy(po, capdu, capdu_len);
+	po += capdu_len;
+
+	return po - key;
+}
+
+
+
+/**
+ * Track the file selection on the card for a command completed successfully or answered from the cache
+ */
+static void applyCommand(struct p11ApduCache_t *cache, int cls, unsigned char *capdu, size_t capdu_len, int success)
+{
+	if (cls == CMD_SELECT) {
+		if (!success) {
+			// The resulting selection depends on the card
+			cache->pathValid = FALSE;
+			cache->efValid = FALSE;
+			return;
+		}
+
+		if (isAbsoluteSelect(capdu, capdu_len)) {
+			cache->pathlen = 0;
+			cache->pathValid = TRUE;
+		}
+
+		if (cache->pathValid && (cache->pathlen + 1 + capdu_len <= MAX_SELECT_PATH)) {
+			cache->path[cache->pathlen++] = (unsigned char)capdu_len;
+			memcpy(cache->path + cache->pathlen, capdu, capdu_len);
+			cache->pathlen += capdu_len;
+		} else {
+			cache->pathValid = FALSE;
+		}
+
+		if (capdu_len <= MAX_EF_REFERENCE) {
+			memcpy(cache->ef, capdu, capdu_len);
+			cache->eflen = capdu_len;
+			cache->efValid = TRUE;
+		} else {
+			cache->efValid = FALSE;
+		}
+	} else if (cls == CMD_READ_FILE) {
+		// The referenced file becomes the current EF
+		memcpy(cache->ef, capdu, 4);
+		cache->eflen = 4;
+		cache->efValid = success;
+	}
+}
+
+
+
+static void addEntry(struct p11ApduCache_t *cache, unsigned char *key, size_t keylen, unsigned char *rapdu, size_t rapdu_len)
+{
+	struct apduCacheEntry *entry;
+	size_t size = keylen + rapdu_len;
+	int i;
+
+	if (size > APDU_CACHE_MAX_BYTES / 4)
+		return;
+
+	for (i = 0; (i < APDU_CACHE_ENTRIES) && (cache->size + size > APDU_CACHE_MAX_BYTES); i++) {
+		removeEntry(cache, &cache->entry[(cache->next + i) % APDU_CACHE_ENTRIES]);
+	}
+
+	entry = &cache->entry[cache->next];
+	removeEntry(cache, entry);
+
+	entry->key = malloc(keylen);
+	entry->rsp = malloc(rapdu_len);
+
+	if (!entry->key || !entry->rsp) {
+		free(entry->key);
+		free(entry->rsp);
+		entry->key = NULL;
+		entry->rsp = NULL;
+		return;
+	}
+
+	memcpy(entry->key, key, keylen);
+	entry->keylen = keylen;
+	memcpy(entry->rsp, rapdu, rapdu_len);
+	entry->rsplen = rapdu_len;
+	entry->authenticated = cache->authenticated;
+
+	cache->size += size;
+	cache->next = (cache->next + 1) % APDU_CACHE_ENTRIES;
+}
+
+
+
+/**
+ * Return the response to a command APDU from the cache
+ *
+ * @param slot the slot the command is sent to
+ * @param capdu the command APDU
+ * @param capdu_len the length of the command APDU
+ * @param rapdu the buffer receiving the response APDU
+ * @param rapdu_len the size of the buffer
+ * @return the length of the response APDU or -1 if the command must be sent to the card
+ */
+int lookupApduCache(struct p11Slot_t *slot, unsigned char *capdu, size_t capdu_len, unsigned char *rapdu, size_t rapdu_len)
+{
+	struct p11ApduCache_t *cache;
+	struct apduCacheEntry *entry;
+	unsigned char key[MAX_KEY];
+	size_t keylen;
+	int cls, i, rc;
+
+	cls = classifyCommand(capdu, capdu_len);
+
+	if ((cls != CMD_READ_FILE) && (cls != CMD_READ_CURRENT) && (cls != CMD_READ))
+		return -1;
+
+	cache = getApduCache(slot, FALSE);
+
+	if (cache == NULL)
+		return -1;
+
+	p11LockMutex(cache->mutex);
+
+	rc = -1;
+	keylen = buildKey(cache, cls, capdu, capdu_len, key);
+
+	for (i = 0; keylen && (i < APDU_CACHE_ENTRIES); i++) {
+		entry = &cache->entry[i];
+		if ((entry->keylen == keylen) && !memcmp(entry->key, key, keylen)) {
+			if (entry->rsplen <= rapdu_len) {
+				memcpy(rapdu, entry->rsp, entry->rsplen);
+				rc = (int)entry->rsplen;
+				applyCommand(cache, cls, capdu, capdu_len, TRUE);
+#ifdef DEBUG
+				debug("Response from APDU cache\n");
+#endif
+			}
+			break;
+		}
+	}
+
+	p11UnlockMutex(cache->mutex);
+
+	return rc;
+}
+
+
+
+/**
+ * Update the cache with the response to a command APDU sent to the card
+ *
+ * @param slot the slot the command was sent to
+ * @param capdu the command APDU
+ * @param capdu_len the length of the command APDU
+ * @param rapdu the response APDU
+ * @param rapdu_len the length of the response APDU or a negative value if transmission failed
+ */
+void updateApduCache(struct p11Slot_t *slot, unsigned char *capdu, size_t capdu_len, unsigned char *rapdu, int rapdu_len)
+{
+	struct p11ApduCache_t *cache;
+	unsigned char key[MAX_KEY];
+	unsigned short sw;
+	size_t keylen;
+	int cls, cacheable;
+
+	cache = getApduCache(slot, TRUE);
+
+	if (cache == NULL)
+		return;
+
+#ifdef CTAPI
+	cacheable = TRUE;
+#else
+	// Responses read outside of a transaction, e.g. during token detection, are never served
+	cacheable = slot->transactionLock > 0;
+#endif
+
+	p11LockMutex(cache->mutex);
+
+	if (rapdu_len < 2) {
+		// Card removed or reset
+		resetCache(cache);
+		p11UnlockMutex(cache->mutex);
+		return;
+	}
+
+	sw = (rapdu[rapdu_len - 2] << 8) | rapdu[rapdu_len - 1];
+	cls = classifyCommand(capdu, capdu_len);
+
+	switch(cls) {
+	case CMD_SELECT:
+		applyCommand(cache, cls, capdu, capdu_len, (sw == 0x9000) || ((sw >> 8) == 0x61) || (sw == 0x6283));
+		break;
+	case CMD_READ_FILE:
+	case CMD_READ_CURRENT:
+	case CMD_READ:
+		if (cacheable && (sw == 0x9000)) {
+			keylen = buildKey(cache, cls, capdu, capdu_len, key);
+			if (keylen) {
+				addEntry(cache, key, keylen, rapdu, rapdu_len);
+			}
+		}
+		applyCommand(cache, cls, capdu, capdu_len, sw == 0x9000);
+		break;
+	case CMD_VERIFY:
+		// A failed verification may reset the security status
+		removeEntries(cache, TRUE);
+		cache->authenticated = (sw == 0x9000);
+		break;
+	case CMD_NEUTRAL:
+		break;
+	default:
+		removeEntries(cache, FALSE);
+		cache->pathValid = FALSE;
+		cache->efValid = FALSE;
+		break;
+	}
+
+	p11UnlockMutex(cache->mutex);
+}
+
+
+
+/**
+ * Flush the cache if the card in the slot has a different ATR
+ *
+ * @param slot the slot in which a new token was detected
+ * @param atr the ATR of the card
+ * @param atrlen the length of the ATR
+ */
+void checkApduCacheATR(struct p11Slot_t *slot, unsigned char *atr, size_t atrlen)
+{
+	struct p11ApduCache_t *cache;
+
+	cache = getApduCache(slot, TRUE);
+
+	if (cache == NULL)
+		return;
+
+	if (atrlen > sizeof(cache->atr))
+		atrlen = sizeof(cache->atr);
+
+	p11LockMutex(cache->mutex);
+
+	if ((cache->atrlen != atrlen) || memcmp(cache->atr, atr, atrlen)) {
+		resetCache(cache);
+		memcpy(cache->atr, atr, atrlen);
+		cache->atrlen = atrlen;
+	}
+
+	p11UnlockMutex(cache->mutex);
+}
+
+
+
+/**
+ * Remove all responses read while a PIN was verified
+ *
+ * @param slot the slot the token was logged out from
+ */
+void logoutApduCache(struct p11Slot_t *slot)
+{
+	struct p11ApduCache_t *cache;
+
+	cache = getApduCache(slot, FALSE);
+
+	if (cache == NULL)
+		return;
+
+	p11LockMutex(cache->mutex);
+	removeEntries(cache, TRUE);
+	cache->authenticated = FALSE;
+	p11UnlockMutex(cache->mutex);
+}
+
+
+
+/**
+ * Remove all responses at the start of a card transaction
+ *
+ * The security status is retained, so that responses read while a PIN is verified are
+ * still removed at logout.
+ *
+ * @param slot the slot
+ */
+void beginApduCacheTransaction(struct p11Slot_t *slot)
+{
+	struct p11ApduCache_t *cache;
+
+	cache = getApduCache(slot, FALSE);
+
+	if (cache == NULL)
+		return;
+
+	p11LockMutex(cache->mutex);
+	removeEntries(cache, FALSE);
+	cache->pathValid = FALSE;
+	cache->efValid = FALSE;
+	p11UnlockMutex(cache->mutex);
+}
+
+
+
+/**
+ * Remove all responses, e.g. after the card was removed
+ *
+ * @param slot the slot
+ */
+void flushApduCache(struct p11Slot_t *slot)
+{
+	struct p11ApduCache_t *cache;
+
+	cache = getApduCache(slot, FALSE);
+
+	if (cache == NULL)
+		return;
+
+	p11LockMutex(cache->mutex);
+	resetCache(cache);
+	cache->atrlen = 0;
+	p11UnlockMutex(cache->mutex);
+}
+
+
+
+/**
+ * Release the cache of a slot
+ *
+ * @param slot the slot
+ */
+void freeApduCache(struct p11Slot_t *slot)
+{
+	struct p11ApduCache_t *cache;
+
+	if (slot->primarySlot)
+		return;
+
+	cache = slot->apduCache;
+
+	if (cache == NULL)
+		return;
+
+	removeEntries(cache, FALSE);
+	p11DestroyMutex(cache->mutex);
+	free(cache);
+	slot->apduCache = NULL;
+}
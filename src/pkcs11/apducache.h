@@ -0,0 +1,46 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    apducache.h
+ * @brief   Cache for responses to read-only command APDUs
+ */
+
+#ifndef ___APDUCACHE_H_INC___
+#define ___APDUCACHE_H_INC___
+
+#include <pkcs11/p11generic.h>
+
+int lookupApduCache(struct p11Slot_t *slot, unsigned char *capdu, size_t capdu_len, unsigned char *rapdu, size_t rapdu_len);
+void updateApduCache(struct p11Slot_t *slot, unsigned char *capdu, size_t capdu_len, unsigned char *rapdu, int rapdu_len);
+void checkApduCacheATR(struct p11Slot_t *slot, unsigned char *atr, size_t atrlen);
+void logoutApduCache(struct p11Slot_t *slot);
+void beginApduCacheTransaction(struct p11Slot_t *slot);
+void flushApduCache(struct p11Slot_t *slot);
+void freeApduCache(struct p11Slot_t *slot);
+
+#endif /* ___APDUCACHE_H_INC___ */
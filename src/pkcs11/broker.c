@@ -0,0 +1,530 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    broker.c
+ * @brief   Message encoding for the protocol between module and sc-hsm-brokerd
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#endif
+
+#include <pkcs11/broker.h>
+#include <pkcs11/object.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+
+
+/**
+ * Initialize an empty message
+ *
+ * @param msg       the message
+ */
+void brokerInitMessage(struct brokerMessage *msg)
+{
+	memset(msg, 0, sizeof(*msg));
+}
+
+
+
+/**
+ * Release the buffer allocated for the message
+ *
+ * @param msg       the message
+ */
+void brokerFreeMessage(struct brokerMessage *msg)
+{
+	if (msg->val) {
+		free(msg->val);
+	}
+	memset(msg, 0, sizeof(*msg));
+}
+
+
+
+/**
+ * Make room for len bytes at the end of the message
+ *
+ * @param msg       the message
+ * @param len       the number of bytes to append
+ * @return          pointer to the appended space or NULL if out of memory
+ */
+static unsigned char *reserve(struct brokerMessage *msg, size_t len)
+{
+	unsigned char *p;
+	size_t size;
+
+	if (msg->error) {
+		return NULL;
+	}
+
+	if (msg->len + len > msg->size) {
+		size = msg->size ? msg->size : 256;
+		while (size < msg->len + len) {
+			size <<= 1;
+		}
+
+		if (size > BROKER_MAX_MESSAGE) {
+			msg->error = 1;
+			return NULL;
+		}
+
+		p = (unsigned char *)realloc(msg->val, size);
+		if (p == NULL) {
+			msg->error = 1;
+			return NULL;
+		}
+		msg->val = p;
+		msg->size = size;
+	}
+
+	p = msg->val + msg->len;
+	msg->len += len;
+	return p;
+}
+
+
+
+/**
+ * Return pointer to the next len bytes of the message
+ *
+ * @param msg       the message
+ * @param len       the number of bytes to consume
+ * @return          pointer into the message or NULL if the message is too short
+ */
+static unsigned char *consume(struct brokerMessage *msg, size_t len)
+{
+	unsigned char *p;
+
+	if (msg->error || (len > msg->len - msg->pos)) {
+		msg->error = 1;
+		return NULL;
+	}
+
+	p = msg->val + msg->pos;
+	msg->pos += len;
+	return p;
+}
+
+
+
+void brokerPutByte(struct brokerMessage *msg, unsigned char val)
+{
+	unsigned char *p;
+
+	p = reserve(msg, 1);
+	if (p) {
+		*p = val;
+	}
+}
+
+
+
+void brokerPutInt(struct brokerMessage *msg, CK_ULONG val)
+{
+	unsigned char *p;
+
+	p = reserve(msg, 4);
+	if (p) {
+		p[0] = (unsigned char)(val >> 24);
+		p[1] = (unsigned char)(val >> 16);
+		p[2] = (unsigned char)(val >> 8);
+		p[3] = (unsigned char)val;
+	}
+}
+
+
+
+void brokerPutBytes(struct brokerMessage *msg, const unsigned char *val, size_t len)
+{
+	unsigned char *p;
+
+	brokerPutInt(msg, len);
+	p = reserve(msg, len);
+	if (p && len) {
+		memcpy(p, val, len);
+	}
+}
+
+
+
+static void putFixed(struct brokerMessage *msg, const unsigned char *val, size_t len)
+{
+	unsigned char *p;
+
+	p = reserve(msg, len);
+	if (p) {
+		memcpy(p, val, len);
+	}
+}
+
+
+
+static void putVersion(struct brokerMessage *msg, CK_VERSION_PTR version)
+{
+	brokerPutByte(msg, version->major);
+	brokerPutByte(msg, version->minor);
+}
+
+
+
+void brokerPutSlotInfo(struct brokerMessage *msg, CK_SLOT_INFO_PTR info)
+{
+	putFixed(msg, info->slotDescription, sizeof(info->slotDescription));
+	putFixed(msg, info->manufacturerID, sizeof(info->manufacturerID));
+	brokerPutInt(msg, info->flags);
+	putVersion(msg, &info->hardwareVersion);
+	putVersion(msg, &info->firmwareVersion);
+}
+
+
+
+void brokerPutTokenInfo(struct brokerMessage *msg, CK_TOKEN_INFO_PTR info)
+{
+	putFixed(msg, info->label, sizeof(info->label));
+	putFixed(msg, info->manufacturerID, sizeof(info->manufacturerID));
+	putFixed(msg, info->model, sizeof(info->model));
+	putFixed(msg, info->serialNumber, sizeof(info->serialNumber));
+	brokerPutInt(msg, info->flags);
+	brokerPutInt(msg, info->ulMaxSessionCount);
+	brokerPutInt(msg, info->ulSessionCount);
+	brokerPutInt(msg, info->ulMaxRwSessionCount);
+	brokerPutInt(msg, info->ulRwSessionCount);
+	brokerPutInt(msg, info->ulMaxPinLen);
+	brokerPutInt(msg, info->ulMinPinLen);
+	brokerPutInt(msg, info->ulTotalPublicMemory);
+	brokerPutInt(msg, info->ulFreePublicMemory);
+	brokerPutInt(msg, info->ulTotalPrivateMemory);
+	brokerPutInt(msg, info->ulFreePrivateMemory);
+	putVersion(msg, &info->hardwareVersion);
+	putVersion(msg, &info->firmwareVersion);
+	putFixed(msg, info->utcTime, sizeof(info->utcTime));
+}
+
+
+
+/**
+ * Encode the object with handle, key size, flags and all attributes
+ *
+ * @param msg       the message
+ * @param object    the object to encode
+ */
+void brokerPutObject(struct brokerMessage *msg, struct p11Object_t *object)
+{
+	struct p11Attribute_t *attr;
+	int cnt;
+
+	cnt = 0;
+	for (attr = object->attrList; attr; attr = attr->next) {
+		cnt++;
+	}
+
+	brokerPutInt(msg, object->handle);
+	brokerPutInt(msg, object->keysize);
+	brokerPutByte(msg, (object->publicObj ? 1 : 0) | (object->tokenObj ? 2 : 0) | (object->sensitiveObj ? 4 : 0));
+	brokerPutInt(msg, cnt);
+
+	for (attr = object->attrList; attr; attr = attr->next) {
+		brokerPutInt(msg, attr->attrData.type);
+		brokerPutBytes(msg, attr->attrData.pValue, attr->attrData.ulValueLen);
+	}
+}
+
+
+
+unsigned char brokerGetByte(struct brokerMessage *msg)
+{
+	unsigned char *p;
+
+	p = consume(msg, 1);
+	return p ? *p : 0;
+}
+
+
+
+/**
+ * Decode a 4 byte integer. 0xFFFFFFFF is widened to CK_UNAVAILABLE_INFORMATION.
+ *
+ * @param msg       the message
+ * @return          the integer value
+ */
+CK_ULONG brokerGetInt(struct brokerMessage *msg)
+{
+	unsigned char *p;
+	CK_ULONG val;
+
+	p = consume(msg, 4);
+	if (p == NULL) {
+		return 0;
+	}
+
+	val = ((CK_ULONG)p[0] << 24) | ((CK_ULONG)p[1] << 16) | ((CK_ULONG)p[2] << 8) | p[3];
+	return val == 0xFFFFFFFF ? CK_UNAVAILABLE_INFORMATION : val;
+}
+
+
+
+/**
+ * Decode variable length data
+ *
+ * @param msg       the message
+ * @param val       set to point to the data inside the message buffer
+ * @return          the length of the data
+ */
+size_t brokerGetBytes(struct brokerMessage *msg, unsigned char **val)
+{
+	size_t len;
+
+	len = brokerGetInt(msg);
+	*val = consume(msg, len);
+	return *val ? len : 0;
+}
+
+
+
+static void getFixed(struct brokerMessage *msg, unsigned char *val, size_t len)
+{
+	unsigned char *p;
+
+	p = consume(msg, len);
+	if (p) {
+		memcpy(val, p, len);
+	}
+}
+
+
+
+static void getVersion(struct brokerMessage *msg, CK_VERSION_PTR version)
+{
+	version->major = brokerGetByte(msg);
+	version->minor = brokerGetByte(msg);
+}
+
+
+
+void brokerGetSlotInfo(struct brokerMessage *msg, CK_SLOT_INFO_PTR info)
+{
+	getFixed(msg, info->slotDescription, sizeof(info->slotDescription));
+	getFixed(msg, info->manufacturerID, sizeof(info->manufacturerID));
+	info->flags = brokerGetInt(msg);
+	getVersion(msg, &info->hardwareVersion);
+	getVersion(msg, &info->firmwareVersion);
+}
+
+
+
+void brokerGetTokenInfo(struct brokerMessage *msg, CK_TOKEN_INFO_PTR info)
+{
+	getFixed(msg, info->label, sizeof(info->label));
+	getFixed(msg, info->manufacturerID, sizeof(info->manufacturerID));
+	getFixed(msg, info->model, sizeof(info->model));
+	getFixed(msg, info->serialNumber, sizeof(info->serialNumber));
+	info->flags = brokerGetInt(msg);
+	info->ulMaxSessionCount = brokerGetInt(msg);
+	info->ulSessionCount = brokerGetInt(msg);
+	info->ulMaxRwSessionCount = brokerGetInt(msg);
+	info->ulRwSessionCount = brokerGetInt(msg);
+	info->ulMaxPinLen = brokerGetInt(msg);
+	info->ulMinPinLen = brokerGetInt(msg);
+	info->ulTotalPublicMemory = brokerGetInt(msg);
+	info->ulFreePublicMemory = brokerGetInt(msg);
+	info->ulTotalPrivateMemory = brokerGetInt(msg);
+	info->ulFreePrivateMemory = brokerGetInt(msg);
+	getVersion(msg, &info->hardwareVersion);
+	getVersion(msg, &info->firmwareVersion);
+	getFixed(msg, info->utcTime, sizeof(info->utcTime));
+}
+
+
+
+/**
+ * Decode an object encoded with brokerPutObject()
+ *
+ * @param msg       the message
+ * @param object    set to the newly allocated object
+ * @return          CKR_OK, CKR_HOST_MEMORY or CKR_DEVICE_ERROR if the message is malformed
+ */
+int brokerGetObject(struct brokerMessage *msg, struct p11Object_t **object)
+{
+	struct p11Object_t *pObject;
+	CK_ATTRIBUTE attr;
+	unsigned char flags, *val;
+	int cnt;
+
+	pObject = (struct p11Object_t *)calloc(1, sizeof(struct p11Object_t));
+
+	if (pObject == NULL) {
+		return CKR_HOST_MEMORY;
+	}
+
+	pObject->handle = brokerGetInt(msg);
+	pObject->keysize = brokerGetInt(msg);
+	flags = brokerGetByte(msg);
+	pObject->publicObj = flags & 1;
+	pObject->tokenObj = (flags & 2) >> 1;
+	pObject->sensitiveObj = (flags & 4) >> 2;
+
+	cnt = brokerGetInt(msg);
+
+	while (!msg->error && (cnt-- > 0)) {
+		attr.type = brokerGetInt(msg);
+		attr.ulValueLen = brokerGetBytes(msg, &val);
+		attr.pValue = val;
+
+		if (!msg->error && (addAttribute(pObject, &attr) != CKR_OK)) {
+			removeAllAttributes(pObject);
+			free(pObject);
+			return CKR_HOST_MEMORY;
+		}
+	}
+
+	if (msg->error) {
+		removeAllAttributes(pObject);
+		free(pObject);
+		return CKR_DEVICE_ERROR;
+	}
+
+	*object = pObject;
+	return CKR_OK;
+}
+
+
+
+#ifndef _WIN32
+
+/**
+ * Send message with length prefix
+ *
+ * @param fd        the connected socket
+ * @param msg       the message
+ * @return          0 or -1 if the message could not be send
+ */
+int brokerSendMessage(int fd, struct brokerMessage *msg)
+{
+	unsigned char hdr[4], *p;
+	size_t len;
+	ssize_t rc;
+	int i;
+
+	if (msg->error) {
+		return -1;
+	}
+
+	hdr[0] = (unsigned char)(msg->len >> 24);
+	hdr[1] = (unsigned char)(msg->len >> 16);
+	hdr[2] = (unsigned char)(msg->len >> 8);
+	hdr[3] = (unsigned char)msg->len;
+
+	for (i = 0; i < 2; i++) {
+		p = i ? msg->val : hdr;
+		len = i ? msg->len : sizeof(hdr);
+
+		while (len > 0) {
+			rc = send(fd, p, len, MSG_NOSIGNAL);
+			if (rc < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return -1;
+			}
+			p += rc;
+			len -= rc;
+		}
+	}
+
+	return 0;
+}
+
+
+
+static int readFully(int fd, unsigned char *p, size_t len)
+{
+	ssize_t rc;
+
+	while (len > 0) {
+		rc = recv(fd, p, len, 0);
+		if (rc < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if (rc == 0) {
+			return -1;
+		}
+		p += rc;
+		len -= rc;
+	}
+	return 0;
+}
+
+
+
+/**
+ * Receive message with length prefix, replacing the content of msg
+ *
+ * @param fd        the connected socket
+ * @param msg       the message
+ * @return          0 or -1 if the connection was closed or the message is malformed
+ */
+int brokerReceiveMessage(int fd, struct brokerMessage *msg)
+{
+	unsigned char hdr[4];
+	size_t len;
+
+	if (readFully(fd, hdr, sizeof(hdr)) < 0) {
+		return -1;
+	}
+
+	len = ((size_t)hdr[0] << 24) | ((size_t)hdr[1] << 16) | ((size_t)hdr[2] << 8) | hdr[3];
+
+	if (len > BROKER_MAX_MESSAGE) {
+		return -1;
+	}
+
+	msg->len = 0;
+	msg->pos = 0;
+	msg->error = 0;
+
+	if ((reserve(msg, len) == NULL) && len) {
+		return -1;
+	}
+
+	return readFully(fd, msg->val, len);
+}
+
+#endif /* _WIN32 */
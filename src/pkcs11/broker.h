@@ -0,0 +1,86 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    broker.h
+ * @brief   Message encoding for the protocol between module and sc-hsm-brokerd
+ */
+
+#ifndef ___BROKER_H_INC___
+#define ___BROKER_H_INC___
+
+#include <pkcs11/cryptoki.h>
+#include <pkcs11/p11generic.h>
+
+/*
+ * Each message on the Unix domain socket is a 4 byte big endian length followed
+ * by the message body. A request body starts with the opcode byte, a response
+ * body with the CK_RV of the operation. Integers are encoded as 4 byte big endian
+ * values, variable length data is prefixed with its length as integer.
+ */
+
+#define BROKER_SOCKET_DEFAULT		"/var/run/sc-hsm-brokerd.sock"
+#define BROKER_MAX_MESSAGE			(1024 * 1024)
+#define BROKER_MAX_SLOTS			32
+
+#define BRK_GET_SLOTS		0x01	/* -> n { slotID, CK_SLOT_INFO }                                 */
+#define BRK_GET_TOKEN		0x02	/* slotID -> CK_TOKEN_INFO, driver name                          */
+#define BRK_GET_OBJECTS		0x03	/* slotID, private -> n { objects }                              */
+#define BRK_LOGIN			0x04	/* slotID, userType, PIN ->                                      */
+#define BRK_LOGOUT			0x05	/* slotID ->                                                     */
+#define BRK_SIGN			0x06	/* slotID, handle, mechanism, buffer size, data -> signature     */
+#define BRK_DECRYPT			0x07	/* slotID, handle, mechanism, buffer size, cryptogram -> plain   */
+
+/**
+ * Message buffer used for encoding and decoding
+ */
+struct brokerMessage {
+	unsigned char *val;                 /**< Buffer holding the message body                */
+	size_t len;                         /**< Length of the message body                     */
+	size_t size;                        /**< Allocated size of the buffer                   */
+	size_t pos;                         /**< Read position while decoding                   */
+	int error;                          /**< Encoding or decoding failed                    */
+};
+
+void brokerInitMessage(struct brokerMessage *msg);
+void brokerFreeMessage(struct brokerMessage *msg);
+void brokerPutByte(struct brokerMessage *msg, unsigned char val);
+void brokerPutInt(struct brokerMessage *msg, CK_ULONG val);
+void brokerPutBytes(struct brokerMessage *msg, const unsigned char *val, size_t len);
+void brokerPutSlotInfo(struct brokerMessage *msg, CK_SLOT_INFO_PTR info);
+void brokerPutTokenInfo(struct brokerMessage *msg, CK_TOKEN_INFO_PTR info);
+void brokerPutObject(struct brokerMessage *msg, struct p11Object_t *object);
+unsigned char brokerGetByte(struct brokerMessage *msg);
+CK_ULONG brokerGetInt(struct brokerMessage *msg);
+size_t brokerGetBytes(struct brokerMessage *msg, unsigned char **val);
+void brokerGetSlotInfo(struct brokerMessage *msg, CK_SLOT_INFO_PTR info);
+void brokerGetTokenInfo(struct brokerMessage *msg, CK_TOKEN_INFO_PTR info);
+int brokerGetObject(struct brokerMessage *msg, struct p11Object_t **object);
+int brokerSendMessage(int fd, struct brokerMessage *msg);
+int brokerReceiveMessage(int fd, struct brokerMessage *msg);
+
+#endif /* ___BROKER_H_INC___ */
@@ -32,6 +32,8 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
 #include <memory.h>
 #include <pkcs11/object.h>
@@ -75,3 +77,78 @@ int createDataObject(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, struct p11Obj
 
 	return rc;
 }
+
+
+
+/**
+ * Create a token data object from the PKCS#15 description and the value read from the device
+ *
+ * @param p15       The data object description
+ * @param value     The object value
+ * @param valuelen  The length of the object value
+ * @param pObject   Pointer to pointer updated with the newly created object
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+int createDataObjectFromP15(struct p15DataObjectDescription *p15, unsigned char *value, size_t valuelen, struct p11Object_t **pObject)
+{
+	CK_OBJECT_CLASS class = CKO_DATA;
+	CK_BBOOL true = CK_TRUE;
+	CK_BBOOL false = CK_FALSE;
+	CK_ATTRIBUTE template[] = {
+			{ CKA_CLASS, &class, sizeof(class) },
+			{ CKA_TOKEN, &true, sizeof(true) },
+			{ CKA_PRIVATE, &false, sizeof(false) },
+			{ CKA_MODIFIABLE, &false, sizeof(false) },
+			{ CKA_LABEL, NULL, 0 },
+			{ CKA_APPLICATION, NULL, 0 },
+			{ CKA_OBJECT_ID, NULL, 0 },
+			{ CKA_VALUE, NULL, 0 }
+	};
+	struct p11Object_t *p11o;
+	int rc;
+
+	FUNC_CALLED();
+
+	if (p15->coa.flags & P15_PRIVATE) {
+		template[2].pValue = &true;
+	}
+
+	if (p15->coa.flags & P15_MODIFIABLE) {
+		template[3].pValue = &true;
+	}
+
+	if (p15->coa.label) {
+		template[4].pValue = p15->coa.label;
+		template[4].ulValueLen = strlen(template[4].pValue);
+	}
+
+	if (p15->applicationName) {
+		template[5].pValue = p15->applicationName;
+		template[5].ulValueLen = strlen(template[5].pValue);
+	}
+
+	if (p15->applicationOID.len) {
+		template[6].pValue = p15->applicationOID.val;
+		template[6].ulValueLen = p15->applicationOID.len;
+	}
+
+	template[7].pValue = value;
+	template[7].ulValueLen = valuelen;
+
+	p11o = calloc(sizeof(struct p11Object_t), 1);
+
+	if (p11o == NULL) {
+		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+	}
+
+	rc = createDataObject(template, sizeof(template) / sizeof(CK_ATTRIBUTE), p11o);
+
+	if (rc != CKR_OK) {
+		free(p11o);
+		FUNC_FAILS(rc, "Could not create data object");
+	}
+
+	*pObject = p11o;
+
+	FUNC_RETURNS(CKR_OK);
+}
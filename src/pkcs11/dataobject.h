@@ -39,7 +39,9 @@
 #include <pkcs11/cryptoki.h>
 #include <pkcs11/session.h>
 #include <pkcs11/object.h>
+#include <pkcs11/pkcs15.h>
 
 int createDataObject(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, struct p11Object_t *object);
+int createDataObjectFromP15(struct p15DataObjectDescription *p15, unsigned char *value, size_t valuelen, struct p11Object_t **pObject);
 
 #endif /* ___DATAOBJECT_H_INC___ */
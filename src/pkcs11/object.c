@@ -32,6 +32,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
 #include <pkcs11/object.h>
@@ -582,6 +583,26 @@ int isValidPtr(void *ptr)
 
 
 
+static void freeAttributeTable(struct p11Object_t *object)
+{
+	if (object->attrTable) {
+		free(object->attrTable);
+		object->attrTable = NULL;
+	}
+}
+
+
+
+static int compareAttributeTableEntries(const void *a, const void *b)
+{
+	CK_ATTRIBUTE_TYPE ta = ((struct p11AttributeTableEntry_t *)a)->type;
+	CK_ATTRIBUTE_TYPE tb = ((struct p11AttributeTableEntry_t *)b)->type;
+
+	return ta < tb ? -1 : (ta > tb ? 1 : 0);
+}
+
+
+
 int addAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate)
 {
 	struct p11Attribute_t *pAttribute, **ppAttribute;
@@ -613,6 +634,10 @@ int addAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate)
 	}
 	*ppAttribute = pAttribute;
 
+	object->size += sizeof(CK_ATTRIBUTE) + pAttribute->attrData.ulValueLen;
+
+	freeAttributeTable(object);
+
 	return CKR_OK;
 }
 
@@ -641,6 +666,95 @@ int findAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR attributeTemplate
 
 
 
+/**
+ * Build the table of attributes sorted by type
+ *
+ * The table is built once the object is complete, e.g. when added to a token or session,
+ * and released if attributes are added or removed later on.
+ *
+ * @param object the object
+ * @return CKR_OK or CKR_HOST_MEMORY
+ */
+int buildAttributeTable(struct p11Object_t *object)
+{
+	struct p11AttributeTable_t *table;
+	struct p11Attribute_t *attr;
+	int count;
+
+	freeAttributeTable(object);
+
+	count = 0;
+	for (attr = object->attrList; attr != NULL; attr = attr->next) {
+		count++;
+	}
+
+	table = (struct p11AttributeTable_t *)malloc(sizeof(struct p11AttributeTable_t) + count * sizeof(struct p11AttributeTableEntry_t));
+
+	if (table == NULL) {
+		return CKR_HOST_MEMORY;
+	}
+
+	table->count = 0;
+	for (attr = object->attrList; attr != NULL; attr = attr->next) {
+		table->entry[table->count].type = attr->attrData.type;
+		table->entry[table->count].attribute = attr;
+		table->count++;
+	}
+
+	qsort(table->entry, table->count, sizeof(struct p11AttributeTableEntry_t), compareAttributeTableEntries);
+
+	object->attrTable = table;
+	return CKR_OK;
+}
+
+
+
+/**
+ * Find attribute by type, using the attribute table if available
+ *
+ * @param object the object
+ * @param type the attribute type
+ * @return the attribute or NULL if not found
+ */
+struct p11Attribute_t *lookupAttribute(struct p11Object_t *object, CK_ATTRIBUTE_TYPE type)
+{
+	struct p11AttributeTable_t *table;
+	struct p11Attribute_t *attr;
+	int lo, hi, mid;
+
+	table = object->attrTable;
+
+	if (table == NULL) {
+		for (attr = object->attrList; attr != NULL; attr = attr->next) {
+			if (attr->attrData.type == type) {
+				return attr;
+			}
+		}
+		return NULL;
+	}
+
+	lo = 0;
+	hi = table->count - 1;
+
+	while (lo <= hi) {
+		mid = (lo + hi) >> 1;
+
+		if (table->entry[mid].type == type) {
+			return table->entry[mid].attribute;
+		}
+
+		if (table->entry[mid].type < type) {
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	return NULL;
+}
+
+
+
 int findAttributeInTemplate(CK_ATTRIBUTE_TYPE attributeType, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
 {
 	int i;
@@ -671,9 +785,13 @@ int removeAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR attributeTempla
 	pAttr = *ppAttr;
 	*ppAttr = (*ppAttr)->next;
 
+	object->size -= sizeof(CK_ATTRIBUTE) + pAttr->attrData.ulValueLen;
+
 	free(pAttr->attrData.pValue);
 	free(pAttr);
 
+	freeAttributeTable(object);
+
 	return CKR_OK;
 }
 
@@ -945,12 +1063,12 @@ int serializeObject(struct p11Object_t *pObject, unsigned char **pBuffer, unsign
 int isMatchingObject(struct p11Object_t *pObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
 {
 	struct p11Attribute_t *pAttribute;
-	int i, rv;
+	int i;
 
 	for (i = 0; i < ulCount; i++) {
-		rv = findAttribute(pObject, pTemplate + i, &pAttribute);
+		pAttribute = lookupAttribute(pObject, pTemplate[i].type);
 
-		if (rv < 0) {
+		if (pAttribute == NULL) {
 			return CK_FALSE;
 		}
 		if (pTemplate[i].ulValueLen != pAttribute->attrData.ulValueLen) {
@@ -55,6 +55,17 @@ struct p11Attribute_t {
 
 struct p11Token_t;				// Forward declaration
 
+/**
+ * Attributes of an object sorted by type for fast lookup of multiple attributes
+ */
+struct p11AttributeTable_t {
+	int count;                          /**< Number of entries                   */
+	struct p11AttributeTableEntry_t {
+		CK_ATTRIBUTE_TYPE type;
+		struct p11Attribute_t *attribute;
+	} entry[1];                         /**< Entries sorted by attribute type    */
+};
+
 /**
  * Internal structure to store common attributes of an object.
  *
@@ -91,6 +102,8 @@ struct p11Object_t {
     int (*C_SignFinal)    (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG_PTR);
 
     struct p11Attribute_t *attrList;    /**< The list of attributes              */
+    struct p11AttributeTable_t *attrTable; /**< Sorted attributes or NULL      */
+    CK_ULONG size;                  /**< Size as reported by C_GetObjectSize */
     struct p11Object_t *next;       /**< Pointer to next object              */
 
 };
@@ -119,6 +132,8 @@ int isValidPtr(void *ptr);
 int addAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate);
 int findAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR attributeTemplate, struct p11Attribute_t **attribute);
 int findAttributeInTemplate(CK_ATTRIBUTE_TYPE attributeType, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount);
+int buildAttributeTable(struct p11Object_t *object);
+struct p11Attribute_t *lookupAttribute(struct p11Object_t *object, CK_ATTRIBUTE_TYPE type);
 int removeAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR attributeTemplate);
 int removeAllAttributes(struct p11Object_t *object);
 void addObjectToList(struct p11Object_t **ppObject, struct p11Object_t *object);
@@ -0,0 +1,68 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    p11ext.h
+ * @brief   Extensions to the PKCS#11 interface exported by the module
+ */
+
+#ifndef ___P11EXT_H_INC___
+#define ___P11EXT_H_INC___
+
+#include <pkcs11/cryptoki.h>
+
+/**
+ * Single signature in a batch processed by SC_SignBatch()
+ */
+typedef struct SC_SIGN_BATCH_ITEM {
+	CK_BYTE_PTR pData;                  /**< Data to sign                                   */
+	CK_ULONG ulDataLen;                 /**< Length of data                                 */
+	CK_BYTE_PTR pSignature;             /**< Buffer receiving the signature                 */
+	CK_ULONG ulSignatureLen;            /**< Size of buffer, updated with signature length  */
+	CK_RV rv;                           /**< Result of this signature operation             */
+} SC_SIGN_BATCH_ITEM;
+
+typedef SC_SIGN_BATCH_ITEM CK_PTR SC_SIGN_BATCH_ITEM_PTR;
+
+/*
+ * SC_SignBatch signs all items with the same key and mechanism while holding exclusive
+ * access to the token. If pPin is not NULL, then the PIN is verified before the first
+ * signature and again whenever the PIN use counter of the key is exhausted, as far as
+ * the card policy permits. With pPin NULL and ulPinLen 0 on a reader with PIN-Pad the
+ * PIN is requested whenever the card demands it. The batch stops at the first error and
+ * items not processed are returned with CKR_FUNCTION_CANCELED. A PIN verified only for the
+ * batch is not left verified after an error.
+ *
+ * Obtain the function with dlsym() or GetProcAddress() on the module.
+ */
+CK_DECLARE_FUNCTION(CK_RV, SC_SignBatch)(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey,
+		CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen, SC_SIGN_BATCH_ITEM_PTR pItems, CK_ULONG ulCount);
+
+typedef CK_RV (*SC_SignBatch_t)(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey,
+		CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen, SC_SIGN_BATCH_ITEM_PTR pItems, CK_ULONG ulCount);
+
+#endif /* ___P11EXT_H_INC___ */
@@ -38,6 +38,9 @@
 #include <pkcs11/p11generic.h>
 #include <pkcs11/session.h>
 #include <pkcs11/slotpool.h>
+#include <pkcs11/slot.h>
+#include <pkcs11/slot-broker.h>
+#include <pkcs11/token.h>
 #include <pkcs11/strbpcpy.h>
 
 #ifdef DEBUG
@@ -53,6 +56,11 @@ struct p11Context_t *context = NULL;
 
 static CK_C_INITIALIZE_ARGS initArgs;
 
+#ifndef _WIN32
+static struct p11Context_t *forkedContext = NULL;
+static int atforkRegistered = FALSE;
+#endif
+
 
 
 CK_RV p11CreateMutex(CK_VOID_PTR_PTR ppMutex)
@@ -180,6 +188,62 @@ int determineCaller()
 
 
 
+#ifndef _WIN32
+/**
+ * Called in the child process after fork()
+ *
+ * PKCS#11 requires the child to call C_Initialize. The context inherited from the parent
+ * is put aside, so that C_Initialize can reuse the slot, token and object state instead
+ * of enumerating readers and reading all objects from the token again. The inherited
+ * state is not modified before, so memory pages remain shared with the parent.
+ */
+static void childAfterFork(void)
+{
+	if (context != NULL) {
+		forkedContext = context;
+		context = NULL;
+	}
+}
+
+
+
+/**
+ * Reuse the context inherited from the parent process
+ *
+ * @return          CKR_OK or any other Cryptoki error code if a full initialization is required
+ */
+static int reuseForkedContext()
+{
+	int rv;
+
+	context = forkedContext;
+	forkedContext = NULL;
+
+	// The mutex may have been held by another thread of the parent while forking
+	rv = p11CreateMutex(&context->mutex);
+
+	if (rv == CKR_OK) {
+		// Sessions are not inherited by the child
+		terminateSessionPool(&context->sessionPool);
+		initSessionPool(&context->sessionPool);
+
+		rv = reattachSlots(&context->slotPool);
+	}
+
+	if (rv != CKR_OK) {
+#ifdef DEBUG
+		debug("[C_Initialize] Inherited context can not be reused ...\n");
+#endif
+		// Not released, as devices and handles are still in use by the parent
+		context = NULL;
+	}
+
+	return rv;
+}
+#endif
+
+
+
 /*
  * Initialize the PKCS#11 function list.
  *
@@ -291,6 +355,17 @@ CK_DECLARE_FUNCTION(CK_RV, C_Initialize)
 		return CKR_CRYPTOKI_ALREADY_INITIALIZED;
 	}
 
+#ifndef _WIN32
+	if (!atforkRegistered) {
+		pthread_atfork(NULL, NULL, childAfterFork);
+		atforkRegistered = TRUE;
+	}
+
+	if ((forkedContext != NULL) && (reuseForkedContext() == CKR_OK)) {
+		return CKR_OK;
+	}
+#endif
+
 	context = (struct p11Context_t *) calloc (1, sizeof(struct p11Context_t));
 
 	if (context == NULL) {
@@ -308,6 +383,18 @@ CK_DECLARE_FUNCTION(CK_RV, C_Initialize)
 
 	context->caller = determineCaller();
 
+#ifndef _WIN32
+	if (getenv("PKCS11_BROKER_SOCKET")) {
+		rv = initBrokerClient();
+
+		if (rv != CKR_OK) {
+			free(context);
+			context = NULL;
+			FUNC_RETURNS(rv);
+		}
+	}
+#endif
+
 	initSessionPool(&context->sessionPool);
 
 	rv = initSlotPool(&context->slotPool);
@@ -336,14 +423,33 @@ CK_DECLARE_FUNCTION(CK_RV, C_Finalize)
 		CK_VOID_PTR   pReserved  /* reserved.  Should be NULL_PTR */
 )
 {
+	int rc, rv = CKR_OK;
+	struct p11Slot_t *slot;
+
 	FUNC_CALLED();
 
 	if (context != NULL) {
+		// Write object modifications still pending before the slots are released
+		for (slot = context->slotPool.list; slot != NULL; slot = slot->next) {
+			if (slot->token != NULL) {
+				rc = flushTokenObjects(slot, slot->token);
+				if (rc != CKR_OK) {
+#ifdef DEBUG
+					debug("flushTokenObjects failed with rc=%d\n", rc);
+#endif
+					rv = rc;
+				}
+			}
+		}
+
 		p11LockMutex(context->mutex);
 
 		terminateSessionPool(&context->sessionPool);
 		terminateSlotPool(&context->slotPool);
 
+		if (context->brokerClient)
+			terminateBrokerClient();
+
 		p11UnlockMutex(context->mutex);
 
 #ifdef DEBUG
@@ -358,7 +464,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_Finalize)
 
 	context = NULL;
 
-	return CKR_OK;
+	return rv;
 }
 
 
@@ -39,6 +39,7 @@
 
 #include <pkcs11/cryptoki.h>
 #include <pkcs11/object.h>
+#include <pkcs11/p11ext.h>
 
 #define VERSION_MAJOR     2
 #define VERSION_MINOR     7
@@ -105,11 +106,36 @@ struct p11Token_t {
 	CK_ULONG numberOfPrivateTokenObjects; /**< The number of private objects in this token  */
 	struct p11Object_t *tokenPrivObjList; /**< Pointer to the first object in pool          */
 
+	struct p11ObjectIndex_t *objectIndex; /**< Index for certificate chain lookups          */
+
+	unsigned long dirtySince;           /**< Time in ms of the first unwritten change, 0 if none */
+	unsigned long synchronized;         /**< Time in ms of the last check for changes on the device */
+
 	struct p11TokenDriver *drv;         /**< Driver for this token                          */
 };
 
 
 
+struct p11ApduCache_t;
+struct p11ObjectIndex_t;
+
+/**
+ * Copy of slot and token state for info queries that run without the global lock.
+ *
+ * Updates are published with a sequence counter, which is odd while an update is in progress.
+ */
+struct p11SlotSnapshot_t {
+	volatile unsigned long sequence;  /**< Incremented before and after an update    */
+	volatile unsigned long validated; /**< Time of last status check in ms, 0 if stale */
+	int tokenPresent;                 /**< A token is present in the slot            */
+	CK_SLOT_INFO slotInfo;            /**< Information about the slot                */
+	CK_TOKEN_INFO tokenInfo;          /**< Information about the token               */
+	CK_USER_TYPE user;                /**< The user logged into the token            */
+	struct p11TokenDriver *drv;       /**< Driver for the token                      */
+};
+
+
+
 /**
  * Internal structure to store information about a slot.
  *
@@ -125,7 +151,10 @@ struct p11Slot_t {
 	char readername[MAX_READERNAME];  /**< The reader name for this slot       */
 	SCARDCONTEXT context;             /**< Card manager context for slot       */
 	SCARDHANDLE card;                 /**< Handle to card                      */
+	int transactionLock;              /**< Nesting depth of the PC/SC transaction */
+	unsigned long transactionOwner;   /**< Thread that may nest the PC/SC transaction */
 #endif
+	CK_SLOT_ID brokerSlotID;          /**< Slot id at sc-hsm-brokerd           */
 	int maxCAPDU;                     /**< Maximum length of command APDU      */
 	int maxRAPDU;                     /**< Maximum length of response APDU     */
 	int noExtLengthReadAll;           /**< Prevent using Le='000000'           */
@@ -133,6 +162,8 @@ struct p11Slot_t {
 	struct p11Slot_t *virtualSlots[2];/**< Virtual slots using this as base    */
 	struct p11Token_t *token;         /**< Pointer to token in the slot        */
 	struct p11Token_t *removedToken;  /**< Removed but not freed token         */
+	struct p11SlotSnapshot_t snapshot;/**< State for lock-free info queries    */
+	struct p11ApduCache_t *apduCache; /**< Responses to read-only commands     */
 	struct p11Slot_t *next;           /**< Pointer to next available slot      */
 };
 
@@ -179,6 +210,16 @@ struct p11TokenDriver {
 	int (*logout)(struct p11Slot_t *slot);
 	int (*initpin)(struct p11Slot_t *slot, unsigned char *pin, int pinlen);
 	int (*setpin)(struct p11Slot_t *slot, unsigned char *oldpin, int oldpinlen, unsigned char *newpin, int newpinlen);
+	/**< Update token objects with changes on the device, NULL if objects are never changed  */
+	int (*synchronize)(struct p11Slot_t *slot, struct p11Token_t *token);
+	/**< Write a created or modified token object to the device, NULL if not supported      */
+	int (*writeObject)(struct p11Slot_t *slot, struct p11Token_t *token, struct p11Object_t *object);
+	/**< Delete a token object from the device, NULL if not supported                       */
+	int (*deleteObject)(struct p11Slot_t *slot, struct p11Token_t *token, struct p11Object_t *object);
+	/**< Check that a token object can be written with the attribute changes in pTemplate, NULL if not supported */
+	int (*checkObject)(struct p11Token_t *token, struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount);
+	/**< Sign a batch with PIN verification as required by the token, NULL to use C_Sign    */
+	int (*signBatch)(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, unsigned char *pin, int pinlen, SC_SIGN_BATCH_ITEM_PTR items, CK_ULONG count);
 
 	int (*C_DecryptInit)  (struct p11Object_t *, CK_MECHANISM_PTR);
 	int (*C_Decrypt)      (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
@@ -205,6 +246,8 @@ struct p11Context_t {
 
 	int caller;                             /**< Calling application                      */
 
+	int brokerClient;                       /**< Forward token access to sc-hsm-brokerd   */
+
 	FILE *debugFileHandle;
 
 	struct p11SessionPool_t sessionPool;    /**< Session pool                             */
@@ -442,7 +442,19 @@ CK_DECLARE_FUNCTION(CK_RV, C_Decrypt)(
 	}
 
 	if (pObject->C_Decrypt != NULL) {
+		rv = lockSessionSlot(pSession, pSlot);
+
+		if (rv != CKR_OK) {
+			FUNC_RETURNS(rv);
+		}
+
 		rv = pObject->C_Decrypt(pObject, pSession->activeMechanism, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen);
+		unlockSlot(pSlot);
+
+		if ((pSession->activeObjectHandle == CK_INVALID_HANDLE) || (rv == CKR_DEVICE_ERROR)) {
+			releaseSessionSlotLock(pSession);
+		}
+
 		if (rv == CKR_DEVICE_ERROR) {
 			rv = handleDeviceError(hSession);
 			FUNC_FAILS(rv, "Device error reported");
@@ -781,10 +793,20 @@ CK_DECLARE_FUNCTION(CK_RV, C_Sign)(
 	}
 
 	if (pObject->C_Sign != NULL) {
+		rv = lockSessionSlot(pSession, pSlot);
+
+		if (rv != CKR_OK) {
+			FUNC_RETURNS(rv);
+		}
+
 		rv = pObject->C_Sign(pObject, pSession->activeMechanism, pData, ulDataLen, pSignature, pulSignatureLen);
+		unlockSlot(pSlot);
 
 		if ((pSignature != NULL) && (rv != CKR_BUFFER_TOO_SMALL)) {
 			pSession->activeObjectHandle = CK_INVALID_HANDLE;
+			releaseSessionSlotLock(pSession);
+		} else if (rv == CKR_DEVICE_ERROR) {
+			releaseSessionSlotLock(pSession);
 		}
 
 		if (rv == CKR_DEVICE_ERROR) {
@@ -800,6 +822,143 @@ CK_DECLARE_FUNCTION(CK_RV, C_Sign)(
 
 
 
+/*  SC_SignBatch signs a list of data items with the same key, keeping the
+    token reserved for the whole batch. See p11ext.h for details. */
+CK_DECLARE_FUNCTION(CK_RV, SC_SignBatch)(
+		CK_SESSION_HANDLE hSession,
+		CK_MECHANISM_PTR pMechanism,
+		CK_OBJECT_HANDLE hKey,
+		CK_UTF8CHAR_PTR pPin,
+		CK_ULONG ulPinLen,
+		SC_SIGN_BATCH_ITEM_PTR pItems,
+		CK_ULONG ulCount
+)
+{
+	int rv;
+	CK_ULONG i;
+	struct p11Object_t *pObject;
+	struct p11Slot_t *pSlot;
+	struct p11Session_t *pSession;
+
+	FUNC_CALLED();
+
+	if (context == NULL) {
+		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
+	}
+
+	if (!isValidPtr(pMechanism)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	if (!ulCount || !isValidPtr(pItems)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	if ((ulPinLen > 0) && !isValidPtr(pPin)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	for (i = 0; i < ulCount; i++) {
+		if (!isValidPtr(pItems[i].pData)) {
+			FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+		}
+
+		// pSignature == NULL is a length query
+		if ((pItems[i].pSignature != NULL) && !isValidPtr(pItems[i].pSignature)) {
+			FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+		}
+	}
+
+	rv = findSessionByHandle(&context->sessionPool, hSession, &pSession);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	if (pSession->activeObjectHandle != CK_INVALID_HANDLE) {
+		FUNC_FAILS(CKR_OPERATION_ACTIVE, "Operation is already active");
+	}
+
+	rv = findSlot(&context->slotPool, pSession->slotID, &pSlot);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	rv = findSlotKey(pSlot, hKey, &pObject);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	if ((pObject->C_SignInit == NULL) || (pObject->C_Sign == NULL)) {
+		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
+	}
+
+	rv = pObject->C_SignInit(pObject, pMechanism);
+
+	if (rv == CKR_DEVICE_ERROR) {
+		rv = handleDeviceError(hSession);
+		FUNC_FAILS(rv, "Device error reported");
+	}
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	for (i = 0; i < ulCount; i++) {
+		pItems[i].rv = CKR_FUNCTION_CANCELED;
+	}
+
+	rv = lockSessionSlot(pSession, pSlot);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	if (pSlot->token->drv->signBatch != NULL) {
+		rv = pSlot->token->drv->signBatch(pObject, pMechanism->mechanism, pPin, ulPinLen, pItems, ulCount);
+	} else {
+		// Without driver support the PIN is verified once for the whole batch
+		if (pPin != NULL) {
+			rv = logIn(pSlot, CKU_CONTEXT_SPECIFIC, pPin, ulPinLen);
+		}
+
+		for (i = 0; (rv == CKR_OK) && (i < ulCount); i++) {
+			rv = pObject->C_Sign(pObject, pMechanism->mechanism, pItems[i].pData, pItems[i].ulDataLen, pItems[i].pSignature, &pItems[i].ulSignatureLen);
+			pItems[i].rv = rv;
+
+			if (rv == CKR_BUFFER_TOO_SMALL) {
+				rv = CKR_OK;
+			}
+		}
+	}
+
+	p11LockMutex(context->mutex);
+
+	// The batch stops at the first error. Do not leave the PIN verified for the
+	// remaining signatures, unless the user was logged in anyway
+	if ((rv != CKR_OK) && (pSlot->token->drv->signBatch == NULL) &&
+		(pSlot->token->user == INT_CKU_NO_USER)) {
+		logOut(pSlot);
+	}
+
+	// PIN status may have changed
+	invalidateSlotSnapshot(pSlot);
+	p11UnlockMutex(context->mutex);
+
+	unlockSlot(pSlot);
+
+	if (rv == CKR_DEVICE_ERROR) {
+		rv = handleDeviceError(hSession);
+		FUNC_FAILS(rv, "Device error reported");
+	}
+
+	FUNC_RETURNS(rv);
+}
+
+
+
 /*  C_SignUpdate continues a multiple-part signature operation,
     processing another data part. */
 CK_DECLARE_FUNCTION(CK_RV, C_SignUpdate)(
@@ -896,12 +1055,22 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignFinal)(
 		FUNC_RETURNS(rv);
 	}
 
+	rv = lockSessionSlot(pSession, pSlot);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
 	if (pObject->C_SignFinal != NULL) {
 		rv = pObject->C_SignFinal(pObject, pSession->activeMechanism, pSignature, pulSignatureLen);
+		unlockSlot(pSlot);
 
 		if ((pSignature != NULL) && (rv != CKR_BUFFER_TOO_SMALL)) {
 			pSession->activeObjectHandle = CK_INVALID_HANDLE;
 			clearCryptoBuffer(pSession);
+			releaseSessionSlotLock(pSession);
+		} else if (rv == CKR_DEVICE_ERROR) {
+			releaseSessionSlotLock(pSession);
 		}
 
 		if (rv == CKR_DEVICE_ERROR) {
@@ -911,10 +1080,14 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignFinal)(
 	} else {
 		if (pObject->C_Sign != NULL) {
 			rv = pObject->C_Sign(pObject, pSession->activeMechanism, pSession->cryptoBuffer, pSession->cryptoBufferSize, pSignature, pulSignatureLen);
+			unlockSlot(pSlot);
 
 			if ((pSignature != NULL) && (rv != CKR_BUFFER_TOO_SMALL)) {
 				pSession->activeObjectHandle = CK_INVALID_HANDLE;
 				clearCryptoBuffer(pSession);
+				releaseSessionSlotLock(pSession);
+			} else if (rv == CKR_DEVICE_ERROR) {
+				releaseSessionSlotLock(pSession);
 			}
 
 			if (rv == CKR_DEVICE_ERROR) {
@@ -922,6 +1095,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignFinal)(
 				FUNC_FAILS(rv, "Device error reported");
 			}
 		} else {
+			unlockSlot(pSlot);
 			FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
 		}
 	}
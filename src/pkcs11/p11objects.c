@@ -125,7 +125,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_CreateObject)(
 	if ((getSessionState(session, slot->token) == CKS_RW_USER_FUNCTIONS) && pObject->tokenObj) {
 		addObject(slot->token, pObject, pObject->publicObj);
 
-		rv = synchronizeToken(slot, slot->token);
+		rv = saveObject(slot, slot->token, pObject);
 
 		if (rv != CKR_OK) {
 			removeTokenObject(slot->token, pObject->handle, pObject->publicObj);
@@ -217,7 +217,11 @@ CK_DECLARE_FUNCTION(CK_RV, C_DestroyObject)(
 		}
 
 		/* remove the object from the storage media */
-		destroyObject(slot, slot->token, pObject);
+		rv = destroyObject(slot, slot->token, pObject);
+
+		if (rv != CKR_OK) {
+			FUNC_FAILS(rv, "Could not remove object from token");
+		}
 
 		/* remove the object from the list */
 		removeTokenObject(slot->token, hObject, pObject->publicObj);
@@ -247,8 +251,6 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetObjectSize)(
 	struct p11Object_t *pObject;
 	struct p11Session_t *session;
 	struct p11Slot_t *slot;
-	unsigned int size;
-	unsigned char *tmp;
 	CK_STATE state;
 
 	FUNC_CALLED();
@@ -292,10 +294,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetObjectSize)(
 		}
 	}
 
-	serializeObject(pObject, &tmp, &size);
-	free(tmp);
-
-	*pulSize = size;
+	// Maintained by addAttribute() and removeAttribute(), same as the length of serializeObject()
+	*pulSize = pObject->size;
 
 	FUNC_RETURNS(CKR_OK);
 }
@@ -366,11 +366,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetAttributeValue)(
 	rv = CKR_OK;
 
 	for (i = 0; i < ulCount; i++) {
-		attribute = pObject->attrList;
-
-		while (attribute && (attribute->attrData.type != pTemplate[i].type)) {
-			attribute = attribute->next;
-		}
+		attribute = lookupAttribute(pObject, pTemplate[i].type);
 
 		if (!attribute) {
 			pTemplate[i].ulValueLen = (CK_LONG) -1;
@@ -411,8 +407,9 @@ CK_DECLARE_FUNCTION(CK_RV, C_SetAttributeValue)(
 		CK_ULONG ulCount
 )
 {
-	int rv;
+	int rv, modified = 0;
 	CK_ULONG i;
+	CK_ATTRIBUTE modifiableTemplate = { CKA_MODIFIABLE, NULL, 0 };
 	struct p11Object_t *pObject, *tmp;
 	struct p11Session_t *session;
 	struct p11Slot_t *slot;
@@ -460,6 +457,24 @@ CK_DECLARE_FUNCTION(CK_RV, C_SetAttributeValue)(
 		}
 	}
 
+	if ((findAttribute(pObject, &modifiableTemplate, &attribute) >= 0) &&
+		(attribute->attrData.ulValueLen == sizeof(CK_BBOOL)) && (*(CK_BBOOL *)attribute->attrData.pValue == CK_FALSE)) {
+		FUNC_FAILS(CKR_ATTRIBUTE_READ_ONLY, "Object is not modifiable");
+	}
+
+	// Fail now rather than when the change is written to the device
+	if (pObject->tokenObj) {
+		if (slot->token->drv->checkObject == NULL) {
+			FUNC_FAILS(CKR_ATTRIBUTE_READ_ONLY, "Token objects can not be modified");
+		}
+
+		rv = slot->token->drv->checkObject(slot->token, pObject, pTemplate, ulCount);
+
+		if (rv != CKR_OK) {
+			FUNC_RETURNS(rv);
+		}
+	}
+
 	for (i = 0; i < ulCount; i++) {
 		attribute = pObject->attrList;
 
@@ -500,11 +515,13 @@ CK_DECLARE_FUNCTION(CK_RV, C_SetAttributeValue)(
 				/* insert new private object */
 				addObject(slot->token, tmp, FALSE);
 
-				rv = synchronizeToken(slot, slot->token);
+				rv = saveObject(slot, slot->token, tmp);
 
-				if (rv < 0) {
+				if (rv != CKR_OK) {
 					FUNC_RETURNS(rv);
 				}
+
+				pObject = tmp;
 			}
 		} else {
 			if (pTemplate[i].ulValueLen > attribute->attrData.ulValueLen) {
@@ -512,19 +529,24 @@ CK_DECLARE_FUNCTION(CK_RV, C_SetAttributeValue)(
 				attribute->attrData.pValue = malloc(pTemplate[i].ulValueLen);
 			}
 
+			pObject->size += pTemplate[i].ulValueLen - attribute->attrData.ulValueLen;
 			attribute->attrData.ulValueLen = pTemplate[i].ulValueLen;
 			memcpy(attribute->attrData.pValue, pTemplate[i].pValue, pTemplate[i].ulValueLen);
 
-			pObject->dirtyFlag = 1;
-
-			rv = synchronizeToken(slot, slot->token);
+			// The object index refers to attribute values
+			invalidateObjectIndex(slot->token);
 
-			if (rv < 0) {
-				FUNC_RETURNS(rv);
-			}
+			modified = 1;
 		}
 	}
 
+	rv = CKR_OK;
+
+	// Updates in quick succession are written to the device in one go
+	if (modified && pObject->tokenObj) {
+		rv = updateObject(slot, slot->token, pObject);
+	}
+
 	FUNC_RETURNS(rv);
 }
 
@@ -580,6 +602,15 @@ CK_DECLARE_FUNCTION(CK_RV, C_FindObjectsInit)(
 		C_FindObjectsFinal(hSession);
 	}
 
+	/* objects created or deleted by other processes */
+	if (slot->token) {
+		rv = refreshTokenObjects(slot, slot->token);
+
+		if (rv != CKR_OK) {
+			FUNC_FAILS(rv, "Synchronizing token objects failed");
+		}
+	}
+
 	/* session objects */
 	pObject = session->sessionObjList;
 
@@ -594,29 +625,10 @@ CK_DECLARE_FUNCTION(CK_RV, C_FindObjectsInit)(
 		FUNC_RETURNS(rv);
 	}
 
-	/* public token objects */
-	pObject = slot->token->tokenObjList;
-
-	while (pObject != NULL) {
-		if (isMatchingObject(pObject, pTemplate, ulCount)) {
-			addObjectToSearchList(session, pObject);
-		}
-		pObject = pObject->next;
-	}
-
-	/* private token objects */
+	/* public and private token objects */
 	state = getSessionState(session, slot->token);
-	if ((state == CKS_RW_USER_FUNCTIONS) ||
-		(state == CKS_RO_USER_FUNCTIONS)) {
-		pObject = slot->token->tokenPrivObjList;
-
-		while (pObject != NULL) {
-			if (isMatchingObject(pObject, pTemplate, ulCount)) {
-				addObjectToSearchList(session, pObject);
-			}
-			pObject = pObject->next;
-		}
-	}
+	addMatchingTokenObjectsToSearchList(session, slot->token, pTemplate, ulCount,
+		(state == CKS_RW_USER_FUNCTIONS) || (state == CKS_RO_USER_FUNCTIONS));
 
 	FUNC_RETURNS(CKR_OK);
 }
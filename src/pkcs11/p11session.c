@@ -125,7 +125,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_CloseSession)(
 		CK_SESSION_HANDLE hSession
 )
 {
-	int rv;
+	int rv, flushrv = CKR_OK;
+	struct p11Slot_t *slot;
 	struct p11Session_t *session;
 
 	FUNC_CALLED();
@@ -140,6 +141,14 @@ CK_DECLARE_FUNCTION(CK_RV, C_CloseSession)(
 		FUNC_RETURNS(rv);
 	}
 
+	// Write object modifications still pending for the token. The session is closed
+	// regardless, see flushTokenObjects() for objects that failed to write.
+	if ((findSlot(&context->slotPool, session->slotID, &slot) == CKR_OK) && (slot->token != NULL)) {
+		flushrv = flushTokenObjects(slot, slot->token);
+	}
+
+	releaseSessionSlotLock(session);
+
 	p11LockMutex(context->mutex);
 
 	rv = removeSession(&context->sessionPool, hSession);
@@ -150,6 +159,10 @@ CK_DECLARE_FUNCTION(CK_RV, C_CloseSession)(
 		FUNC_RETURNS(rv);
 	}
 
+	if (flushrv != CKR_OK) {
+		FUNC_FAILS(flushrv, "Writing modified objects failed");
+	}
+
 	FUNC_RETURNS(CKR_OK);
 }
 
@@ -160,6 +173,10 @@ CK_DECLARE_FUNCTION(CK_RV, C_CloseAllSessions)(
 		CK_SLOT_ID slotID
 )
 {
+	int rv = CKR_OK;
+	struct p11Slot_t *slot;
+	struct p11Session_t *session;
+
 	FUNC_CALLED();
 
 	if (context == NULL) {
@@ -170,12 +187,28 @@ CK_DECLARE_FUNCTION(CK_RV, C_CloseAllSessions)(
 		FUNC_FAILS(CKR_SESSION_HANDLE_INVALID,"Session pool not initialized");
 	}
 
+	// Write object modifications still pending for the token. The sessions are closed
+	// regardless, see flushTokenObjects() for objects that failed to write.
+	if ((findSlot(&context->slotPool, slotID, &slot) == CKR_OK) && (slot->token != NULL)) {
+		rv = flushTokenObjects(slot, slot->token);
+	}
+
+	for (session = context->sessionPool.list; session != NULL; session = session->next) {
+		if (session->slotID == slotID) {
+			releaseSessionSlotLock(session);
+		}
+	}
+
 	p11LockMutex(context->mutex);
 
 	closeSessionsForSlot(&context->sessionPool, slotID);
 
 	p11UnlockMutex(context->mutex);
 
+	if (rv != CKR_OK) {
+		FUNC_FAILS(rv, "Writing modified objects failed");
+	}
+
 	FUNC_RETURNS(CKR_OK);
 }
 
@@ -189,7 +222,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetSessionInfo)(
 {
 	int rv;
 	struct p11Slot_t *slot;
-	struct p11Token_t *token;
+	struct p11SlotSnapshot_t snapshot;
 	struct p11Session_t *session;
 
 	FUNC_CALLED();
@@ -214,7 +247,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetSessionInfo)(
 		FUNC_RETURNS(rv);
 	}
 
-	rv = getValidatedToken(slot, &token);
+	rv = getSlotSnapshot(slot, &snapshot);
 
 	if (rv != CKR_OK) {
 		FUNC_RETURNS(rv);
@@ -223,7 +256,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetSessionInfo)(
 	pInfo->slotID = session->slotID;
 	pInfo->flags = session->flags;
 	pInfo->ulDeviceError = 0;
-	pInfo->state = getSessionState(session, token);
+	pInfo->state = getSessionStateForUser(session, snapshot.user);
 
 	FUNC_RETURNS(CKR_OK);
 }
@@ -311,42 +344,49 @@ CK_DECLARE_FUNCTION(CK_RV, C_Login)(
 		return rv;
 	}
 
-	p11LockMutex(context->mutex);
+	// A context specific login stays in the same transaction as the following operation,
+	// so that no other application can use the authentication state in between
+	rv = lockSessionSlot(session, slot);
 
-	if ((userType != CKU_CONTEXT_SPECIFIC) && (token->user == CKU_USER || token->user == CKU_SO)) {
-		p11UnlockMutex(context->mutex);
-		FUNC_RETURNS(CKR_USER_ALREADY_LOGGED_IN);
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
 	}
 
-	if (userType == CKU_USER || userType == CKU_CONTEXT_SPECIFIC) {
+	p11LockMutex(context->mutex);
+
+	if ((userType != CKU_CONTEXT_SPECIFIC) && (token->user == CKU_USER || token->user == CKU_SO)) {
+		rv = CKR_USER_ALREADY_LOGGED_IN;
+	} else if (userType == CKU_USER || userType == CKU_CONTEXT_SPECIFIC) {
 		if (!(token->info.flags & CKF_USER_PIN_INITIALIZED)) {
-			p11UnlockMutex(context->mutex);
-			FUNC_RETURNS(CKR_USER_PIN_NOT_INITIALIZED);
+			rv = CKR_USER_PIN_NOT_INITIALIZED;
 		}
 	} else {
 		if (!(session->flags & CKF_RW_SESSION)) {
-			p11UnlockMutex(context->mutex);
-			FUNC_RETURNS(CKR_SESSION_READ_ONLY);
-		}
-		if (token->rosessions) {
-			p11UnlockMutex(context->mutex);
-			FUNC_RETURNS(CKR_SESSION_READ_ONLY_EXISTS);
+			rv = CKR_SESSION_READ_ONLY;
+		} else if (token->rosessions) {
+			rv = CKR_SESSION_READ_ONLY_EXISTS;
 		}
 	}
 
-	rv = logIn(slot, userType, pPin, ulPinLen);
-
-	if (rv != CKR_OK) {
-		p11UnlockMutex(context->mutex);
-		FUNC_RETURNS(rv);
+	if (rv == CKR_OK) {
+		rv = logIn(slot, userType, pPin, ulPinLen);
 	}
 
-	if (userType != CKU_CONTEXT_SPECIFIC)
+	if ((rv == CKR_OK) && (userType != CKU_CONTEXT_SPECIFIC))
 		token->user = userType;
 
+	// Login state and PIN status changed
+	invalidateSlotSnapshot(slot);
+
 	p11UnlockMutex(context->mutex);
 
-	FUNC_RETURNS(CKR_OK);
+	if ((rv == CKR_OK) && (userType == CKU_CONTEXT_SPECIFIC) && !session->slotLocked) {
+		session->slotLocked = TRUE;
+	} else {
+		unlockSlot(slot);
+	}
+
+	FUNC_RETURNS(rv);
 }
 
 
@@ -356,7 +396,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_Logout)(
 		CK_SESSION_HANDLE hSession
 )
 {
-	int rv;
+	int rv, flushrv;
 	struct p11Session_t *session;
 	struct p11Slot_t *slot;
 	struct p11Token_t *token;
@@ -383,17 +423,27 @@ CK_DECLARE_FUNCTION(CK_RV, C_Logout)(
 		FUNC_RETURNS(rv);
 	}
 
+	// Modified private objects can only be written while the PIN is verified. The user is
+	// logged out regardless, private objects that failed to write are kept until the next login.
+	flushrv = flushTokenObjects(slot, token);
+
 	token->user = INT_CKU_NO_USER;
 
 	p11LockMutex(context->mutex);
 
 	rv = logOut(slot);
 
+	invalidateSlotSnapshot(slot);
+
 	p11UnlockMutex(context->mutex);
 
 	if (rv != CKR_OK) {
 		FUNC_RETURNS(rv);
 	}
 
+	if (flushrv != CKR_OK) {
+		FUNC_FAILS(flushrv, "Writing modified objects failed");
+	}
+
 	FUNC_RETURNS(CKR_OK);
 }
@@ -53,7 +53,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetSlotList)(
 {
 	CK_RV rv = CKR_OK;
 	struct p11Slot_t *slot;
-	struct p11Token_t *token;
+	struct p11SlotSnapshot_t snapshot;
 	CK_ULONG i;
 
 	FUNC_CALLED();
@@ -85,7 +85,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetSlotList)(
 	i = 0;
 
 	while (slot != NULL) {
-		if (!tokenPresent || (getValidatedToken(slot, &token) == CKR_OK)) {
+		if (!tokenPresent || (getSlotSnapshot(slot, &snapshot) == CKR_OK)) {
 			if (pSlotList && (i < *pulCount)) {
 				pSlotList[i] = slot->id;
 			}
@@ -121,7 +121,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetSlotInfo)(
 {
 	int rv;
 	struct p11Slot_t *slot = NULL;
-	struct p11Token_t *token = NULL;
+	struct p11SlotSnapshot_t snapshot;
 
 	FUNC_CALLED();
 
@@ -133,27 +133,29 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetSlotInfo)(
 		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
 	}
 
-	// updateSlots() and getToken() potentially change a lot of internal structures
-	// which is why both are protected here using the global lock
-	p11LockMutex(context->mutex);
-
-	rv = updateSlots(&context->slotPool);
+	rv = findSlot(&context->slotPool, slotID, &slot);
 
 	if (rv != CKR_OK) {
-		FUNC_RETURNS(rv);
-	}
+		// updateSlots() potentially changes a lot of internal structures
+		// which is why it is protected here using the global lock
+		p11LockMutex(context->mutex);
 
-	rv = findSlot(&context->slotPool, slotID, &slot);
+		rv = updateSlots(&context->slotPool);
 
-	if (rv != CKR_OK) {
-		FUNC_RETURNS(rv);
-	}
+		if (rv == CKR_OK) {
+			rv = findSlot(&context->slotPool, slotID, &slot);
+		}
 
-	p11UnlockMutex(context->mutex);
+		p11UnlockMutex(context->mutex);
 
-	getValidatedToken(slot, &token);				// Update token status
+		if (rv != CKR_OK) {
+			FUNC_RETURNS(rv);
+		}
+	}
 
-	memcpy(pInfo, &(slot->info), sizeof(CK_SLOT_INFO));
+	getSlotSnapshot(slot, &snapshot);				// Update token status
+
+	memcpy(pInfo, &snapshot.slotInfo, sizeof(CK_SLOT_INFO));
 
 	FUNC_RETURNS(CKR_OK);
 }
@@ -168,7 +170,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetTokenInfo)(
 {
 	int rv;
 	struct p11Slot_t *slot;
-	struct p11Token_t *token;
+	struct p11SlotSnapshot_t snapshot;
 
 	FUNC_CALLED();
 
@@ -186,13 +188,13 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetTokenInfo)(
 		FUNC_RETURNS(rv);
 	}
 
-	rv = getValidatedToken(slot, &token);
+	rv = getSlotSnapshot(slot, &snapshot);
 
 	if (rv != CKR_OK) {
 		FUNC_RETURNS(rv);
 	}
 
-	memcpy(pInfo, &token->info, sizeof(CK_TOKEN_INFO));
+	memcpy(pInfo, &snapshot.tokenInfo, sizeof(CK_TOKEN_INFO));
 
 	FUNC_RETURNS(CKR_OK);
 }
@@ -228,7 +230,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetMechanismList)(
 {
 	int rv;
 	struct p11Slot_t *slot;
-	struct p11Token_t *token;
+	struct p11SlotSnapshot_t snapshot;
 
 	FUNC_CALLED();
 
@@ -250,13 +252,13 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetMechanismList)(
 		FUNC_RETURNS(rv);
 	}
 
-	rv = getValidatedToken(slot, &token);
+	rv = getSlotSnapshot(slot, &snapshot);
 
 	if (rv != CKR_OK) {
 		FUNC_RETURNS(rv);
 	}
 
-	FUNC_RETURNS(token->drv->getMechanismList(pMechanismList, pulCount));
+	FUNC_RETURNS(snapshot.drv->getMechanismList(pMechanismList, pulCount));
 }
 
 
@@ -271,7 +273,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetMechanismInfo)(
 {
 	CK_RV rv = CKR_OK;
 	struct p11Slot_t *slot;
-	struct p11Token_t *token;
+	struct p11SlotSnapshot_t snapshot;
 
 	FUNC_CALLED();
 
@@ -289,13 +291,13 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetMechanismInfo)(
 		FUNC_RETURNS(rv);
 	}
 
-	rv = getValidatedToken(slot, &token);
+	rv = getSlotSnapshot(slot, &snapshot);
 
 	if (rv != CKR_OK) {
 		FUNC_RETURNS(rv);
 	}
 
-	FUNC_RETURNS(token->drv->getMechanismInfo(type, pInfo));
+	FUNC_RETURNS(snapshot.drv->getMechanismInfo(type, pInfo));
 }
 
 
@@ -383,6 +385,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_InitPIN)(
 
 	rv = initPIN(slot, pPin, ulPinLen);
 
+	invalidateSlotSnapshot(slot);
+
 	FUNC_RETURNS(rv);
 }
 
@@ -437,5 +441,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_SetPIN)(
 
 	rv = setPIN(slot, pOldPin, ulOldLen, pNewPin, ulNewLen);
 
+	invalidateSlotSnapshot(slot);
+
 	FUNC_RETURNS(rv);
 }
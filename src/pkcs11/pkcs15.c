@@ -50,15 +50,28 @@ static int decodeCommonObjectAttributes(unsigned char *coa, int coalen, struct p
 
 	po = coa;
 	tag = asn1Tag(&po);
+	len = asn1Length(&po);
 
 	if (tag == ASN1_UTF8String) {
-		len = asn1Length(&po);
 		label = calloc(len + 1, 1);
 		if (label == NULL) {
 			return -1;
 		}
 		memcpy(label, po, len);
 		p15->label = label;
+
+		po += len;
+
+		if ((po - coa) >= coalen) {
+			return 0;
+		}
+
+		tag = asn1Tag(&po);
+		len = asn1Length(&po);
+	}
+
+	if ((tag == ASN1_BIT_STRING) && (len > 1)) {
+		asn1DecodeFlags(po + 1, len - 1, &p15->flags);
 	}
 
 	return 0;
@@ -397,6 +410,268 @@ int decodeCertificateDescription(unsigned char *cd, size_t cdlen, struct p15Cert
 
 
 
+static int decodeCommonDataObjectAttributes(unsigned char *cdoa, int cdoalen, struct p15DataObjectDescription *p15)
+{
+	int tag,len;
+	unsigned char *po, *obj;
+
+	if (cdoalen <= 0)
+		return 0;
+
+	po = cdoa;
+
+	while ((po - cdoa) < cdoalen) {
+		obj = po;
+		tag = asn1Tag(&po);
+		len = asn1Length(&po);
+
+		if (tag == ASN1_UTF8String) {
+			p15->applicationName = calloc(len + 1, 1);
+			if (p15->applicationName == NULL) {
+				return -1;
+			}
+			memcpy(p15->applicationName, po, len);
+		} else if (tag == ASN1_OBJECT_IDENTIFIER) {
+			// Keep the full TLV, as CKA_OBJECT_ID contains the DER encoding
+			p15->applicationOID.len = po + len - obj;
+			p15->applicationOID.val = calloc(p15->applicationOID.len, 1);
+			if (p15->applicationOID.val == NULL) {
+				return -1;
+			}
+			memcpy(p15->applicationOID.val, obj, p15->applicationOID.len);
+		}
+
+		po += len;
+	}
+
+	return 0;
+}
+
+
+
+static int decodeDataObjectAttributes(unsigned char *dod, int dodlen, struct p15DataObjectDescription *p15)
+{
+	int rc,tag,len;
+	unsigned char *po, *obj;
+
+	if (dodlen <= 0) {				// Nothing to decode
+		return 0;
+	}
+
+	po = obj = dod;
+
+	tag = asn1Tag(&po);
+	if (tag != ASN1_SEQUENCE) {
+		return -1;
+	}
+
+	len = asn1Length(&po);
+
+	rc = decodeCommonObjectAttributes(po, len, &p15->coa);
+	if (rc < 0) {
+		return rc;
+	}
+
+	po += len;
+
+	if ((po - dod) >= dodlen) {
+		return 0;
+	}
+
+	obj = po;
+	tag = asn1Tag(&po);
+	if (tag != ASN1_SEQUENCE) {
+		return -1;
+	}
+
+	len = asn1Length(&po);
+
+	rc = decodeCommonDataObjectAttributes(po, len, p15);
+	if (rc < 0) {
+		return rc;
+	}
+
+	po += len;
+
+	if ((po - dod) >= dodlen) {
+		return 0;
+	}
+
+	obj = po;
+	tag = asn1Tag(&po);
+	len = asn1Length(&po);
+
+	if (tag == 0xA0) {				// Skip subClassAttributes
+		po += len;
+
+		if ((po - dod) >= dodlen) {
+			return 0;
+		}
+
+		obj = po;
+		tag = asn1Tag(&po);
+		len = asn1Length(&po);
+	}
+
+	if (tag != 0xA1) {
+		return -1;
+	}
+
+	// typeAttributes contain the path to the EF holding the value
+	obj = asn1Find(obj, (unsigned char *)"\xA1\x30\x04", 3);
+
+	if (obj != NULL) {
+		po = obj;
+		asn1Tag(&po);
+		len = asn1Length(&po);
+
+		p15->efidOrPath.val = calloc(len, 1);
+		if (p15->efidOrPath.val == NULL) {
+			return -1;
+		}
+		memcpy(p15->efidOrPath.val, po, len);
+		p15->efidOrPath.len = len;
+	}
+
+	return 0;
+}
+
+
+
+/**
+ * Decode a TLV encoded PKCS#15 data object description into a structure
+ *
+ * The caller must use freeDataObjectDescription() to free the allocated structure
+ *
+ * @param dod       The first byte of the encoded structure
+ * @param dodlen    The length of the encoded structure
+ * @param p15       Pointer to pointer updated with the newly allocated structure
+ * @return          0 if successful, -1 for structural errors
+ */
+int decodeDataObjectDescription(unsigned char *dod, size_t dodlen, struct p15DataObjectDescription **p15)
+{
+	int rc,tag,len;
+	unsigned char *po;
+
+	rc = asn1Validate(dod, dodlen);
+
+	if (rc != 0) {
+		return -1;
+	}
+
+	*p15 = calloc(1, sizeof(struct p15DataObjectDescription));
+	if (*p15 == NULL) {
+		return -1;
+	}
+
+	po = dod;
+
+	tag = asn1Tag(&po);
+	len = asn1Length(&po);
+
+	if (tag != ASN1_SEQUENCE) {		// Only opaqueDO is supported
+		return -1;
+	}
+
+	rc = decodeDataObjectAttributes(po, len, *p15);
+
+	return rc;
+}
+
+
+
+/**
+ * Encode a PKCS#15 data object description as opaqueDO with a path reference
+ *
+ * @param p15       The data object description
+ * @param dod       The buffer receiving the encoded structure
+ * @param dodlen    The size of the buffer
+ * @return          The length of the encoding or -1 if the buffer is too small
+ */
+int encodeDataObjectDescription(struct p15DataObjectDescription *p15, unsigned char *dod, size_t dodlen)
+{
+	unsigned char *po, *obj, flags;
+	int len, labellen, namelen;
+
+	labellen = p15->coa.label ? strlen(p15->coa.label) : 0;
+	namelen = p15->applicationName ? strlen(p15->applicationName) : 0;
+
+	// Content plus a maximum of 4 bytes for tag and length of each of the 10 TLVs
+	if (labellen + namelen + p15->applicationOID.len + p15->efidOrPath.len + 2 + 1 + 40 > dodlen) {
+		return -1;
+	}
+
+	po = dod;
+
+	// CommonObjectAttributes
+	obj = po;
+	if (labellen) {
+		asn1StoreTag(&po, ASN1_UTF8String);
+		asn1StoreLength(&po, labellen);
+		memcpy(po, p15->coa.label, labellen);
+		po += labellen;
+	}
+
+	flags = (unsigned char)(p15->coa.flags >> 24);
+	asn1StoreTag(&po, ASN1_BIT_STRING);
+	if (flags & 0x40) {
+		asn1StoreLength(&po, 2);
+		*po++ = 6;
+		*po++ = flags & 0xC0;
+	} else if (flags & 0x80) {
+		asn1StoreLength(&po, 2);
+		*po++ = 7;
+		*po++ = 0x80;
+	} else {
+		asn1StoreLength(&po, 1);
+		*po++ = 0;
+	}
+
+	if (p15->coa.flags & P15_PRIVATE) {
+		// authId of the user PIN
+		asn1StoreTag(&po, ASN1_OCTET_STRING);
+		asn1StoreLength(&po, 1);
+		*po++ = 0x01;
+	}
+
+	len = asn1Encap(ASN1_SEQUENCE, obj, po - obj);
+	po = obj + len;
+
+	// CommonDataObjectAttributes
+	obj = po;
+	if (namelen) {
+		asn1StoreTag(&po, ASN1_UTF8String);
+		asn1StoreLength(&po, namelen);
+		memcpy(po, p15->applicationName, namelen);
+		po += namelen;
+	}
+
+	if (p15->applicationOID.len) {
+		memcpy(po, p15->applicationOID.val, p15->applicationOID.len);
+		po += p15->applicationOID.len;
+	}
+
+	len = asn1Encap(ASN1_SEQUENCE, obj, po - obj);
+	po = obj + len;
+
+	// typeAttributes with Path
+	obj = po;
+	asn1StoreTag(&po, ASN1_OCTET_STRING);
+	asn1StoreLength(&po, p15->efidOrPath.len);
+	memcpy(po, p15->efidOrPath.val, p15->efidOrPath.len);
+	po += p15->efidOrPath.len;
+
+	len = asn1Encap(ASN1_SEQUENCE, obj, po - obj);
+	len = asn1Encap(0xA1, obj, len);
+	po = obj + len;
+
+	len = asn1Encap(ASN1_SEQUENCE, dod, po - dod);
+
+	return len;
+}
+
+
+
 static void freeCommonObjectAttributes(struct p15CommonObjectAttributes *coa)
 {
 	if (coa->label != NULL) {
@@ -446,3 +721,28 @@ void freeCertificatePrivateKeyDescription(struct p15CertificateDescription **p15
 	}
 	*p15 = NULL;
 }
+
+
+
+/**
+ * Free structure allocated in decodeDataObjectDescription()
+ *
+ * @param p15       Pointer to pointer to structure. Pointer is cleared with NULL
+ */
+void freeDataObjectDescription(struct p15DataObjectDescription **p15)
+{
+	if (*p15 != NULL) {
+		freeCommonObjectAttributes(&(*p15)->coa);
+		if ((*p15)->applicationName) {
+			free((*p15)->applicationName);
+		}
+		if ((*p15)->applicationOID.val) {
+			free((*p15)->applicationOID.val);
+		}
+		if ((*p15)->efidOrPath.val) {
+			free((*p15)->efidOrPath.val);
+		}
+		free(*p15);
+	}
+	*p15 = NULL;
+}
@@ -58,6 +58,9 @@ extern "C" {
 #define P15_DERIVE          0x00800000
 #define P15_NONREPUDIATION  0x00400000
 
+#define P15_PRIVATE         0x80000000
+#define P15_MODIFIABLE      0x40000000
+
 
 
 /**
@@ -65,6 +68,7 @@ extern "C" {
  */
 struct p15CommonObjectAttributes {
 	char            *label;             /**< The label        */
+	unsigned long   flags;              /**< CommonObjectFlags */
 };
 
 
@@ -107,10 +111,27 @@ struct p15CertificateDescription {
 };
 
 
+/**
+ * Data object description as defined by PKCS#15
+ */
+struct p15DataObjectDescription {
+	struct p15CommonObjectAttributes
+	                coa;                /**< CommonObjectAttributes               */
+	char            *applicationName;   /**< The application name or NULL         */
+	struct bytestring_s
+	                applicationOID;     /**< The DER encoded application OID      */
+	struct bytestring_s
+	                efidOrPath;         /**< The EF identifier or full path       */
+};
+
+
 int decodePrivateKeyDescription(unsigned char *prkd, size_t prkdlen, struct p15PrivateKeyDescription **p15);
 int decodeCertificateDescription(unsigned char *cd, size_t cdlen, struct p15CertificateDescription **p15);
+int decodeDataObjectDescription(unsigned char *dod, size_t dodlen, struct p15DataObjectDescription **p15);
+int encodeDataObjectDescription(struct p15DataObjectDescription *p15, unsigned char *dod, size_t dodlen);
 void freePrivateKeyDescription(struct p15PrivateKeyDescription **p15);
 void freeCertificatePrivateKeyDescription(struct p15CertificateDescription **p15);
+void freeDataObjectDescription(struct p15DataObjectDescription **p15);
 
 /* Support for C++ compiler ----------------------------------------------- */
 
@@ -0,0 +1,766 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    sc-hsm-brokerd.c
+ * @brief   Token broker serving multiple processes through a Unix domain socket
+ *
+ * The broker owns the card readers and keeps token objects and the login state
+ * for all processes on the host. Processes use the PKCS#11 module in client mode
+ * (PKCS11_BROKER_SOCKET set), which forwards sign, decrypt and object requests
+ * to the broker.
+ *
+ * Requests are served in a single thread. Each round serves at most one request
+ * per connected client, so that a busy process can not starve the others.
+ *
+ * Every client must authenticate with the PIN before it can use private keys,
+ * even if the token is already logged in. Keys with CKA_ALWAYS_AUTHENTICATE also
+ * require a context specific login by the same client before each operation. The
+ * token is logged out when the last authenticated client logs out or disconnects.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <pkcs11/p11generic.h>
+#include <pkcs11/slot.h>
+#include <pkcs11/slotpool.h>
+#include <pkcs11/token.h>
+#include <pkcs11/object.h>
+#include <pkcs11/broker.h>
+
+#define MAX_CLIENTS			64
+#define CLIENT_TIMEOUT		5		/* Seconds to wait for the remainder of a request */
+
+extern struct p11Context_t *context;
+
+/**
+ * State of a connected client process
+ */
+struct brokerClient {
+	int fd;                                        /**< Connection or -1 if unused           */
+	struct p11Token_t *login[BROKER_MAX_SLOTS];    /**< Token the client authenticated with  */
+	struct p11Token_t *contextLogin[BROKER_MAX_SLOTS]; /**< Token with PIN verified for the next operation */
+};
+
+static struct brokerClient clients[MAX_CLIENTS];
+static struct p11Token_t *loginToken[BROKER_MAX_SLOTS];   /**< Token logged in by the broker     */
+static int loginCount[BROKER_MAX_SLOTS];                  /**< Number of authenticated clients   */
+
+static volatile sig_atomic_t terminate = 0;
+
+
+
+static void onSignal(int sig)
+{
+	terminate = 1;
+}
+
+
+
+/**
+ * Find the slot and the token in it
+ *
+ * @param id        the slot id
+ * @param slot      the slot
+ * @param token     the token in the slot
+ * @return          CKR_OK, CKR_SLOT_ID_INVALID, CKR_TOKEN_NOT_PRESENT or any other Cryptoki error code
+ */
+static int getSlotAndToken(CK_SLOT_ID id, struct p11Slot_t **slot, struct p11Token_t **token)
+{
+	int rc;
+
+	if (id >= BROKER_MAX_SLOTS) {
+		return CKR_SLOT_ID_INVALID;
+	}
+
+	rc = findSlot(&context->slotPool, id, slot);
+
+	if (rc != CKR_OK) {
+		return rc;
+	}
+
+	rc = getValidatedToken(*slot, token);
+
+	if (rc == CKR_DEVICE_REMOVED) {
+		rc = CKR_TOKEN_NOT_PRESENT;
+	}
+
+	// Authentication state ends with the token
+	if ((rc != CKR_OK) || (loginToken[id] != *token)) {
+		loginToken[id] = NULL;
+		loginCount[id] = 0;
+	}
+
+	return rc;
+}
+
+
+
+static int isLoggedIn(struct brokerClient *client, CK_SLOT_ID id, struct p11Token_t *token)
+{
+	return (client->login[id] == token) && (loginToken[id] == token) && (token->user == CKU_USER);
+}
+
+
+
+static int isAttributeTrue(struct p11Object_t *object, CK_ATTRIBUTE_TYPE type)
+{
+	struct p11Attribute_t *attr;
+
+	attr = lookupAttribute(object, type);
+
+	return (attr != NULL) && (attr->attrData.ulValueLen == sizeof(CK_BBOOL)) && (*(CK_BBOOL *)attr->attrData.pValue == CK_TRUE);
+}
+
+
+
+static int isPrivateKey(struct p11Object_t *object)
+{
+	struct p11Attribute_t *attr;
+
+	attr = lookupAttribute(object, CKA_CLASS);
+
+	return (attr != NULL) && (attr->attrData.ulValueLen == sizeof(CK_OBJECT_CLASS)) && (*(CK_OBJECT_CLASS *)attr->attrData.pValue == CKO_PRIVATE_KEY);
+}
+
+
+
+/**
+ * Drop the authentication of the client and log out the token with the last client
+ */
+static void releaseLogin(struct brokerClient *client, CK_SLOT_ID id)
+{
+	struct p11Slot_t *slot;
+	struct p11Token_t *token;
+
+	client->contextLogin[id] = NULL;
+
+	if (client->login[id] == NULL) {
+		return;
+	}
+
+	if ((getSlotAndToken(id, &slot, &token) == CKR_OK) && (client->login[id] == token)) {
+		if (--loginCount[id] == 0) {
+			lockSlot(slot);
+			logOut(slot);
+			unlockSlot(slot);
+			loginToken[id] = NULL;
+			syslog(LOG_INFO, "Slot %lu logged out", (unsigned long)id);
+		}
+	}
+
+	client->login[id] = NULL;
+}
+
+
+
+static int handleGetSlots(struct brokerClient *client, struct brokerMessage *req, struct brokerMessage *rsp)
+{
+	struct p11Slot_t *slot;
+	CK_ULONG cnt;
+	int rc;
+
+	rc = C_GetSlotList(FALSE, NULL, &cnt);
+
+	if (rc != CKR_OK) {
+		return rc;
+	}
+
+	cnt = 0;
+	for (slot = context->slotPool.list; slot; slot = slot->next) {
+		if (slot->id < BROKER_MAX_SLOTS) {
+			cnt++;
+		}
+	}
+
+	brokerPutInt(rsp, cnt);
+
+	for (slot = context->slotPool.list; slot; slot = slot->next) {
+		if (slot->id < BROKER_MAX_SLOTS) {
+			brokerPutInt(rsp, slot->id);
+			brokerPutSlotInfo(rsp, &slot->info);
+		}
+	}
+
+	return CKR_OK;
+}
+
+
+
+static int handleGetToken(struct brokerClient *client, struct brokerMessage *req, struct brokerMessage *rsp)
+{
+	struct p11Slot_t *slot;
+	struct p11Token_t *token;
+	int rc;
+
+	rc = getSlotAndToken(brokerGetInt(req), &slot, &token);
+
+	if (rc != CKR_OK) {
+		return rc;
+	}
+
+	brokerPutTokenInfo(rsp, &token->info);
+	brokerPutBytes(rsp, (unsigned char *)token->drv->name, strlen(token->drv->name));
+
+	return CKR_OK;
+}
+
+
+
+static int handleGetObjects(struct brokerClient *client, struct brokerMessage *req, struct brokerMessage *rsp)
+{
+	struct p11Slot_t *slot;
+	struct p11Token_t *token;
+	struct p11Object_t *object;
+	CK_SLOT_ID id;
+	int rc, private;
+
+	id = brokerGetInt(req);
+	private = brokerGetByte(req);
+
+	rc = getSlotAndToken(id, &slot, &token);
+
+	if (rc != CKR_OK) {
+		return rc;
+	}
+
+	// Pick up changes made by other applications
+	rc = refreshTokenObjects(slot, token);
+
+	if (rc != CKR_OK) {
+		return rc;
+	}
+
+	if (private) {
+		if (!isLoggedIn(client, id, token)) {
+			return CKR_USER_NOT_LOGGED_IN;
+		}
+		brokerPutInt(rsp, token->numberOfPrivateTokenObjects);
+		object = token->tokenPrivObjList;
+	} else {
+		brokerPutInt(rsp, token->numberOfTokenObjects);
+		object = token->tokenObjList;
+	}
+
+	for (; object; object = object->next) {
+		brokerPutObject(rsp, object);
+	}
+
+	return CKR_OK;
+}
+
+
+
+static int handleLogin(struct brokerClient *client, struct brokerMessage *req, struct brokerMessage *rsp)
+{
+	struct p11Slot_t *slot;
+	struct p11Token_t *token;
+	CK_SLOT_ID id;
+	CK_USER_TYPE userType;
+	unsigned char *pin;
+	size_t pinlen;
+	int rc;
+
+	id = brokerGetInt(req);
+	userType = brokerGetInt(req);
+	pinlen = brokerGetBytes(req, &pin);
+
+	if (req->error) {
+		return CKR_ARGUMENTS_BAD;
+	}
+
+	// SO functions are not available through the broker
+	if ((userType != CKU_USER) && (userType != CKU_CONTEXT_SPECIFIC)) {
+		return CKR_USER_TYPE_INVALID;
+	}
+
+	rc = getSlotAndToken(id, &slot, &token);
+
+	if (rc != CKR_OK) {
+		return rc;
+	}
+
+	if (!(token->info.flags & CKF_USER_PIN_INITIALIZED)) {
+		return CKR_USER_PIN_NOT_INITIALIZED;
+	}
+
+	if (userType == CKU_CONTEXT_SPECIFIC) {
+		client->contextLogin[id] = NULL;
+	}
+
+	// The PIN is verified for every client, even if the token is already logged in
+	rc = lockSlot(slot);
+
+	if (rc != CKR_OK) {
+		return rc;
+	}
+
+	rc = logIn(slot, userType, pinlen ? pin : NULL, pinlen);
+	unlockSlot(slot);
+
+	if (rc != CKR_OK) {
+		return rc;
+	}
+
+	// Valid only for the next operation of this client
+	if (userType == CKU_CONTEXT_SPECIFIC) {
+		client->contextLogin[id] = token;
+	}
+
+	if ((userType == CKU_USER) && (client->login[id] != token)) {
+		token->user = CKU_USER;
+		loginToken[id] = token;
+		client->login[id] = token;
+		loginCount[id]++;
+	}
+
+	return CKR_OK;
+}
+
+
+
+static int handleLogout(struct brokerClient *client, struct brokerMessage *req, struct brokerMessage *rsp)
+{
+	CK_SLOT_ID id;
+
+	id = brokerGetInt(req);
+
+	if (id >= BROKER_MAX_SLOTS) {
+		return CKR_SLOT_ID_INVALID;
+	}
+
+	releaseLogin(client, id);
+
+	return CKR_OK;
+}
+
+
+
+static int handleCrypt(struct brokerClient *client, int opcode, struct brokerMessage *req, struct brokerMessage *rsp)
+{
+	struct p11Slot_t *slot;
+	struct p11Token_t *token;
+	struct p11Object_t *object;
+	CK_MECHANISM mech;
+	CK_SLOT_ID id;
+	CK_OBJECT_HANDLE handle;
+	CK_ULONG outlen;
+	unsigned char *in, out[4096];
+	size_t inlen;
+	int rc, contextLogin;
+
+	id = brokerGetInt(req);
+	handle = brokerGetInt(req);
+	mech.mechanism = brokerGetInt(req);
+	// Mechanism parameters are not part of the protocol, clients reject them up front
+	mech.pParameter = NULL;
+	mech.ulParameterLen = 0;
+	outlen = brokerGetInt(req);
+	inlen = brokerGetBytes(req, &in);
+
+	if (req->error) {
+		return CKR_ARGUMENTS_BAD;
+	}
+
+	if (outlen > sizeof(out)) {
+		outlen = sizeof(out);
+	}
+
+	rc = getSlotAndToken(id, &slot, &token);
+
+	if (rc != CKR_OK) {
+		return rc;
+	}
+
+	// A context specific login is consumed by the next operation, even if that fails
+	contextLogin = (client->contextLogin[id] == token);
+	client->contextLogin[id] = NULL;
+
+	// Private keys only for authenticated clients. Keys with CKA_ALWAYS_AUTHENTICATE are public.
+	rc = CKR_KEY_HANDLE_INVALID;
+	if (isLoggedIn(client, id, token)) {
+		rc = findSlotObject(slot, handle, &object, FALSE);
+	}
+	if (rc != CKR_OK) {
+		rc = findSlotObject(slot, handle, &object, TRUE);
+	}
+	if (rc != CKR_OK) {
+		return CKR_KEY_HANDLE_INVALID;
+	}
+
+	// The PIN verified by another client must not authorize the operation
+	if (isAttributeTrue(object, CKA_ALWAYS_AUTHENTICATE)) {
+		if (!contextLogin) {
+			return CKR_USER_NOT_LOGGED_IN;
+		}
+	} else if (isPrivateKey(object) && !isLoggedIn(client, id, token)) {
+		return CKR_USER_NOT_LOGGED_IN;
+	}
+
+	if (opcode == BRK_SIGN) {
+		if ((object->C_SignInit == NULL) || (object->C_Sign == NULL)) {
+			return CKR_FUNCTION_NOT_SUPPORTED;
+		}
+		rc = object->C_SignInit(object, &mech);
+	} else {
+		if ((object->C_DecryptInit == NULL) || (object->C_Decrypt == NULL)) {
+			return CKR_FUNCTION_NOT_SUPPORTED;
+		}
+		rc = object->C_DecryptInit(object, &mech);
+	}
+
+	if (rc != CKR_OK) {
+		return rc;
+	}
+
+	rc = lockSlot(slot);
+
+	if (rc != CKR_OK) {
+		return rc;
+	}
+
+	if (opcode == BRK_SIGN) {
+		rc = object->C_Sign(object, mech.mechanism, in, inlen, outlen ? out : NULL, &outlen);
+	} else {
+		rc = object->C_Decrypt(object, mech.mechanism, in, inlen, outlen ? out : NULL, &outlen);
+	}
+
+	unlockSlot(slot);
+
+	if ((rc == CKR_OK) || (rc == CKR_BUFFER_TOO_SMALL)) {
+		brokerPutInt(rsp, outlen);
+		brokerPutBytes(rsp, out, ((rc == CKR_OK) && (outlen <= sizeof(out))) ? outlen : 0);
+	}
+
+	return rc;
+}
+
+
+
+/**
+ * Process a single request from the client
+ *
+ * @param client    the client
+ * @return          0 or -1 if the connection shall be closed
+ */
+static int serveClient(struct brokerClient *client)
+{
+	struct brokerMessage req, rsp;
+	unsigned char opcode;
+	int rc;
+
+	brokerInitMessage(&req);
+	brokerInitMessage(&rsp);
+
+	if (brokerReceiveMessage(client->fd, &req) < 0) {
+		brokerFreeMessage(&req);
+		return -1;
+	}
+
+	brokerPutInt(&rsp, 0);			// Placeholder for the return code
+
+	opcode = brokerGetByte(&req);
+
+	switch(opcode) {
+	case BRK_GET_SLOTS:
+		rc = handleGetSlots(client, &req, &rsp);
+		break;
+	case BRK_GET_TOKEN:
+		rc = handleGetToken(client, &req, &rsp);
+		break;
+	case BRK_GET_OBJECTS:
+		rc = handleGetObjects(client, &req, &rsp);
+		break;
+	case BRK_LOGIN:
+		rc = handleLogin(client, &req, &rsp);
+		break;
+	case BRK_LOGOUT:
+		rc = handleLogout(client, &req, &rsp);
+		break;
+	case BRK_SIGN:
+	case BRK_DECRYPT:
+		rc = handleCrypt(client, opcode, &req, &rsp);
+		break;
+	default:
+		rc = CKR_FUNCTION_NOT_SUPPORTED;
+	}
+
+	// Don't keep PIN or plain text in memory longer than required
+	if (req.val) {
+		memset(req.val, 0, req.size);
+	}
+	brokerFreeMessage(&req);
+
+	if (rsp.error) {
+		brokerFreeMessage(&rsp);
+		return -1;
+	}
+
+	if ((rc != CKR_OK) && (rc != CKR_BUFFER_TOO_SMALL)) {
+		rsp.len = 4;
+	}
+
+	rsp.val[0] = (unsigned char)(rc >> 24);
+	rsp.val[1] = (unsigned char)(rc >> 16);
+	rsp.val[2] = (unsigned char)(rc >> 8);
+	rsp.val[3] = (unsigned char)rc;
+
+	rc = brokerSendMessage(client->fd, &rsp);
+
+	brokerFreeMessage(&rsp);
+	return rc;
+}
+
+
+
+static void closeClient(struct brokerClient *client)
+{
+	int i;
+
+	for (i = 0; i < BROKER_MAX_SLOTS; i++) {
+		releaseLogin(client, i);
+	}
+
+	close(client->fd);
+	client->fd = -1;
+}
+
+
+
+static void acceptClient(int lfd)
+{
+	struct timeval tv;
+	int fd, i;
+
+	fd = accept(lfd, NULL, NULL);
+
+	if (fd < 0) {
+		return;
+	}
+
+	for (i = 0; (i < MAX_CLIENTS) && (clients[i].fd >= 0); i++);
+
+	if (i == MAX_CLIENTS) {
+		syslog(LOG_WARNING, "Too many clients, connection refused");
+		close(fd);
+		return;
+	}
+
+	// Don't let a stalled client block all others
+	tv.tv_sec = CLIENT_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	memset(&clients[i], 0, sizeof(clients[i]));
+	clients[i].fd = fd;
+}
+
+
+
+static int openSocket(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		syslog(LOG_ERR, "Socket path %s too long", path);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (fd < 0) {
+		syslog(LOG_ERR, "socket() failed: %s", strerror(errno));
+		return -1;
+	}
+
+	unlink(path);
+
+	if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) || (listen(fd, 16) < 0)) {
+		syslog(LOG_ERR, "Could not listen on %s: %s", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	// Access to the socket is controlled by the group of the broker
+	chmod(path, 0660);
+
+	return fd;
+}
+
+
+
+static void usage()
+{
+	fprintf(stderr, "Usage: sc-hsm-brokerd [-d] [-s socket]\n");
+	fprintf(stderr, "  -d         detach and run in the background\n");
+	fprintf(stderr, "  -s socket  path of socket (default %s)\n", BROKER_SOCKET_DEFAULT);
+}
+
+
+
+int main(int argc, char *argv[])
+{
+	struct pollfd pfd[MAX_CLIENTS + 1];
+	struct brokerClient *map[MAX_CLIENTS + 1];
+	struct p11Slot_t *slot;
+	struct p11Token_t *token;
+	const char *path = BROKER_SOCKET_DEFAULT;
+	int lfd, detach = 0, i, n, start, rc;
+	CK_ULONG cnt;
+
+	while ((rc = getopt(argc, argv, "ds:")) != -1) {
+		switch(rc) {
+		case 'd':
+			detach = 1;
+			break;
+		case 's':
+			path = optarg;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	openlog("sc-hsm-brokerd", LOG_PID | (detach ? 0 : LOG_PERROR), LOG_DAEMON);
+
+	// The broker itself must access the readers
+	unsetenv("PKCS11_BROKER_SOCKET");
+
+	rc = C_Initialize(NULL);
+
+	if (rc != CKR_OK) {
+		syslog(LOG_ERR, "C_Initialize failed with 0x%lx", (unsigned long)rc);
+		return 1;
+	}
+
+	// Load all tokens and objects once at startup
+	C_GetSlotList(FALSE, NULL, &cnt);
+	for (slot = context->slotPool.list; slot; slot = slot->next) {
+		getValidatedToken(slot, &token);
+	}
+
+	lfd = openSocket(path);
+
+	if (lfd < 0) {
+		C_Finalize(NULL);
+		return 1;
+	}
+
+	if (detach && (daemon(0, 0) < 0)) {
+		syslog(LOG_ERR, "daemon() failed: %s", strerror(errno));
+		close(lfd);
+		C_Finalize(NULL);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		clients[i].fd = -1;
+	}
+
+	syslog(LOG_INFO, "Listening on %s with %lu slots", path, context->slotPool.numberOfSlots);
+
+	start = 0;
+	while (!terminate) {
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+		n = 1;
+
+		// Start with the client after the one served first in the previous round
+		for (i = 0; i < MAX_CLIENTS; i++) {
+			struct brokerClient *client = &clients[(start + i) % MAX_CLIENTS];
+			if (client->fd >= 0) {
+				pfd[n].fd = client->fd;
+				pfd[n].events = POLLIN;
+				map[n] = client;
+				n++;
+			}
+		}
+
+		rc = poll(pfd, n, -1);
+
+		if (rc < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			syslog(LOG_ERR, "poll() failed: %s", strerror(errno));
+			break;
+		}
+
+		// One request per client and round
+		for (i = 1; i < n; i++) {
+			if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+				if (serveClient(map[i]) < 0) {
+					closeClient(map[i]);
+				}
+			}
+		}
+
+		start = (start + 1) % MAX_CLIENTS;
+
+		if (pfd[0].revents & POLLIN) {
+			acceptClient(lfd);
+		}
+	}
+
+	syslog(LOG_INFO, "Terminating");
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (clients[i].fd >= 0) {
+			closeClient(&clients[i]);
+		}
+	}
+
+	close(lfd);
+	unlink(path);
+
+	C_Finalize(NULL);
+
+	return 0;
+}
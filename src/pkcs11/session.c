@@ -37,6 +37,7 @@
 
 #include <pkcs11/session.h>
 #include <pkcs11/slotpool.h>
+#include <pkcs11/slot.h>
 
 extern struct p11Context_t *context;
 
@@ -234,6 +235,50 @@ int removeSession(struct p11SessionPool_t *pool, CK_SESSION_HANDLE handle)
 
 
 
+/**
+ * Gain exclusive access to the slot for an operation in the session. If the session holds
+ * exclusive access since a context specific login, possibly obtained by a different
+ * thread, the calling thread takes it over and nests.
+ * Must be called without holding the context mutex.
+ *
+ * @param session    the session
+ * @param slot       the slot of the session
+ * @return           CKR_OK or any other Cryptoki error code
+ */
+int lockSessionSlot(struct p11Session_t *session, struct p11Slot_t *slot)
+{
+	if (session->slotLocked) {
+		claimSlotLock(slot);
+	}
+
+	return lockSlot(slot);
+}
+
+
+
+/**
+ * Release exclusive access to the slot, if held by the session since a context specific login.
+ * Must be called without holding the context mutex.
+ *
+ * @param session    the session
+ */
+void releaseSessionSlotLock(struct p11Session_t *session)
+{
+	struct p11Slot_t *slot;
+
+	if (!session->slotLocked) {
+		return;
+	}
+
+	session->slotLocked = FALSE;
+
+	if (findSlot(&context->slotPool, session->slotID, &slot) == CKR_OK) {
+		unlockSlot(slot);
+	}
+}
+
+
+
 /**
  * Close all sessions opened for a slot
  *
@@ -289,10 +334,24 @@ void tokenRemovedForSessionsOnSlot(struct p11SessionPool_t *pool, CK_SLOT_ID slo
  * @return One of the CK_STATE values
  */
 CK_STATE getSessionState(struct p11Session_t *session, struct p11Token_t *token)
+{
+	return getSessionStateForUser(session, token->user);
+}
+
+
+
+/**
+ * Return the session state for the user logged into the token
+ *
+ * @param session    the session
+ * @param user       the user logged into the token the session is bound to
+ * @return One of the CK_STATE values
+ */
+CK_STATE getSessionStateForUser(struct p11Session_t *session, CK_USER_TYPE user)
 {
 	CK_STATE state;
 
-	switch (token->user) {
+	switch (user) {
 	case CKU_USER:
 		state = (session->flags & CKF_RW_SESSION) ? CKS_RW_USER_FUNCTIONS : CKS_RO_USER_FUNCTIONS;
 		break;
@@ -325,6 +384,8 @@ void addSessionObject(struct p11Session_t *session, struct p11Object_t *object)
 	object->handle = session->freeSessionObjNumber++;
 	object->dirtyFlag = 0;
 
+	buildAttributeTable(object);
+
 	addObjectToList(&session->sessionObjList, object);
 
 	session->numberOfSessionObjects++;
@@ -62,6 +62,7 @@ struct p11Session_t {
 	CK_BYTE_PTR cryptoBuffer;           /**< Buffer storing intermediate results                */
 	CK_ULONG cryptoBufferSize;          /**< Current content of crypto buffer                   */
 	CK_ULONG cryptoBufferMax;           /**< Current size of crypto buffer                      */
+	int slotLocked;                     /**< Exclusive access held from a context specific login */
 
 	struct p11ObjectSearch_t searchObj; /**< Store the result of a search operation             */
 
@@ -82,9 +83,12 @@ void addSession(struct p11SessionPool_t *pool, struct p11Session_t *session);
 int findSessionByHandle(struct p11SessionPool_t *pool, CK_SESSION_HANDLE handle, struct p11Session_t **session);
 int findSessionBySlotID(struct p11SessionPool_t *pool, CK_SLOT_ID slotID, struct p11Session_t **session);
 int removeSession(struct p11SessionPool_t *pool, CK_SESSION_HANDLE handle);
+int lockSessionSlot(struct p11Session_t *session, struct p11Slot_t *slot);
+void releaseSessionSlotLock(struct p11Session_t *session);
 void closeSessionsForSlot(struct p11SessionPool_t *pool, CK_SLOT_ID slotID);
 void tokenRemovedForSessionsOnSlot(struct p11SessionPool_t *pool, CK_SLOT_ID slotID);
 CK_STATE getSessionState(struct p11Session_t *session, struct p11Token_t *token);
+CK_STATE getSessionStateForUser(struct p11Session_t *session, CK_USER_TYPE user);
 void addSessionObject(struct p11Session_t *session, struct p11Object_t *object);
 int findSessionObject(struct p11Session_t *session, CK_OBJECT_HANDLE handle, struct p11Object_t **object);
 int removeSessionObject(struct p11Session_t *session, CK_OBJECT_HANDLE handle);
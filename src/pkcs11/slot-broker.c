@@ -0,0 +1,755 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    slot-broker.c
+ * @brief   Slot implementation forwarding to sc-hsm-brokerd
+ *
+ * In client mode the module does not access card readers. Slots, token information
+ * and token objects are obtained from sc-hsm-brokerd, which owns the readers and
+ * keeps objects and login state for all processes on the host. Signature and
+ * decryption requests are forwarded to the broker.
+ *
+ * Client mode is enabled by setting PKCS11_BROKER_SOCKET to the path of the
+ * broker socket. An empty value selects the default path.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include <pkcs11/slot.h>
+#include <pkcs11/token.h>
+#include <pkcs11/slotpool.h>
+#include <pkcs11/object.h>
+#include <pkcs11/broker.h>
+#include <pkcs11/slot-broker.h>
+
+#ifdef DEBUG
+#include <pkcs11/debug.h>
+#endif
+
+#define MAX_BROKER_DRIVERS 8
+
+extern struct p11Context_t *context;
+
+static int brokerSocket = -1;
+static void *brokerMutex = NULL;
+
+
+
+/**
+ * Connect to the broker socket if not already connected
+ *
+ * @return          CKR_OK or CKR_DEVICE_ERROR if the broker is not available
+ */
+static int connectBroker()
+{
+#ifndef _WIN32
+	struct sockaddr_un addr;
+	char *path;
+	int fd;
+
+	FUNC_CALLED();
+
+	if (brokerSocket >= 0) {
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	path = getenv("PKCS11_BROKER_SOCKET");
+	if (!path || !*path) {
+		path = BROKER_SOCKET_DEFAULT;
+	}
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Broker socket path too long");
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (fd < 0) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not create socket");
+	}
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+#ifdef DEBUG
+		debug("Connecting to broker at %s failed: %s\n", path, strerror(errno));
+#endif
+		close(fd);
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not connect to sc-hsm-brokerd");
+	}
+
+#ifdef DEBUG
+	debug("Connected to broker at %s\n", path);
+#endif
+
+	brokerSocket = fd;
+	FUNC_RETURNS(CKR_OK);
+#else
+	FUNC_RETURNS(CKR_FUNCTION_NOT_SUPPORTED);
+#endif
+}
+
+
+
+/**
+ * Send request to broker and replace it with the response
+ *
+ * Requests from all threads share a single connection and are serialized.
+ *
+ * @param msg       the request, on return the response positioned behind the return code
+ * @return          the return code from the broker or CKR_DEVICE_ERROR if communication failed
+ */
+static int brokerTransact(struct brokerMessage *msg)
+{
+	int rc;
+
+	FUNC_CALLED();
+
+	p11LockMutex(brokerMutex);
+
+	rc = connectBroker();
+
+#ifndef _WIN32
+	if ((rc == CKR_OK) && ((brokerSendMessage(brokerSocket, msg) < 0) || (brokerReceiveMessage(brokerSocket, msg) < 0))) {
+		// Reconnect with the next request, e.g. after the broker was restarted
+		close(brokerSocket);
+		brokerSocket = -1;
+		rc = CKR_DEVICE_ERROR;
+	}
+#endif
+
+	p11UnlockMutex(brokerMutex);
+
+	if (rc != CKR_OK) {
+		FUNC_FAILS(rc, "Communication with sc-hsm-brokerd failed");
+	}
+
+	rc = brokerGetInt(msg);
+
+	if (msg->error) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Malformed response from sc-hsm-brokerd");
+	}
+
+	FUNC_RETURNS(rc);
+}
+
+
+
+/**
+ * Load public or private objects from broker into the token
+ *
+ * @param token     the token
+ * @param private   load private rather than public objects
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+static int loadBrokerObjects(struct p11Token_t *token, int private)
+{
+	struct brokerMessage msg;
+	struct p11Object_t *object;
+	CK_OBJECT_CLASS class;
+	CK_ATTRIBUTE template[] = { { CKA_CLASS, &class, sizeof(class) } };
+	struct p11Attribute_t *attr;
+	int rc, cnt;
+
+	FUNC_CALLED();
+
+	brokerInitMessage(&msg);
+	brokerPutByte(&msg, BRK_GET_OBJECTS);
+	brokerPutInt(&msg, token->slot->brokerSlotID);
+	brokerPutByte(&msg, private ? 1 : 0);
+
+	rc = brokerTransact(&msg);
+
+	if (rc != CKR_OK) {
+		brokerFreeMessage(&msg);
+		FUNC_FAILS(rc, "Loading objects failed");
+	}
+
+	cnt = brokerGetInt(&msg);
+
+	while ((cnt-- > 0) && (rc == CKR_OK)) {
+		rc = brokerGetObject(&msg, &object);
+
+		if (rc != CKR_OK) {
+			break;
+		}
+
+		if ((findAttribute(object, template, &attr) >= 0) && (*(CK_OBJECT_CLASS *)attr->attrData.pValue == CKO_PRIVATE_KEY)) {
+			object->C_SignInit = token->drv->C_SignInit;
+			object->C_Sign = token->drv->C_Sign;
+			object->C_DecryptInit = token->drv->C_DecryptInit;
+			object->C_Decrypt = token->drv->C_Decrypt;
+		}
+
+		addObject(token, object, !private);
+	}
+
+	brokerFreeMessage(&msg);
+
+	if (rc != CKR_OK) {
+		FUNC_FAILS(rc, "Decoding objects failed");
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+static void removeBrokerPrivateObjects(struct p11Token_t *token)
+{
+	removeAllObjectsFromList(&token->tokenPrivObjList);
+	token->numberOfPrivateTokenObjects = 0;
+	invalidateObjectIndex(token);
+}
+
+
+
+static int broker_login(struct p11Slot_t *slot, int userType, unsigned char *pin, int pinlen)
+{
+	struct brokerMessage msg;
+	int rc;
+
+	FUNC_CALLED();
+
+	brokerInitMessage(&msg);
+	brokerPutByte(&msg, BRK_LOGIN);
+	brokerPutInt(&msg, slot->brokerSlotID);
+	brokerPutInt(&msg, userType);
+	brokerPutBytes(&msg, pin, pin ? pinlen : 0);
+
+	rc = brokerTransact(&msg);
+
+	// Don't keep the PIN in memory longer than required
+	if (msg.val) {
+		memset(msg.val, 0, msg.size);
+	}
+	brokerFreeMessage(&msg);
+
+	if (rc != CKR_OK) {
+		FUNC_FAILS(rc, "Login at broker failed");
+	}
+
+	if (userType == CKU_USER) {
+		removeBrokerPrivateObjects(slot->token);
+		rc = loadBrokerObjects(slot->token, TRUE);
+	}
+
+	FUNC_RETURNS(rc);
+}
+
+
+
+static int broker_logout(struct p11Slot_t *slot)
+{
+	struct brokerMessage msg;
+	int rc;
+
+	FUNC_CALLED();
+
+	removeBrokerPrivateObjects(slot->token);
+
+	brokerInitMessage(&msg);
+	brokerPutByte(&msg, BRK_LOGOUT);
+	brokerPutInt(&msg, slot->brokerSlotID);
+
+	rc = brokerTransact(&msg);
+
+	brokerFreeMessage(&msg);
+
+	FUNC_RETURNS(rc);
+}
+
+
+
+/**
+ * Check the mechanism against the driver of the token at the broker
+ *
+ * Only the mechanism type is forwarded, so mechanisms with parameters are rejected
+ * rather than silently processed without them.
+ */
+static int checkMechanism(struct p11Object_t *pObject, CK_MECHANISM_PTR mech, CK_FLAGS usage)
+{
+	CK_MECHANISM_INFO info;
+	int rc;
+
+	if ((mech->pParameter != NULL) || (mech->ulParameterLen != 0)) {
+		return CKR_MECHANISM_PARAM_INVALID;
+	}
+
+	rc = pObject->token->drv->getMechanismInfo(mech->mechanism, &info);
+
+	if ((rc != CKR_OK) || !(info.flags & usage)) {
+		return CKR_MECHANISM_INVALID;
+	}
+
+	return CKR_OK;
+}
+
+
+
+/**
+ * Forward a signature or decryption request to the broker
+ */
+static int brokerCrypt(struct p11Object_t *pObject, unsigned char opcode, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pIn, CK_ULONG ulInLen, CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen)
+{
+	struct brokerMessage msg;
+	unsigned char *po;
+	CK_ULONG outlen;
+	size_t len;
+	int rc;
+
+	FUNC_CALLED();
+
+	brokerInitMessage(&msg);
+	brokerPutByte(&msg, opcode);
+	brokerPutInt(&msg, pObject->token->slot->brokerSlotID);
+	brokerPutInt(&msg, pObject->handle);
+	brokerPutInt(&msg, mech);
+	brokerPutInt(&msg, pOut ? *pulOutLen : 0);
+	brokerPutBytes(&msg, pIn, ulInLen);
+
+	rc = brokerTransact(&msg);
+
+	if ((rc == CKR_OK) || (rc == CKR_BUFFER_TOO_SMALL)) {
+		outlen = brokerGetInt(&msg);
+		len = brokerGetBytes(&msg, &po);
+
+		if (msg.error || (pOut && (len > *pulOutLen))) {
+			rc = CKR_DEVICE_ERROR;
+		} else {
+			if (pOut && len) {
+				memcpy(pOut, po, len);
+			}
+			*pulOutLen = outlen;
+		}
+	}
+
+	brokerFreeMessage(&msg);
+
+	FUNC_RETURNS(rc);
+}
+
+
+
+static int broker_C_SignInit(struct p11Object_t *pObject, CK_MECHANISM_PTR mech)
+{
+	FUNC_CALLED();
+
+	FUNC_RETURNS(checkMechanism(pObject, mech, CKF_SIGN));
+}
+
+
+
+static int broker_C_Sign(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+	FUNC_CALLED();
+
+	FUNC_RETURNS(brokerCrypt(pObject, BRK_SIGN, mech, pData, ulDataLen, pSignature, pulSignatureLen));
+}
+
+
+
+static int broker_C_DecryptInit(struct p11Object_t *pObject, CK_MECHANISM_PTR mech)
+{
+	FUNC_CALLED();
+
+	FUNC_RETURNS(checkMechanism(pObject, mech, CKF_DECRYPT));
+}
+
+
+
+static int broker_C_Decrypt(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+{
+	FUNC_CALLED();
+
+	FUNC_RETURNS(brokerCrypt(pObject, BRK_DECRYPT, mech, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen));
+}
+
+
+
+/**
+ * Return a driver for tokens at the broker. The driver reports the mechanisms of the
+ * driver used by the broker and forwards all card related functions to the broker.
+ *
+ * @param name      the name of the driver used by the broker
+ * @return          the driver or NULL if no such driver is known
+ */
+static struct p11TokenDriver *getBrokerTokenDriver(const char *name)
+{
+	static struct p11TokenDriver drivers[MAX_BROKER_DRIVERS];
+	static int numberOfDrivers = 0;
+	struct p11TokenDriver *base, *drv;
+	int i;
+
+	base = getTokenDriverByName(name);
+
+	if (base == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < numberOfDrivers; i++) {
+		if (drivers[i].name == base->name) {
+			return &drivers[i];
+		}
+	}
+
+	if (numberOfDrivers >= MAX_BROKER_DRIVERS) {
+		return NULL;
+	}
+
+	drv = &drivers[numberOfDrivers++];
+	*drv = *base;
+
+	drv->newToken = NULL;
+	drv->freeToken = NULL;
+	drv->login = broker_login;
+	drv->logout = broker_logout;
+	drv->initpin = NULL;
+	drv->setpin = NULL;
+	drv->synchronize = NULL;
+	drv->writeObject = NULL;
+	drv->deleteObject = NULL;
+	drv->checkObject = NULL;
+	drv->signBatch = NULL;
+	drv->C_DecryptInit = broker_C_DecryptInit;
+	drv->C_Decrypt = broker_C_Decrypt;
+	drv->C_DecryptUpdate = NULL;
+	drv->C_DecryptFinal = NULL;
+	drv->C_SignInit = broker_C_SignInit;
+	drv->C_Sign = broker_C_Sign;
+	drv->C_SignUpdate = NULL;
+	drv->C_SignFinal = NULL;
+
+	return drv;
+}
+
+
+
+/**
+ * Create token from the information provided by the broker and load public objects
+ *
+ * @param slot      the slot
+ * @param info      the token information
+ * @param name      the name of the driver used by the broker
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+static int newBrokerToken(struct p11Slot_t *slot, CK_TOKEN_INFO_PTR info, const char *name)
+{
+	struct p11Token_t *ptoken;
+	struct p11TokenDriver *drv;
+	int rc;
+
+	FUNC_CALLED();
+
+	drv = getBrokerTokenDriver(name);
+
+	if (drv == NULL) {
+		FUNC_FAILS(CKR_TOKEN_NOT_RECOGNIZED, "No driver for token at broker");
+	}
+
+	ptoken = (struct p11Token_t *)calloc(1, sizeof(struct p11Token_t));
+
+	if (ptoken == NULL) {
+		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+	}
+
+	ptoken->slot = slot;
+	ptoken->info = *info;
+	ptoken->freeObjectNumber = 1;
+	ptoken->user = INT_CKU_NO_USER;
+	ptoken->drv = drv;
+
+	rc = loadBrokerObjects(ptoken, FALSE);
+
+	if (rc != CKR_OK) {
+		removeAllObjectsFromList(&ptoken->tokenObjList);
+		free(ptoken);
+		FUNC_FAILS(rc, "Loading public objects failed");
+	}
+
+	rc = addToken(slot, ptoken);
+
+	if (rc != CKR_OK) {
+		freeToken(ptoken);
+		FUNC_FAILS(rc, "addToken() failed");
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Query the broker for the token in the slot, tracking insertion and removal
+ *
+ * @param slot      the slot
+ * @param token     the current token or NULL
+ * @return          CKR_OK, CKR_TOKEN_NOT_PRESENT, CKR_DEVICE_REMOVED or any other Cryptoki error code
+ */
+int getBrokerToken(struct p11Slot_t *slot, struct p11Token_t **token)
+{
+	struct brokerMessage msg;
+	CK_TOKEN_INFO info;
+	char name[64];
+	unsigned char *po;
+	size_t len;
+	int rc;
+
+	FUNC_CALLED();
+
+	*token = slot->token;
+
+	if (slot->closed) {
+		FUNC_RETURNS(CKR_TOKEN_NOT_PRESENT);
+	}
+
+	brokerInitMessage(&msg);
+	brokerPutByte(&msg, BRK_GET_TOKEN);
+	brokerPutInt(&msg, slot->brokerSlotID);
+
+	rc = brokerTransact(&msg);
+
+	if (rc == CKR_TOKEN_NOT_PRESENT) {
+		brokerFreeMessage(&msg);
+		if (slot->token) {
+			removeToken(slot);
+			*token = NULL;
+			FUNC_RETURNS(CKR_DEVICE_REMOVED);
+		}
+		FUNC_RETURNS(CKR_TOKEN_NOT_PRESENT);
+	}
+
+	if (rc != CKR_OK) {
+		brokerFreeMessage(&msg);
+		FUNC_FAILS(rc, "Querying token failed");
+	}
+
+	memset(&info, 0, sizeof(info));
+	brokerGetTokenInfo(&msg, &info);
+	len = brokerGetBytes(&msg, &po);
+
+	if (msg.error || (len >= sizeof(name))) {
+		brokerFreeMessage(&msg);
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Malformed token information");
+	}
+
+	memcpy(name, po, len);
+	name[len] = 0;
+	brokerFreeMessage(&msg);
+
+	if (slot->token) {
+		if (!memcmp(slot->token->info.serialNumber, info.serialNumber, sizeof(info.serialNumber)) &&
+			!memcmp(slot->token->info.label, info.label, sizeof(info.label))) {
+			// Same token, but PIN status may have changed
+			slot->token->info.flags = info.flags;
+			FUNC_RETURNS(CKR_OK);
+		}
+		removeToken(slot);
+	}
+
+	rc = newBrokerToken(slot, &info, name);
+
+	*token = slot->token;
+	FUNC_RETURNS(rc);
+}
+
+
+
+/**
+ * Create slots for all slots at the broker not yet known
+ *
+ * @param pool      the slot pool
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+int updateBrokerSlots(struct p11SlotPool_t *pool)
+{
+	struct brokerMessage msg;
+	struct p11Slot_t *slot;
+	CK_SLOT_INFO info;
+	CK_SLOT_ID id;
+	int rc, cnt;
+
+	FUNC_CALLED();
+
+	brokerInitMessage(&msg);
+	brokerPutByte(&msg, BRK_GET_SLOTS);
+
+	rc = brokerTransact(&msg);
+
+	if (rc != CKR_OK) {
+		brokerFreeMessage(&msg);
+		FUNC_FAILS(rc, "Querying slots failed");
+	}
+
+	cnt = brokerGetInt(&msg);
+
+	while (cnt-- > 0) {
+		id = brokerGetInt(&msg);
+		brokerGetSlotInfo(&msg, &info);
+
+		if (msg.error) {
+			brokerFreeMessage(&msg);
+			FUNC_FAILS(CKR_DEVICE_ERROR, "Malformed slot list");
+		}
+
+		for (slot = pool->list; slot && (slot->brokerSlotID != id); slot = slot->next);
+
+		if (slot) {
+			slot->closed = FALSE;
+			continue;
+		}
+
+		slot = (struct p11Slot_t *) calloc(1, sizeof(struct p11Slot_t));
+
+		if (slot == NULL) {
+			brokerFreeMessage(&msg);
+			FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+		}
+
+		slot->brokerSlotID = id;
+		slot->info = info;
+		slot->info.flags &= ~CKF_TOKEN_PRESENT;
+
+		addSlot(pool, slot);
+
+#ifdef DEBUG
+		debug("Added slot (%lu) for slot %lu at broker\n", slot->id, id);
+#endif
+	}
+
+	brokerFreeMessage(&msg);
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+int closeBrokerSlot(struct p11Slot_t *slot)
+{
+	FUNC_CALLED();
+
+	slot->closed = TRUE;
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Open a new connection to the broker in a child process after fork()
+ *
+ * The inherited connection is shared with the parent and the broker keeps the
+ * login state per connection, so the child starts unauthenticated.
+ */
+int reattachBrokerSlots(struct p11SlotPool_t *pool)
+{
+	struct p11Slot_t *slot;
+	int rc;
+
+	FUNC_CALLED();
+
+#ifndef _WIN32
+	if (brokerSocket >= 0) {
+		close(brokerSocket);
+		brokerSocket = -1;
+	}
+#endif
+
+	// The mutex may have been held by another thread of the parent while forking
+	rc = p11CreateMutex(&brokerMutex);
+
+	if (rc != CKR_OK) {
+		FUNC_FAILS(rc, "Could not create mutex");
+	}
+
+	for (slot = pool->list; slot; slot = slot->next) {
+		if (slot->token && (slot->token->user != INT_CKU_NO_USER)) {
+			removeBrokerPrivateObjects(slot->token);
+			slot->token->user = INT_CKU_NO_USER;
+		}
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Enable client mode
+ *
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+int initBrokerClient()
+{
+	int rc;
+
+	FUNC_CALLED();
+
+	rc = p11CreateMutex(&brokerMutex);
+
+	if (rc != CKR_OK) {
+		FUNC_FAILS(rc, "Could not create mutex");
+	}
+
+	context->brokerClient = TRUE;
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Close the connection to the broker
+ */
+void terminateBrokerClient()
+{
+#ifndef _WIN32
+	if (brokerSocket >= 0) {
+		close(brokerSocket);
+		brokerSocket = -1;
+	}
+#endif
+
+	p11DestroyMutex(brokerMutex);
+	brokerMutex = NULL;
+}
@@ -46,12 +46,14 @@
 #include <pkcs11/slotpool.h>
 #include <pkcs11/slot-pcsc.h>
 #include <pkcs11/strbpcpy.h>
+#include <pkcs11/apducache.h>
 
 #ifdef DEBUG
 #include <pkcs11/debug.h>
 #endif
 
 #ifndef _WIN32
+#include <pthread.h>
 #include <pcsclite.h>
 #endif
 
@@ -499,8 +501,10 @@ static int checkForNewPCSCToken(struct p11Slot_t *slot)
  */
 static int checkForRemovedPCSCToken(struct p11Slot_t *slot)
 {
+	struct p11Slot_t *pslot;
 	int rc;
 	LONG rv;
+	DWORD dwActiveProtocol;
 
 	FUNC_CALLED();
 
@@ -531,6 +535,7 @@ static int checkForRemovedPCSCToken(struct p11Slot_t *slot)
 #ifdef DEBUG
 		debug("SCardDisconnect (%i, %s): %s\n", slot->id, slot->readername, pcsc_error_to_string(rc));
 #endif
+		slot->transactionLock = 0;
 
 		// Check if a new token was inserted in the meantime
 		rc = checkForNewPCSCToken(slot);
@@ -538,6 +543,22 @@ static int checkForRemovedPCSCToken(struct p11Slot_t *slot)
 		if (rc == CKR_TOKEN_NOT_PRESENT) {
 			FUNC_RETURNS(CKR_DEVICE_REMOVED);
 		}
+	} else if (rv == SCARD_W_RESET_CARD) {
+		// Card was reset by another application. Reconnect and resynchronize instead of
+		// removing the token, so that sessions survive the reset. Virtual slots share
+		// the card handle with the primary slot
+		pslot = slot->primarySlot ? slot->primarySlot : slot;
+		rv = SCardReconnect(pslot->card, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, SCARD_LEAVE_CARD, &dwActiveProtocol);
+
+#ifdef DEBUG
+		debug("SCardReconnect (%i, %s): %s\n", slot->id, slot->readername, pcsc_error_to_string(rv));
+#endif
+
+		if (rv != SCARD_S_SUCCESS) {
+			FUNC_FAILS(CKR_DEVICE_ERROR, "Error reconnecting to reset card");
+		}
+
+		rc = resetToken(pslot);
 	} else {
 		FUNC_FAILS(CKR_DEVICE_ERROR, "Error getting PC/SC card terminal status");
 	}
@@ -565,42 +586,141 @@ int getPCSCToken(struct p11Slot_t *slot, struct p11Token_t **token)
 
 
 
+static unsigned long currentThread()
+{
+#ifdef _WIN32
+	return (unsigned long)GetCurrentThreadId();
+#else
+	return (unsigned long)pthread_self();
+#endif
+}
+
+
+
+/**
+ * Wait until the transaction is no longer nested deeper than depth by a different thread.
+ * Must be called with the context mutex held, which is released while waiting.
+ */
+static void waitForTransaction(struct p11Slot_t *slot, unsigned long self, int depth)
+{
+	while ((slot->transactionLock > depth) && (slot->transactionOwner != self)) {
+		p11UnlockMutex(context->mutex);
+#ifdef _WIN32
+		Sleep(1);
+#else
+		usleep(1000);
+#endif
+		p11LockMutex(context->mutex);
+	}
+}
+
+
+
+/**
+ * Gain exclusive access to the card by starting a PC/SC transaction
+ *
+ * Calls can be nested to hold a single transaction across a burst of operations,
+ * e.g. a login followed by a signature. Only the outermost call starts the
+ * transaction, so nested calls do not cause a round trip to the resource manager.
+ *
+ * The PC/SC transaction is held by the process, so only the thread owning the
+ * transaction may nest. Other threads wait until the transaction ends.
+ */
 int lockPCSCSlot(struct p11Slot_t *slot)
 {
-	DWORD dwActiveProtocol;
 	LONG rv;
+	unsigned long self;
+	int first;
 
 	FUNC_CALLED();
 
-	rv = SCardReconnect(slot->card, SCARD_SHARE_EXCLUSIVE, SCARD_PROTOCOL_T1, SCARD_LEAVE_CARD, &dwActiveProtocol);
+	if (!slot->card) {
+		FUNC_RETURNS(CKR_TOKEN_NOT_PRESENT);
+	}
+
+	self = currentThread();
+
+	p11LockMutex(context->mutex);
+	waitForTransaction(slot, self, 0);
+	first = slot->transactionLock++ == 0;
+	slot->transactionOwner = self;
+	p11UnlockMutex(context->mutex);
+
+	if (!first) {
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	rv = SCardBeginTransaction(slot->card);
 
 #ifdef DEBUG
-	debug("SCardReconnect (%i, %s): %s\n", slot->id, slot->readername, pcsc_error_to_string(rv));
+	debug("SCardBeginTransaction (%i, %s): %s\n", slot->id, slot->readername, pcsc_error_to_string(rv));
 #endif
 
-	if (rv != SCARD_S_SUCCESS)
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not reconnect to card");
+	if (rv != SCARD_S_SUCCESS) {
+		p11LockMutex(context->mutex);
+		slot->transactionLock--;
+		p11UnlockMutex(context->mutex);
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not begin transaction");
+	}
+
+	// Another application may have changed the card since our last transaction
+	beginApduCacheTransaction(slot);
 
 	FUNC_RETURNS(CKR_OK);
 }
 
 
 
+/**
+ * Take over a transaction held across calls, e.g. by a session after a context specific login,
+ * so that the calling thread can nest. Waits while a different thread uses the transaction.
+ */
+void claimPCSCSlot(struct p11Slot_t *slot)
+{
+	unsigned long self;
+
+	self = currentThread();
+
+	p11LockMutex(context->mutex);
+	waitForTransaction(slot, self, 1);
+	if (slot->transactionLock > 0) {
+		slot->transactionOwner = self;
+	}
+	p11UnlockMutex(context->mutex);
+}
+
+
+
+/**
+ * Release exclusive access to the card, ending the transaction with the outermost call
+ */
 int unlockPCSCSlot(struct p11Slot_t *slot)
 {
-	DWORD dwActiveProtocol;
 	LONG rv;
+	int last;
 
 	FUNC_CALLED();
 
-	rv = SCardReconnect(slot->card, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, SCARD_LEAVE_CARD, &dwActiveProtocol);
+	p11LockMutex(context->mutex);
+	if (slot->transactionLock == 0) {
+		p11UnlockMutex(context->mutex);
+		FUNC_RETURNS(CKR_OK);			// Transaction ended by disconnect
+	}
+	last = --slot->transactionLock == 0;
+	p11UnlockMutex(context->mutex);
+
+	if (!last || !slot->card) {
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	rv = SCardEndTransaction(slot->card, SCARD_LEAVE_CARD);
 
 #ifdef DEBUG
-	debug("SCardReconnect (%i, %s): %s\n", slot->id, slot->readername, pcsc_error_to_string(rv));
+	debug("SCardEndTransaction (%i, %s): %s\n", slot->id, slot->readername, pcsc_error_to_string(rv));
 #endif
 
 	if (rv != SCARD_S_SUCCESS)
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not reconnect to card");
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not end transaction");
 
 	FUNC_RETURNS(CKR_OK);
 }
@@ -836,6 +956,94 @@ int updatePCSCSlots(struct p11SlotPool_t *pool)
 
 
 
+static int isLoggedInPCSCToken(struct p11Slot_t *slot)
+{
+	int i;
+
+	if (slot->token->user != INT_CKU_NO_USER) {
+		return TRUE;
+	}
+
+	for (i = 0; i < sizeof(slot->virtualSlots) / sizeof(slot->virtualSlots[0]); i++) {
+		if (slot->virtualSlots[i] && slot->virtualSlots[i]->token &&
+			(slot->virtualSlots[i]->token->user != INT_CKU_NO_USER)) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+
+
+/**
+ * Reopen the PC/SC handles in a child process after fork()
+ *
+ * PC/SC contexts and card handles can not be shared between processes. The handles
+ * inherited from the parent are dropped without releasing them, as releasing would
+ * affect the parent. Tokens and objects inherited from the parent are kept, unless the
+ * parent was logged in.
+ */
+int reattachPCSCSlots(struct p11SlotPool_t *pool)
+{
+	struct p11Slot_t *slot;
+	DWORD dwActiveProtocol;
+	LONG rv;
+
+	FUNC_CALLED();
+
+	// Established again with the next update of the slot list
+	globalContext = 0;
+
+	for (slot = pool->list; slot; slot = slot->next) {
+		if (slot->primarySlot || slot->closed)
+			continue;
+
+		slot->transactionLock = 0;
+
+		rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &(slot->context));
+
+#ifdef DEBUG
+		debug("SCardEstablishContext: %s\n", pcsc_error_to_string(rv));
+#endif
+
+		if (rv != SCARD_S_SUCCESS) {
+			FUNC_FAILS(CKR_DEVICE_ERROR, "Could not establish context to PC/SC manager");
+		}
+
+		if (!slot->card)
+			continue;
+
+		rv = SCardConnect(slot->context, slot->readername, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &(slot->card), &dwActiveProtocol);
+
+#ifdef DEBUG
+		debug("SCardConnect (%i, %s): %s\n", slot->id, slot->readername, pcsc_error_to_string(rv));
+#endif
+
+		if (rv != SCARD_S_SUCCESS) {
+			// Token removed since the parent connected
+			slot->card = 0;
+			if (slot->token) {
+				removeToken(slot);
+			}
+			continue;
+		}
+
+		// The login of the parent must not be inherited by the child. Drivers keep private
+		// objects once loaded, so the token is detected and loaded again instead.
+		// Calling logOut() would reset the security state of the card for the parent as well
+		if (slot->token && isLoggedInPCSCToken(slot)) {
+			SCardDisconnect(slot->card, SCARD_LEAVE_CARD);
+			slot->card = 0;
+			removeToken(slot);
+		}
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
 int closePCSCSlot(struct p11Slot_t *slot)
 {
 	LONG rc;
@@ -882,6 +1090,7 @@ int closePCSCSlot(struct p11Slot_t *slot)
 
 	slot->context = 0;
 	slot->card = 0;
+	slot->transactionLock = 0;
 	slot->closed = TRUE;
 
 	FUNC_RETURNS(CKR_OK);
@@ -113,7 +113,9 @@ int transmitAPDUviaPCSC(struct p11Slot_t *slot,
 int getPCSCToken(struct p11Slot_t *slot, struct p11Token_t **token);
 int lockPCSCSlot(struct p11Slot_t *slot);
 int unlockPCSCSlot(struct p11Slot_t *slot);
+void claimPCSCSlot(struct p11Slot_t *slot);
 int updatePCSCSlots(struct p11SlotPool_t *pool);
+int reattachPCSCSlots(struct p11SlotPool_t *pool);
 int closePCSCSlot(struct p11Slot_t *slot);
 
 #endif
@@ -33,11 +33,18 @@
 
 #include <string.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
 #include <pkcs11/p11generic.h>
 #include <pkcs11/slot.h>
 #include <pkcs11/token.h>
 #include <pkcs11/slotpool.h>
 #include <pkcs11/session.h>
+#include <pkcs11/apducache.h>
 
 #ifdef DEBUG
 #include <pkcs11/debug.h>
@@ -49,8 +56,21 @@
 #include "slot-pcsc.h"
 #endif
 
+#include "slot-broker.h"
+
 extern struct p11Context_t *context;
 
+/*
+ * Time in ms a slot snapshot is used for info queries before the token status is checked again
+ */
+#define SNAPSHOT_VALIDITY		1000
+
+#ifdef _WIN32
+#define memoryBarrier() MemoryBarrier()
+#else
+#define memoryBarrier() __sync_synchronize()
+#endif
+
 
 
 /**
@@ -124,6 +144,8 @@ int removeToken(struct p11Slot_t *slot)
 				removeToken(slot->virtualSlots[i]);
 			}
 		}
+
+		flushApduCache(slot);
 	}
 
 	if (slot->removedToken) {
@@ -145,6 +167,50 @@ int removeToken(struct p11Slot_t *slot)
 
 
 
+/**
+ * Update the token after the card was reset by another application
+ *
+ * The reset clears the security state of the card, so the token and the tokens in
+ * associated virtual slots are logged out. Token objects are synchronized with the
+ * device rather than reloaded, so sessions survive the reset.
+ *
+ * @param slot      The slot in which the card was reset
+ *
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+int resetToken(struct p11Slot_t *slot)
+{
+	int i, rc;
+
+	if (slot->token == NULL) {
+		return CKR_FUNCTION_FAILED;
+	}
+
+	if (!slot->primarySlot) {
+		for (i = 0; i < sizeof(slot->virtualSlots) / sizeof(slot->virtualSlots[0]); i++) {
+			if (slot->virtualSlots[i] && slot->virtualSlots[i]->token) {
+				rc = resetToken(slot->virtualSlots[i]);
+				if (rc != CKR_OK) {
+					return rc;
+				}
+			}
+		}
+
+		flushApduCache(slot);
+	}
+
+	rc = logOut(slot);
+	if (rc != CKR_OK) {
+		return rc;
+	}
+
+	invalidateSlotSnapshot(slot);
+
+	return synchronizeToken(slot, slot->token);
+}
+
+
+
 /**
  * Encode APDU using either short or extended notation
  *
@@ -240,8 +306,8 @@ int transmitAPDU(struct p11Slot_t *slot,
 		int OutLen, unsigned char *OutData,
 		int InLen, unsigned char *InData, int InSize, unsigned short *SW1SW2)
 {
-	int rc;
-	unsigned char apdu[4098];
+	int rc, clen;
+	unsigned char capdu[4098], apdu[4098];
 #ifdef DEBUG
 	char scr[4196];
 	char *po;
@@ -276,21 +342,35 @@ int transmitAPDU(struct p11Slot_t *slot,
 
 	rc = encodeCommandAPDU(CLA, INS, P1, P2,
 			OutLen, OutData, InData ? InLen : -1,
-			apdu, sizeof(apdu));
+			capdu, sizeof(capdu));
 
 	if (rc < 0)
 		FUNC_FAILS(rc, "Encoding APDU failed");
 
+	clen = rc;
+
+	rc = -1;
+
+#ifndef CTAPI
+	// Outside of a transaction other applications may change the card at any time
+	if (slot->transactionLock)
+#endif
+		rc = lookupApduCache(slot, capdu, clen, apdu, sizeof(apdu));
+
+	if (rc < 0) {
 #ifdef CTAPI
-	rc = transmitAPDUviaCTAPI(slot, 0,
-			apdu, rc,
-			apdu, sizeof(apdu));
+		rc = transmitAPDUviaCTAPI(slot, 0,
+				capdu, clen,
+				apdu, sizeof(apdu));
 #else
-	rc = transmitAPDUviaPCSC(slot,
-			apdu, rc,
-			apdu, sizeof(apdu));
+		rc = transmitAPDUviaPCSC(slot,
+				capdu, clen,
+				apdu, sizeof(apdu));
 #endif
 
+		updateApduCache(slot, capdu, clen, apdu, rc);
+	}
+
 	if (rc >= 2) {
 		*SW1SW2 = (apdu[rc - 2] << 8) | apdu[rc - 1];
 		rc -= 2;
@@ -336,6 +416,7 @@ int transmitVerifyPinAPDU(struct p11Slot_t *slot,
 {
 	int rc;
 	unsigned char apdu[4098];
+	unsigned char header[4] = { CLA, INS, P1, P2 };
 #ifdef DEBUG
 	char scr[4196];
 #endif
@@ -370,6 +451,8 @@ int transmitVerifyPinAPDU(struct p11Slot_t *slot,
 			apdu, sizeof(apdu));
 #endif
 
+	updateApduCache(slot, header, sizeof(header), apdu, rc);
+
 	if (rc >= 2) {
 		*SW1SW2 = (apdu[rc - 2] << 8) | apdu[rc - 1];
 		rc -= 2;
@@ -421,6 +504,7 @@ int getVirtualSlot(struct p11Slot_t *slot, int index, struct p11Slot_t **vslot)
 
 	*newslot = *slot;
 	newslot->token = NULL;
+	newslot->apduCache = NULL;
 	newslot->next = NULL;
 	newslot->primarySlot = slot;
 	slot->virtualSlots[index] = newslot;
@@ -450,9 +534,57 @@ int getToken(struct p11Slot_t *slot, struct p11Token_t **token)
 
 
 
+/**
+ * Return a monotonic time in milliseconds, which is never 0
+ */
+unsigned long currentMillis()
+{
+	unsigned long now;
+#ifdef _WIN32
+	now = GetTickCount();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+	// 0 marks a stale snapshot
+	return now ? now : 1;
+}
+
+
+
+/**
+ * Publish the slot and token state for info queries. Must be called with the global lock held.
+ */
+static void publishSlotSnapshot(struct p11Slot_t *slot, unsigned long now)
+{
+	struct p11SlotSnapshot_t *snapshot = &slot->snapshot;
+
+	snapshot->sequence++;
+	memoryBarrier();
+
+	snapshot->slotInfo = slot->info;
+	snapshot->tokenPresent = slot->token != NULL;
+
+	if (slot->token) {
+		snapshot->tokenInfo = slot->token->info;
+		snapshot->user = slot->token->user;
+		snapshot->drv = slot->token->drv;
+	}
+
+	snapshot->validated = now;
+
+	memoryBarrier();
+	snapshot->sequence++;
+}
+
+
+
 int getValidatedToken(struct p11Slot_t *slot, struct p11Token_t **token)
 {
-	int rc;
+	int rc, i;
+	unsigned long now;
 	struct p11Slot_t *pslot;
 
 	FUNC_CALLED();
@@ -465,11 +597,24 @@ int getValidatedToken(struct p11Slot_t *slot, struct p11Token_t **token)
 
 	p11LockMutex(context->mutex);
 
+	if (context->brokerClient) {
+		rc = getBrokerToken(pslot, token);
+	} else {
 #ifdef CTAPI
-	rc = getCTAPIToken(pslot, token);
+		rc = getCTAPIToken(pslot, token);
 #else
-	rc = getPCSCToken(pslot, token);
+		rc = getPCSCToken(pslot, token);
 #endif
+	}
+
+	now = currentMillis();
+	publishSlotSnapshot(pslot, now);
+
+	for (i = 0; i < sizeof(pslot->virtualSlots) / sizeof(pslot->virtualSlots[0]); i++) {
+		if (pslot->virtualSlots[i]) {
+			publishSlotSnapshot(pslot->virtualSlots[i], now);
+		}
+	}
 
 	p11UnlockMutex(context->mutex);
 
@@ -481,6 +626,55 @@ int getValidatedToken(struct p11Slot_t *slot, struct p11Token_t **token)
 
 
 
+/**
+ * Get the slot and token state for info queries without taking the global lock
+ *
+ * The snapshot published by the last status check is used, as long as it is not older than
+ * SNAPSHOT_VALIDITY. Otherwise the token status is checked again using getValidatedToken().
+ *
+ * @param slot      the slot
+ * @param snapshot  the buffer receiving a consistent copy of the state, also if an error is returned
+ * @return          CKR_OK, CKR_TOKEN_NOT_PRESENT or any other error returned by getValidatedToken()
+ */
+int getSlotSnapshot(struct p11Slot_t *slot, struct p11SlotSnapshot_t *snapshot)
+{
+	struct p11Token_t *token;
+	unsigned long seq, validated;
+	int rc;
+
+	rc = CKR_OK;
+	validated = slot->snapshot.validated;
+
+	// The status check always publishes a new snapshot, even if it fails
+	if (!validated || (currentMillis() - validated >= SNAPSHOT_VALIDITY)) {
+		rc = getValidatedToken(slot, &token);
+	}
+
+	do {
+		seq = slot->snapshot.sequence;
+		memoryBarrier();
+		*snapshot = slot->snapshot;
+		memoryBarrier();
+	} while ((seq & 1) || (seq != slot->snapshot.sequence));
+
+	if ((rc == CKR_OK) && !snapshot->tokenPresent)
+		rc = CKR_TOKEN_NOT_PRESENT;
+
+	return rc;
+}
+
+
+
+/**
+ * Force a status check with the next info query, e.g. after login state or PIN status changed
+ */
+void invalidateSlotSnapshot(struct p11Slot_t *slot)
+{
+	slot->snapshot.validated = 0;
+}
+
+
+
 /**
  * Gain exclusive access to the token in the slot, preventing other processes to access the token
  */
@@ -493,6 +687,10 @@ int lockSlot(struct p11Slot_t *slot)
 	if (pslot->primarySlot)
 		pslot = pslot->primarySlot;
 
+	// The broker holds exclusive access while processing a request
+	if (context->brokerClient)
+		return CKR_OK;
+
 #ifdef CTAPI
 	rc = 0;
 #else
@@ -515,6 +713,9 @@ int unlockSlot(struct p11Slot_t *slot)
 	if (pslot->primarySlot)
 		pslot = pslot->primarySlot;
 
+	if (context->brokerClient)
+		return CKR_OK;
+
 #ifdef CTAPI
 	rc = 0;
 #else
@@ -525,6 +726,27 @@ int unlockSlot(struct p11Slot_t *slot)
 
 
 
+/**
+ * Let the calling thread continue to use exclusive access held across calls, e.g. by a session
+ */
+void claimSlotLock(struct p11Slot_t *slot)
+{
+	struct p11Slot_t *pslot;
+
+	pslot = slot;
+	if (pslot->primarySlot)
+		pslot = pslot->primarySlot;
+
+	if (context->brokerClient)
+		return;
+
+#ifndef CTAPI
+	claimPCSCSlot(pslot);
+#endif
+}
+
+
+
 int findSlotObject(struct p11Slot_t *slot, CK_OBJECT_HANDLE handle, struct p11Object_t **object, int publicObject)
 {
 	int rc;
@@ -564,6 +786,9 @@ int updateSlots(struct p11SlotPool_t *pool)
 
 	FUNC_CALLED();
 
+	if (context->brokerClient)
+		FUNC_RETURNS(updateBrokerSlots(pool));
+
 #ifdef CTAPI
 	rc = updateCTAPISlots(pool);
 #else
@@ -584,6 +809,9 @@ int closeSlot(struct p11Slot_t *slot)
 	if (slot->primarySlot)
 		FUNC_RETURNS(CKR_OK);
 
+	if (context->brokerClient)
+		FUNC_RETURNS(closeBrokerSlot(slot));
+
 #ifdef CTAPI
 	rc = closeCTAPISlot(slot);
 #else
@@ -592,3 +820,36 @@ int closeSlot(struct p11Slot_t *slot)
 
 	FUNC_RETURNS(rc);
 }
+
+
+
+/**
+ * Reopen reader handles in a child process after fork(), keeping the token and
+ * object state inherited from the parent
+ *
+ * @param pool      the slot pool inherited from the parent
+ * @return          CKR_OK, CKR_FUNCTION_NOT_SUPPORTED if handles can not be reopened or any other Cryptoki error code
+ */
+int reattachSlots(struct p11SlotPool_t *pool)
+{
+	struct p11Slot_t *slot;
+	int rc;
+
+	FUNC_CALLED();
+
+	for (slot = pool->list; slot; slot = slot->next) {
+		invalidateSlotSnapshot(slot);
+	}
+
+	if (context->brokerClient)
+		FUNC_RETURNS(reattachBrokerSlots(pool));
+
+#ifdef CTAPI
+	// The USB device is claimed by the parent
+	rc = CKR_FUNCTION_NOT_SUPPORTED;
+#else
+	rc = reattachPCSCSlots(pool);
+#endif
+
+	FUNC_RETURNS(rc);
+}
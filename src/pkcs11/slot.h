@@ -39,6 +39,7 @@
 
 int addToken(struct p11Slot_t *slot, struct p11Token_t *token);
 int removeToken(struct p11Slot_t *slot);
+int resetToken(struct p11Slot_t *slot);
 int encodeCommandAPDU(
 		unsigned char CLA, unsigned char INS, unsigned char P1, unsigned char P2,
 		size_t Nc, unsigned char *OutData, int Ne,
@@ -55,12 +56,17 @@ int transmitVerifyPinAPDU(struct p11Slot_t *slot,
 		unsigned char pinblockstring, unsigned char pinlengthformat);
 int getToken(struct p11Slot_t *slot, struct p11Token_t **token);
 int getValidatedToken(struct p11Slot_t *slot, struct p11Token_t **token);
+int getSlotSnapshot(struct p11Slot_t *slot, struct p11SlotSnapshot_t *snapshot);
+void invalidateSlotSnapshot(struct p11Slot_t *slot);
+unsigned long currentMillis();
 int findSlotObject(struct p11Slot_t *slot, CK_OBJECT_HANDLE handle, struct p11Object_t **object, int publicObject);
 int findSlotKey(struct p11Slot_t *slot, CK_OBJECT_HANDLE handle, struct p11Object_t **object);
 int lockSlot(struct p11Slot_t *slot);
 int unlockSlot(struct p11Slot_t *slot);
+void claimSlotLock(struct p11Slot_t *slot);
 int updateSlots(struct p11SlotPool_t *pool);
 int closeSlot(struct p11Slot_t *slot);
+int reattachSlots(struct p11SlotPool_t *pool);
 int addToken(struct p11Slot_t *slot, struct p11Token_t *token);
 int removeToken(struct p11Slot_t *slot);
 int getVirtualSlot(struct p11Slot_t *slot, int index, struct p11Slot_t **vslot);
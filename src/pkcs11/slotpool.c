@@ -39,6 +39,7 @@
 #include <pkcs11/slotpool.h>
 #include <pkcs11/slot.h>
 #include <pkcs11/token.h>
+#include <pkcs11/apducache.h>
 #include <pkcs11/debug.h>
 
 extern struct p11Context_t *context;
@@ -117,6 +118,7 @@ int terminateSlotPool(struct p11SlotPool_t *pool)
 		}
 
 		closeSlot(pSlot);
+		freeApduCache(pSlot);
 
 		pFreeSlot = pSlot;
 		pSlot = pSlot->next;
@@ -39,7 +39,9 @@
 #include <pkcs11/slot.h>
 #include <pkcs11/object.h>
 #include <pkcs11/token.h>
+#include <pkcs11/apducache.h>
 #include <pkcs11/certificateobject.h>
+#include <pkcs11/dataobject.h>
 #include <pkcs11/privatekeyobject.h>
 #include <pkcs11/publickeyobject.h>
 #include <pkcs11/strbpcpy.h>
@@ -47,6 +49,8 @@
 #include <pkcs11/pkcs15.h>
 #include <pkcs11/debug.h>
 
+#include <common/ecdsasig.h>
+
 
 
 static unsigned char aid[] = { 0xE8,0x2B,0x06,0x01,0x04,0x01,0x81,0xC3,0x1F,0x02,0x01 };
@@ -181,6 +185,92 @@ static int readEF(struct p11Slot_t *slot, unsigned short fid, unsigned char *con
 
 
 
+/**
+ * Write content to an EF, which is created if it does not exist
+ *
+ * UPDATE BINARY with odd instruction byte transfers the offset and data in a
+ * single extended length APDU. Content exceeding the maximum command APDU is
+ * written in consecutive chunks.
+ */
+static int writeEF(struct p11Slot_t *slot, unsigned short fid, unsigned char *content, size_t len)
+{
+	unsigned char cdata[MAX_EXT_APDU_LENGTH], *po;
+	size_t ofs, chunk, maxchunk;
+	int rc;
+	unsigned short SW1SW2;
+	FUNC_CALLED();
+
+	// 7 byte for the APDU header with extended Lc and 8 byte for offset and data tag
+	maxchunk = MAX_EXT_APDU_LENGTH;
+	if (slot->maxCAPDU && (slot->maxCAPDU < maxchunk)) {
+		maxchunk = slot->maxCAPDU;
+	}
+	maxchunk -= 15;
+
+	ofs = 0;
+	do	{
+		chunk = len - ofs;
+		if (chunk > maxchunk) {
+			chunk = maxchunk;
+		}
+
+		po = cdata;
+		*po++ = 0x54;
+		*po++ = 0x02;
+		*po++ = (unsigned char)(ofs >> 8);
+		*po++ = (unsigned char)(ofs & 0xFF);
+		asn1StoreTag(&po, 0x53);
+		asn1StoreLength(&po, chunk);
+		memcpy(po, content + ofs, chunk);
+		po += chunk;
+
+		rc = transmitAPDU(slot, 0x00, 0xD7, fid >> 8, fid & 0xFF,
+				po - cdata, cdata,
+				0, NULL, 0, &SW1SW2);
+
+		if (rc < 0) {
+			FUNC_FAILS(rc, "transmitAPDU failed");
+		}
+
+		if (SW1SW2 != 0x9000) {
+			FUNC_FAILS(-1, "Update EF failed");
+		}
+
+		ofs += chunk;
+	} while (ofs < len);
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+static int deleteEF(struct p11Slot_t *slot, unsigned short fid)
+{
+	unsigned char fidbin[2];
+	int rc;
+	unsigned short SW1SW2;
+	FUNC_CALLED();
+
+	fidbin[0] = fid >> 8;
+	fidbin[1] = fid & 0xFF;
+
+	rc = transmitAPDU(slot, 0x00, 0xE4, 0x02, 0x00,
+			2, fidbin,
+			0, NULL, 0, &SW1SW2);
+
+	if (rc < 0) {
+		FUNC_FAILS(rc, "transmitAPDU failed");
+	}
+
+	if ((SW1SW2 != 0x9000) && (SW1SW2 != 0x6A82)) {
+		FUNC_FAILS(-1, "Delete EF failed");
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
 static int getSignatureSize(CK_MECHANISM_TYPE mech, struct p11Object_t *pObject)
 {
 	switch(mech) {
@@ -239,76 +329,6 @@ static int getAlgorithmIdForDecryption(CK_MECHANISM_TYPE mech)
 
 
 
-static int decodeECDSASignature(unsigned char *data, int datalen,
-								unsigned char *out, int outlen)
-{
-	int fieldsizebytes, i, r, taglen;
-	unsigned char *po, *value;
-
-	FUNC_CALLED();
-
-	r = asn1Validate(data, datalen);
-
-	if (r != 0) {
-		FUNC_FAILS(-1, "Signature is not a valid TLV structure");
-	}
-
-	// Determine field size from length of signature
-	if (datalen <= 58) {			// 192 bit curve = 24 * 2 + 10 byte maximum DER signature
-		fieldsizebytes = 24;
-	} else if (datalen <= 66) {		// 224 bit curve = 28 * 2 + 10 byte maximum DER signature
-		fieldsizebytes = 28;
-	} else if (datalen <= 74) {		// 256 bit curve = 32 * 2 + 10 byte maximum DER signature
-		fieldsizebytes = 32;
-	} else if (datalen <= 90) {		// 320 bit curve = 40 * 2 + 10 byte maximum DER signature
-		fieldsizebytes = 40;
-	} else {
-		fieldsizebytes = 64;
-	}
-
-#ifdef DEBUG
-	debug("Field size %d, signature buffer size %d\n", fieldsizebytes, outlen);
-#endif
-
-	if (outlen < (fieldsizebytes * 2)) {
-		FUNC_FAILS(-1, "output too small for EC signature");
-	}
-
-	memset(out, 0, outlen);
-
-	po = data;
-	if (asn1Tag(&po) != ASN1_SEQUENCE) {
-		FUNC_FAILS(-1, "Signature not encapsulated in SEQUENCE");
-	}
-
-	r = asn1Length(&po);
-	if ((r < 8) || (r > 137)) {
-		FUNC_FAILS(-1, "Invalid signature size");
-	}
-
-	for (i = 0; i < 2; i++) {
-		if (asn1Tag(&po) != ASN1_INTEGER) {
-			FUNC_FAILS(-1, "Coordinate not encapsulated in INTEGER");
-		}
-
-		taglen = asn1Length(&po);
-		value = po;
-		po += taglen;
-
-		if (taglen > fieldsizebytes) { /* drop leading 00 if present */
-			if (*value != 0x00) {
-				FUNC_FAILS(-1, "Invalid value in coordinate");
-			}
-			value++;
-			taglen--;
-		}
-		memcpy(out + fieldsizebytes * i + fieldsizebytes - taglen , value, taglen);
-	}
-	FUNC_RETURNS(fieldsizebytes << 1);
-}
-
-
-
 static int sc_hsm_C_SignInit(struct p11Object_t *pObject, CK_MECHANISM_PTR mech)
 {
 	int algo;
@@ -347,9 +367,9 @@ static void applyPKCSPadding(unsigned char *di, int dilen, unsigned char *buff,
 
 static int sc_hsm_C_Sign(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
 {
-	int rc, algo, signaturelen;
+	int rc, algo, signaturelen, fieldsize = 0, dersize;
 	unsigned short SW1SW2;
-	unsigned char scr[256];
+	unsigned char scr[256], *der = NULL;
 	FUNC_CALLED();
 
 	rc = getSignatureSize(mech, pObject);
@@ -374,9 +394,18 @@ static int sc_hsm_C_Sign(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, CK
 	}
 
 	if ((algo == ALGO_EC_RAW) || (algo == ALGO_EC_SHA1)) {
+		// Receive the DER encoded signature directly into the callers buffer if it can hold it
+		fieldsize = signaturelen >> 1;
+		if (*pulSignatureLen >= ECDSA_DER_MAX_LEN(fieldsize)) {
+			der = pSignature;
+			dersize = *pulSignatureLen;
+		} else {
+			der = scr;
+			dersize = sizeof(scr);
+		}
 		rc = transmitAPDU(pObject->token->slot, 0x80, 0x68, (unsigned char)pObject->tokenid, (unsigned char)algo,
 				ulDataLen, pData,
-				0, scr, sizeof(scr), &SW1SW2);
+				0, der, dersize, &SW1SW2);
 	} else {
 		if (mech == CKM_RSA_PKCS) {
 			if (signaturelen > sizeof(scr)) {
@@ -393,285 +422,1061 @@ static int sc_hsm_C_Sign(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, CK
 		}
 	}
 
-	if (rc < 0) {
-		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
-	}
+	if (rc < 0) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
+	}
+
+	if (SW1SW2 != 0x9000) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Signature operation failed");
+	}
+
+	if ((algo == ALGO_EC_RAW) || (algo == ALGO_EC_SHA1)) {
+		rc = ecdsa_der_to_raw(der, rc, pSignature, *pulSignatureLen, fieldsize);
+		if (rc < 0) {
+			FUNC_FAILS(CKR_DEVICE_ERROR, "Invalid ECDSA signature");
+		}
+	}
+
+	*pulSignatureLen = rc;
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+static int sc_hsm_C_DecryptInit(struct p11Object_t *pObject, CK_MECHANISM_PTR mech)
+{
+	int algo;
+
+	FUNC_CALLED();
+
+	algo = getAlgorithmIdForDecryption(mech->mechanism);
+	if (algo < 0) {
+		FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism not supported");
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+static int stripPKCS15Padding(unsigned char *scr, int len, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+{
+	int c1,c2,c3;
+
+	c1 = *scr++ == 0x00;
+	c2 = *scr++ == 0x02;
+	len -= 2;
+	while ((len > 0) && *scr) {
+		scr++;
+		len--;
+	}
+	c3 = len > 0;
+
+	if (!(c1 && c2 && c3)) {
+		return CKR_ENCRYPTED_DATA_INVALID;
+	}
+
+	scr++;
+	len--;
+
+	if (len > *pulDataLen) {
+		return CKR_BUFFER_TOO_SMALL;
+	}
+
+	memcpy(pData, scr, len);
+	*pulDataLen = len;
+
+	return CKR_OK;
+}
+
+
+
+static int sc_hsm_C_Decrypt(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+{
+	int rc, algo;
+	unsigned short SW1SW2;
+	unsigned char scr[256];
+
+	FUNC_CALLED();
+
+	if (pData == NULL) {
+		*pulDataLen = pObject->keysize >> 3;
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	algo = getAlgorithmIdForDecryption(mech);
+	if (algo < 0) {
+		FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism not supported");
+	}
+
+	rc = transmitAPDU(pObject->token->slot, 0x80, 0x62, (unsigned char)pObject->tokenid, (unsigned char)algo,
+			ulEncryptedDataLen, pEncryptedData,
+			0, scr, sizeof(scr), &SW1SW2);
+
+	if (rc < 0) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
+	}
+
+	if (SW1SW2 != 0x9000) {
+		FUNC_FAILS(CKR_ENCRYPTED_DATA_INVALID, "Decryption operation failed");
+	}
+
+	if (mech == CKM_RSA_X_509) {
+		if (rc > *pulDataLen) {
+			*pulDataLen = rc;
+			FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "supplied buffer too small");
+		}
+		*pulDataLen = rc;
+		memcpy(pData, scr, rc);
+	} else {
+		rc = stripPKCS15Padding(scr, rc, pData, pulDataLen);
+		if (rc != CKR_OK) {
+			FUNC_FAILS(rc, "Invalid PKCS#1 padding");
+		}
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+static int addPrivateKeyObject(struct p11Token_t *token, struct p15PrivateKeyDescription *p15key, struct p11Object_t *p11cert, unsigned char id)
+{
+	struct p11Object_t *p11prikey;
+	int rc;
+
+	FUNC_CALLED();
+
+	rc = createPrivateKeyObjectFromP15(p15key, p11cert, FALSE, &p11prikey);
+
+	if (rc != CKR_OK) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not create private key object");
+	}
+
+	p11prikey->C_SignInit = sc_hsm_C_SignInit;
+	p11prikey->C_Sign = sc_hsm_C_Sign;
+	p11prikey->C_DecryptInit = sc_hsm_C_DecryptInit;
+	p11prikey->C_Decrypt = sc_hsm_C_Decrypt;
+
+	p11prikey->tokenid = (int)id;
+	p11prikey->keysize = p11cert->keysize;
+
+	addObject(token, p11prikey, FALSE);
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+static int addEECertificateAndKeyObjects(struct p11Token_t *token, unsigned char id)
+{
+	unsigned char certValue[MAX_CERTIFICATE_SIZE];
+	struct p11Object_t *p11cert, *p11pubkey;
+	struct p15PrivateKeyDescription *p15key = NULL;
+	struct token_sc_hsm *sc;
+	struct p15CertificateDescription p15cert;
+	unsigned char prkd[MAX_P15_SIZE];
+	int rc;
+
+	FUNC_CALLED();
+
+	rc = readEF(token->slot, (PRKD_PREFIX << 8) | id, prkd, sizeof(prkd));
+
+	if (rc < 0) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Error reading private key description");
+	}
+
+	rc = decodePrivateKeyDescription(prkd, rc, &p15key);
+
+	if (rc < 0) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Error decoding private key description");
+	}
+
+	rc = readEF(token->slot, (EE_CERTIFICATE_PREFIX << 8) | id, certValue, sizeof(certValue));
+
+	if (rc < 0) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Error reading certificate");
+	}
+
+	// A SmartCard-HSM does not store a separate P15 certificate description. Copy from key description
+	memset(&p15cert, 0, sizeof(p15cert));
+	p15cert.certtype = P15_CT_X509;
+	p15cert.coa = p15key->coa;
+	p15cert.id = p15key->id;
+	p15cert.isCA = 0;
+
+	rc = createCertificateObjectFromP15(&p15cert, certValue, rc, &p11cert);
+
+	if (rc != CKR_OK) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not create P11 certificate object");
+	}
+
+	p11cert->tokenid = (int)id;
+
+	addObject(token, p11cert, TRUE);
+
+	// As a side effect p11cert->keysize is updated with the key size determined from the public key
+	rc = createPublicKeyObjectFromCertificate(p15key, p11cert, &p11pubkey);
+
+	if (rc != CKR_OK) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not create public key object");
+	}
+
+	p11pubkey->tokenid = (int)id;
+
+	addObject(token, p11pubkey, TRUE);
+
+	sc = getPrivateData(token);
+
+	if (sc->privateKeysLoaded) {
+		rc = addPrivateKeyObject(token, p15key, p11cert, id);
+		freePrivateKeyDescription(&p15key);
+		FUNC_RETURNS(rc);
+	}
+
+	// The private key object is only needed after login, so keep the description until then
+	freePrivateKeyDescription(&sc->p15keys[id]);
+	sc->p15keys[id] = p15key;
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Create the private key objects deferred during token load
+ *
+ * Called after the first successful user login, so that the public objects are
+ * available without building private key objects that can not be used anyway.
+ */
+static int loadPrivateKeyObjects(struct p11Token_t *token)
+{
+	CK_OBJECT_CLASS class = CKO_CERTIFICATE;
+	CK_ATTRIBUTE template[] = {
+			{ CKA_CLASS, &class, sizeof(class) },
+			{ CKA_ID, NULL, 0 }
+	};
+	struct token_sc_hsm *sc;
+	struct p11Object_t *p11cert;
+	int rc, id;
+
+	FUNC_CALLED();
+
+	sc = getPrivateData(token);
+
+	for (id = 0; id < 256; id++) {
+		if (sc->p15keys[id] == NULL) {
+			continue;
+		}
+
+		template[1].pValue = sc->p15keys[id]->id.val;
+		template[1].ulValueLen = sc->p15keys[id]->id.len;
+
+		rc = findMatchingTokenObject(token, template, 2, &p11cert);
+
+		if (rc == CKR_OK) {
+			rc = addPrivateKeyObject(token, sc->p15keys[id], p11cert, id);
+		}
+
+		if (rc != CKR_OK) {
+#ifdef DEBUG
+			debug("addPrivateKeyObject failed with rc=%d\n", rc);
+#endif
+		}
+
+		freePrivateKeyDescription(&sc->p15keys[id]);
+	}
+
+	sc->privateKeysLoaded = 1;
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+static int addCACertificateObject(struct p11Token_t *token, unsigned char id)
+{
+	unsigned char certValue[MAX_CERTIFICATE_SIZE];
+	struct p11Object_t *p11cert;
+	struct p15CertificateDescription *p15cert;
+	unsigned char cd[MAX_P15_SIZE];
+	int rc;
+
+	FUNC_CALLED();
+
+	rc = readEF(token->slot, (CD_PREFIX << 8) | id, cd, sizeof(cd));
+
+	if (rc < 0) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Error reading certificate description");
+	}
+
+	rc = decodeCertificateDescription(cd, rc, &p15cert);
+
+	if (rc < 0) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Error decoding certificate description");
+	}
+
+	rc = readEF(token->slot, (CA_CERTIFICATE_PREFIX << 8) | id, certValue, sizeof(certValue));
+
+	if (rc < 0) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Error reading certificate");
+	}
+
+	p15cert->isCA = 1;
+	rc = createCertificateObjectFromP15(p15cert, certValue, rc, &p11cert);
+
+	if (rc != CKR_OK) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not create P11 certificate object");
+	}
+
+	// Use the file identifier to distinguish from key objects with the same id
+	p11cert->tokenid = (CA_CERTIFICATE_PREFIX << 8) | id;
+
+	addObject(token, p11cert, TRUE);
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * FNV-1a hash over the content of an EF, used to detect files rewritten in place
+ */
+static unsigned long hashContent(unsigned char *content, size_t len)
+{
+	unsigned long hash = 2166136261UL;
+
+	while (len--) {
+		hash ^= *content++;
+		hash = (hash * 16777619UL) & 0xFFFFFFFFUL;
+	}
+	return hash;
+}
+
+
+
+static int addDataObjectFromP15(struct p11Token_t *token, struct p15DataObjectDescription *p15, unsigned char id)
+{
+	unsigned char value[MAX_DATA_OBJECT_SIZE];
+	struct p11Object_t *p11data;
+	unsigned short fid;
+	int rc;
+
+	FUNC_CALLED();
+
+	if (p15->efidOrPath.len < 2) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Data object description without path");
+	}
+
+	fid = (p15->efidOrPath.val[p15->efidOrPath.len - 2] << 8) | p15->efidOrPath.val[p15->efidOrPath.len - 1];
+
+	rc = readEF(token->slot, fid, value, sizeof(value));
+
+	if (rc < 0) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Error reading data object");
+	}
+
+	getPrivateData(token)->dataLength[id] = rc;
+	getPrivateData(token)->dataHash[id] = hashContent(value, rc);
+
+	rc = createDataObjectFromP15(p15, value, rc, &p11data);
+
+	if (rc != CKR_OK) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not create P11 data object");
+	}
+
+	// Use the file identifier to distinguish from key objects with the same id
+	p11data->tokenid = (DCOD_PREFIX << 8) | id;
+
+	addObject(token, p11data, p11data->publicObj);
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Create the data object described in the DCOD EF with the given id
+ *
+ * The value of a private data object can only be read after PIN verification, so
+ * the object is deferred until the next login if the user is not logged in.
+ */
+static int addDataObject(struct p11Token_t *token, unsigned char id)
+{
+	struct token_sc_hsm *sc;
+	struct p15DataObjectDescription *p15data = NULL;
+	unsigned char dcod[MAX_P15_SIZE];
+	int rc;
+
+	FUNC_CALLED();
+
+	sc = getPrivateData(token);
+
+	rc = readEF(token->slot, (DCOD_PREFIX << 8) | id, dcod, sizeof(dcod));
+
+	if (rc < 0) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Error reading data object description");
+	}
+
+	sc->dcodLength[id] = rc;
+	sc->dcodHash[id] = hashContent(dcod, rc);
+
+	rc = decodeDataObjectDescription(dcod, rc, &p15data);
+
+	if (rc < 0) {
+		freeDataObjectDescription(&p15data);
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Error decoding data object description");
+	}
+
+	if ((p15data->coa.flags & P15_PRIVATE) && (token->user != CKU_USER)) {
+		sc->p15data[id] = p15data;
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	rc = addDataObjectFromP15(token, p15data, id);
+
+	freeDataObjectDescription(&p15data);
+
+	FUNC_RETURNS(rc);
+}
+
+
+
+/**
+ * Create the private data objects deferred until the user logged in
+ */
+static int loadPrivateDataObjects(struct p11Token_t *token)
+{
+	struct token_sc_hsm *sc;
+	int rc, id;
+
+	FUNC_CALLED();
+
+	sc = getPrivateData(token);
+
+	for (id = 0; id < 256; id++) {
+		if (sc->p15data[id] == NULL) {
+			continue;
+		}
+
+		rc = addDataObjectFromP15(token, sc->p15data[id], id);
+
+		if (rc != CKR_OK) {
+#ifdef DEBUG
+			debug("addDataObjectFromP15 failed with rc=%d\n", rc);
+#endif
+		}
+
+		freeDataObjectDescription(&sc->p15data[id]);
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+static int containsFile(unsigned char *filelist, int listlen, unsigned char prefix, unsigned char id)
+{
+	int i;
+
+	for (i = 0; i < listlen; i += 2) {
+		if ((filelist[i] == prefix) && (filelist[i + 1] == id)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+
+static void addFile(struct token_sc_hsm *sc, unsigned char prefix, unsigned char id)
+{
+	if (containsFile(sc->filelist, sc->filelistlen, prefix, id)) {
+		return;
+	}
+
+	sc->filelist[sc->filelistlen++] = prefix;
+	sc->filelist[sc->filelistlen++] = id;
+}
+
+
+
+static void removeFile(struct token_sc_hsm *sc, unsigned char prefix, unsigned char id)
+{
+	int i;
+
+	for (i = 0; i < sc->filelistlen; i += 2) {
+		if ((sc->filelist[i] == prefix) && (sc->filelist[i + 1] == id)) {
+			memmove(sc->filelist + i, sc->filelist + i + 2, sc->filelistlen - i - 2);
+			sc->filelistlen -= 2;
+			return;
+		}
+	}
+}
+
+
+
+/**
+ * Mark the keys, CA certificates and data objects with files in filelist that are missing in reflist
+ */
+static void markChangedFiles(unsigned char *filelist, int listlen, unsigned char *reflist, int reflen, unsigned char *keys, unsigned char *cacerts, unsigned char *data)
+{
+	int i;
+
+	for (i = 0; i < listlen; i += 2) {
+		if (containsFile(reflist, reflen, filelist[i], filelist[i + 1])) {
+			continue;
+		}
+
+		switch(filelist[i]) {
+		case KEY_PREFIX:
+		case PRKD_PREFIX:
+		case EE_CERTIFICATE_PREFIX:
+			keys[filelist[i + 1]] = 1;
+			break;
+		case CA_CERTIFICATE_PREFIX:
+		case CD_PREFIX:
+			cacerts[filelist[i + 1]] = 1;
+			break;
+		case DCOD_PREFIX:
+		case DATA_PREFIX:
+		case PROT_DATA_PREFIX:
+			data[filelist[i + 1]] = 1;
+			break;
+		}
+	}
+}
+
+
+
+static void removeObjectsWithTokenId(struct p11Token_t *token, int tokenid)
+{
+	struct p11Object_t *object, *next;
+
+	for (object = token->tokenObjList; object != NULL; object = next) {
+		next = object->next;
+		if (object->tokenid == tokenid) {
+			removeTokenObject(token, object->handle, TRUE);
+		}
+	}
+
+	for (object = token->tokenPrivObjList; object != NULL; object = next) {
+		next = object->next;
+		if (object->tokenid == tokenid) {
+			removeTokenObject(token, object->handle, FALSE);
+		}
+	}
+}
+
+
+
+static struct p11Object_t *findObjectWithTokenId(struct p11Token_t *token, int tokenid)
+{
+	struct p11Object_t *object;
+
+	for (object = token->tokenObjList; object != NULL; object = object->next) {
+		if (object->tokenid == tokenid) {
+			return object;
+		}
+	}
+
+	for (object = token->tokenPrivObjList; object != NULL; object = object->next) {
+		if (object->tokenid == tokenid) {
+			return object;
+		}
+	}
+	return NULL;
+}
+
+
+
+/**
+ * Mark the data objects with files in filelist that were rewritten in place
+ *
+ * Data objects are updated without adding or removing files, so the content of the
+ * files is compared with the content seen when the object was last read or written.
+ * The value of private data objects can only be compared while the user is logged in.
+ */
+static void markRewrittenDataObjects(struct p11Token_t *token, unsigned char *filelist, int listlen, unsigned char *data)
+{
+	struct token_sc_hsm *sc;
+	struct p11Object_t *object;
+	unsigned char content[MAX_DATA_OBJECT_SIZE];
+	unsigned char prefix;
+	int rc, id;
+
+	sc = getPrivateData(token);
+
+	for (id = 0; id < 256; id++) {
+		if (data[id] || !containsFile(filelist, listlen, DCOD_PREFIX, id)) {
+			continue;
+		}
+
+		object = findObjectWithTokenId(token, (DCOD_PREFIX << 8) | id);
+
+		// Changes not yet written take precedence
+		if ((object != NULL) && object->dirtyFlag) {
+			continue;
+		}
+
+		rc = readEF(token->slot, (DCOD_PREFIX << 8) | id, content, sizeof(content));
+
+		if ((rc < 0) || (hashContent(content, rc) != sc->dcodHash[id])) {
+			data[id] = 1;
+			continue;
+		}
+
+		if ((object == NULL) || (!object->publicObj && (token->user != CKU_USER))) {
+			continue;
+		}
+
+		prefix = object->publicObj ? DATA_PREFIX : PROT_DATA_PREFIX;
+
+		rc = readEF(token->slot, (prefix << 8) | id, content, sizeof(content));
+
+		if ((rc < 0) || (hashContent(content, rc) != sc->dataHash[id])) {
+			data[id] = 1;
+		}
+	}
+}
+
+
+
+/**
+ * Update the token objects to match the list of files on the device
+ *
+ * Objects for which files were added or removed since the last update are replaced.
+ * Data objects are also replaced if their files were rewritten in place. All other
+ * objects remain in place and keep their handle.
+ */
+static int updateObjects(struct p11Token_t *token, unsigned char *filelist, int listlen)
+{
+	struct token_sc_hsm *sc;
+	unsigned char keys[256], cacerts[256], data[256];
+	int rc, id;
+
+	FUNC_CALLED();
+
+	sc = getPrivateData(token);
+
+	memset(keys, 0, sizeof(keys));
+	memset(cacerts, 0, sizeof(cacerts));
+	memset(data, 0, sizeof(data));
+
+	markChangedFiles(filelist, listlen, sc->filelist, sc->filelistlen, keys, cacerts, data);
+	markChangedFiles(sc->filelist, sc->filelistlen, filelist, listlen, keys, cacerts, data);
+	markRewrittenDataObjects(token, filelist, listlen, data);
+
+	memcpy(sc->filelist, filelist, listlen);
+	sc->filelistlen = listlen;
+
+	for (id = 0; id < 256; id++) {
+		if (keys[id] && (id != 0)) {				// Skip Device Authentication Key
+			removeObjectsWithTokenId(token, id);
+			freePrivateKeyDescription(&sc->p15keys[id]);
+
+			if (containsFile(filelist, listlen, KEY_PREFIX, id)) {
+				rc = addEECertificateAndKeyObjects(token, id);
+				if (rc != CKR_OK) {
+#ifdef DEBUG
+					debug("addEECertificateAndKeyObjects failed with rc=%d\n", rc);
+#endif
+				}
+			}
+		}
+
+		if (cacerts[id]) {
+			removeObjectsWithTokenId(token, (CA_CERTIFICATE_PREFIX << 8) | id);
+
+			if (containsFile(filelist, listlen, CA_CERTIFICATE_PREFIX, id)) {
+				rc = addCACertificateObject(token, id);
+				if (rc != CKR_OK) {
+#ifdef DEBUG
+					debug("addCACertificateAndKeyObjects failed with rc=%d\n", rc);
+#endif
+				}
+			}
+		}
+
+		if (data[id]) {
+			removeObjectsWithTokenId(token, (DCOD_PREFIX << 8) | id);
+			freeDataObjectDescription(&sc->p15data[id]);
+
+			if (containsFile(filelist, listlen, DCOD_PREFIX, id)) {
+				rc = addDataObject(token, id);
+				if (rc != CKR_OK) {
+#ifdef DEBUG
+					debug("addDataObject failed with rc=%d\n", rc);
+#endif
+				}
+			}
+		}
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+static int sc_hsm_loadObjects(struct p11Token_t *token)
+{
+	unsigned char filelist[MAX_FILES * 2];
+	struct p11Slot_t *slot = token->slot;
+	int rc;
+
+	FUNC_CALLED();
+
+	rc = enumerateObjects(slot, filelist, sizeof(filelist));
+	if (rc < 0) {
+		FUNC_FAILS(rc, "enumerateObjects failed");
+	}
+
+	rc = updateObjects(token, filelist, rc);
+
+	FUNC_RETURNS(rc);
+}
+
+
+
+/**
+ * Synchronize token objects with keys and certificates created or deleted by other
+ * applications or processes
+ *
+ * Objects are only read for files that appeared since the last enumeration, so the
+ * cost is proportional to the number of changes.
+ */
+static int sc_hsm_synchronize(struct p11Slot_t *slot, struct p11Token_t *token)
+{
+	unsigned char filelist[MAX_FILES * 2];
+	int rc;
+
+	FUNC_CALLED();
 
-	if (SW1SW2 != 0x9000) {
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Signature operation failed");
-	}
+	rc = enumerateObjects(slot, filelist, sizeof(filelist));
 
-	if ((algo == ALGO_EC_RAW) || (algo == ALGO_EC_SHA1)) {
-		rc = decodeECDSASignature(scr, rc, pSignature, *pulSignatureLen);
+	if (rc < 0) {
+		// The applet is no longer selected if the card was reset
+		rc = selectApplet(slot);
 		if (rc < 0) {
-			FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "supplied buffer too small");
+			FUNC_FAILS(CKR_DEVICE_ERROR, "applet selection failed");
+		}
+
+		rc = enumerateObjects(slot, filelist, sizeof(filelist));
+		if (rc < 0) {
+			FUNC_FAILS(CKR_DEVICE_ERROR, "enumerateObjects failed");
 		}
 	}
 
-	*pulSignatureLen = rc;
-	FUNC_RETURNS(CKR_OK);
+	rc = updateObjects(token, filelist, rc);
+
+	FUNC_RETURNS(rc);
 }
 
 
 
-static int sc_hsm_C_DecryptInit(struct p11Object_t *pObject, CK_MECHANISM_PTR mech)
+static CK_ATTRIBUTE_PTR getObjectAttribute(struct p11Object_t *object, CK_ATTRIBUTE_TYPE type)
 {
-	int algo;
+	CK_ATTRIBUTE template = { 0, NULL, 0 };
+	struct p11Attribute_t *attr;
 
-	FUNC_CALLED();
+	template.type = type;
 
-	algo = getAlgorithmIdForDecryption(mech->mechanism);
-	if (algo < 0) {
-		FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism not supported");
+	if (findAttribute(object, &template, &attr) < 0) {
+		return NULL;
 	}
-
-	FUNC_RETURNS(CKR_OK);
+	return &attr->attrData;
 }
 
 
 
-static int stripPKCS15Padding(unsigned char *scr, int len, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+static char *copyStringAttribute(struct p11Object_t *object, CK_ATTRIBUTE_TYPE type)
 {
-	int c1,c2,c3;
+	CK_ATTRIBUTE_PTR attr;
+	char *str;
 
-	c1 = *scr++ == 0x00;
-	c2 = *scr++ == 0x02;
-	len -= 2;
-	while ((len > 0) && *scr) {
-		scr++;
-		len--;
-	}
-	c3 = len > 0;
+	attr = getObjectAttribute(object, type);
 
-	if (!(c1 && c2 && c3)) {
-		return CKR_ENCRYPTED_DATA_INVALID;
+	if ((attr == NULL) || (attr->ulValueLen == 0)) {
+		return NULL;
 	}
 
-	scr++;
-	len--;
-
-	if (len > *pulDataLen) {
-		return CKR_BUFFER_TOO_SMALL;
+	str = calloc(attr->ulValueLen + 1, 1);
+	if (str != NULL) {
+		memcpy(str, attr->pValue, attr->ulValueLen);
 	}
-
-	memcpy(pData, scr, len);
-	*pulDataLen = len;
-
-	return CKR_OK;
+	return str;
 }
 
 
 
-static int sc_hsm_C_Decrypt(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+/**
+ * Determine an identifier not used by a data object on the device or in the cached list of files
+ */
+static int allocateDataObjectId(struct token_sc_hsm *sc, unsigned char *filelist, int listlen)
 {
-	int rc, algo;
-	unsigned short SW1SW2;
-	unsigned char scr[256];
+	int id;
+
+	for (id = 1; id < 256; id++) {
+		if (!containsFile(filelist, listlen, DCOD_PREFIX, id) &&
+			!containsFile(filelist, listlen, DATA_PREFIX, id) &&
+			!containsFile(filelist, listlen, PROT_DATA_PREFIX, id) &&
+			!containsFile(sc->filelist, sc->filelistlen, DCOD_PREFIX, id) &&
+			!containsFile(sc->filelist, sc->filelistlen, DATA_PREFIX, id) &&
+			!containsFile(sc->filelist, sc->filelistlen, PROT_DATA_PREFIX, id)) {
+			return id;
+		}
+	}
+	return -1;
+}
 
-	FUNC_CALLED();
 
-	if (pData == NULL) {
-		*pulDataLen = pObject->keysize >> 3;
-		FUNC_RETURNS(CKR_OK);
-	}
 
-	algo = getAlgorithmIdForDecryption(mech);
-	if (algo < 0) {
-		FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism not supported");
-	}
+/**
+ * Write the EF and delete it before, if the new content is shorter than the current content
+ *
+ * UPDATE BINARY does not truncate the EF, so the old tail would otherwise remain.
+ */
+static int replaceEF(struct p11Slot_t *slot, unsigned char prefix, unsigned char id, unsigned char *content, size_t len, unsigned short *curlen)
+{
+	struct token_sc_hsm *sc;
+	int rc;
 
-	rc = transmitAPDU(pObject->token->slot, 0x80, 0x62, (unsigned char)pObject->tokenid, (unsigned char)algo,
-			ulEncryptedDataLen, pEncryptedData,
-			0, scr, sizeof(scr), &SW1SW2);
+	sc = getPrivateData(slot->token);
 
-	if (rc < 0) {
-		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
+	if ((len < *curlen) && containsFile(sc->filelist, sc->filelistlen, prefix, id)) {
+		rc = deleteEF(slot, (prefix << 8) | id);
+		if (rc < 0) {
+			return rc;
+		}
 	}
 
-	if (SW1SW2 != 0x9000) {
-		FUNC_FAILS(CKR_ENCRYPTED_DATA_INVALID, "Decryption operation failed");
+	rc = writeEF(slot, (prefix << 8) | id, content, len);
+	if (rc < 0) {
+		return rc;
 	}
 
-	if (mech == CKM_RSA_X_509) {
-		if (rc > *pulDataLen) {
-			*pulDataLen = rc;
-			FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "supplied buffer too small");
-		}
-		*pulDataLen = rc;
-		memcpy(pData, scr, rc);
-	} else {
-		rc = stripPKCS15Padding(scr, rc, pData, pulDataLen);
-		if (rc != CKR_OK) {
-			FUNC_FAILS(rc, "Invalid PKCS#1 padding");
-		}
-	}
+	*curlen = (unsigned short)len;
+	addFile(sc, prefix, id);
 
-	FUNC_RETURNS(CKR_OK);
+	return 0;
 }
 
 
 
-static int addEECertificateAndKeyObjects(struct p11Token_t *token, unsigned char id)
+/**
+ * Write a data object to the device
+ *
+ * The value is stored in the EF with prefix DATA_PREFIX or PROT_DATA_PREFIX, the
+ * PKCS#15 description in the DCOD EF with the same identifier. The written files are
+ * added to the list of known files, so that the next synchronization does not reload
+ * the object. Objects of other classes are not stored by PKCS#11.
+ *
+ * @param slot      The slot in which the token is inserted
+ * @param token     The token
+ * @param object    The created or modified object
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+static int sc_hsm_writeObject(struct p11Slot_t *slot, struct p11Token_t *token, struct p11Object_t *object)
 {
-	unsigned char certValue[MAX_CERTIFICATE_SIZE];
-	struct p11Object_t *p11cert, *p11pubkey, *p11prikey;
-	struct p15PrivateKeyDescription *p15key = NULL;
-	struct p15CertificateDescription p15cert;
-	unsigned char prkd[MAX_P15_SIZE];
-	int rc;
+	struct token_sc_hsm *sc;
+	struct p15DataObjectDescription p15;
+	CK_ATTRIBUTE_PTR attr, value;
+	unsigned char filelist[MAX_FILES * 2], dcod[MAX_P15_SIZE], path[2];
+	unsigned char prefix, oprefix;
+	int rc, id, listlen;
 
 	FUNC_CALLED();
 
-	rc = readEF(token->slot, (PRKD_PREFIX << 8) | id, prkd, sizeof(prkd));
+	sc = getPrivateData(token);
 
-	if (rc < 0) {
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Error reading private key description");
+	attr = getObjectAttribute(object, CKA_CLASS);
+
+	if ((attr == NULL) || (*(CK_OBJECT_CLASS *)attr->pValue != CKO_DATA)) {
+		FUNC_RETURNS(CKR_OK);
 	}
 
-	rc = decodePrivateKeyDescription(prkd, rc, &p15key);
+	value = getObjectAttribute(object, CKA_VALUE);
 
-	if (rc < 0) {
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Error decoding private key description");
+	if ((value == NULL) || (value->ulValueLen > MAX_DATA_OBJECT_SIZE)) {
+		FUNC_FAILS(CKR_ATTRIBUTE_VALUE_INVALID, "Data object value exceeds maximum size");
 	}
 
-	rc = readEF(token->slot, (EE_CERTIFICATE_PREFIX << 8) | id, certValue, sizeof(certValue));
+	if ((object->tokenid >> 8) == DCOD_PREFIX) {
+		id = object->tokenid & 0xFF;
+	} else {
+		// Other applications may have created data objects since the last synchronization
+		listlen = enumerateObjects(slot, filelist, sizeof(filelist));
 
-	if (rc < 0) {
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Error reading certificate");
-	}
+		if (listlen < 0) {
+			FUNC_FAILS(CKR_DEVICE_ERROR, "enumerateObjects failed");
+		}
 
-	// A SmartCard-HSM does not store a separate P15 certificate description. Copy from key description
-	memset(&p15cert, 0, sizeof(p15cert));
-	p15cert.certtype = P15_CT_X509;
-	p15cert.coa = p15key->coa;
-	p15cert.id = p15key->id;
-	p15cert.isCA = 0;
+		id = allocateDataObjectId(sc, filelist, listlen);
 
-	rc = createCertificateObjectFromP15(&p15cert, certValue, rc, &p11cert);
+		if (id < 0) {
+			FUNC_FAILS(CKR_DEVICE_MEMORY, "No free identifier for data object");
+		}
 
-	if (rc != CKR_OK) {
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not create P11 certificate object");
+		sc->dataLength[id] = 0;
+		sc->dcodLength[id] = 0;
 	}
 
-	p11cert->tokenid = (int)id;
-
-	addObject(token, p11cert, TRUE);
+	if (!containsFile(sc->filelist, sc->filelistlen, DCOD_PREFIX, id) &&
+		(sc->filelistlen + 4 > sizeof(sc->filelist))) {
+		FUNC_FAILS(CKR_DEVICE_MEMORY, "Maximum number of files exceeded");
+	}
 
-	// As a side effect p11cert->keysize is updated with the key size determined from the public key
-	rc = createPublicKeyObjectFromCertificate(p15key, p11cert, &p11pubkey);
+	prefix = object->publicObj ? DATA_PREFIX : PROT_DATA_PREFIX;
+	oprefix = object->publicObj ? PROT_DATA_PREFIX : DATA_PREFIX;
 
-	if (rc != CKR_OK) {
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not create public key object");
+	// An object changed to private must not leave the readable value behind
+	if (containsFile(sc->filelist, sc->filelistlen, oprefix, id)) {
+		rc = deleteEF(slot, (oprefix << 8) | id);
+		if (rc < 0) {
+			FUNC_FAILS(CKR_DEVICE_ERROR, "Could not delete data object value");
+		}
+		removeFile(sc, oprefix, id);
+		sc->dataLength[id] = 0;
 	}
 
-	addObject(token, p11pubkey, TRUE);
+	// The value is written first, so that the description never refers to a missing EF
+	// Changes made by this application are not reported as rewritten by the next synchronization
+	sc->dataHash[id] = hashContent(value->pValue, value->ulValueLen);
 
-	rc = createPrivateKeyObjectFromP15(p15key, p11cert, FALSE, &p11prikey);
+	rc = replaceEF(slot, prefix, id, value->pValue, value->ulValueLen, &sc->dataLength[id]);
 
-	if (rc != CKR_OK) {
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not create private key object");
+	if (rc < 0) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not write data object value");
 	}
 
-	p11prikey->C_SignInit = sc_hsm_C_SignInit;
-	p11prikey->C_Sign = sc_hsm_C_Sign;
-	p11prikey->C_DecryptInit = sc_hsm_C_DecryptInit;
-	p11prikey->C_Decrypt = sc_hsm_C_Decrypt;
-
-	p11prikey->tokenid = (int)id;
-	p11prikey->keysize = p11cert->keysize;
+	memset(&p15, 0, sizeof(p15));
 
-	addObject(token, p11prikey, FALSE);
+	p15.coa.label = copyStringAttribute(object, CKA_LABEL);
+	p15.applicationName = copyStringAttribute(object, CKA_APPLICATION);
 
-	freePrivateKeyDescription(&p15key);
-	FUNC_RETURNS(CKR_OK);
-}
+	if (!object->publicObj) {
+		p15.coa.flags |= P15_PRIVATE;
+	}
 
+	attr = getObjectAttribute(object, CKA_MODIFIABLE);
+	if ((attr != NULL) && (attr->ulValueLen == sizeof(CK_BBOOL)) && *(CK_BBOOL *)attr->pValue) {
+		p15.coa.flags |= P15_MODIFIABLE;
+	}
 
+	attr = getObjectAttribute(object, CKA_OBJECT_ID);
+	if (attr != NULL) {
+		p15.applicationOID.val = attr->pValue;
+		p15.applicationOID.len = attr->ulValueLen;
+	}
 
-static int addCACertificateObject(struct p11Token_t *token, unsigned char id)
-{
-	unsigned char certValue[MAX_CERTIFICATE_SIZE];
-	struct p11Object_t *p11cert;
-	struct p15CertificateDescription *p15cert;
-	unsigned char cd[MAX_P15_SIZE];
-	int rc;
+	path[0] = prefix;
+	path[1] = id;
+	p15.efidOrPath.val = path;
+	p15.efidOrPath.len = sizeof(path);
 
-	FUNC_CALLED();
+	rc = encodeDataObjectDescription(&p15, dcod, sizeof(dcod));
 
-	rc = readEF(token->slot, (CD_PREFIX << 8) | id, cd, sizeof(cd));
+	if (p15.coa.label) {
+		free(p15.coa.label);
+	}
+	if (p15.applicationName) {
+		free(p15.applicationName);
+	}
 
 	if (rc < 0) {
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Error reading certificate description");
+		FUNC_FAILS(CKR_ATTRIBUTE_VALUE_INVALID, "Data object description exceeds maximum size");
 	}
 
-	rc = decodeCertificateDescription(cd, rc, &p15cert);
+	sc->dcodHash[id] = hashContent(dcod, rc);
+
+	rc = replaceEF(slot, DCOD_PREFIX, id, dcod, rc, &sc->dcodLength[id]);
 
 	if (rc < 0) {
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Error decoding certificate description");
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not write data object description");
 	}
 
-	rc = readEF(token->slot, (CA_CERTIFICATE_PREFIX << 8) | id, certValue, sizeof(certValue));
+	object->tokenid = (DCOD_PREFIX << 8) | id;
 
-	if (rc < 0) {
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Error reading certificate");
-	}
+	FUNC_RETURNS(CKR_OK);
+}
 
-	p15cert->isCA = 1;
-	rc = createCertificateObjectFromP15(p15cert, certValue, rc, &p11cert);
 
-	if (rc != CKR_OK) {
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not create P11 certificate object");
+
+/**
+ * Check that a data object can be written with the attribute changes in pTemplate
+ *
+ * @param token     The token
+ * @param object    The object to be modified
+ * @param pTemplate The attributes to change
+ * @param ulCount   The number of attributes in pTemplate
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+static int sc_hsm_checkObject(struct p11Token_t *token, struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+	CK_ATTRIBUTE_PTR attr;
+	int i;
+
+	FUNC_CALLED();
+
+	attr = getObjectAttribute(object, CKA_CLASS);
+
+	// Objects of other classes are not stored by PKCS#11
+	if ((attr == NULL) || (*(CK_OBJECT_CLASS *)attr->pValue != CKO_DATA)) {
+		FUNC_FAILS(CKR_ATTRIBUTE_READ_ONLY, "Only data objects can be modified");
 	}
 
-	p11cert->tokenid = (int)id;
+	i = findAttributeInTemplate(CKA_VALUE, pTemplate, ulCount);
 
-	addObject(token, p11cert, TRUE);
+	if ((i >= 0) && (pTemplate[i].ulValueLen > MAX_DATA_OBJECT_SIZE)) {
+		FUNC_FAILS(CKR_ATTRIBUTE_VALUE_INVALID, "Data object value exceeds maximum size");
+	}
 
 	FUNC_RETURNS(CKR_OK);
 }
 
 
 
-static int sc_hsm_loadObjects(struct p11Token_t *token)
+/**
+ * Delete the files of a data object from the device
+ *
+ * @param slot      The slot in which the token is inserted
+ * @param token     The token
+ * @param object    The object to delete
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+static int sc_hsm_deleteObject(struct p11Slot_t *slot, struct p11Token_t *token, struct p11Object_t *object)
 {
-	unsigned char filelist[MAX_FILES * 2];
-	struct p11Slot_t *slot = token->slot;
-	int rc,listlen,i,id,prefix;
+	static const unsigned char prefixes[] = { DCOD_PREFIX, DATA_PREFIX, PROT_DATA_PREFIX };
+	struct token_sc_hsm *sc;
+	int rc, i, id;
 
 	FUNC_CALLED();
 
-	rc = enumerateObjects(slot, filelist, sizeof(filelist));
-	if (rc < 0) {
-		FUNC_FAILS(rc, "enumerateObjects failed");
+	if ((object->tokenid >> 8) != DCOD_PREFIX) {
+		FUNC_RETURNS(CKR_OK);
 	}
 
-	listlen = rc;
-	for (i = 0; i < listlen; i += 2) {
-		prefix = filelist[i];
-		id = filelist[i + 1];
+	sc = getPrivateData(token);
+	id = object->tokenid & 0xFF;
 
-		switch(prefix) {
-		case KEY_PREFIX:
-			if (id != 0) {				// Skip Device Authentication Key
-				rc = addEECertificateAndKeyObjects(token, id);
-				if (rc != CKR_OK) {
-#ifdef DEBUG
-					debug("addEECertificateAndKeyObjects failed with rc=%d\n", rc);
-#endif
-				}
-			}
-			break;
-		case CA_CERTIFICATE_PREFIX:
-			rc = addCACertificateObject(token, id);
-			if (rc != CKR_OK) {
-#ifdef DEBUG
-				debug("addCACertificateAndKeyObjects failed with rc=%d\n", rc);
-#endif
-			}
-			break;
+	// The description is deleted first, so that an interrupted delete leaves no visible object
+	for (i = 0; i < sizeof(prefixes); i++) {
+		if (!containsFile(sc->filelist, sc->filelistlen, prefixes[i], id)) {
+			continue;
+		}
+
+		rc = deleteEF(slot, (prefixes[i] << 8) | id);
+
+		if (rc < 0) {
+			FUNC_FAILS(CKR_DEVICE_ERROR, "Could not delete data object");
 		}
+
+		removeFile(sc, prefixes[i], id);
 	}
 
+	sc->dataLength[id] = 0;
+	sc->dcodLength[id] = 0;
+
 	FUNC_RETURNS(CKR_OK);
 }
 
@@ -803,6 +1608,12 @@ static int sc_hsm_login(struct p11Slot_t *slot, int userType, unsigned char *pin
 		if (rc != CKR_OK) {
 			FUNC_FAILS(rc, "sc_hsm_login failed");
 		}
+
+		loadPrivateDataObjects(slot->token);
+
+		if (!getPrivateData(slot->token)->privateKeysLoaded) {
+			loadPrivateKeyObjects(slot->token);
+		}
 	}
 
 	FUNC_RETURNS(rc);
@@ -1114,6 +1925,21 @@ static int getMechanismInfo(CK_MECHANISM_TYPE type, CK_MECHANISM_INFO_PTR pInfo)
 
 
 
+static void sc_hsm_freeToken(struct p11Token_t *token)
+{
+	struct token_sc_hsm *sc;
+	int id;
+
+	sc = getPrivateData(token);
+
+	for (id = 0; id < 256; id++) {
+		freePrivateKeyDescription(&sc->p15keys[id]);
+		freeDataObjectDescription(&sc->p15data[id]);
+	}
+}
+
+
+
 struct p11TokenDriver *getSmartCardHSMTokenDriver()
 {
 	static struct p11TokenDriver sc_hsm_token = {
@@ -1124,13 +1950,18 @@ struct p11TokenDriver *getSmartCardHSMTokenDriver()
 		0,
 		isCandidate,
 		newSmartCardHSMToken,
-		NULL,
+		sc_hsm_freeToken,
 		getMechanismList,
 		getMechanismInfo,
 		sc_hsm_login,
 		sc_hsm_logout,
 		sc_hsm_initpin,
 		sc_hsm_setpin,
+		sc_hsm_synchronize,
+		sc_hsm_writeObject,
+		sc_hsm_deleteObject,
+		sc_hsm_checkObject,
+		NULL,
 
 		sc_hsm_C_DecryptInit,	// int (*C_DecryptInit)  (struct p11Object_t *, CK_MECHANISM_PTR);
 		sc_hsm_C_Decrypt,		// int (*C_Decrypt)      (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
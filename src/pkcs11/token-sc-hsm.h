@@ -36,11 +36,13 @@
 
 #include <pkcs11/cryptoki.h>
 #include <pkcs11/p11generic.h>
+#include <pkcs11/pkcs15.h>
 
 #define MAX_ATR					40
 #define MAX_EXT_APDU_LENGTH		1014
 #define MAX_FILES				128
 #define MAX_P15_SIZE			1024
+#define MAX_DATA_OBJECT_SIZE	4096
 
 #define PRKD_PREFIX				0xC4		/* Hi byte in file identifier for PKCS#15 PRKD objects */
 #define CD_PREFIX				0xC8		/* Hi byte in file identifier for PKCS#15 CD objects */
@@ -71,6 +73,15 @@
 
 struct token_sc_hsm {
 	unsigned char sopin[8];
+	unsigned char filelist[MAX_FILES * 2];	/* Files found with the last enumeration */
+	int filelistlen;
+	struct p15PrivateKeyDescription *p15keys[256];	/* Keys without private key object */
+	int privateKeysLoaded;					/* Private key objects created after login */
+	struct p15DataObjectDescription *p15data[256];	/* Private data objects deferred until login */
+	unsigned short dataLength[256];			/* Size of the data object value EFs */
+	unsigned short dcodLength[256];			/* Size of the data object description EFs */
+	unsigned long dataHash[256];			/* Hash of the data object value EFs */
+	unsigned long dcodHash[256];			/* Hash of the data object description EFs */
 };
 
 struct p11TokenDriver *sc_hsm_getDriver();
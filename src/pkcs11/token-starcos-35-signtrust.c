@@ -54,7 +54,7 @@ static unsigned char atr352ST[] = { 0x3B,0xDD,0x96,0xFF,0x81,0x31,0xFE,0x45,0x80
 static struct p15PrivateKeyDescription prkd_eSign1[] = {
 		{
 			P15_KT_RSA,
-			{ "C.CH.DS" },
+			{ "C.CH.DS", 0 },
 			1,
 			{ (unsigned char *)"\x01", 1 },
 			P15_SIGN|P15_NONREPUDIATION,
@@ -68,7 +68,7 @@ static struct p15PrivateKeyDescription prkd_eSign1[] = {
 static struct p15PrivateKeyDescription prkd_eSign2[] = {
 		{
 			P15_KT_RSA,
-			{ "C2.CH.DS" },
+			{ "C2.CH.DS", 0 },
 			1,
 			{ (unsigned char *)"\x02", 1 },
 			P15_SIGN|P15_NONREPUDIATION,
@@ -83,28 +83,28 @@ static struct p15CertificateDescription certd_eSign1[] = {
 	{
 		0,                                          // isCA
 		P15_CT_X509,                                // Certificate type
-		{ "C.CH.DS" },                              // Label
+		{ "C.CH.DS", 0 },                              // Label
 		{ (unsigned char *)"\x01", 1 },				// Id
 		{ (unsigned char *)"\xC0\x00", 2 }			// efifOrPath
 	},
 	{
 		1,
 		P15_CT_X509,
-		{ "C.CA.DS" },
+		{ "C.CA.DS", 0 },
 		{ (unsigned char *)"\x11", 1 },
 		{ (unsigned char *)"\xC0\x08", 2 }
 	},
 	{
 		0,
 		P15_CT_X509_ATTRIBUTE,
-		{ "C.ATTRIBUTE.DS" },
+		{ "C.ATTRIBUTE.DS", 0 },
 		{ (unsigned char *)"\x21", 1 },
 		{ (unsigned char *)"\xC1\x00", 2 }
 	},
 	{
 		0,
 		P15_CT_X509,
-		{ "C.RCA.DS" },
+		{ "C.RCA.DS", 0 },
 		{ (unsigned char *)"\x31", 1 },
 		{ (unsigned char *)"\xC0\x0E", 2 }
 	}
@@ -117,21 +117,21 @@ static struct p15CertificateDescription certd_eSign2[] = {
 	{
 		0,
 		P15_CT_X509,
-		{ "C2.CH.DS" },
+		{ "C2.CH.DS", 0 },
 		{ (unsigned char *)"\x02", 1 },
 		{ (unsigned char *)"\xC0\x01", 2 }
 	},
 	{
 		1,
 		P15_CT_X509,
-		{ "C2.CA.DS" },
+		{ "C2.CA.DS", 0 },
 		{ (unsigned char *)"\x12", 1 },
 		{ (unsigned char *)"\xC0\x09", 2 }
 	},
 	{
 		0,
 		P15_CT_X509_ATTRIBUTE,
-		{ "C2.ATTRIBUTE.DS" },
+		{ "C2.ATTRIBUTE.DS", 0 },
 		{ (unsigned char *)"\x22", 1 },
 		{ (unsigned char *)"\xC1\x03", 2 }
 	}
@@ -143,7 +143,7 @@ static struct p15CertificateDescription certd_eSign2[] = {
 static struct p15PrivateKeyDescription prkd_eUserPKI[] = {
 		{
 			P15_KT_RSA,
-			{ "C.CH.AUT" },
+			{ "C.CH.AUT", 0 },
 			1,
 			{ (unsigned char *)"\x03", 1 },
 			P15_SIGN|P15_DECIPHER,
@@ -152,7 +152,7 @@ static struct p15PrivateKeyDescription prkd_eUserPKI[] = {
 		},
 		{
 			P15_KT_RSA,
-			{ "C.CH.ENC" },
+			{ "C.CH.ENC", 0 },
 			1,
 			{ (unsigned char *)"\x04", 1 },
 			P15_DECIPHER,
@@ -167,42 +167,42 @@ static struct p15CertificateDescription certd_eUserPKI[] = {
 	{
 		0,                                          // isCA
 		P15_CT_X509,                                // Certificate type
-		{ "C.CH.AUT" },                             // Label
+		{ "C.CH.AUT", 0 },                             // Label
 		{ (unsigned char *)"\x03", 1 },				// Id
 		{ (unsigned char *)"\xC5\x00", 2 }			// efifOrPath
 	},
 	{
 		1,
 		P15_CT_X509,
-		{ "C.CA.AUT" },
+		{ "C.CA.AUT", 0 },
 		{ (unsigned char *)"\x11", 1 },
 		{ (unsigned char *)"\xC5\x08", 2 }
 	},
 	{
 		1,
 		P15_CT_X509,
-		{ "C.RCA.AUT" },
+		{ "C.RCA.AUT", 0 },
 		{ (unsigned char *)"\x31", 1 },
 		{ (unsigned char *)"\xC5\x0E", 2 }
 	},
 	{
 		0,                                          // isCA
 		P15_CT_X509,                                // Certificate type
-		{ "C.CH.ENC" },                             // Label
+		{ "C.CH.ENC", 0 },                             // Label
 		{ (unsigned char *)"\x04", 1 },				// Id
 		{ (unsigned char *)"\xC2\x00", 2 }			// efifOrPath
 	},
 	{
 		1,
 		P15_CT_X509,
-		{ "C.CA.ENC" },
+		{ "C.CA.ENC", 0 },
 		{ (unsigned char *)"\x12", 1 },
 		{ (unsigned char *)"\xC2\x08", 2 }
 	},
 	{
 		1,
 		P15_CT_X509,
-		{ "C.RCA.ENC" },
+		{ "C.RCA.ENC", 0 },
 		{ (unsigned char *)"\x32", 1 },
 		{ (unsigned char *)"\xC2\x0E", 2 }
 	}
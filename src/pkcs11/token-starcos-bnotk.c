@@ -56,7 +56,7 @@ static unsigned char atr352_2[] = { 0x3B,0xD9,0x96,0xFF,0x81,0x31,0xFE,0x45,0x80
 static struct p15PrivateKeyDescription prkd_eSign1[] = {
 		{
 			P15_KT_RSA,
-			{ "C.CH.DS" },
+			{ "C.CH.DS", 0 },
 			1,
 			{ (unsigned char *)"\x01", 1 },
 			P15_SIGN|P15_NONREPUDIATION,
@@ -70,7 +70,7 @@ static struct p15PrivateKeyDescription prkd_eSign1[] = {
 static struct p15PrivateKeyDescription prkd_eSign2[] = {
 		{
 			P15_KT_RSA,
-			{ "C2.CH.DS" },
+			{ "C2.CH.DS", 0 },
 			1,
 			{ (unsigned char *)"\x02", 1 },
 			P15_SIGN|P15_NONREPUDIATION,
@@ -85,21 +85,21 @@ static struct p15CertificateDescription certd_eSign1[] = {
 	{
 		0,                                          // isCA
 		P15_CT_X509,                                // Certificate type
-		{ "C.CH.DS" },                              // Label
+		{ "C.CH.DS", 0 },                              // Label
 		{ (unsigned char *)"\x01", 1 },				// Id
 		{ (unsigned char *)"\xC0\x01", 2 }			// efifOrPath
 	},
 	{
 		1,
 		P15_CT_X509,
-		{ "C.CA.DS" },
+		{ "C.CA.DS", 0 },
 		{ (unsigned char *)"\x11", 1 },
 		{ (unsigned char *)"\xC0\x11", 2 }
 	},
 	{
 		0,
 		P15_CT_X509_ATTRIBUTE,
-		{ "C.ATTRIBUTE.DS" },
+		{ "C.ATTRIBUTE.DS", 0 },
 		{ (unsigned char *)"\x21", 1 },
 		{ (unsigned char *)"\xC0\x13", 2 }
 	},
@@ -112,21 +112,21 @@ static struct p15CertificateDescription certd_eSign2[] = {
 	{
 		0,
 		P15_CT_X509,
-		{ "C2.CH.DS" },
+		{ "C2.CH.DS", 0 },
 		{ (unsigned char *)"\x02", 1 },
 		{ (unsigned char *)"\xC0\x02", 2 }
 	},
 	{
 		1,
 		P15_CT_X509,
-		{ "C2.CA.DS" },
+		{ "C2.CA.DS", 0 },
 		{ (unsigned char *)"\x12", 1 },
 		{ (unsigned char *)"\xC0\x12", 2 }
 	},
 	{
 		0,
 		P15_CT_X509_ATTRIBUTE,
-		{ "C2.ATTRIBUTE.DS" },
+		{ "C2.ATTRIBUTE.DS", 0 },
 		{ (unsigned char *)"\x22", 1 },
 		{ (unsigned char *)"\xC0\x14", 2 }
 	}
@@ -138,7 +138,7 @@ static struct p15CertificateDescription certd_eSign2[] = {
 static struct p15PrivateKeyDescription prkd_eUserPKI[] = {
 		{
 			P15_KT_RSA,
-			{ "C.CH.AUT" },
+			{ "C.CH.AUT", 0 },
 			1,
 			{ (unsigned char *)"\x03", 1 },
 			P15_SIGN|P15_DECIPHER,
@@ -153,14 +153,14 @@ static struct p15CertificateDescription certd_eUserPKI[] = {
 	{
 		0,                                          // isCA
 		P15_CT_X509,                                // Certificate type
-		{ "C.CH.AUT" },                             // Label
+		{ "C.CH.AUT", 0 },                             // Label
 		{ (unsigned char *)"\x03", 1 },				// Id
 		{ (unsigned char *)"\xC0\x03", 2 }			// efifOrPath
 	},
 	{
 		1,
 		P15_CT_X509,
-		{ "C.CA.AUT" },
+		{ "C.CA.AUT", 0 },
 		{ (unsigned char *)"\x11", 1 },
 		{ (unsigned char *)"\xC0\x01", 2 }
 	}
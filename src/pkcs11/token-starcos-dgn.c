@@ -56,7 +56,7 @@ static unsigned char atr35[] = { 0x3B,0xD9,0x96,0xFF,0x81,0x31,0xFE,0x45,0x80,0x
 static struct p15PrivateKeyDescription prkd_eSign[] = {
 		{
 			P15_KT_RSA,
-			{ "C.CH.DS" },
+			{ "C.CH.DS", 0 },
 			1,
 			{ (unsigned char *)"\x01", 1 },
 			P15_SIGN|P15_NONREPUDIATION,
@@ -71,7 +71,7 @@ static struct p15CertificateDescription certd_eSign[] = {
 	{
 		0,                                          // isCA
 		P15_CT_X509,                                // Certificate type
-		{ "C.CH.DS" },                              // Label
+		{ "C.CH.DS", 0 },                              // Label
 		{ (unsigned char *)"\x01", 1 },				// Id
 		{ (unsigned char *)"\xC0\x00", 2 }			// efifOrPath
 	}
@@ -83,7 +83,7 @@ static struct p15CertificateDescription certd_eSign[] = {
 static struct p15PrivateKeyDescription prkd_eUserPKI[] = {
 		{
 			P15_KT_RSA,
-			{ "C.CH.AUT" },
+			{ "C.CH.AUT", 0 },
 			1,
 			{ (unsigned char *)"\x03", 1 },
 			P15_SIGN,
@@ -92,7 +92,7 @@ static struct p15PrivateKeyDescription prkd_eUserPKI[] = {
 		},
 		{
 			P15_KT_RSA,
-			{ "C.CH.ENC" },
+			{ "C.CH.ENC", 0 },
 			1,
 			{ (unsigned char *)"\x04", 1 },
 			P15_DECIPHER,
@@ -107,14 +107,14 @@ static struct p15CertificateDescription certd_eUserPKI[] = {
 	{
 		0,                                          // isCA
 		P15_CT_X509,                                // Certificate type
-		{ "C.CH.AUT" },                             // Label
+		{ "C.CH.AUT", 0 },                             // Label
 		{ (unsigned char *)"\x03", 1 },				// Id
 		{ (unsigned char *)"\xC5\x00", 2 }			// efifOrPath
 	},
 	{
 		0,                                          // isCA
 		P15_CT_X509,                                // Certificate type
-		{ "C.CH.ENC" },                             // Label
+		{ "C.CH.ENC", 0 },                             // Label
 		{ (unsigned char *)"\x04", 1 },				// Id
 		{ (unsigned char *)"\xC2\x00", 2 }			// efifOrPath
 	}
@@ -355,6 +355,7 @@ static int newDGNToken(struct p11Slot_t *slot, struct p11Token_t **token)
 	esign_token.isCandidate = isCandidate;
 	esign_token.newToken = newDGNToken;
 	esign_token.C_Sign = esign_C_Sign;
+	esign_token.signBatch = NULL;
 
 	rc = createStarcosToken(slot, &ptoken, &esign_token, &starcosApplications[1]);
 	if (rc != CKR_OK)
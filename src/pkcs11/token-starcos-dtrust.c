@@ -54,7 +54,7 @@ static unsigned char atr34[] = { 0x3B,0xD8,0x18,0xFF,0x81,0xB1,0xFE,0x45,0x1F,0x
 static struct p15PrivateKeyDescription prkd_eSign[] = {
 		{
 			P15_KT_RSA,
-			{ "C.CH.DS" },
+			{ "C.CH.DS", 0 },
 			1,
 			{ (unsigned char *)"\x01", 1 },
 			P15_SIGN|P15_NONREPUDIATION,
@@ -69,21 +69,21 @@ static struct p15CertificateDescription certd_eSign[] = {
 	{
 		0,                                          // isCA
 		P15_CT_X509,                                // Certificate type
-		{ "C.CH.DS" },                              // Label
+		{ "C.CH.DS", 0 },                              // Label
 		{ (unsigned char *)"\x01", 1 },				// Id
 		{ (unsigned char *)"\xC1\x03", 2 }			// efifOrPath
 	},
 	{
 		1,
 		P15_CT_X509,
-		{ "C.CA.DS" },
+		{ "C.CA.DS", 0 },
 		{ (unsigned char *)"\x11", 1 },
 		{ (unsigned char *)"\xC1\x04", 2 }
 	},
 	{
 		1,
 		P15_CT_X509,
-		{ "C.RCA.DS" },
+		{ "C.RCA.DS", 0 },
 		{ (unsigned char *)"\x12", 1 },
 		{ (unsigned char *)"\xC1\x05", 2 }
 	}
@@ -94,7 +94,7 @@ static struct p15CertificateDescription certd_eSign[] = {
 static struct p15PrivateKeyDescription prkd_eUserPKI[] = {
 		{
 			P15_KT_RSA,
-			{ "C.CH.AUT" },
+			{ "C.CH.AUT", 0 },
 			1,
 			{ (unsigned char *)"\x03", 1 },
 			P15_SIGN|P15_DECIPHER,
@@ -109,21 +109,21 @@ static struct p15CertificateDescription certd_eUserPKI[] = {
 	{
 		0,                                          // isCA
 		P15_CT_X509,                                // Certificate type
-		{ "C.CH.AUT" },                             // Label
+		{ "C.CH.AUT", 0 },                             // Label
 		{ (unsigned char *)"\x03", 1 },				// Id
 		{ (unsigned char *)"\xC1\x00", 2 }			// efifOrPath
 	},
 	{
 		1,
 		P15_CT_X509,
-		{ "C.CA.AUT" },
+		{ "C.CA.AUT", 0 },
 		{ (unsigned char *)"\x11", 1 },
 		{ (unsigned char *)"\xC1\x01", 2 }
 	},
 	{
 		1,
 		P15_CT_X509,
-		{ "C.RCA.AUT" },
+		{ "C.RCA.AUT", 0 },
 		{ (unsigned char *)"\x12", 1 },
 		{ (unsigned char *)"\xC1\x02", 2 }
 	}
@@ -608,12 +608,16 @@ static int starcos_C_SignInit(struct p11Object_t *pObject, CK_MECHANISM_PTR mech
 
 
 
-static int starcos_C_Sign(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+/**
+ * Compute a signature with the key in the selected application
+ *
+ * The caller must hold the token lock.
+ */
+static int computeSignature(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
 {
 	int rc, len, signaturelen;
 	unsigned short SW1SW2;
 	unsigned char scr[256],*s, *d;
-	struct p11Slot_t *slot;
 
 	FUNC_CALLED();
 
@@ -633,22 +637,9 @@ static int starcos_C_Sign(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, C
 		FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "Signature length is larger than buffer");
 	}
 
-	slot = pObject->token->slot;
-	starcosLock(pObject->token);
-	if (!slot->token) {
-		FUNC_RETURNS(CKR_DEVICE_REMOVED);
-	}
-
-	rc = starcosSelectApplication(pObject->token);
-	if (rc < 0) {
-		starcosUnlock(pObject->token);
-		FUNC_FAILS(CKR_DEVICE_ERROR, "selecting application failed");
-	}
-
 	if (mech != CKM_RSA_PKCS) {
 		rc = starcosDigest(pObject->token, mech, pData, ulDataLen);
 		if (rc != CKR_OK) {
-			starcosUnlock(pObject->token);
 			FUNC_FAILS(rc, "digesting failed");
 		}
 		pData = NULL;
@@ -657,7 +648,6 @@ static int starcos_C_Sign(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, C
 
 	rc = getAlgorithmIdForSigning(pObject->token, mech, &s);
 	if (rc != CKR_OK) {
-		starcosUnlock(pObject->token);
 		FUNC_FAILS(rc, "getAlgorithmIdForSigning() failed");
 	}
 
@@ -677,12 +667,10 @@ static int starcos_C_Sign(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, C
 		0, NULL, 0, &SW1SW2);
 
 	if (rc < 0) {
-		starcosUnlock(pObject->token);
 		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
 	}
 
 	if (SW1SW2 != 0x9000) {
-		starcosUnlock(pObject->token);
 		FUNC_FAILS(CKR_DEVICE_ERROR, "MANAGE SE failed");
 	}
 
@@ -691,22 +679,54 @@ static int starcos_C_Sign(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, C
 			0, pSignature, *pulSignatureLen, &SW1SW2);
 
 	if (rc < 0) {
-		starcosUnlock(pObject->token);
 		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
 	}
 
 	if (SW1SW2 == 0x6982) {
-		starcosUnlock(pObject->token);
 		FUNC_FAILS(CKR_USER_NOT_LOGGED_IN, "User not logged in");
 	}
 
 	if (SW1SW2 != 0x9000) {
-		starcosUnlock(pObject->token);
 		FUNC_FAILS(CKR_DEVICE_ERROR, "Signature operation failed");
 	}
 
 	*pulSignatureLen = rc;
 
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+static int starcos_C_Sign(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+	int rc;
+	struct p11Slot_t *slot;
+
+	FUNC_CALLED();
+
+	if (pSignature == NULL) {
+		FUNC_RETURNS(computeSignature(pObject, mech, pData, ulDataLen, pSignature, pulSignatureLen));
+	}
+
+	slot = pObject->token->slot;
+	starcosLock(pObject->token);
+	if (!slot->token) {
+		FUNC_RETURNS(CKR_DEVICE_REMOVED);
+	}
+
+	rc = starcosSelectApplication(pObject->token);
+	if (rc < 0) {
+		starcosUnlock(pObject->token);
+		FUNC_FAILS(CKR_DEVICE_ERROR, "selecting application failed");
+	}
+
+	rc = computeSignature(pObject, mech, pData, ulDataLen, pSignature, pulSignatureLen);
+
+	if (rc != CKR_OK) {
+		starcosUnlock(pObject->token);
+		FUNC_FAILS(rc, "computeSignature() failed");
+	}
+
 	if ((pObject->token->user == CKU_USER) && (pObject->token->pinUseCounter == 1)) {
 		pObject->token->user = INT_CKU_NO_USER;
 	}
@@ -853,28 +873,37 @@ int starcosAddCertificateObject(struct p11Token_t *token, struct p15CertificateD
 
 
 
-int starcosAddPrivateKeyObject(struct p11Token_t *token, struct p15PrivateKeyDescription *p15)
+static int findCertificateForKey(struct p11Token_t *token, struct p15PrivateKeyDescription *p15, struct p11Object_t **p11cert)
 {
 	CK_OBJECT_CLASS class = CKO_CERTIFICATE;
 	CK_ATTRIBUTE template[] = {
 			{ CKA_CLASS, &class, sizeof(class) },
 			{ CKA_ID, NULL, 0 }
 	};
-	struct p11Object_t *p11prikey, *p11pubkey, *p11cert;
-	int rc,useAA;
-
-	FUNC_CALLED();
 
 	template[1].pValue = p15->id.val;
 	template[1].ulValueLen = p15->id.len;
 
-	rc = findMatchingTokenObject(token, template, 2, &p11cert);
+	return findMatchingTokenObject(token, template, 2, p11cert);
+}
 
-	if (rc != CKR_OK) {
-		FUNC_FAILS(rc, "Could not find matching certificate");
-	}
 
-	useAA = (p15->usage & P15_NONREPUDIATION) && (token->pinUseCounter == 1);
+
+static int isAlwaysAuthenticate(struct p11Token_t *token, struct p15PrivateKeyDescription *p15)
+{
+	return (p15->usage & P15_NONREPUDIATION) && (token->pinUseCounter == 1);
+}
+
+
+
+static int addPrivateKeyObject(struct p11Token_t *token, struct p15PrivateKeyDescription *p15, struct p11Object_t *p11cert)
+{
+	struct p11Object_t *p11prikey;
+	int rc,useAA;
+
+	FUNC_CALLED();
+
+	useAA = isAlwaysAuthenticate(token, p15);
 
 	rc = createPrivateKeyObjectFromP15(p15, p11cert, useAA, &p11prikey);
 
@@ -891,6 +920,41 @@ int starcosAddPrivateKeyObject(struct p11Token_t *token, struct p15PrivateKeyDes
 	p11prikey->keysize = p15->keysize;
 	addObject(token, p11prikey, useAA ? TRUE : FALSE);
 
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Add the public key object for a private key description
+ *
+ * The private key object is only created here if it is visible without login. All other
+ * private key objects are created with the first login in starcosLoadPrivateKeyObjects().
+ */
+int starcosAddPrivateKeyObject(struct p11Token_t *token, struct p15PrivateKeyDescription *p15)
+{
+	struct starcosPrivateData *sc;
+	struct p11Object_t *p11pubkey, *p11cert;
+	int rc;
+
+	FUNC_CALLED();
+
+	rc = findCertificateForKey(token, p15, &p11cert);
+
+	if (rc != CKR_OK) {
+		FUNC_FAILS(rc, "Could not find matching certificate");
+	}
+
+	sc = starcosGetPrivateData(token);
+
+	if (sc->privateKeysLoaded || isAlwaysAuthenticate(token, p15)) {
+		rc = addPrivateKeyObject(token, p15, p11cert);
+
+		if (rc != CKR_OK) {
+			FUNC_FAILS(rc, "Could not add private key object");
+		}
+	}
+
 	rc = createPublicKeyObjectFromCertificate(p15, p11cert, &p11pubkey);
 
 	if (rc != CKR_OK) {
@@ -904,6 +968,53 @@ int starcosAddPrivateKeyObject(struct p11Token_t *token, struct p15PrivateKeyDes
 
 
 
+/**
+ * Create the private key objects deferred during token load
+ *
+ * @param token     The token after the first successful user login
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+int starcosLoadPrivateKeyObjects(struct p11Token_t *token)
+{
+	struct starcosPrivateData *sc;
+	struct p11Object_t *p11cert;
+	int rc,i;
+
+	FUNC_CALLED();
+
+	sc = starcosGetPrivateData(token);
+
+	if (sc->privateKeysLoaded) {
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	for (i = 0; i < sc->application->privateKeysLen; i++) {
+		struct p15PrivateKeyDescription *p15 = &sc->application->privateKeys[i];
+
+		if (isAlwaysAuthenticate(token, p15)) {
+			continue;
+		}
+
+		rc = findCertificateForKey(token, p15, &p11cert);
+
+		if (rc == CKR_OK) {
+			rc = addPrivateKeyObject(token, p15, p11cert);
+		}
+
+		if (rc != CKR_OK) {
+#ifdef DEBUG
+			debug("addPrivateKeyObject failed with rc=%d\n", rc);
+#endif
+		}
+	}
+
+	sc->privateKeysLoaded = TRUE;
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
 static int loadObjects(struct p11Token_t *token)
 {
 	struct starcosPrivateData *sc;
@@ -972,6 +1083,68 @@ int encodeF2B(unsigned char *pin, int pinlen, unsigned char *f2b)
 
 
 
+/**
+ * Verify the user PIN using the PIN-Pad or the provided PIN value
+ *
+ * The caller must hold the token lock and have selected the application.
+ *
+ * @param slot      The slot in which the token is inserted
+ * @param pin       Pointer to PIN value or NULL if PIN shall be verified using PIN-Pad
+ * @param pinLen    The length of the PIN supplied in pin
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+static int verifyUserPIN(struct p11Slot_t *slot, unsigned char *pin, int pinlen)
+{
+	int rc;
+	unsigned short SW1SW2;
+	unsigned char f2b[8];
+	struct starcosPrivateData *sc;
+
+	FUNC_CALLED();
+
+	sc = starcosGetPrivateData(slot->token);
+
+	if (slot->hasFeatureVerifyPINDirect && !pinlen && !pin) {
+#ifdef DEBUG
+		debug("Verify PIN using CKF_PROTECTED_AUTHENTICATION_PATH\n");
+#endif
+		memset(f2b, 0xFF, 8);
+		f2b[0] = 0x20;
+
+		rc = transmitVerifyPinAPDU(slot, 0x00, 0x20, 0x00, sc->application->pinref,
+				8, f2b,
+				&SW1SW2,
+				PIN_SYSTEM_UNIT_BYTES + PIN_POSITION_1 + PIN_LEFT_JUSTIFICATION + PIN_FORMAT_BCD, /* bmFormatString */
+				0x06, 0x0F, /* Minimum and maximum length of PIN */
+				0x47, /* bmPINBlockString: inserted PIN length is 4 bits, 7 bytes PIN block*/
+				0x04 /* bmPINLengthFormat: system units are bits, PIN length position is 4 bits*/
+				);
+	} else {
+#ifdef DEBUG
+		debug("Verify PIN using provided PIN value\n");
+#endif
+		rc = encodeF2B(pin, pinlen, f2b);
+
+		if (rc != CKR_OK) {
+			FUNC_FAILS(rc, "Could not encode PIN");
+		}
+
+		rc = transmitAPDU(slot, 0x00, 0x20, 0x00, sc->application->pinref,
+				8, f2b,
+				0, NULL, 0, &SW1SW2);
+	}
+
+	if (rc < 0) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
+	}
+
+	rc = starcosUpdatePinStatus(slot->token, SW1SW2);
+
+	FUNC_RETURNS(rc);
+}
+
+
+
 /**
  * Perform PIN verification and make private objects visible
  *
@@ -984,8 +1157,6 @@ int encodeF2B(unsigned char *pin, int pinlen, unsigned char *f2b)
 static int login(struct p11Slot_t *slot, int userType, unsigned char *pin, int pinlen)
 {
 	int rc = CKR_OK;
-	unsigned short SW1SW2;
-	unsigned char f2b[8];
 	struct starcosPrivateData *sc;
 
 	FUNC_CALLED();
@@ -1011,54 +1182,134 @@ static int login(struct p11Slot_t *slot, int userType, unsigned char *pin, int p
 			FUNC_FAILS(rc, "Could not encode PIN");
 		}
 	} else {
+		rc = verifyUserPIN(slot, pin, pinlen);
 
-		if (slot->hasFeatureVerifyPINDirect && !pinlen && !pin) {
-#ifdef DEBUG
-			debug("Verify PIN using CKF_PROTECTED_AUTHENTICATION_PATH\n");
-#endif
-			memset(f2b, 0xFF, 8);
-			f2b[0] = 0x20;
-
-			rc = transmitVerifyPinAPDU(slot, 0x00, 0x20, 0x00, sc->application->pinref,
-					8, f2b,
-					&SW1SW2,
-					PIN_SYSTEM_UNIT_BYTES + PIN_POSITION_1 + PIN_LEFT_JUSTIFICATION + PIN_FORMAT_BCD, /* bmFormatString */
-					0x06, 0x0F, /* Minimum and maximum length of PIN */
-					0x47, /* bmPINBlockString: inserted PIN length is 4 bits, 7 bytes PIN block*/
-					0x04 /* bmPINLengthFormat: system units are bits, PIN length position is 4 bits*/
-					);
-		} else {
-#ifdef DEBUG
-			debug("Verify PIN using provided PIN value\n");
-#endif
-			rc = encodeF2B(pin, pinlen, f2b);
+		if (rc != CKR_OK) {
+			starcosUnlock(slot->token);
+			FUNC_FAILS(rc, "login failed");
+		}
+
+		starcosLoadPrivateKeyObjects(slot->token);
+	}
+
+	starcosUnlock(slot->token);
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Sign a batch of data with the same key in a single hold of the token lock
+ *
+ * The PIN use counter of a qualified signature key limits the number of signatures
+ * after each VERIFY. VERIFY is sent up front if a PIN is provided and again whenever
+ * the counter is exhausted. With a PIN-Pad the PIN is requested only once the card
+ * denies the signature. A provided PIN is not used again for keys that allow only a
+ * single signature per PIN entry, so a batch on such a key produces one signature.
+ *
+ * @param pObject   The signature key
+ * @param mech      The signature mechanism
+ * @param pin       The PIN, NULL to use the current login state or the PIN-Pad
+ * @param pinlen    The length of the PIN
+ * @param items     The data to sign and the buffers receiving the signatures
+ * @param count     The number of items
+ * @return          CKR_OK or the error that terminated the batch
+ */
+static int starcos_signBatch(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, unsigned char *pin, int pinlen, SC_SIGN_BATCH_ITEM_PTR items, CK_ULONG count)
+{
+	struct p11Token_t *token;
+	struct p11Slot_t *slot;
+	CK_ULONG i;
+	int rc, remaining, reverify;
+
+	FUNC_CALLED();
+
+	token = pObject->token;
+	slot = token->slot;
+
+	starcosLock(token);
+	if (!slot->token) {
+		starcosUnlock(token);
+		FUNC_RETURNS(CKR_DEVICE_REMOVED);
+	}
+
+	rc = starcosSelectApplication(token);
+	if (rc < 0) {
+		starcosUnlock(token);
+		FUNC_FAILS(CKR_DEVICE_ERROR, "selecting application failed");
+	}
+
+	// Signatures left until the PIN must be verified again, -1 if unknown or not limited
+	remaining = -1;
+
+	if (pin != NULL) {
+		rc = verifyUserPIN(slot, pin, pinlen);
+
+		if (rc != CKR_OK) {
+			starcosUnlock(token);
+			FUNC_FAILS(rc, "PIN verification failed");
+		}
+
+		remaining = token->pinUseCounter ? token->pinUseCounter : -1;
+	}
+
+	reverify = (!pin && !pinlen && slot->hasFeatureVerifyPINDirect) || (pin && (token->pinUseCounter != 1));
+
+	rc = CKR_OK;
+	for (i = 0; i < count; i++) {
+		if (remaining == 0) {
+			rc = reverify ? verifyUserPIN(slot, pin, pinlen) : CKR_USER_NOT_LOGGED_IN;
 
 			if (rc != CKR_OK) {
-				starcosUnlock(slot->token);
-				FUNC_FAILS(rc, "Could not encode PIN");
+				items[i].rv = rc;
+				break;
 			}
 
-			rc = transmitAPDU(slot, 0x00, 0x20, 0x00, sc->application->pinref,
-					8, f2b,
-					0, NULL, 0, &SW1SW2);
+			remaining = token->pinUseCounter;
 		}
 
+		rc = computeSignature(pObject, mech, items[i].pData, items[i].ulDataLen, items[i].pSignature, &items[i].ulSignatureLen);
 
-		if (rc < 0) {
-			starcosUnlock(slot->token);
-			FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
+		// The counter was consumed before the batch started
+		if ((rc == CKR_USER_NOT_LOGGED_IN) && (remaining < 0) && reverify) {
+			rc = verifyUserPIN(slot, pin, pinlen);
+
+			if (rc == CKR_OK) {
+				remaining = token->pinUseCounter ? token->pinUseCounter : -1;
+				rc = computeSignature(pObject, mech, items[i].pData, items[i].ulDataLen, items[i].pSignature, &items[i].ulSignatureLen);
+			}
 		}
 
-		rc = starcosUpdatePinStatus(slot->token, SW1SW2);
+		items[i].rv = rc;
+
+		if (rc == CKR_BUFFER_TOO_SMALL) {
+			rc = CKR_OK;
+			continue;
+		}
 
 		if (rc != CKR_OK) {
-			starcosUnlock(slot->token);
-			FUNC_FAILS(rc, "login failed");
+			break;
+		}
+
+		// A length query does not produce a signature and leaves the counter untouched
+		if (items[i].pSignature == NULL) {
+			continue;
+		}
+
+		if (remaining > 0) {
+			remaining--;
+		} else if (token->pinUseCounter == 1) {
+			remaining = 0;
 		}
 	}
 
-	starcosUnlock(slot->token);
-	FUNC_RETURNS(CKR_OK);
+	// The security status of the card is reset once the counter is exhausted
+	if ((token->user == CKU_USER) && (remaining == 0)) {
+		token->user = INT_CKU_NO_USER;
+	}
+
+	starcosUnlock(token);
+	FUNC_RETURNS(rc);
 }
 
 
@@ -1432,6 +1683,11 @@ struct p11TokenDriver *getStarcosTokenDriver()
 		logout,
 		initpin,
 		setpin,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+		starcos_signBatch,
 
 		starcos_C_DecryptInit,	// int (*C_DecryptInit)  (struct p11Object_t *, CK_MECHANISM_PTR);
 		starcos_C_Decrypt,		// int (*C_Decrypt)      (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
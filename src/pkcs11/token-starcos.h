@@ -61,6 +61,7 @@ struct starcosPrivateData {
 	int                         selectedApplication;
 	void                        *mutex;
 	unsigned char               sopin[8];
+	int                         privateKeysLoaded;
 };
 
 struct starcosPrivateData *starcosGetPrivateData(struct p11Token_t *token);
@@ -73,6 +74,7 @@ int starcosCheckPINStatus(struct p11Slot_t *slot, unsigned char pinref);
 int starcosUpdatePinStatus(struct p11Token_t *token, int pinstatus);
 int starcosAddCertificateObject(struct p11Token_t *token, struct p15CertificateDescription *p15);
 int starcosAddPrivateKeyObject(struct p11Token_t *token, struct p15PrivateKeyDescription *p15);
+int starcosLoadPrivateKeyObjects(struct p11Token_t *token);
 int starcosDigest(struct p11Token_t *token, CK_MECHANISM_TYPE mech, unsigned char *data, size_t len);
 int starcosDeterminePinUseCounter(struct p11Token_t *token, unsigned char recref, int *useCounter, int *lifeCycle);
 int encodeF2B(unsigned char *pin, int pinlen, unsigned char *f2b);
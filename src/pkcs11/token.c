@@ -33,6 +33,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -40,8 +41,11 @@
 #include <pkcs11/strbpcpy.h>
 
 #include <pkcs11/token.h>
+#include <pkcs11/slot.h>
 #include <pkcs11/object.h>
+#include <pkcs11/session.h>
 #include <pkcs11/dataobject.h>
+#include <pkcs11/apducache.h>
 
 #include <pkcs11/token-sc-hsm.h>
 
@@ -72,6 +76,169 @@ static tokenDriver_t tokenDriver[] = {
 
 
 
+#define OBJECT_INDEX_SIZE		256		/* Number of hash buckets, must be a power of 2 */
+#define OBJECT_INDEX_HASH_INIT	2166136261UL	/* FNV-1a offset basis */
+
+/**
+ * Entry in the object index
+ */
+struct objectIndexEntry {
+	unsigned long hash;                 /**< Hash of the indexed attribute value(s)         */
+	struct p11Object_t *object;         /**< The indexed object                             */
+	int publicObject;                   /**< Object is in the list of public objects        */
+	struct objectIndexEntry *next;      /**< Next entry in the same bucket                  */
+};
+
+/**
+ * Hash index over token objects by CKA_SUBJECT and by CKA_ISSUER plus CKA_SERIAL_NUMBER
+ *
+ * The index is built with the first search after the list of token objects changed.
+ */
+struct p11ObjectIndex_t {
+	int valid;                          /**< Index matches the current list of objects      */
+	struct objectIndexEntry *subject[OBJECT_INDEX_SIZE];
+	struct objectIndexEntry *issuerSerial[OBJECT_INDEX_SIZE];
+	struct objectIndexEntry *entries;   /**< Storage for all entries                        */
+};
+
+
+
+/**
+ * Mark the object index as outdated after the list of token objects changed
+ *
+ * @param token     The token whose objects changed
+ */
+void invalidateObjectIndex(struct p11Token_t *token)
+{
+	if (token->objectIndex) {
+		token->objectIndex->valid = 0;
+	}
+}
+
+
+
+static void freeObjectIndex(struct p11Token_t *token)
+{
+	if (token->objectIndex) {
+		free(token->objectIndex->entries);
+		free(token->objectIndex);
+		token->objectIndex = NULL;
+	}
+}
+
+
+
+static unsigned long hashAttributeValue(unsigned long hash, CK_ATTRIBUTE_PTR attr)
+{
+	unsigned char *p = (unsigned char *)attr->pValue;
+	CK_ULONG len = attr->ulValueLen;
+
+	while (len--) {
+		hash ^= *p++;
+		hash = (hash * 16777619UL) & 0xFFFFFFFFUL;
+	}
+	return hash;
+}
+
+
+
+static int getObjectAttribute(struct p11Object_t *object, CK_ATTRIBUTE_TYPE type, CK_ATTRIBUTE_PTR *attr)
+{
+	CK_ATTRIBUTE template = { 0, NULL, 0 };
+	struct p11Attribute_t *pattr;
+
+	template.type = type;
+	if (findAttribute(object, &template, &pattr) < 0) {
+		return -1;
+	}
+
+	*attr = &pattr->attrData;
+	return 0;
+}
+
+
+
+static void addToObjectIndex(struct objectIndexEntry **bucket, struct objectIndexEntry *entry, unsigned long hash, struct p11Object_t *object, int publicObject)
+{
+	bucket += hash & (OBJECT_INDEX_SIZE - 1);
+
+	entry->hash = hash;
+	entry->object = object;
+	entry->publicObject = publicObject;
+	entry->next = *bucket;
+	*bucket = entry;
+}
+
+
+
+/**
+ * Rebuild the object index from the lists of public and private token objects
+ *
+ * @param token     The token
+ * @return          CKR_OK or CKR_HOST_MEMORY
+ */
+static int buildObjectIndex(struct p11Token_t *token)
+{
+	struct p11ObjectIndex_t *index;
+	struct objectIndexEntry *entry;
+	struct p11Object_t *object;
+	CK_ATTRIBUTE_PTR subject, issuer, serial;
+	int count, publicObject;
+
+	if (token->objectIndex == NULL) {
+		token->objectIndex = (struct p11ObjectIndex_t *)calloc(1, sizeof(struct p11ObjectIndex_t));
+
+		if (token->objectIndex == NULL) {
+			return CKR_HOST_MEMORY;
+		}
+	}
+
+	index = token->objectIndex;
+
+	free(index->entries);
+	index->entries = NULL;
+	memset(index->subject, 0, sizeof(index->subject));
+	memset(index->issuerSerial, 0, sizeof(index->issuerSerial));
+
+	count = 0;
+	for (object = token->tokenObjList; object != NULL; object = object->next) {
+		count++;
+	}
+	for (object = token->tokenPrivObjList; object != NULL; object = object->next) {
+		count++;
+	}
+
+	// At most two entries per object
+	index->entries = (struct objectIndexEntry *)calloc(count * 2 + 1, sizeof(struct objectIndexEntry));
+
+	if (index->entries == NULL) {
+		return CKR_HOST_MEMORY;
+	}
+
+	entry = index->entries;
+
+	for (publicObject = TRUE; publicObject >= FALSE; publicObject--) {
+		object = publicObject ? token->tokenObjList : token->tokenPrivObjList;
+
+		for (; object != NULL; object = object->next) {
+			if (getObjectAttribute(object, CKA_SUBJECT, &subject) == 0) {
+				addToObjectIndex(index->subject, entry++, hashAttributeValue(OBJECT_INDEX_HASH_INIT, subject), object, publicObject);
+			}
+
+			if ((getObjectAttribute(object, CKA_ISSUER, &issuer) == 0) &&
+				(getObjectAttribute(object, CKA_SERIAL_NUMBER, &serial) == 0)) {
+				addToObjectIndex(index->issuerSerial, entry++, hashAttributeValue(hashAttributeValue(OBJECT_INDEX_HASH_INIT, issuer), serial), object, publicObject);
+			}
+		}
+	}
+
+	index->valid = 1;
+
+	return CKR_OK;
+}
+
+
+
 /**
  * Add token object to list of public or private objects
  *
@@ -89,6 +256,9 @@ int addObject(struct p11Token_t *token, struct p11Object_t *object, int publicOb
 		object->handle = token->freeObjectNumber++;
 	}
 
+	// Attributes are complete once the object is added, so prepare for fast attribute queries
+	buildAttributeTable(object);
+
 	if (publicObject) {
 		addObjectToList(&token->tokenObjList, object);
 		token->numberOfTokenObjects++;
@@ -97,7 +267,7 @@ int addObject(struct p11Token_t *token, struct p11Object_t *object, int publicOb
 		token->numberOfPrivateTokenObjects++;
 	}
 
-	object->dirtyFlag = 1;
+	invalidateObjectIndex(token);
 
 	return CKR_OK;
 }
@@ -168,6 +338,81 @@ int findMatchingTokenObject(struct p11Token_t *token, CK_ATTRIBUTE_PTR pTemplate
 
 
 
+/**
+ * Add token objects matching the template to the search list of the session
+ *
+ * Searches by CKA_SUBJECT or by CKA_ISSUER and CKA_SERIAL_NUMBER, as used when building
+ * certificate chains, are served from the object index. All other searches scan the
+ * lists of token objects.
+ *
+ * @param session   The session performing the search
+ * @param token     The token
+ * @param pTemplate The search template
+ * @param ulCount   The number of attributes in the template
+ * @param privateObjects Include private objects in the search
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+int addMatchingTokenObjectsToSearchList(struct p11Session_t *session, struct p11Token_t *token, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, int privateObjects)
+{
+	struct objectIndexEntry *entry, **bucket;
+	struct p11Object_t *object;
+	unsigned long hash;
+	int subject, issuer, serial, publicObject;
+
+	subject = findAttributeInTemplate(CKA_SUBJECT, pTemplate, ulCount);
+	issuer = findAttributeInTemplate(CKA_ISSUER, pTemplate, ulCount);
+	serial = findAttributeInTemplate(CKA_SERIAL_NUMBER, pTemplate, ulCount);
+
+	// Synchronization replaces objects while holding the lock
+	p11LockMutex(context->mutex);
+
+	if ((subject >= 0) || ((issuer >= 0) && (serial >= 0))) {
+		if ((token->objectIndex != NULL && token->objectIndex->valid) || (buildObjectIndex(token) == CKR_OK)) {
+			if (subject >= 0) {
+				hash = hashAttributeValue(OBJECT_INDEX_HASH_INIT, &pTemplate[subject]);
+				bucket = token->objectIndex->subject;
+			} else {
+				hash = hashAttributeValue(hashAttributeValue(OBJECT_INDEX_HASH_INIT, &pTemplate[issuer]), &pTemplate[serial]);
+				bucket = token->objectIndex->issuerSerial;
+			}
+
+			bucket += hash & (OBJECT_INDEX_SIZE - 1);
+
+			// Public objects first, like the list scan below
+			for (publicObject = TRUE; publicObject >= (privateObjects ? FALSE : TRUE); publicObject--) {
+				for (entry = *bucket; entry != NULL; entry = entry->next) {
+					if ((entry->hash == hash) && (entry->publicObject == publicObject) && isMatchingObject(entry->object, pTemplate, ulCount)) {
+						addObjectToSearchList(session, entry->object);
+					}
+				}
+			}
+
+			p11UnlockMutex(context->mutex);
+			return CKR_OK;
+		}
+	}
+
+	for (object = token->tokenObjList; object != NULL; object = object->next) {
+		if (isMatchingObject(object, pTemplate, ulCount)) {
+			addObjectToSearchList(session, object);
+		}
+	}
+
+	if (privateObjects) {
+		for (object = token->tokenPrivObjList; object != NULL; object = object->next) {
+			if (isMatchingObject(object, pTemplate, ulCount)) {
+				addObjectToSearchList(session, object);
+			}
+		}
+	}
+
+	p11UnlockMutex(context->mutex);
+
+	return CKR_OK;
+}
+
+
+
 /**
  * Remove object from list of token objects
  *
@@ -193,6 +438,8 @@ int removeTokenObject(struct p11Token_t *token, CK_OBJECT_HANDLE handle, int pub
 		token->numberOfPrivateTokenObjects--;
 	}
 
+	invalidateObjectIndex(token);
+
 	return CKR_OK;
 }
 
@@ -209,6 +456,7 @@ static void removePrivateObjects(struct p11Token_t *token)
 {
 	removeAllObjectsFromList(&token->tokenPrivObjList);
 	token->numberOfPrivateTokenObjects = 0;
+	invalidateObjectIndex(token);
 }
 
 
@@ -224,6 +472,7 @@ static void removePublicObjects(struct p11Token_t *token)
 {
 	removeAllObjectsFromList(&token->tokenObjList);
 	token->numberOfTokenObjects = 0;
+	invalidateObjectIndex(token);
 }
 
 
@@ -260,6 +509,8 @@ int removeObjectLeavingAttributes(struct p11Token_t *token, CK_OBJECT_HANDLE han
 
 	token->numberOfTokenObjects--;
 
+	invalidateObjectIndex(token);
+
 	if (rc == 0) {      /* We removed the last element from the list */
 		if (publicObject) {
 			token->tokenObjList = NULL;
@@ -274,22 +525,201 @@ int removeObjectLeavingAttributes(struct p11Token_t *token, CK_OBJECT_HANDLE han
 
 
 /**
- * Remove object from token
+ * Remove object from the device
  *
  * @param slot      The slot in which the token is inserted
  * @param token     The token to update
+ * @param object    The object to remove
  *
  * @return          CKR_OK or any other Cryptoki error code
  */
 int destroyObject(struct p11Slot_t *slot, struct p11Token_t *token, struct p11Object_t *object)
 {
-	return CKR_OK;
+	int rc;
+
+	if (token->drv->deleteObject == NULL) {
+		return CKR_OK;
+	}
+
+	rc = lockSlot(slot);
+
+	if (rc != CKR_OK) {
+		return rc;
+	}
+
+	rc = token->drv->deleteObject(slot, token, object);
+
+	unlockSlot(slot);
+
+	return rc;
 }
 
 
 
 /**
- * Synchronize a token objects that have been changed (e.g. have the dirty flag set)
+ * Write a created or modified object to the device immediately
+ *
+ * @param slot      The slot in which the token is inserted
+ * @param token     The token to update
+ * @param object    The object to write
+ *
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+int saveObject(struct p11Slot_t *slot, struct p11Token_t *token, struct p11Object_t *object)
+{
+	int rc;
+
+	if (token->drv->writeObject == NULL) {
+		object->dirtyFlag = 0;
+		return CKR_OK;
+	}
+
+	rc = lockSlot(slot);
+
+	if (rc != CKR_OK) {
+		return rc;
+	}
+
+	rc = token->drv->writeObject(slot, token, object);
+
+	unlockSlot(slot);
+
+	if (rc == CKR_OK) {
+		object->dirtyFlag = 0;
+	}
+
+	return rc;
+}
+
+
+
+/**
+ * Errors after which writing the same object again may succeed
+ */
+static int isTransientWriteError(int rc)
+{
+	switch(rc) {
+	case CKR_HOST_MEMORY:
+	case CKR_DEVICE_ERROR:
+	case CKR_DEVICE_REMOVED:
+	case CKR_TOKEN_NOT_PRESENT:
+	case CKR_USER_NOT_LOGGED_IN:
+		return TRUE;
+	}
+	return FALSE;
+}
+
+
+
+static int flushObjectList(struct p11Slot_t *slot, struct p11Token_t *token, struct p11Object_t *object, int *pending)
+{
+	int rc, rv = CKR_OK;
+
+	for (; object != NULL; object = object->next) {
+		if (object->dirtyFlag) {
+			rc = saveObject(slot, token, object);
+			if (rc != CKR_OK) {
+				rv = rc;
+				if (isTransientWriteError(rc)) {
+					*pending = TRUE;
+				} else {
+					// Writing again would fail the same way, so the change is dropped
+					object->dirtyFlag = 0;
+				}
+			}
+		}
+	}
+
+	return rv;
+}
+
+
+
+/**
+ * Write all modified objects of the token to the device
+ *
+ * Objects that failed to write with a transient error remain marked and are retried
+ * with the next flush. Modified private objects are kept until the user is logged in.
+ *
+ * Must not be called with the global lock held, as the slot is locked for the write.
+ *
+ * @param slot      The slot in which the token is inserted
+ * @param token     The token to update
+ *
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+int flushTokenObjects(struct p11Slot_t *slot, struct p11Token_t *token)
+{
+	int rc, rv, pending = FALSE;
+	struct p11Object_t *object;
+
+	if (!token->dirtySince) {
+		return CKR_OK;
+	}
+
+	rv = flushObjectList(slot, token, token->tokenObjList, &pending);
+
+	rc = CKR_OK;
+	if (token->user == CKU_USER) {
+		rc = flushObjectList(slot, token, token->tokenPrivObjList, &pending);
+	} else {
+		for (object = token->tokenPrivObjList; object != NULL; object = object->next) {
+			if (object->dirtyFlag) {
+				pending = TRUE;
+			}
+		}
+	}
+
+	if (!pending) {
+		token->dirtySince = 0;
+	}
+
+	return rv != CKR_OK ? rv : rc;
+}
+
+
+
+/**
+ * Mark an object as modified and write pending changes if the write delay passed
+ *
+ * Modifications within OBJECT_WRITE_DELAY after the first unwritten change are
+ * coalesced into a single write. Remaining changes are written when a session is
+ * closed or the user logs out.
+ *
+ * @param slot      The slot in which the token is inserted
+ * @param token     The token to update
+ * @param object    The modified object
+ *
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+int updateObject(struct p11Slot_t *slot, struct p11Token_t *token, struct p11Object_t *object)
+{
+	unsigned long now;
+
+	object->dirtyFlag = 1;
+
+	now = currentMillis();
+
+	if (!token->dirtySince) {
+		token->dirtySince = now;
+		return CKR_OK;
+	}
+
+	if (now - token->dirtySince < OBJECT_WRITE_DELAY) {
+		return CKR_OK;
+	}
+
+	return flushTokenObjects(slot, token);
+}
+
+
+
+/**
+ * Synchronize token objects with the objects on the device
+ *
+ * Objects created or deleted on the device, e.g. by another process, are added to or
+ * removed from the list of token objects. Unchanged objects keep their handle, so
+ * sessions remain open and valid.
  *
  * @param slot      The slot in which the token is inserted
  * @param token     The token to update
@@ -298,7 +728,63 @@ int destroyObject(struct p11Slot_t *slot, struct p11Token_t *token, struct p11Ob
  */
 int synchronizeToken(struct p11Slot_t *slot, struct p11Token_t *token)
 {
-	return CKR_OK;
+	if (token->drv->synchronize == NULL) {
+		return CKR_OK;
+	}
+	return token->drv->synchronize(slot, token);
+}
+
+
+
+/**
+ * Pick up objects created, deleted or changed on the device by other applications or processes
+ *
+ * The driver compares the objects on the device with the objects seen before. The device
+ * is checked at most once within TOKEN_SYNC_INTERVAL.
+ *
+ * Must not be called with the global lock held, as the slot is locked for the check.
+ *
+ * @param slot      The slot in which the token is inserted
+ * @param token     The token to update
+ *
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+int refreshTokenObjects(struct p11Slot_t *slot, struct p11Token_t *token)
+{
+	unsigned long now;
+	int rc;
+
+	if (token->drv->synchronize == NULL) {
+		return CKR_OK;
+	}
+
+	now = currentMillis();
+
+	if (token->synchronized && (now - token->synchronized < TOKEN_SYNC_INTERVAL)) {
+		return CKR_OK;
+	}
+
+	rc = lockSlot(slot);
+
+	if (rc != CKR_OK) {
+		return rc;
+	}
+
+	// Other threads may walk the object lists while objects are replaced
+	p11LockMutex(context->mutex);
+
+	rc = synchronizeToken(slot, token);
+
+	p11UnlockMutex(context->mutex);
+
+	unlockSlot(slot);
+
+	// Check again with the next call if the device could not be checked
+	if (rc == CKR_OK) {
+		token->synchronized = now;
+	}
+
+	return rc;
 }
 
 
@@ -336,6 +822,9 @@ int logOut(struct p11Slot_t *slot)
 {
 	slot->token->user = 0xFF;
 
+	// Responses read with the PIN verified must not survive the logout
+	logoutApduCache(slot);
+
 	return slot->token->drv->logout(slot);
 }
 
@@ -400,6 +889,8 @@ int newToken(struct p11Slot_t *slot, unsigned char *atr, size_t atrlen, struct p
 
 	FUNC_CALLED();
 
+	checkApduCacheATR(slot, atr, atrlen);
+
 	for (t = tokenDriver; *t != NULL; t++) {
 		drv = (*t)();
 		if (drv->isCandidate(atr, atrlen)) {
@@ -417,6 +908,28 @@ int newToken(struct p11Slot_t *slot, unsigned char *atr, size_t atrlen, struct p
 
 
 
+/**
+ * Find the token driver with the given name
+ *
+ * @param name      The name of the driver
+ * @return          The driver or NULL if no driver has that name
+ */
+struct p11TokenDriver *getTokenDriverByName(const char *name)
+{
+	tokenDriver_t *t;
+	struct p11TokenDriver *drv;
+
+	for (t = tokenDriver; *t != NULL; t++) {
+		drv = (*t)();
+		if (!strcmp(drv->name, name))
+			return drv;
+	}
+
+	return NULL;
+}
+
+
+
 /**
  * Release memory allocated for token
  *
@@ -432,6 +945,7 @@ void freeToken(struct p11Token_t *token)
 
 		removePrivateObjects(token);
 		removePublicObjects(token);
+		freeObjectIndex(token);
 		free(token);
 	}
 }
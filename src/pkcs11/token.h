@@ -72,6 +72,9 @@
 
 #define MAX_CERTIFICATE_SIZE	4096
 
+#define OBJECT_WRITE_DELAY		500		/* Time in ms in which object modifications are coalesced */
+#define TOKEN_SYNC_INTERVAL		1000	/* Minimum time in ms between checks for changes on the device */
+
 int newToken(struct p11Slot_t *slot, unsigned char *atr, size_t atrlen, struct p11Token_t **token);
 void freeToken(struct p11Token_t *token);
 int logIn(struct p11Slot_t *slot, CK_USER_TYPE userType, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen);
@@ -81,11 +84,18 @@ int setPIN(struct p11Slot_t *slot, CK_UTF8CHAR_PTR pOldPin, CK_ULONG ulOldPinLen
 int addObject(struct p11Token_t *token, struct p11Object_t *object, int publicObject);
 int findObject(struct p11Token_t *token, CK_OBJECT_HANDLE handle, struct p11Object_t **object, int publicObject);
 int findMatchingTokenObject(struct p11Token_t *token, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, struct p11Object_t **pObject);
+int addMatchingTokenObjectsToSearchList(struct p11Session_t *session, struct p11Token_t *token, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, int privateObjects);
+void invalidateObjectIndex(struct p11Token_t *token);
 int removeTokenObject(struct p11Token_t *token, CK_OBJECT_HANDLE handle, int publicObject);
 int removeObjectLeavingAttributes(struct p11Token_t *token, CK_OBJECT_HANDLE handle, int publicObject);
 int saveObjects(struct p11Slot_t *slot, struct p11Token_t *token, int publicObject);
 int destroyObject(struct p11Slot_t *slot, struct p11Token_t *token, struct p11Object_t *object);
+int saveObject(struct p11Slot_t *slot, struct p11Token_t *token, struct p11Object_t *object);
+int updateObject(struct p11Slot_t *slot, struct p11Token_t *token, struct p11Object_t *object);
+int flushTokenObjects(struct p11Slot_t *slot, struct p11Token_t *token);
 int synchronizeToken(struct p11Slot_t *slot, struct p11Token_t *token);
+int refreshTokenObjects(struct p11Slot_t *slot, struct p11Token_t *token);
 struct p11Token_t *getBaseToken(struct p11Token_t *token);
+struct p11TokenDriver *getTokenDriverByName(const char *name);
 
 #endif /* ___TOKEN_H_INC___ */
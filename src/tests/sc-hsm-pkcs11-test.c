@@ -54,6 +54,7 @@
 
 #include <unistd.h>
 #include <dlfcn.h>
+#include <sys/wait.h>
 #define LIB_HANDLE void*
 #define P11LIBNAME "/usr/local/lib/libsc-hsm-pkcs11.so"
 
@@ -118,6 +119,7 @@ void usleep(unsigned int usec)
 
 
 #include <pkcs11/cryptoki.h>
+#include <pkcs11/p11ext.h>
 
 struct id2name_t {
 	unsigned long       id;
@@ -1025,6 +1027,81 @@ void testECSigning(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
 
 
 
+void testSignBatch(CK_FUNCTION_LIST_PTR p11, LIB_HANDLE dlhandle, CK_SESSION_HANDLE session)
+{
+	SC_SignBatch_t signBatch;
+	CK_OBJECT_CLASS class = CKO_PRIVATE_KEY;
+	CK_KEY_TYPE keyType = CKK_RSA;
+	CK_BBOOL true = CK_TRUE;
+	CK_ATTRIBUTE template[] = {
+			{ CKA_CLASS, &class, sizeof(class) },
+			{ CKA_KEY_TYPE, &keyType, sizeof(keyType) },
+			{ CKA_ALWAYS_AUTHENTICATE, &true, sizeof(true) }
+	};
+	CK_OBJECT_HANDLE hnd;
+	CK_MECHANISM mech = { CKM_SHA256_RSA_PKCS, 0, 0 };
+	char *tbs = "Hello World";
+	CK_BYTE signature[2][512];
+	SC_SIGN_BATCH_ITEM items[2];
+	int rc, i, singleUse;
+
+	signBatch = (SC_SignBatch_t)dlsym(dlhandle, "SC_SignBatch");
+	printf("Locating SC_SignBatch - %s\n", verdict(signBatch != NULL));
+
+	if (signBatch == NULL) {
+		return;
+	}
+
+	// Keys with a single use PIN counter require a PIN for each signature
+	rc = findObject(p11, session, (CK_ATTRIBUTE_PTR)&template, sizeof(template) / sizeof(CK_ATTRIBUTE), 0, &hnd);
+	singleUse = (rc == CKR_OK);
+
+	if (!singleUse) {
+		rc = findObject(p11, session, (CK_ATTRIBUTE_PTR)&template, sizeof(template) / sizeof(CK_ATTRIBUTE) - 1, 0, &hnd);
+
+		if (rc != CKR_OK) {
+			printf("No RSA key found for SC_SignBatch\n");
+			return;
+		}
+	}
+
+	// A length query does not consume the PIN use counter
+	for (i = 0; i < 2; i++) {
+		items[i].pData = (CK_BYTE_PTR)tbs;
+		items[i].ulDataLen = strlen(tbs);
+		items[i].pSignature = signature[i];
+		items[i].ulSignatureLen = sizeof(signature[i]);
+		items[i].rv = CKR_GENERAL_ERROR;
+	}
+	items[0].pSignature = NULL;
+	items[0].ulSignatureLen = 0;
+
+	printf("Calling SC_SignBatch with length query ");
+	rc = signBatch(session, &mech, hnd, pin, pinlen, items, 2);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+	printf("Length query - %s : %s\n", id2name(p11CKRName, items[0].rv, 0, namebuf), verdict((items[0].rv == CKR_OK) && (items[0].ulSignatureLen > 0)));
+	printf("Signature - %s : %s\n", id2name(p11CKRName, items[1].rv, 0, namebuf), verdict((items[1].rv == CKR_OK) && (items[1].ulSignatureLen == items[0].ulSignatureLen)));
+
+	if (!singleUse) {
+		return;
+	}
+
+	// The PIN verified for the batch permits a single signature only
+	for (i = 0; i < 2; i++) {
+		items[i].pSignature = signature[i];
+		items[i].ulSignatureLen = sizeof(signature[i]);
+		items[i].rv = CKR_GENERAL_ERROR;
+	}
+
+	printf("Calling SC_SignBatch with single use PIN ");
+	rc = signBatch(session, &mech, hnd, pin, pinlen, items, 2);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_USER_NOT_LOGGED_IN));
+	printf("First signature - %s : %s\n", id2name(p11CKRName, items[0].rv, 0, namebuf), verdict(items[0].rv == CKR_OK));
+	printf("Second signature - %s : %s\n", id2name(p11CKRName, items[1].rv, 0, namebuf), verdict(items[1].rv == CKR_USER_NOT_LOGGED_IN));
+}
+
+
+
 void testSessions(CK_FUNCTION_LIST_PTR p11, CK_SLOT_ID slotid)
 {
 	int rc;
@@ -1339,6 +1416,346 @@ void testLogin(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
 
 
 
+#ifndef _WIN32
+void testForkLogin(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
+{
+	int rc, status;
+	pid_t pid;
+	CK_SLOT_ID slotid;
+	CK_SESSION_INFO sessioninfo;
+	CK_SESSION_HANDLE childsession;
+	CK_C_INITIALIZE_ARGS initArgs;
+	CK_OBJECT_HANDLE hnd;
+	CK_OBJECT_CLASS class = CKO_PRIVATE_KEY;
+	CK_KEY_TYPE keyType = CKK_RSA;
+	CK_ATTRIBUTE template[] = {
+			{ CKA_CLASS, &class, sizeof(class) },
+			{ CKA_KEY_TYPE, &keyType, sizeof(keyType) }
+	};
+
+	printf("Calling C_GetSessionInfo ");
+	rc = p11->C_GetSessionInfo(session, &sessioninfo);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+	printf("Session state %lu - %s\n", sessioninfo.state, verdict(sessioninfo.state == CKS_RW_USER_FUNCTIONS));
+
+	slotid = sessioninfo.slotID;
+
+	fflush(stdout);
+	pid = fork();
+
+	if (pid == 0) {
+		// The child reuses the state of the parent, but must not inherit the login
+		testscompleted = 0;
+		testsfailed = 0;
+
+		memset(&initArgs, 0, sizeof(initArgs));
+		initArgs.flags = CKF_OS_LOCKING_OK;
+
+		printf("Calling C_Initialize in child ");
+		rc = p11->C_Initialize(&initArgs);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		if (rc != CKR_OK) {
+			exit(1);
+		}
+
+		printf("Calling C_GetSessionInfo with session of parent ");
+		rc = p11->C_GetSessionInfo(session, &sessioninfo);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_SESSION_HANDLE_INVALID));
+
+		printf("Calling C_OpenSession in child ");
+		rc = p11->C_OpenSession(slotid, CKF_RW_SESSION | CKF_SERIAL_SESSION, NULL, NULL, &childsession);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		printf("Calling C_GetSessionInfo in child ");
+		rc = p11->C_GetSessionInfo(childsession, &sessioninfo);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+		printf("Session state %lu - %s\n", sessioninfo.state, verdict(sessioninfo.state == CKS_RW_PUBLIC_SESSION));
+
+		printf("Find a private key in child");
+		rc = findObject(p11, childsession, (CK_ATTRIBUTE_PTR)&template, sizeof(template) / sizeof(CK_ATTRIBUTE), 0, &hnd);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_ARGUMENTS_BAD));
+
+		printf("Calling C_Finalize in child ");
+		rc = p11->C_Finalize(NULL);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		fflush(stdout);
+		exit(testsfailed ? 1 : 0);
+	}
+
+	printf("Calling fork ");
+	printf("- %d : %s\n", pid, verdict(pid > 0));
+
+	if (pid < 0) {
+		return;
+	}
+
+	rc = waitpid(pid, &status, 0);
+	printf("Tests in child - %s\n", verdict((rc == pid) && WIFEXITED(status) && (WEXITSTATUS(status) == 0)));
+
+	printf("Calling C_GetSessionInfo ");
+	rc = p11->C_GetSessionInfo(session, &sessioninfo);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+	printf("Session state %lu - %s\n", sessioninfo.state, verdict(sessioninfo.state == CKS_RW_USER_FUNCTIONS));
+
+	printf("Find a private key after fork");
+	rc = findObject(p11, session, (CK_ATTRIBUTE_PTR)&template, sizeof(template) / sizeof(CK_ATTRIBUTE), 0, &hnd);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+}
+#endif
+
+
+
+int createTestDataObject(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session, char *label, CK_BBOOL priv, CK_BYTE_PTR value, CK_ULONG valuelen, CK_OBJECT_HANDLE_PTR phnd)
+{
+	CK_OBJECT_CLASS class = CKO_DATA;
+	CK_BBOOL true = CK_TRUE;
+	CK_ATTRIBUTE template[] = {
+			{ CKA_CLASS, &class, sizeof(class) },
+			{ CKA_TOKEN, &true, sizeof(true) },
+			{ CKA_PRIVATE, &priv, sizeof(priv) },
+			{ CKA_MODIFIABLE, &true, sizeof(true) },
+			{ CKA_LABEL, label, strlen(label) },
+			{ CKA_VALUE, value, valuelen }
+	};
+
+	return p11->C_CreateObject(session, template, sizeof(template) / sizeof(CK_ATTRIBUTE), phnd);
+}
+
+
+
+int findTestDataObject(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session, char *label, CK_OBJECT_HANDLE_PTR phnd)
+{
+	CK_OBJECT_CLASS class = CKO_DATA;
+	CK_ATTRIBUTE template[] = {
+			{ CKA_CLASS, &class, sizeof(class) },
+			{ CKA_LABEL, label, strlen(label) }
+	};
+
+	return findObject(p11, session, template, sizeof(template) / sizeof(CK_ATTRIBUTE), 0, phnd);
+}
+
+
+
+void testDataObjectPersistence(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
+{
+	int rc;
+	CK_OBJECT_HANDLE hnd;
+	char *label = "Test Data Private";
+	char *labeloversize = "Test Data Oversize";
+	char *value = "Initial value";
+	char *newvalue = "Modified value";
+	CK_BYTE buff[64];
+	CK_BYTE oversize[4097];		// Exceeds the maximum size of a data object on the SmartCard-HSM
+	CK_ATTRIBUTE template[] = {
+			{ CKA_VALUE, newvalue, strlen(newvalue) }
+	};
+
+	memset(oversize, 0x5A, sizeof(oversize));
+
+	printf("Calling C_CreateObject with oversize value ");
+	rc = createTestDataObject(p11, session, labeloversize, CK_FALSE, oversize, sizeof(oversize), &hnd);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_ATTRIBUTE_VALUE_INVALID));
+
+	printf("Find data object not created");
+	rc = findTestDataObject(p11, session, labeloversize, &hnd);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_ARGUMENTS_BAD));
+
+	printf("Calling C_CreateObject ");
+	rc = createTestDataObject(p11, session, label, CK_TRUE, (CK_BYTE_PTR)value, strlen(value), &hnd);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	if (rc != CKR_OK) {
+		return;
+	}
+
+	// The change is written with C_Logout at the latest
+	printf("Calling C_SetAttributeValue ");
+	rc = p11->C_SetAttributeValue(session, hnd, template, 1);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	template[0].pValue = oversize;
+	template[0].ulValueLen = sizeof(oversize);
+
+	printf("Calling C_SetAttributeValue with oversize value ");
+	rc = p11->C_SetAttributeValue(session, hnd, template, 1);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_ATTRIBUTE_VALUE_INVALID));
+
+	printf("Calling C_Logout ");
+	rc = p11->C_Logout(session);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	printf("Find private data object after logout");
+	rc = findTestDataObject(p11, session, label, &hnd);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_ARGUMENTS_BAD));
+
+	// Private objects are read from the token again
+	printf("Calling C_Login User ");
+	rc = p11->C_Login(session, CKU_USER, pin, pinlen);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	if (rc != CKR_OK) {
+		exit(1);
+	}
+
+	printf("Find private data object after login");
+	rc = findTestDataObject(p11, session, label, &hnd);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	if (rc != CKR_OK) {
+		return;
+	}
+
+	template[0].pValue = buff;
+	template[0].ulValueLen = sizeof(buff);
+
+	printf("Calling C_GetAttributeValue ");
+	rc = p11->C_GetAttributeValue(session, hnd, template, 1);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+	printf("Value persistent - %s\n", verdict((template[0].ulValueLen == strlen(newvalue)) && !memcmp(buff, newvalue, strlen(newvalue))));
+
+	printf("Calling C_DestroyObject ");
+	rc = p11->C_DestroyObject(session, hnd);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+}
+
+
+
+#ifndef _WIN32
+void testExternalObjectChange(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
+{
+	int rc, status;
+	pid_t pid;
+	CK_SLOT_ID slotid;
+	CK_SESSION_INFO sessioninfo;
+	CK_SESSION_HANDLE childsession;
+	CK_C_INITIALIZE_ARGS initArgs;
+	CK_OBJECT_HANDLE hnd, hndcreated;
+	char *label = "Test Data Modified";
+	char *labelcreated = "Test Data Created";
+	char *value = "Value from parent";
+	char *newvalue = "Value from other process";
+	CK_BYTE buff[64];
+	CK_ATTRIBUTE template[] = {
+			{ CKA_VALUE, buff, sizeof(buff) }
+	};
+
+	printf("Calling C_GetSessionInfo ");
+	rc = p11->C_GetSessionInfo(session, &sessioninfo);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	slotid = sessioninfo.slotID;
+
+	printf("Calling C_CreateObject ");
+	rc = createTestDataObject(p11, session, label, CK_FALSE, (CK_BYTE_PTR)value, strlen(value), &hnd);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	if (rc != CKR_OK) {
+		return;
+	}
+
+	printf("Find data object not yet created");
+	rc = findTestDataObject(p11, session, labelcreated, &hndcreated);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_ARGUMENTS_BAD));
+
+	fflush(stdout);
+	pid = fork();
+
+	if (pid == 0) {
+		// Another process changes the objects on the token
+		testscompleted = 0;
+		testsfailed = 0;
+
+		memset(&initArgs, 0, sizeof(initArgs));
+		initArgs.flags = CKF_OS_LOCKING_OK;
+
+		printf("Calling C_Initialize in child ");
+		rc = p11->C_Initialize(&initArgs);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		if (rc != CKR_OK) {
+			exit(1);
+		}
+
+		printf("Calling C_OpenSession in child ");
+		rc = p11->C_OpenSession(slotid, CKF_RW_SESSION | CKF_SERIAL_SESSION, NULL, NULL, &childsession);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		printf("Calling C_Login User in child ");
+		rc = p11->C_Login(childsession, CKU_USER, pin, pinlen);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		printf("Find data object in child");
+		rc = findTestDataObject(p11, childsession, label, &hnd);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		template[0].pValue = newvalue;
+		template[0].ulValueLen = strlen(newvalue);
+
+		printf("Calling C_SetAttributeValue in child ");
+		rc = p11->C_SetAttributeValue(childsession, hnd, template, 1);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		printf("Calling C_CreateObject in child ");
+		rc = createTestDataObject(p11, childsession, labelcreated, CK_FALSE, (CK_BYTE_PTR)newvalue, strlen(newvalue), &hndcreated);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		// Writes the modified value
+		printf("Calling C_CloseSession in child ");
+		rc = p11->C_CloseSession(childsession);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		printf("Calling C_Finalize in child ");
+		rc = p11->C_Finalize(NULL);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		fflush(stdout);
+		exit(testsfailed ? 1 : 0);
+	}
+
+	printf("Calling fork ");
+	printf("- %d : %s\n", pid, verdict(pid > 0));
+
+	if (pid > 0) {
+		rc = waitpid(pid, &status, 0);
+		printf("Tests in child - %s\n", verdict((rc == pid) && WIFEXITED(status) && (WEXITSTATUS(status) == 0)));
+	}
+
+	printf("Find data object created by other process");
+	rc = findTestDataObject(p11, session, labelcreated, &hndcreated);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	if (rc == CKR_OK) {
+		printf("Calling C_DestroyObject ");
+		rc = p11->C_DestroyObject(session, hndcreated);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+	}
+
+	printf("Find data object modified by other process");
+	rc = findTestDataObject(p11, session, label, &hnd);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	if (rc != CKR_OK) {
+		return;
+	}
+
+	template[0].pValue = buff;
+	template[0].ulValueLen = sizeof(buff);
+
+	printf("Calling C_GetAttributeValue ");
+	rc = p11->C_GetAttributeValue(session, hnd, template, 1);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+	printf("Value changed - %s\n", verdict((template[0].ulValueLen == strlen(newvalue)) && !memcmp(buff, newvalue, strlen(newvalue))));
+
+	printf("Calling C_DestroyObject ");
+	rc = p11->C_DestroyObject(session, hnd);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+}
+#endif
+
+
+
 void testInsertRemove(CK_FUNCTION_LIST_PTR p11, CK_SLOT_ID slotid)
 {
 	CK_RV rc;
@@ -1784,6 +2201,18 @@ int main(int argc, char *argv[])
 
 				testLogin(p11, session);
 
+#ifndef _WIN32
+				testForkLogin(p11, session);
+#endif
+
+				// Data objects are only stored on the SmartCard-HSM
+				if (!strncmp("SmartCard-HSM", (char *)tokeninfo.model, 13)) {
+					testDataObjectPersistence(p11, session);
+#ifndef _WIN32
+					testExternalObjectChange(p11, session);
+#endif
+				}
+
 				// List all objects
 				memset(attr, 0, sizeof(attr));
 				listObjects(p11, session, attr, 0);
@@ -1796,6 +2225,8 @@ int main(int argc, char *argv[])
 
 				testECSigning(p11, session);
 
+				testSignBatch(p11, dlhandle, session);
+
 				printf("Calling C_CloseSession ");
 				rc = p11->C_CloseSession(session);
 				printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
@@ -0,0 +1,187 @@
+/**
+ * SmartCard-HSM Ultra-Light Library
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file merkle.h
+ * @brief Merkle tree and inclusion proofs for batch signatures
+ */
+#ifndef _MERKLE_H_
+#define _MERKLE_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sc-hsm-ultralite.h"
+
+#define PROOF_TYPE 0xABCE /*!< Inclusion proof file type (stored in the file header) */
+#define PROOF_VER 101 /*!< Inclusion proof file version (stored in the file header) */
+
+/*
+	Batch signatures sign the root of a Merkle tree built over the hashes
+	of all files signed in a batch, so a single card operation covers
+	any number of files. Each file then needs an inclusion proof linking its
+	hash to the signed root.
+
+	Leaves and inner nodes are hashed with different prefixes (as in RFC 6962)
+	so that an inner node can never be passed off as a leaf:
+		leaf = H(0x00 || file hash)
+		node = H(0x01 || left || right)
+	H is the hash of the signing template (SHA-256, SHA-384 or SHA-512),
+	its length is stored in the proof.
+	A level with an odd number of nodes promotes its last node unchanged to
+	the next level.
+
+	To verify a file: compute the leaf from the file hash, then for each level,
+	starting with i = index and m = count: if (i ^ 1) < m, combine with the
+	next path hash (as left child if i is odd, otherwise as right child).
+	Continue with i = i / 2 and m = (m + 1) / 2 until m == 1. The result
+	must equal the root, which is the MessageDigest in the CMS signature.
+*/
+
+/**
+ * Header of an inclusion proof file. It is followed by
+ * @a path_len sibling hashes of @a hash_len bytes each,
+ * starting at the leaf level.
+ */
+typedef struct
+{
+	int type;
+	int ver;
+	unsigned int index;
+	unsigned int count;
+	unsigned int path_len;
+	unsigned int hash_len;
+	unsigned char root[64];       /*!< First @a hash_len bytes used */
+} proof_t;
+
+/**
+ * Calculate a leaf (@a prefix 0x00, @a b NULL) or inner node
+ * (@a prefix 0x01) of the tree.
+ */
+void merkle_hash(unsigned char prefix, const unsigned char* a, const unsigned char* b,
+	unsigned int hash_len, unsigned char* out)
+{
+	hash_context ctx;
+
+	hash_starts(&ctx, hash_len);
+	hash_update(&ctx, &prefix, 1);
+	hash_update(&ctx, (unsigned char*)a, hash_len);
+	if (b)
+		hash_update(&ctx, (unsigned char*)b, hash_len);
+	hash_finish(&ctx, out);
+}
+
+/**
+ * Build the Merkle tree over @a count file hashes of @a hash_len
+ * bytes each, stored one after the other. All levels are
+ * returned in a single array allocated with malloc, starting with the
+ * leaves and ending with the root.
+ * @return The tree or NULL if out of memory.
+ */
+unsigned char* build_merkle_tree(const unsigned char* hashes, unsigned int count, unsigned int hash_len)
+{
+	unsigned char* tree;
+	unsigned char* level;
+	unsigned char* next;
+	unsigned int i, m, nodes;
+
+	for (nodes = count, m = count; m > 1; m = (m + 1) / 2)
+		nodes += (m + 1) / 2;
+
+	tree = (unsigned char*)malloc(nodes * hash_len);
+	if (tree == NULL)
+		return NULL;
+
+	for (i = 0; i < count; i++)
+		merkle_hash(0x00, hashes + i * hash_len, NULL, hash_len, tree + i * hash_len);
+
+	for (level = tree, m = count; m > 1; level = next, m = (m + 1) / 2) {
+		next = level + m * hash_len;
+		for (i = 0; i + 1 < m; i += 2)
+			merkle_hash(0x01, level + i * hash_len, level + (i + 1) * hash_len, hash_len, next + i / 2 * hash_len);
+		if (m & 1)
+			memcpy(next + m / 2 * hash_len, level + (m - 1) * hash_len, hash_len);
+	}
+
+	return tree;
+}
+
+/**
+ * Return the root of the @a tree with @a count leaves
+ */
+const unsigned char* merkle_root(const unsigned char* tree, unsigned int count, unsigned int hash_len)
+{
+	unsigned int m;
+
+	for (m = count; m > 1; m = (m + 1) / 2)
+		tree += m * hash_len;
+	return tree;
+}
+
+/**
+ * Write the inclusion proof for leaf @a index of the @a tree
+ * with @a count leaves to disk at the specified path @a path.
+ * @retval 0 Success.
+ * @retval 1 File couldn't be written.
+ */
+int write_proof(const char* path, const unsigned char* tree, unsigned int count,
+	unsigned int hash_len, unsigned int index)
+{
+	int rc = 0;
+	FILE* fp;
+	proof_t proof;
+	const unsigned char* level;
+	unsigned int i, m;
+
+	memset(&proof, 0, sizeof(proof));
+	proof.type = PROOF_TYPE;
+	proof.ver = PROOF_VER;
+	proof.index = index;
+	proof.count = count;
+	proof.hash_len = hash_len;
+
+	for (i = index, m = count; m > 1; i /= 2, m = (m + 1) / 2)
+		if ((i ^ 1) < m)
+			proof.path_len++;
+	memcpy(proof.root, merkle_root(tree, count, hash_len), hash_len);
+
+	fp = fopen(path, "wb");
+	if (!fp)
+		return 1;
+	if (fwrite(&proof, sizeof(proof), 1, fp) != 1)
+		rc = 1;
+	for (level = tree, i = index, m = count; rc == 0 && m > 1; level += m * hash_len, i /= 2, m = (m + 1) / 2)
+		if ((i ^ 1) < m && fwrite(level + (i ^ 1) * hash_len, hash_len, 1, fp) != 1)
+			rc = 1;
+	if (fclose(fp) != 0)
+		rc = 1;
+
+	return rc;
+}
+
+#endif /* _MERKLE_H_ */
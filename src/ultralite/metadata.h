@@ -33,43 +33,77 @@
 #define _METADATA_H_
 
 #include <stdio.h>
+#include <string.h>
+
+#include "sc-hsm-ultralite.h"
 
 #define METADATA_TYPE 0xABCD /*!< Signature metadata file file type (stored in the file header) */
-#define METADATA_VER 100 /*!< Signature metadata file file version (stored in the file header) */
+#define METADATA_VER 103 /*!< Signature metadata file file version (stored in the file header) */
+#define METADATA_TAIL_LEN 4096 /*!< Maximum number of bytes covered by the tail checksum */
 
 /**
  * Structure for saving the latest hashed content
  * length of a signature to disk. This allows quick
  * retrieval of a file's associated signature
  * without scanning against a regular expression.
+ *
+ * The hash midstate after @a hashed_content_len bytes
+ * (SHA-256, SHA-384 or SHA-512) is saved as well, so that a file that was only appended to
+ * can be re-signed by hashing just the new bytes. The tail
+ * checksum covers the last @a tail_len bytes of the hashed
+ * content and is used to detect files that were rewritten
+ * rather than appended to.
  */
 typedef struct
 {
 	int type;
 	int ver;
-	unsigned int hashed_content_len;
+	unsigned long long hashed_content_len;
+	hash_context hash_ctx;
+	unsigned int tail_len;
+	unsigned char tail_hash[32];
 } metadata_t;
 
+/**
+ * Calculate the tail checksum, i.e. the SHA-256 hash of the last
+ * @a tail_len (at most ::METADATA_TAIL_LEN) bytes of the hashed content.
+ */
+void hash_tail(const unsigned char* tail, unsigned int tail_len, unsigned char tail_hash[32])
+{
+	sha256_context ctx;
+
+	sha256_starts(&ctx);
+	sha256_update(&ctx, (unsigned char*)tail, tail_len);
+	sha256_finish(&ctx, tail_hash);
+}
+
 /**
  * Write a binary metadata file to disk at the specified path
  * @a path.  The content of the metadata file is exactly one
  * ::metadata_t struct which contains the length of the
- * hashed content covered by the associated signature file.
+ * hashed content covered by the associated signature file,
+ * the hash midstate @a ctx after that content and its tail
+ * checksum.
  * @see ::metadata_t
  * @retval 0 Success.
  * @retval R_EACCES File couldn't be opened for writing.
  * @retval R_EIO I/O error.
  */
-int write_metadata(const char* path, unsigned int hashed_content_len)
+int write_metadata(const char* path, unsigned long long hashed_content_len,
+	const hash_context* ctx, unsigned int tail_len, const unsigned char tail_hash[32])
 {
 	int n;
 	FILE* fp;
 	metadata_t md;
 
 	/* Initialize the metadata_t struct with the specified values */
+	memset(&md, 0, sizeof(md));
 	md.type = METADATA_TYPE;
 	md.ver = METADATA_VER;
 	md.hashed_content_len = hashed_content_len;
+	md.hash_ctx = *ctx;
+	md.tail_len = tail_len;
+	memcpy(md.tail_hash, tail_hash, sizeof(md.tail_hash));
 
 	/* Write the metadata_t struct to the specified path */
 	fp = fopen(path, "wb");
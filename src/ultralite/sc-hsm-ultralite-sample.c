@@ -37,16 +37,20 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 
 #ifdef _WIN32
+#include <io.h>
 #include "ext-win/dirent.h"
 #define snprintf _snprintf
 #define strdup _strdup
 #else
 #include <unistd.h>
 #include <dirent.h>
+#include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
 #define MAX_PATH PATH_MAX
@@ -56,71 +60,706 @@
 #include "utils.h"
 #include "sc-hsm-ultralite.h"
 #include "metadata.h"
+#include "merkle.h"
+
+
+#ifndef _WIN32
+#include <pthread.h>
+#define USE_PIPELINE
+#endif
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#define USE_INOTIFY
+#endif
 
 extern int SC_Open(const char *pin);
 extern int SC_ReadFile(uint16 fid, int off, uint8 *data, int dataLen);
 
-unsigned int sign_file(const char* pin, const char* label, const char* path, const char* md_path)
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define QUEUE_SIZE 64 /*!< Maximum number of files waiting in front of each pipeline stage */
+#define READ_BLOCK_SIZE (1024 * 1024) /*!< Block size for files that are read rather than mapped */
+#define HASH_CHUNK_SIZE (1024 * 1024 * 1024) /*!< Maximum length passed to a single hash_update() */
+#ifndef _WIN32
+#define MMAP_MAX_SIZE ((size_t)-1 / 4) /*!< Larger files are read in blocks to save address space */
+#endif
+#ifdef USE_INOTIFY
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO | IN_CREATE)
+#define BATCH_QUIET_MS 500 /*!< A batch of changes ends after this time without further events */
+#define BATCH_MAX_MS 5000 /*!< Changes are never held back longer than this */
+#endif
+
+/**
+ * A file to be signed. Jobs are created by the directory walker,
+ * hashed by one of the hashing workers and then signed by the single
+ * signing stage, which owns the card connection.
+ */
+typedef struct
 {
-	int n, rc;
-	sha256_context ctx;
-	const uint8 *pCms = 0;
-	unsigned char buf[4096], hash[32];
-	char new_sig_path[MAX_PATH];
-	unsigned int hcl = 0;
-	FILE* fp;
+	char path[MAX_PATH];
+	char md_path[MAX_PATH];
+	char old_sig_path[MAX_PATH];
+	int has_md;                  /*!< md contains the metadata of the previous signature */
+	int resume;                  /*!< Continue hashing from the midstate in md */
+	int hash_len;                /*!< Hash of the template: 32 (SHA-256), 48 (SHA-384) or 64 (SHA-512) */
+	int no_map;                  /*!< Read the file instead of mapping it */
+	metadata_t md;
+	/* Results of the hashing stage */
+	unsigned long long hcl;
+	hash_context md_ctx;
+	unsigned int tail_len;
+	unsigned char tail_hash[32];
+	unsigned char hash[64];
+} job_t;
+
+#ifdef USE_PIPELINE
+/**
+ * Bounded FIFO connecting two pipeline stages
+ */
+typedef struct
+{
+	job_t* jobs[QUEUE_SIZE];
+	int head;
+	int count;
+	int closed;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+} queue_t;
+#endif
+
+/**
+ * Signing context shared by all stages
+ */
+typedef struct
+{
+	const char* pin;
+	const char* label;
+	int hash_len;                /*!< Must match the hash of the signing template */
+	int workers;                 /*!< Number of hashing workers, 0 to hash and sign in the walker */
+	int batch;                   /*!< Sign the Merkle root over all files of a run instead of each file */
+	int no_map;                  /*!< Read files instead of mapping them, see hash_file() */
+	job_t** batched;             /*!< Hashed jobs waiting for the batch signature */
+	int batched_count;
+	int batched_size;
+#ifdef USE_PIPELINE
+	queue_t hash_queue;          /*!< Walker -> hashing workers */
+	queue_t sign_queue;          /*!< Hashing workers -> signing stage */
+	int pending;                 /*!< Jobs submitted, but not yet finished */
+	int hashing;                 /*!< Jobs submitted, but not yet hashed */
+	pthread_mutex_t pending_lock;
+	pthread_cond_t idle;
+#endif
+} pipeline_t;
+
+#ifdef USE_INOTIFY
+/**
+ * Watch state for daemon mode
+ */
+typedef struct
+{
+	int fd;
+	char** dirs;                 /*!< Watched directory by watch descriptor */
+	int dirs_size;
+	char** changed;              /*!< Files changed in the current batch */
+	int changed_count;
+	int changed_size;
+	int rescan;                  /*!< Events were lost, scan the whole tree */
+} watcher_t;
+
+static volatile sig_atomic_t Stop;
+#endif
+
+#ifdef USE_PIPELINE
+static void queue_init(queue_t* q)
+{
+	memset(q, 0, sizeof(*q));
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+}
+
+static void queue_destroy(queue_t* q)
+{
+	pthread_cond_destroy(&q->not_full);
+	pthread_cond_destroy(&q->not_empty);
+	pthread_mutex_destroy(&q->lock);
+}
+
+/* Append a job, blocking while the queue is full */
+static void queue_put(queue_t* q, job_t* job)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->count == QUEUE_SIZE)
+		pthread_cond_wait(&q->not_full, &q->lock);
+	q->jobs[(q->head + q->count) % QUEUE_SIZE] = job;
+	q->count++;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Remove the oldest job, blocking while the queue is empty. Returns NULL once closed and drained */
+static job_t* queue_get(queue_t* q)
+{
+	job_t* job = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->count == 0 && !q->closed)
+		pthread_cond_wait(&q->not_empty, &q->lock);
+	if (q->count > 0) {
+		job = q->jobs[q->head];
+		q->head = (q->head + 1) % QUEUE_SIZE;
+		q->count--;
+		pthread_cond_signal(&q->not_full);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return job;
+}
+
+/* Signal that no more jobs will be added */
+static void queue_close(queue_t* q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->closed = 1;
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+#endif /* USE_PIPELINE */
+
+/**
+ * Read the last (up to ::METADATA_TAIL_LEN) bytes before offset @a end
+ * into @a tail.
+ * @retval 0 Success.
+ * @retval -1 I/O error.
+ */
+static int read_tail(int fd, unsigned long long end, unsigned char* tail, unsigned int* tail_len)
+{
+	unsigned int len, n;
+	int rc;
+
+	len = end < METADATA_TAIL_LEN ? (unsigned int)end : METADATA_TAIL_LEN;
+	if (lseek(fd, (off_t)(end - len), SEEK_SET) == (off_t)-1)
+		return -1;
+	for (n = 0; n < len; n += rc) {
+		rc = read(fd, tail + n, len - n);
+		if (rc <= 0)
+			return -1;
+	}
+	*tail_len = len;
+	return 0;
+}
+
+/**
+ * Remember the last ::METADATA_TAIL_LEN bytes of the content streamed so far
+ */
+static void keep_tail(unsigned char* tail, unsigned int* tail_len, const unsigned char* data, unsigned int len)
+{
+	unsigned int drop;
+
+	if (len >= METADATA_TAIL_LEN) {
+		memcpy(tail, data + len - METADATA_TAIL_LEN, METADATA_TAIL_LEN);
+		*tail_len = METADATA_TAIL_LEN;
+		return;
+	}
+	if (*tail_len + len > METADATA_TAIL_LEN) {
+		drop = *tail_len + len - METADATA_TAIL_LEN;
+		memmove(tail, tail + drop, *tail_len - drop);
+		*tail_len -= drop;
+	}
+	memcpy(tail + *tail_len, data, len);
+	*tail_len += len;
+}
+
+/**
+ * Hashing stage: calculate the SHA-256 hash of the file, its midstate
+ * and tail checksum. If requested and the previously hashed content is
+ * unchanged, hashing continues from the midstate saved in the metadata.
+ *
+ * Regular files are mapped and hashed in place. Pipes, very large files
+ * and files that cannot be mapped are read in large blocks instead. In
+ * watch mode files are always read, as a file truncated by its writer
+ * while mapped raises SIGBUS on access beyond the new end.
+ * @retval 0 Success.
+ * @retval -1 The file could not be read.
+ */
+static int hash_file(job_t* job)
+{
+	int fd, rc = 0;
+	hash_context ctx;
+	struct stat st;
+	unsigned char tail[METADATA_TAIL_LEN], *buf;
+	const unsigned char* map = NULL;
+	unsigned int tail_len = 0, len;
+	size_t map_len = 0;
 
 	/* Open the file for reading */
-	fp = fopen(path, "rb");
-	if (!fp) {
-		printf("Error opening file'%s'\n", path);
+	fd = open(job->path, O_RDONLY | O_BINARY);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		printf("Error opening file'%s'\n", job->path);
+		if (fd >= 0)
+			close(fd);
 		return -1;
 	}
 
-	/* Create a SHA-256 hash of the file */
-	sha256_starts(&ctx);
-	for (;;) {
-		int n = fread(buf, 1, sizeof(buf), fp);
-		if (n <= 0)
-			break;
-		hcl += n;
-		sha256_update(&ctx, buf, n);
+#ifndef _WIN32
+	/* Map regular files, the hash block function then reads the page cache directly */
+	if (!job->no_map && S_ISREG(st.st_mode) && st.st_size > 0 && (unsigned long long)st.st_size <= MMAP_MAX_SIZE) {
+		void* p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (p != MAP_FAILED) {
+			map = (const unsigned char*)p;
+			map_len = (size_t)st.st_size;
+			madvise(p, map_len, MADV_SEQUENTIAL);
+		}
 	}
-	sha256_finish(&ctx, hash);
+#endif
 
-	/* Sign the hash with the token */
-	rc = sign_hash(pin, label, hash, sizeof(hash), &pCms);
-	if (rc <= 0) {
-		printf("ERROR sign_hash returned %d\n", rc);
+	job->hcl = 0;
+
+	/* Continue from the saved midstate if the previously hashed content is unchanged */
+	if (job->resume) {
+		if (map && job->md.hashed_content_len <= map_len) {
+			tail_len = job->md.hashed_content_len < METADATA_TAIL_LEN ? (unsigned int)job->md.hashed_content_len : METADATA_TAIL_LEN;
+			hash_tail(map + job->md.hashed_content_len - tail_len, tail_len, job->tail_hash);
+		} else if (!map && read_tail(fd, job->md.hashed_content_len, tail, &tail_len) == 0) {
+			hash_tail(tail, tail_len, job->tail_hash);
+		} else {
+			tail_len = 0;
+		}
+		if (tail_len == job->md.tail_len
+			&& memcmp(job->tail_hash, job->md.tail_hash, sizeof(job->tail_hash)) == 0) {
+			ctx = job->md.hash_ctx;
+			job->hcl = job->md.hashed_content_len;
+		} else {
+			printf("'%s' file was rewritten, hashing from start\n", job->path);
+			job->resume = 0;
+			tail_len = 0;
+		}
+	}
+
+	/* Create a SHA-256, SHA-384 or SHA-512 hash of the file */
+	if (!job->resume)
+		hash_starts(&ctx, job->hash_len);
+
+	if (map) {
+		while (job->hcl < map_len) {
+			len = map_len - job->hcl < HASH_CHUNK_SIZE ? (unsigned int)(map_len - job->hcl) : HASH_CHUNK_SIZE;
+			hash_update(&ctx, (unsigned char*)map + job->hcl, len);
+			job->hcl += len;
+		}
+		tail_len = job->hcl < METADATA_TAIL_LEN ? (unsigned int)job->hcl : METADATA_TAIL_LEN;
+		hash_tail(map + job->hcl - tail_len, tail_len, job->tail_hash);
+#ifndef _WIN32
+		munmap((void*)map, map_len);
+#endif
+	} else {
+#ifdef _WIN32
+		buf = (unsigned char*)malloc(READ_BLOCK_SIZE);
+#else
+		if (posix_memalign((void**)&buf, sysconf(_SC_PAGESIZE), READ_BLOCK_SIZE) != 0)
+			buf = NULL;
+#endif
+		if (buf == NULL) {
+			close(fd);
+			printf("Out of memory\n");
+			return -1;
+		}
+		if (lseek(fd, (off_t)job->hcl, SEEK_SET) == (off_t)-1 && job->hcl > 0) /* pipes can't seek */
+			rc = -1;
+#if !defined(_WIN32) && defined(POSIX_FADV_SEQUENTIAL)
+		posix_fadvise(fd, (off_t)job->hcl, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+		while (rc == 0) {
+			int n = read(fd, buf, READ_BLOCK_SIZE);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0)
+				rc = -1;
+			if (n <= 0)
+				break;
+			job->hcl += n;
+			hash_update(&ctx, buf, n);
+			keep_tail(tail, &tail_len, buf, n);
+		}
+		free(buf);
+		hash_tail(tail, tail_len, job->tail_hash);
+	}
+	close(fd);
+
+	if (rc != 0) {
+		printf("Error reading file'%s'\n", job->path);
 		return -1;
 	}
 
+	job->tail_len = tail_len;
+	job->md_ctx = ctx;
+	hash_finish(&ctx, job->hash);
+
+	return 0;
+}
+
+/**
+ * Write the signature and metadata files of a signed job and delete the
+ * superseded signature. For batch signatures the inclusion proof of leaf
+ * @a index in @a tree is written as well.
+ */
+static void store_signature(job_t* job, const uint8* pCms, int cmsLen,
+	const unsigned char* tree, unsigned int count, unsigned int index)
+{
+	int n;
+	char new_sig_path[MAX_PATH], proof_path[MAX_PATH];
+
 	/* Write the signature to file */
-	n = snprintf(new_sig_path, sizeof(new_sig_path), "%s.%d.p7s", path, hcl);
+	n = snprintf(new_sig_path, sizeof(new_sig_path), "%s.%llu.p7s", job->path, job->hcl);
 	if (n < 0 || n >= sizeof(new_sig_path)) {
-		printf("ERROR constructing new sig path '%s.%d.p7s'\n", path, hcl);
-		return -1;
+		printf("ERROR constructing new sig path '%s.%llu.p7s'\n", job->path, job->hcl);
+		return;
 	}
-	SaveToFile(new_sig_path, pCms, rc);
+	SaveToFile(new_sig_path, pCms, cmsLen);
 	printf("'%s' sig file created/updated\n", new_sig_path);
 
-	/* Create (or update) the metadata file with the new hashed content length */
-	if (write_metadata(md_path, hcl) != 0)
-		printf("'%s' ERROR writing metadata file '%s'\n", path, md_path);
+	/* Write the inclusion proof (or remove a stale one) next to the signature */
+	memcpy(proof_path, new_sig_path, n + 1);
+	memcpy(proof_path + n - 3, "mkp", 3);
+	if (tree) {
+		if (write_proof(proof_path, tree, count, job->hash_len, index) != 0)
+			printf("'%s' ERROR writing proof file '%s'\n", job->path, proof_path);
+	} else {
+		remove(proof_path);
+	}
+
+	/* Create (or update) the metadata file with the new hashed content length and hash midstate */
+	if (write_metadata(job->md_path, job->hcl, &job->md_ctx, job->tail_len, job->tail_hash) != 0)
+		printf("'%s' ERROR writing metadata file '%s'\n", job->path, job->md_path);
+
+	/* Delete the old signature file (but ONLY if it has a new name i.e. different hashed content len!) */
+	if (job->has_md && job->hcl != job->md.hashed_content_len) {
+		if (remove(job->old_sig_path)) {
+			int e = errno;
+			printf("'%s' ERROR deleting old sig file '%s': %s\n", job->path, job->old_sig_path, strerror(e));
+		} else {
+			printf("'%s' sig file (old) deleted\n", job->old_sig_path);
+		}
+		n = strlen(job->old_sig_path);
+		memcpy(proof_path, job->old_sig_path, n + 1);
+		memcpy(proof_path + n - 3, "mkp", 3);
+		remove(proof_path);
+	}
+}
+
+/**
+ * Signing stage: sign the hash with the token and store the signature.
+ */
+static void sign_job(pipeline_t* pl, job_t* job)
+{
+	int rc;
+	const uint8 *pCms = 0;
+
+	/* Sign the hash with the token */
+	rc = sign_hash(pl->pin, pl->label, job->hash, job->hash_len, &pCms);
+	if (rc <= 0) {
+		printf("ERROR sign_hash returned %d\n", rc);
+		return;
+	}
 
-	return hcl;
+	store_signature(job, pCms, rc, NULL, 0, 0);
 }
 
-void sign_all_files(const char* pin, const char* label, const char* path)
+/* Release a finished job and wake up wait_idle() after the last one */
+static void job_done(pipeline_t* pl, job_t* job)
+{
+	free(job);
+#ifdef USE_PIPELINE
+	if (pl->workers > 0) {
+		pthread_mutex_lock(&pl->pending_lock);
+		if (--pl->pending == 0)
+			pthread_cond_broadcast(&pl->idle);
+		pthread_mutex_unlock(&pl->pending_lock);
+	}
+#endif
+}
+
+/**
+ * Batch signing: sign the root of the Merkle tree over all collected
+ * hashes with a single card operation and store the signature with an
+ * inclusion proof for each file. A batch of one is signed directly.
+ */
+static void sign_batch(pipeline_t* pl)
+{
+	int i, n, rc;
+	const uint8 *pCms = 0;
+	unsigned char* hashes;
+	unsigned char* tree = NULL;
+	unsigned char root[64];
+
+	n = pl->batched_count;
+	if (n == 0)
+		return;
+
+	hashes = (unsigned char*)malloc(n * pl->hash_len);
+	if (n > 1 && hashes != NULL) {
+		for (i = 0; i < n; i++)
+			memcpy(hashes + i * pl->hash_len, pl->batched[i]->hash, pl->hash_len);
+		tree = build_merkle_tree(hashes, n, pl->hash_len);
+	}
+	free(hashes);
+
+	if (tree == NULL) { /* single file or out of memory: sign each file */
+		for (i = 0; i < n; i++)
+			sign_job(pl, pl->batched[i]);
+	} else {
+		memcpy(root, merkle_root(tree, n, pl->hash_len), pl->hash_len);
+		printf("Signing batch of %d files\n", n);
+		rc = sign_hash(pl->pin, pl->label, root, pl->hash_len, &pCms);
+		if (rc <= 0) {
+			printf("ERROR sign_hash returned %d\n", rc);
+		} else {
+			for (i = 0; i < n; i++)
+				store_signature(pl->batched[i], pCms, rc, tree, n, i);
+		}
+		free(tree);
+	}
+
+	for (i = 0; i < n; i++)
+		job_done(pl, pl->batched[i]);
+	pl->batched_count = 0;
+}
+
+/* Hold back a hashed job for the batch signature */
+static void batch_job(pipeline_t* pl, job_t* job)
+{
+	if (pl->batched_count == pl->batched_size) {
+		int size = pl->batched_size ? 2 * pl->batched_size : 64;
+		job_t** batched = (job_t**)realloc(pl->batched, size * sizeof(job_t*));
+		if (batched == NULL) { /* can't hold it back, sign it on its own */
+			sign_job(pl, job);
+			job_done(pl, job);
+			return;
+		}
+		pl->batched = batched;
+		pl->batched_size = size;
+	}
+	pl->batched[pl->batched_count++] = job;
+}
+
+/**
+ * Hand a job to the pipeline, or hash and sign it right away if
+ * there are no hashing workers. Takes ownership of @a job.
+ */
+static void submit_job(pipeline_t* pl, job_t* job)
+{
+#ifdef USE_PIPELINE
+	if (pl->workers > 0) {
+		pthread_mutex_lock(&pl->pending_lock);
+		pl->pending++;
+		pl->hashing++;
+		pthread_mutex_unlock(&pl->pending_lock);
+		queue_put(&pl->hash_queue, job);
+		return;
+	}
+#endif
+	if (hash_file(job) != 0) {
+		job_done(pl, job);
+	} else if (pl->batch) {
+		batch_job(pl, job);
+	} else {
+		sign_job(pl, job);
+		job_done(pl, job);
+	}
+}
+
+#ifdef USE_PIPELINE
+static job_t FlushJob; /*!< Queued behind all jobs of a batch to trigger the batch signature */
+
+static void* hash_worker(void* arg)
+{
+	pipeline_t* pl = (pipeline_t*)arg;
+	job_t* job;
+	int rc;
+
+	while ((job = queue_get(&pl->hash_queue)) != NULL) {
+		rc = hash_file(job);
+		if (rc == 0)
+			queue_put(&pl->sign_queue, job);
+		/* Only count the job as hashed once it is queued, see end_batch() */
+		pthread_mutex_lock(&pl->pending_lock);
+		if (--pl->hashing == 0)
+			pthread_cond_broadcast(&pl->idle);
+		pthread_mutex_unlock(&pl->pending_lock);
+		if (rc != 0)
+			job_done(pl, job);
+	}
+	return NULL;
+}
+
+static void* sign_worker(void* arg)
+{
+	pipeline_t* pl = (pipeline_t*)arg;
+	job_t* job;
+
+	while ((job = queue_get(&pl->sign_queue)) != NULL) {
+		if (job == &FlushJob) {
+			sign_batch(pl);
+		} else if (pl->batch) {
+			batch_job(pl, job);
+		} else {
+			sign_job(pl, job);
+			job_done(pl, job);
+		}
+	}
+	return NULL;
+}
+#endif /* USE_PIPELINE */
+
+/* Wait until all submitted jobs have been signed */
+static void wait_idle(pipeline_t* pl)
+{
+#ifdef USE_PIPELINE
+	if (pl->workers == 0)
+		return;
+	pthread_mutex_lock(&pl->pending_lock);
+	while (pl->pending > 0)
+		pthread_cond_wait(&pl->idle, &pl->pending_lock);
+	pthread_mutex_unlock(&pl->pending_lock);
+#endif
+}
+
+/**
+ * Sign everything submitted so far: wait for all pending signatures or,
+ * in batch mode, sign the Merkle root over all files of the batch.
+ */
+static void end_batch(pipeline_t* pl)
+{
+	if (!pl->batch) {
+		wait_idle(pl);
+		return;
+	}
+#ifdef USE_PIPELINE
+	if (pl->workers > 0) {
+		/* Once every job left the hashing stage the flush request is queued behind all of them */
+		pthread_mutex_lock(&pl->pending_lock);
+		while (pl->hashing > 0)
+			pthread_cond_wait(&pl->idle, &pl->pending_lock);
+		pthread_mutex_unlock(&pl->pending_lock);
+		queue_put(&pl->sign_queue, &FlushJob);
+		wait_idle(pl);
+		return;
+	}
+#endif
+	sign_batch(pl);
+}
+
+/**
+ * Decide whether the file @a name in directory @a path needs to be
+ * (re-)signed and submit a job for it if so.
+ */
+static void check_file(pipeline_t* pl, const char* path, const char* name, const struct stat* entry_info)
 {
 	int n, err;
+	struct stat old_sig_info;
+	job_t* job;
+
+	job = (job_t*)malloc(sizeof(job_t));
+	if (job == NULL) {
+		printf("Out of memory\n");
+		return;
+	}
+	job->hash_len = pl->hash_len;
+	job->no_map = pl->no_map;
+
+	n = snprintf(job->path, sizeof(job->path), "%s/%s", path, name);
+	if (n < 0 || n >= sizeof(job->path)) {
+		printf("ERROR constructing entry path for '%s/%s'\n", path, name);
+		free(job);
+		return;
+	}
+
+	/* Get the metadata from the previous signing (from the .<filename> hidden metadata file) */
+	n = snprintf(job->md_path, sizeof(job->md_path), "%s/.%s", path, name);
+	if (n < 0 || n >= sizeof(job->md_path)) {
+		printf("ERROR constructing metadata path '%s/.%s'\n", path, name);
+		free(job);
+		return;
+	}
+	err = read_metadata(job->md_path, &job->md);
+
+	/* Recreate the old (existing) signature filename */
+	n = snprintf(job->old_sig_path, sizeof(job->old_sig_path), "%s/%s.%llu.p7s", path, name, job->md.hashed_content_len);
+	if (n < 0 || n >= sizeof(job->old_sig_path)) {
+		printf("ERROR constructing old sig path '%s/%s.%llu.p7s'\n", path, name, job->md.hashed_content_len);
+		free(job);
+		return;
+	}
+
+	/* Create a new signature (if necessary) */
+	if (!err) { /* If a sig metadata file was found */
+
+		/* stat the old sig file to make sure it still exists */
+		err = stat(job->old_sig_path, &old_sig_info);
+
+		/* If the sig file still exists & the content file is unmodified just keep the old signature and continue */
+		if (!err) {
+			if ((unsigned long long)entry_info->st_size == job->md.hashed_content_len) {
+				printf("'%s' file is unmodified\n", job->path);
+				free(job);
+				return;
+			}
+			printf("'%s' file is modified\n", job->path);
+		} else {
+			/* If the signature file no longer exists, log an error */
+			printf("'%s' sig file missing!\n", job->old_sig_path);
+		}
+
+		/* If the content file is shrinking, log an error */
+		if ((unsigned long long)entry_info->st_size < job->md.hashed_content_len)
+			printf("'%s' file is shrinking!\n", job->path);
+
+		/* Create a new signature file, hashing only the appended content if the file grew */
+		job->has_md = 1;
+		job->resume = (unsigned long long)entry_info->st_size > job->md.hashed_content_len
+			&& job->md.hash_ctx.hashLen == job->hash_len;
+
+	} else { /* otherwise no metadata file was found (or an error occurred while reading the metadata file) */
+		/* So create a new signature file (either no signature file exists yet or it has to be recreated) */
+		printf("'%s' file is not signed\n", job->path);
+		job->has_md = 0;
+		job->resume = 0;
+	}
+
+	submit_job(pl, job);
+}
+
+/* Hidden files (including our metadata files) and signatures are never signed */
+static int is_ignored(const char* name)
+{
+	const char* ext;
+
+	/* Skip "./" "../" and hidden files that begin with '.' */
+	if (name[0] == '.')
+		return 1;
+
+	/* Skip any .p7s and .mkp files  TODO: delete any orphaned .p7s files*/
+	ext = strrchr(name, '.');
+	return ext && (strcmp(ext, ".p7s") == 0 || strcmp(ext, ".mkp") == 0);
+}
+
+/**
+ * Directory walker: decide for every file below @a path whether it needs
+ * to be (re-)signed and submit a job for it.
+ */
+void sign_all_files(pipeline_t* pl, const char* path)
+{
+	int n;
     DIR* dir;
     struct dirent* entry;
-	const char* ext;
-	struct stat entry_info, old_sig_info;
-	char entry_path[MAX_PATH], md_path[PATH_MAX], old_sig_path[PATH_MAX];
-	metadata_t md;
-	unsigned int new_sig_hcl;
+	struct stat entry_info;
+	char entry_path[MAX_PATH];
 
     /* Open directory stream */
     dir = opendir(path);
@@ -133,13 +772,7 @@ void sign_all_files(const char* pin, const char* label, const char* path)
 	/* Loop through each entry in the specified path */
     while ((entry = readdir(dir)) != NULL) {
 
-		/* Skip "./" "../" and hidden files that begin with '.' */
-		if (entry->d_name[0] == '.')
-			continue;
-
-		/* Skip any .p7s files  TODO: delete any orphaned .p7s files*/
-		ext = strrchr(entry->d_name, '.');
-		if (ext && (strcmp(ext, ".p7s") == 0))
+		if (is_ignored(entry->d_name))
 			continue;
 
 		/* Create the full path to the entry */
@@ -158,88 +791,298 @@ void sign_all_files(const char* pin, const char* label, const char* path)
 
 		/* Recursively call this function on sub-directories */
 		if (S_ISDIR(entry_info.st_mode)) {
-			sign_all_files(pin, label, entry_path);
+			sign_all_files(pl, entry_path);
 			continue;
 		}
 
-		/* Get the metadata from the previous signing (from the .<filename> hidden metadata file) */
-		n = snprintf(md_path, sizeof(md_path), "%s/.%s", path, entry->d_name);
-		if (n < 0 || n >= sizeof(md_path)) {
-			printf("ERROR constructing metadata path '%s/.%s'\n", path, entry->d_name);
-			continue;
+		check_file(pl, path, entry->d_name, &entry_info);
+    }
+
+	/* Close the directory stream */
+    closedir(dir);
+}
+
+#ifdef USE_INOTIFY
+static void stop_handler(int sig)
+{
+	Stop = 1;
+}
+
+/* Add watches for @a path and all its sub-directories */
+static void watch_tree(watcher_t* w, const char* path)
+{
+	int wd, n;
+	DIR* dir;
+	struct dirent* entry;
+	struct stat entry_info;
+	char entry_path[MAX_PATH];
+
+	wd = inotify_add_watch(w->fd, path, WATCH_MASK | IN_ONLYDIR);
+	if (wd < 0) {
+		int e = errno;
+		printf("ERROR watching '%s': %s\n", path, strerror(e));
+		return;
+	}
+	if (wd >= w->dirs_size) {
+		int size = wd + 64;
+		char** dirs = (char**)realloc(w->dirs, size * sizeof(char*));
+		if (dirs == NULL) {
+			printf("Out of memory\n");
+			inotify_rm_watch(w->fd, wd);
+			return;
 		}
-		err = read_metadata(md_path, &md);
+		memset(dirs + w->dirs_size, 0, (size - w->dirs_size) * sizeof(char*));
+		w->dirs = dirs;
+		w->dirs_size = size;
+	}
+	free(w->dirs[wd]);
+	w->dirs[wd] = strdup(path);
 
-		/* Recreate the old (existing) signature filename */
-		n = snprintf(old_sig_path, sizeof(old_sig_path), "%s/%s.%d.p7s", path, entry->d_name, md.hashed_content_len);
-		if (n < 0 || n >= sizeof(md_path)) {
-			printf("ERROR constructing old sig path '%s/%s.%d.p7s'\n", path, entry->d_name, md.hashed_content_len);
+	dir = opendir(path);
+	if (dir == NULL)
+		return;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.')
+			continue;
+		n = snprintf(entry_path, sizeof(entry_path), "%s/%s", path, entry->d_name);
+		if (n < 0 || n >= sizeof(entry_path))
 			continue;
+		if (stat(entry_path, &entry_info) == 0 && S_ISDIR(entry_info.st_mode))
+			watch_tree(w, entry_path);
+	}
+	closedir(dir);
+}
+
+/* Remember a changed file for the current batch, ignoring duplicates */
+static void add_changed(watcher_t* w, const char* path)
+{
+	int i;
+
+	for (i = 0; i < w->changed_count; i++)
+		if (strcmp(w->changed[i], path) == 0)
+			return;
+	if (w->changed_count == w->changed_size) {
+		int size = w->changed_size ? 2 * w->changed_size : 64;
+		char** changed = (char**)realloc(w->changed, size * sizeof(char*));
+		if (changed == NULL) { /* can't track, fall back to a full scan */
+			w->rescan = 1;
+			return;
 		}
+		w->changed = changed;
+		w->changed_size = size;
+	}
+	w->changed[w->changed_count] = strdup(path);
+	if (w->changed[w->changed_count] != NULL)
+		w->changed_count++;
+}
 
-		/* Create a new signature (if necessary) */
-		if (!err) { /* If a sig metadata file was found */
-
-			/* stat the old sig file to make sure it still exists */
-			err = stat(old_sig_path, &old_sig_info);
-
-			/* If the sig file still exists & the content file is unmodified just keep the old signature and continue */
-			if (!err) {
-				if (entry_info.st_size == md.hashed_content_len) {
-					printf("'%s' file is unmodified\n", entry_path);
-					continue;
-				}
-				printf("'%s' file is modified\n", entry_path);
-			} else {
-				/* If the signature file no longer exists, log an error */
-				printf("'%s' sig file missing!\n", old_sig_path);
-			}
+/* Process a single inotify event */
+static void handle_event(watcher_t* w, pipeline_t* pl, const struct inotify_event* ev)
+{
+	char path[MAX_PATH];
+	int n;
 
-			/* If the content file is shrinking, log an error */
-			if (entry_info.st_size < md.hashed_content_len)
-				printf("'%s' file is shrinking!\n", entry_path);
-
-			/* Now create a new signature file */
-			new_sig_hcl = sign_file(pin, label, entry_path, md_path);
-
-			/* If no error occurred, delete the old signature file (but ONLY if it has a new name i.e. different hashed content len!) */
-			if (new_sig_hcl > 0 && new_sig_hcl != md.hashed_content_len) {
-				err = remove(old_sig_path);
-				if (err) {
-					int e = errno;
-					printf("'%s' ERROR deleting old sig file '%s': %s\n", entry_path, old_sig_path, strerror(e));
-				} else {
-					printf("'%s' sig file (old) deleted\n", old_sig_path);
-				}
-			}
+	if (ev->mask & IN_Q_OVERFLOW) {
+		w->rescan = 1;
+		return;
+	}
+	if (ev->wd < 0 || ev->wd >= w->dirs_size || w->dirs[ev->wd] == NULL)
+		return;
+	if (ev->mask & IN_IGNORED) { /* directory was removed */
+		free(w->dirs[ev->wd]);
+		w->dirs[ev->wd] = NULL;
+		return;
+	}
+	if (ev->len == 0 || is_ignored(ev->name))
+		return;
 
-		} else { /* otherwise no metadata file was found (or an error occurred while reading the metadata file) */
-			/* So create a new signature file (either no signature file exists yet or it has to be recreated) */
-			printf("'%s' file is not signed\n", entry_path);
-			sign_file(pin, label, entry_path, md_path);
+	n = snprintf(path, sizeof(path), "%s/%s", w->dirs[ev->wd], ev->name);
+	if (n < 0 || n >= sizeof(path))
+		return;
+
+	if (ev->mask & IN_ISDIR) {
+		/* New directory: watch it and sign what was created before the watch was in place */
+		if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+			watch_tree(w, path);
+			sign_all_files(pl, path);
 		}
-    }
+		return;
+	}
 
-	/* Close the directory stream */
-    closedir(dir);
+	/* Files are signed once written, the creation itself is of no interest */
+	if (ev->mask & (IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO))
+		add_changed(w, path);
+}
+
+/* Sign all files changed in the current batch and wait for the signatures */
+static void sign_changed(watcher_t* w, pipeline_t* pl, const char* root)
+{
+	struct stat entry_info;
+	char* name;
+	int i, rescan = w->rescan;
+
+	/* A full scan covers the individually changed files as well */
+	if (rescan) {
+		printf("Events lost, scanning '%s'\n", root);
+		sign_all_files(pl, root);
+		w->rescan = 0;
+	}
+	for (i = 0; i < w->changed_count; i++) {
+		if (!rescan && stat(w->changed[i], &entry_info) == 0 && S_ISREG(entry_info.st_mode)) {
+			name = strrchr(w->changed[i], '/');
+			*name++ = 0;
+			check_file(pl, w->changed[i], name, &entry_info);
+		}
+		free(w->changed[i]);
+	}
+	w->changed_count = 0;
+	end_batch(pl);
+}
+
+static long now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Daemon mode: watch the tree below @a root and sign files shortly after
+ * they were written. Events are collected until no further event arrived
+ * for ::BATCH_QUIET_MS (or for at most ::BATCH_MAX_MS) and each changed
+ * file is then checked and signed once. Runs until SIGINT or SIGTERM.
+ */
+static void watch_all_files(pipeline_t* pl, const char* root)
+{
+	watcher_t w;
+	struct sigaction sa;
+	struct pollfd pfd;
+	char buf[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)];
+	long batch_start = 0;
+	int rc, timeout;
+	ssize_t len, off;
+
+	memset(&w, 0, sizeof(w));
+	w.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (w.fd < 0) {
+		int e = errno;
+		printf("ERROR initializing inotify: %s\n", strerror(e));
+		return;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	/* Watch first, then scan, so that no change is missed */
+	watch_tree(&w, root);
+	sign_all_files(pl, root);
+	end_batch(pl);
+
+	pfd.fd = w.fd;
+	pfd.events = POLLIN;
+	while (!Stop) {
+		if (w.changed_count == 0 && !w.rescan) {
+			timeout = -1;
+		} else {
+			timeout = BATCH_MAX_MS - (int)(now_ms() - batch_start);
+			if (timeout > BATCH_QUIET_MS)
+				timeout = BATCH_QUIET_MS;
+			if (timeout < 0)
+				timeout = 0;
+		}
+
+		rc = poll(&pfd, 1, timeout);
+		if (rc < 0 && errno != EINTR)
+			break;
+
+		if (rc == 0) { /* quiet period elapsed or batch held back long enough */
+			sign_changed(&w, pl, root);
+			continue;
+		}
+
+		while ((len = read(w.fd, buf, sizeof(buf))) > 0) {
+			if (w.changed_count == 0 && !w.rescan)
+				batch_start = now_ms();
+			for (off = 0; off < len; off += sizeof(struct inotify_event) + ((struct inotify_event*)(buf + off))->len)
+				handle_event(&w, pl, (struct inotify_event*)(buf + off));
+		}
+
+		if ((w.changed_count > 0 || w.rescan) && now_ms() - batch_start >= BATCH_MAX_MS)
+			sign_changed(&w, pl, root);
+	}
+
+	sign_changed(&w, pl, root);
+
+	close(w.fd);
+	for (rc = 0; rc < w.dirs_size; rc++)
+		free(w.dirs[rc]);
+	free(w.dirs);
+	free(w.changed);
 }
+#endif /* USE_INOTIFY */
 
 int main(int argc, char** argv)
 {
-	const char * pin, * label;
+	pipeline_t pl;
 	char* path;
 	struct stat info;
-	int i;
+	const char* prog = argv[0];
+	int i, watch = 0, batch = 0, hash_len = 32;
+#ifdef USE_PIPELINE
+	pthread_t *hashers = NULL, signer;
+#endif
+
+	/* Options */
+	for (; argc > 1 && strncmp(argv[1], "--", 2) == 0; argc--, argv++) {
+		if (strcmp(argv[1], "--batch") == 0) {
+			batch = 1;
+		} else if (strcmp(argv[1], "--hash=sha256") == 0) {
+			hash_len = 32;
+		} else if (strcmp(argv[1], "--hash=sha384") == 0) {
+			hash_len = 48;
+		} else if (strcmp(argv[1], "--hash=sha512") == 0) {
+			hash_len = 64;
+#ifdef USE_INOTIFY
+		} else if (strcmp(argv[1], "--watch") == 0) {
+			watch = 1;
+#endif
+		} else {
+			argc = 0; /* show usage */
+			break;
+		}
+	}
 
 	/* Check args */
-	if (argc != 4) {
-		printf("Usage: %s <pin> <label> <path>\n", argv[0]);
+	if (argc != 4 && argc != 5) {
+#ifdef USE_INOTIFY
+		printf("Usage: %s [--batch] [--watch] [--hash=sha256|sha384|sha512] <pin> <label> <path> [<hash-threads>]\n", prog);
+#else
+		printf("Usage: %s [--batch] [--hash=sha256|sha384|sha512] <pin> <label> <path> [<hash-threads>]\n", prog);
+#endif
+		printf("The hash algorithm must match the one of the signature template (default sha256)\n");
 		return 1;
 	}
-	pin = argv[1];
-	label = argv[2];
+	memset(&pl, 0, sizeof(pl));
+	pl.pin = argv[1];
+	pl.label = argv[2];
+	pl.batch = batch;
+	pl.hash_len = hash_len;
+	pl.no_map = watch;
 	path = strdup(argv[3]);
 
+#ifdef USE_PIPELINE
+	/* Default to one hashing worker per CPU */
+	if (argc == 5)
+		pl.workers = atoi(argv[4]);
+	else
+		pl.workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (pl.workers < 0)
+		pl.workers = 0;
+#endif
+
 	/* Trim trailing slashes from path */
 	i = strlen(path);
 	while (--i >= 0 && (path[i] == '/' || path[i] == '\\'))
@@ -252,15 +1095,69 @@ int main(int argc, char** argv)
 		return e;
 	}
 
-	/* TODO: Create a mutex for controlling access to token. Only necessary for simultaneous access to token. */
+#ifdef USE_PIPELINE
+	/* Start the hashing workers and the signing stage, which is the only thread accessing the token */
+	if (pl.workers > 0) {
+		queue_init(&pl.hash_queue);
+		queue_init(&pl.sign_queue);
+		pthread_mutex_init(&pl.pending_lock, NULL);
+		pthread_cond_init(&pl.idle, NULL);
+		hashers = (pthread_t*)calloc(pl.workers, sizeof(pthread_t));
+		if (hashers == NULL) {
+			printf("Out of memory\n");
+			return 1;
+		}
+		for (i = 0; i < pl.workers; i++) {
+			if (pthread_create(&hashers[i], NULL, hash_worker, &pl) != 0) {
+				printf("ERROR creating hashing thread\n");
+				break;
+			}
+		}
+		if (i == 0) { /* no worker started, continue synchronously */
+			free(hashers);
+			pthread_cond_destroy(&pl.idle);
+			pthread_mutex_destroy(&pl.pending_lock);
+			queue_destroy(&pl.sign_queue);
+			queue_destroy(&pl.hash_queue);
+		} else if (pthread_create(&signer, NULL, sign_worker, &pl) != 0) {
+			printf("ERROR creating signing thread\n");
+			return 1;
+		}
+		pl.workers = i;
+	}
+#endif
+
+	/* Sign all files in the specified directory, and keep doing so as files change if requested */
+#ifdef USE_INOTIFY
+	if (watch)
+		watch_all_files(&pl, path);
+	else
+#endif
+	{
+		sign_all_files(&pl, path);
+		end_batch(&pl);
+	}
 
-	/* Sign all files in the specified directory */
-	sign_all_files(pin, label, path);
+#ifdef USE_PIPELINE
+	/* Drain the pipeline */
+	if (pl.workers > 0) {
+		queue_close(&pl.hash_queue);
+		for (i = 0; i < pl.workers; i++)
+			pthread_join(hashers[i], NULL);
+		queue_close(&pl.sign_queue);
+		pthread_join(signer, NULL);
+		free(hashers);
+		pthread_cond_destroy(&pl.idle);
+		pthread_mutex_destroy(&pl.pending_lock);
+		queue_destroy(&pl.sign_queue);
+		queue_destroy(&pl.hash_queue);
+	}
+#endif
 
 	/* Clean up */
 	release_template();
-
-	/* TODO: Destroy mutex. Only necessary for simultaneous access to token. */
+	free(pl.batched);
+	free(path);
 
 #if defined(_WIN32) && defined(DEBUG)
 	_CrtDumpMemoryLeaks();
@@ -28,8 +28,8 @@
  *
  * @file sc-hsm-ultralite.c
  * @author Christoph Brunhuber
- * @brief Functions for RSA-2k signing of SHA-256
- *                  ECDSA-prime256 signing of SHA-256
+ * @brief Functions for RSA-1k..4k signing of SHA-256, SHA-384, SHA-512
+ *                  ECDSA-prime256/384/521 and brainpool signing of SHA-256, SHA-384, SHA-512
  *                  Card Devices, Version 1.0
  */
 
@@ -40,6 +40,8 @@
 #include <string.h>
 #include <time.h>
 
+#include <common/ecdsasig.h>
+
 #include "utils.h"
 #include "sc-hsm-ultralite.h"
 
@@ -85,6 +87,11 @@ void no_printf(const char *format, ...) {}
 	To make it the same size always a 0 is pre pended. If that violates the standard is not clear, however most
 	crypto libraries accept the expanded signature. Windows actually require R and S packed (fixed length),
 	that is the original signature must be transformed anyway before passed to the verify function.
+
+	The hash algorithm of a template is given by its HashLen (32: SHA-256, 48: SHA-384, 64: SHA-512)
+	and the key type by its SignatureSize: RSA keys from 1024 to 4096 bits use the modulus size,
+	ECDSA keys the size of the expanded signature for the field length (e.g. 72 for prime256v1,
+	104 for secp384r1, 137 for brainpoolP512r1 and 141 for secp521r1).
 */
 
 /*******************************************************************************
@@ -240,6 +247,8 @@ typedef struct {
 /* up to here from file */
 	uint16 KeyFid;
 	uint16 TemplateFid;
+	uint16 PrefixLen; /* length of the constant signed attributes before signing time and message digest */
+	hash_context PrefixCtx; /* hash midstate after PrefixLen bytes of the signed attributes */
 	uint8 *pCms;
 	char Label[1]; /* space for the 0 terminator, need calloc(1, sizeof(Template_t) + strlen(label)) */
 } Template_t;
@@ -249,6 +258,22 @@ static Template_t *This; /* current template (singleton) */
 #define TEMPLATE_VERSION (0)
 #define TEMPLATE_HEADER_LENGTH (20)
 
+/*
+	The signed attributes only change in the signing time and the message digest.
+	Hash the constant part in front of both once, so that each signature only needs
+	to hash the remaining tail. The first byte is hashed as SET tag instead of the
+	CONT [0] tag of the template.
+*/
+static void PrepareSignedAttributes()
+{
+	uint8 setTag = 0x31;
+	This->PrefixLen = (This->SigningTimeOff < This->MessageDigestOff
+		? This->SigningTimeOff : This->MessageDigestOff) - This->SignedAttributesOff;
+	hash_starts(&This->PrefixCtx, This->HashLen);
+	hash_update(&This->PrefixCtx, &setTag, 1);
+	hash_update(&This->PrefixCtx, This->pCms + This->SignedAttributesOff + 1, This->PrefixLen - 1);
+}
+
 static int LoadTemplate(const char *label)
 {
 	uint8 *pCms;
@@ -291,8 +316,8 @@ static int LoadTemplate(const char *label)
 	/*
 		Sanity checks
 	*/
-	if (This->HashLen != 32) {
-		printf("currently only SHA256 supported\n");
+	if (This->HashLen != 32 && This->HashLen != 48 && This->HashLen != 64) {
+		printf("only SHA-256, SHA-384 and SHA-512 supported\n");
 		rc = ERR_SANITY;
 		goto error;
 	}
@@ -339,6 +364,7 @@ static int LoadTemplate(const char *label)
 		off += len;
 		pCms += len;
 	}
+	PrepareSignedAttributes();
 	return 0;
 error:
 	if (This->pCms)
@@ -356,39 +382,58 @@ error:
  *******************************************************************************
  ******************************************************************************/
 
-static int PatchSignedAttributes(
+/* Field length of an ECDSA key for the size of its expanded signature or 0 if none */
+static int ECDSAFieldLength(int signatureSize)
+{
+	static const uint8 fieldLengths[] = { 24, 28, 32, 40, 48, 64, 66 };
+	int i;
+	for (i = 0; i < (int)sizeof(fieldLengths); i++) {
+		if (ECDSA_DER_MAX_LEN(fieldLengths[i]) == signatureSize)
+			return fieldLengths[i];
+	}
+	return 0;
+}
+
+static int IsRSASignatureSize(int signatureSize)
+{
+	return 128 <= signatureSize && signatureSize <= MAX_APDU_DATA && signatureSize % 8 == 0;
+}
+
+static int PatchSignedAttributes(uint8 *pCms,
 	const uint8 *hash, int hashLen,
 	uint8 *hashToSign, int hashToSignLen)
 {
+	static time_t lastTime; /* signing time is formatted at most once per second */
+	static char signingTime[16];
 	time_t now;
 	struct tm t;
-	char signingTime[16];
-	uint8 oldTag;
-	sha256_context ctx;
+	hash_context ctx;
+	if (hashToSignLen < This->HashLen)
+		return ERR_HASH;
 	/* patch signing time */
 	time(&now);
-	t = *gmtime(&now);
-	if (!(2013 - 1900 <= t.tm_year && t.tm_year < 2050 - 1900))
-		return ERR_TIME;
-	sprintf(signingTime,
-			"%02d%02d%02d%02d%02d%02dZ",
-			t.tm_year - 100, 1 + t.tm_mon, t.tm_mday,
-			t.tm_hour, t.tm_min, t.tm_sec);
-	memcpy(This->pCms + This->SigningTimeOff, signingTime, 13);
+	if (now != lastTime || signingTime[0] == 0) {
+		t = *gmtime(&now);
+		if (!(2013 - 1900 <= t.tm_year && t.tm_year < 2050 - 1900))
+			return ERR_TIME;
+		sprintf(signingTime,
+				"%02d%02d%02d%02d%02d%02dZ",
+				t.tm_year - 100, 1 + t.tm_mon, t.tm_mday,
+				t.tm_hour, t.tm_min, t.tm_sec);
+		lastTime = now;
+	}
+	memcpy(pCms + This->SigningTimeOff, signingTime, 13);
 	/* patch MessageDigest */
-	memcpy(This->pCms + This->MessageDigestOff, hash, hashLen);
-	/* calculate hash of signed attributes */
-	oldTag = This->pCms[This->SignedAttributesOff]; /* save old tag */
-	This->pCms[This->SignedAttributesOff] = 0x31; /* change from CONT [0] to SET tag */
-	/* todo additional support of at least SHA1 */
-	sha256_starts(&ctx);
-	sha256_update(&ctx, This->pCms + This->SignedAttributesOff, This->SignedAttributesLen);
-	sha256_finish(&ctx, hashToSign);
-	This->pCms[This->SignedAttributesOff] = oldTag; /* restore CONT [0] */
+	memcpy(pCms + This->MessageDigestOff, hash, hashLen);
+	/* calculate hash of signed attributes, continuing after the constant prefix */
+	ctx = This->PrefixCtx;
+	hash_update(&ctx, pCms + This->SignedAttributesOff + This->PrefixLen,
+		This->SignedAttributesLen - This->PrefixLen);
+	hash_finish(&ctx, hashToSign);
 	return 0;
 }
 
-static int PatchRSATemplate(const uint8 *hash, int hashLen)
+static int PatchRSATemplate(uint8 *pCms, const uint8 *hash, int hashLen)
 {
 	/*
 	const ASN1 headers to build the asn1 enclosed hash:
@@ -401,20 +446,16 @@ static int PatchRSATemplate(const uint8 *hash, int hashLen)
 	*/
 	static const uint8 encSHA256[] =
 		"\x30\x31\x30\x0d\x06\x09\x60\x86\x48\x01\x65\x03\x04\x02\x01\x05\x00\x04\x20";
-#if 0
-	static const uint8 encSHA1[] =
-		"\x30\x21\x30\x09\x06\x05\x2b\x0e\x03\x02\x1a\x05\x00\x04\x14";
 	static const uint8 encSHA384[] =
 		"\x30\x41\x30\x0d\x06\x09\x60\x86\x48\x01\x65\x03\x04\x02\x02\x05\x00\x04\x30";
 	static const uint8 encSHA512[] =
 		"\x30\x51\x30\x0d\x06\x09\x60\x86\x48\x01\x65\x03\x04\x02\x03\x05\x00\x04\x40";
-#endif
 	int ix, encLen;
 	const uint8 *enc;
 	uint8 *sig;
 	int rc;
-	uint8 hashToSign[32];
-	rc = PatchSignedAttributes(hash, hashLen, hashToSign, sizeof(hashToSign));
+	uint8 hashToSign[64];
+	rc = PatchSignedAttributes(pCms, hash, hashLen, hashToSign, sizeof(hashToSign));
 	if (rc < 0)
 		return rc;
 	switch (hashLen) {
@@ -422,11 +463,6 @@ static int PatchRSATemplate(const uint8 *hash, int hashLen)
 		enc = encSHA256;
 		encLen = sizeof(encSHA256) - 1;
 		break;
-#if 0
-	case 20:          /* SHA1 */
-		enc = encSHA1;
-		encLen = sizeof(encSHA1) - 1;
-		break;
 	case 48:          /* SHA-384 */
 		enc = encSHA384;
 		encLen = sizeof(encSHA384) - 1;
@@ -435,7 +471,6 @@ static int PatchRSATemplate(const uint8 *hash, int hashLen)
 		enc = encSHA512;
 		encLen = sizeof(encSHA512) - 1;
 		break;
-#endif
 	default:
 		return ERR_HASH;
 	}
@@ -444,7 +479,7 @@ static int PatchRSATemplate(const uint8 *hash, int hashLen)
 		The total size must match exactly the RSA modulus size (RSA2k: 2048 bits == 256 bytes).
 		Use space of p->Signature !!!
 	*/
-	sig = This->pCms + This->SignatureOff;
+	sig = pCms + This->SignatureOff;
 	ix = This->SignatureSize;
 	memcpy(sig + (ix -= hashLen), hashToSign, hashLen);
 	memcpy(sig + (ix -= encLen), enc, encLen);
@@ -455,15 +490,15 @@ static int PatchRSATemplate(const uint8 *hash, int hashLen)
 	return SC_Sign(0x20, (uint8)This->KeyFid, sig, This->SignatureSize, sig, This->SignatureSize);
 }
 
-static int PatchECDSATemplate(const uint8 *hash, int hashLen)
+static int PatchECDSATemplate(uint8 *pCms, const uint8 *hash, int hashLen)
 {
-	int rc;
-	uint8 hashToSign[32];
+	int rc, fl;
+	uint8 hashToSign[64];
 	uint8 *sig;
-	rc = PatchSignedAttributes(hash, hashLen, hashToSign, sizeof(hashToSign));
+	rc = PatchSignedAttributes(pCms, hash, hashLen, hashToSign, sizeof(hashToSign));
 	if (rc < 0)
 		return rc;
-	rc = SC_Sign(0x70, (uint8)This->KeyFid, hashToSign, hashLen, This->pCms + This->SignatureOff, This->SignatureSize);
+	rc = SC_Sign(0x70, (uint8)This->KeyFid, hashToSign, hashLen, pCms + This->SignatureOff, This->SignatureSize);
 	if (rc < 0)
 		return rc;
 	/*
@@ -477,39 +512,32 @@ static int PatchECDSATemplate(const uint8 *hash, int hashLen)
 		not the BER encoding. A ECDSA signature needs not to be DER encoded because
 		it is never hashed or bitwise compared.
 
-		ASN.1 encoding of DSA and ECDSA signature: (total length ... 70, 71 or 72)
+		ASN.1 encoding of DSA and ECDSA signature: (e.g. prime256v1 total length ... 70, 71 or 72)
 		SEQUENCE // length: ... 68, 69 or 70)
 			r INTEGER // length: ... 32 or 33 if MSBit set
 			s INTEGER // length: ... 32 or 33 if MSBit set
 
-		expanded ASN.1 encoding: (total length 72)
+		expanded ASN.1 encoding: (prime256v1 total length 72)
 		0x00=00: 0x30 0x46 //  SEQUENCE of length 0x46 (== 70)
 		0x02=02: 0x02 0x21 // r INTEGER of length 0x21 (== 33)
 		0x25=37: 0x02 0x21 // s INTEGER of length 0x21 (== 33)
 		0x48=72:
+
+		For field lengths above 60 bytes the SEQUENCE length needs the 0x81 prefix,
+		e.g. secp521r1: 0x30 0x81 0x8A, r and s INTEGER of length 0x43 (== 67), total 141.
 	*/
-	sig = This->pCms + This->SignatureOff;
-	if ((57 <= rc && rc <= 72) && sig[0] == 0x30) {
-		int ri = 2 + 2;          /*  index of r data */
-		int rl = sig[ri - 1];    /* length of r data */
-		int si = 2 + 2 + rl + 2; /*  index of s data */
-		int sl = sig[si - 1];    /* length of s data */
-		if (rl > 33 || sl > 33)
-			return ERR_INVALID; /* should never happen */
-		/* due to inplace moving we must start with s */
-		memmove(sig + 72 - sl, sig + si, sl); /* move data of s to end  */
-		memset(sig + 37 + 2, 0, 33 - sl);     /* set leading zeros of s */
-		sig[38] = 33;                         /* set length of s        */
-		sig[37] = 0x02;                       /* set INTEGER tag        */
-		memmove(sig + 37 - rl, sig + ri, rl); /* move data of r         */
-		memset(sig + 2 + 2, 0, 33 - rl);      /* set leading zeros of r */
-		sig[ 3] = 33;                         /* set length of r        */
-		sig[ 2] = 0x02;                       /* set INTEGER tag        */
-		sig[ 1] = 70;                         /* set lenth of SEQUENCE  */
-		/* sig[0] = 0x30; */
-		return 72;
-	}
-	return rc;
+	fl = ECDSAFieldLength(This->SignatureSize);
+	if (fl == 0)
+		return ERR_KEY_SIZE;
+	sig = pCms + This->SignatureOff;
+	/* the signature field holds the largest DER encoding, so both steps work in place */
+	rc = ecdsa_der_to_raw(sig, rc, sig, This->SignatureSize, fl);
+	if (rc < 0)
+		return ERR_INVALID; /* should never happen */
+	rc = ecdsa_raw_to_der(sig, fl, This->SignatureSize, 1);
+	if (rc < 0)
+		return ERR_INVALID;
+	return This->SignatureSize;
 }
 
 /*******************************************************************************
@@ -522,22 +550,12 @@ static int PatchECDSATemplate(const uint8 *hash, int hashLen)
  *******************************************************************************
  ******************************************************************************/
 /*
- *  Signature of specified hash
- *
- *  pin         : smartcard pin
- *  label       : key and template label
- *  hash        : Hash to be signed
- *  hashLen     : Length of hash (20, 32, 48 or 64)
- *  ppCms       : returns the CMS data in *ppCms
- *
- *  Returns : CMS size or error if <= 0
- */
-int EXPORT_FUNC sign_hash(const char *pin, const char *label, const uint8 *hash, int hashLen, const uint8 **ppCms)
+	Reuse the cached template if it still belongs to the token or load it
+*/
+static int OpenTemplate(const char *pin, const char *label)
 {
 	int rc;
 
-	*ppCms = 0;
-
 	if (This) { /* try to reuse template */
 		if (strcmp(This->Label, label)) {
 			release_template();
@@ -558,19 +576,115 @@ int EXPORT_FUNC sign_hash(const char *pin, const char *label, const uint8 *hash,
 			return rc;
 		}
 	}
-	if (This->SignatureSize == 256) /* RSA */
-		rc = PatchRSATemplate(hash, hashLen);
-	else if (This->SignatureSize == 72)
-		rc = PatchECDSATemplate(hash, hashLen);
+	return 0;
+}
+
+/*
+	Patch the template copy in pCms with the hash and sign it
+*/
+static int PatchTemplate(uint8 *pCms, const uint8 *hash, int hashLen)
+{
+	int rc;
+
+	if (IsRSASignatureSize(This->SignatureSize))
+		rc = PatchRSATemplate(pCms, hash, hashLen);
+	else if (ECDSAFieldLength(This->SignatureSize))
+		rc = PatchECDSATemplate(pCms, hash, hashLen);
 	else
 		rc = ERR_TEMPLATE;
-	if (rc == 72 || rc == 256) {
-		*ppCms = This->pCms;
+	if (rc == This->SignatureSize)
 		return This->CMSLen;
+	return rc < 0 ? rc : ERR_KEY_SIZE;
+}
+
+/*
+ *  Signature of specified hash
+ *
+ *  pin         : smartcard pin
+ *  label       : key and template label
+ *  hash        : Hash to be signed
+ *  hashLen     : Length of hash (32, 48 or 64), must match the hash of the template
+ *  ppCms       : returns the CMS data in *ppCms
+ *
+ *  Returns : CMS size or error if <= 0
+ */
+int EXPORT_FUNC sign_hash(const char *pin, const char *label, const uint8 *hash, int hashLen, const uint8 **ppCms)
+{
+	int rc;
+
+	*ppCms = 0;
+
+	rc = OpenTemplate(pin, label);
+	if (rc < 0)
+		return rc;
+	if (hashLen != This->HashLen) {
+		printf("hash length %d does not match template hash length %d\n", hashLen, This->HashLen);
+		return ERR_HASH;
+	}
+	rc = PatchTemplate(This->pCms, hash, hashLen);
+	if (rc > 0) {
+		*ppCms = This->pCms;
+		return rc;
 	}
 	/* error case */
 	release_template();
-	return rc < 0 ? rc : ERR_KEY_SIZE;
+	return rc;
+}
+
+/*
+ *  Signatures of several hashes with the same key
+ *
+ *  The template is checked once for all hashes and each CMS is produced
+ *  directly in the buffer supplied by the caller.
+ *
+ *  pin         : smartcard pin
+ *  label       : key and template label
+ *  hashes      : Hashes to be signed
+ *  hashLen     : Length of each hash (32, 48 or 64), must match the hash of the template
+ *  n           : Number of hashes
+ *  cms         : Buffers for the CMS data
+ *  cmsLen      : Size of each buffer on input, CMS size or 0 on output
+ *
+ *  Returns : Number of CMS created or error if < 0. On error the CMS
+ *            created before the failing hash remain valid.
+ */
+int EXPORT_FUNC sign_hashes(const char *pin, const char *label,
+	const uint8 * const *hashes, int hashLen, int n,
+	uint8 **cms, int *cmsLen)
+{
+	int rc, i;
+
+	for (i = 0; i < n; i++) {
+		if (cms[i] == 0)
+			return ERR_INVALID;
+	}
+
+	rc = OpenTemplate(pin, label);
+	if (rc < 0)
+		return rc;
+	if (hashLen != This->HashLen) {
+		printf("hash length %d does not match template hash length %d\n", hashLen, This->HashLen);
+		return ERR_HASH;
+	}
+	for (i = 0; i < n; i++) {
+		if (cmsLen[i] < This->CMSLen) {
+			rc = ERR_MEMORY;
+			break;
+		}
+		memcpy(cms[i], This->pCms, This->CMSLen);
+		rc = PatchTemplate(cms[i], hashes[i], hashLen);
+		if (rc <= 0)
+			break;
+		cmsLen[i] = rc;
+	}
+	if (i == n)
+		return n;
+	/* error case */
+	for (; i < n; i++)
+		cmsLen[i] = 0;
+	if (rc != ERR_MEMORY)
+		release_template();
+	return rc;
 }
 
 void EXPORT_FUNC release_template()
@@ -582,3 +696,42 @@ void EXPORT_FUNC release_template()
 	free(This);
 	This = 0;
 }
+
+/*
+ *  Start hash of given length
+ *
+ *  ctx         : hash context
+ *  hashLen     : 32 (SHA-256), 48 (SHA-384) or 64 (SHA-512)
+ *
+ *  Returns : 0 or ERR_HASH if the length is not supported
+ */
+int EXPORT_FUNC hash_starts(hash_context *ctx, int hashLen)
+{
+	ctx->hashLen = hashLen;
+	switch (hashLen) {
+	case 32:
+		sha256_starts(&ctx->u.sha256);
+		return 0;
+	case 48:
+	case 64:
+		sha512_starts(&ctx->u.sha512, hashLen == 48);
+		return 0;
+	}
+	return ERR_HASH;
+}
+
+void EXPORT_FUNC hash_update(hash_context *ctx, unsigned char *input, unsigned int length)
+{
+	if (ctx->hashLen == 32)
+		sha256_update(&ctx->u.sha256, input, length);
+	else
+		sha512_update(&ctx->u.sha512, input, length);
+}
+
+void EXPORT_FUNC hash_finish(hash_context *ctx, unsigned char *digest)
+{
+	if (ctx->hashLen == 32)
+		sha256_finish(&ctx->u.sha256, digest);
+	else
+		sha512_finish(&ctx->u.sha512, digest);
+}
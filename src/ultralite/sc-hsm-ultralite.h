@@ -28,8 +28,8 @@
  *
  * @file sc-hsm-ultralite.h
  * @author Christoph Brunhuber
- * @brief Functions for RSA-2k signing of SHA1, SHA-256, SHA-384, SHA-512
- *                  ECDSA-prime256 signing of SHA1, SHA-256
+ * @brief Functions for RSA-1k..4k signing of SHA-256, SHA-384, SHA-512
+ *                  ECDSA-prime256/384/521 and brainpool signing of SHA-256, SHA-384, SHA-512
  *                  Card Devices, Version 1.0
  */
 
@@ -72,6 +72,10 @@ int EXPORT_FUNC sign_hash(const char *pin, const char *label,
 	const unsigned char *hash, int hashLen,
 	const unsigned char **ppCMS);
 
+int EXPORT_FUNC sign_hashes(const char *pin, const char *label,
+	const unsigned char * const *hashes, int hashLen, int n,
+	unsigned char **cms, int *cmsLen);
+
 void EXPORT_FUNC release_template();
 
 typedef struct {
@@ -85,4 +89,30 @@ void EXPORT_FUNC sha256_starts(sha256_context *ctx);
 void EXPORT_FUNC sha256_update(sha256_context *ctx, unsigned char *input, unsigned int length);
 void EXPORT_FUNC sha256_finish(sha256_context *ctx, unsigned char digest[32]);
 
+typedef struct {
+	unsigned long long total[2];
+	unsigned long long state[8];
+	unsigned char buffer[128];
+	int is384;
+} sha512_context;
+
+void EXPORT_FUNC sha512_starts(sha512_context *ctx, int is384);
+void EXPORT_FUNC sha512_update(sha512_context *ctx, unsigned char *input, unsigned int length);
+void EXPORT_FUNC sha512_finish(sha512_context *ctx, unsigned char digest[64]);
+
+/*
+ * Hash selected by its length: 32 (SHA-256), 48 (SHA-384) or 64 (SHA-512)
+ */
+typedef struct {
+	int hashLen;
+	union {
+		sha256_context sha256;
+		sha512_context sha512;
+	} u;
+} hash_context;
+
+int  EXPORT_FUNC hash_starts(hash_context *ctx, int hashLen);
+void EXPORT_FUNC hash_update(hash_context *ctx, unsigned char *input, unsigned int length);
+void EXPORT_FUNC hash_finish(hash_context *ctx, unsigned char *digest);
+
 #endif
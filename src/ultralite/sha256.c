@@ -24,6 +24,44 @@
 typedef unsigned char uint8;
 typedef unsigned int uint32;
 
+/*
+ * Block functions process any number of complete 64 byte blocks directly
+ * from the input. The fastest one supported by the CPU is selected at runtime
+ * on the first call; the portable C version is always available.
+ */
+typedef void (*sha256_blocks_fn)( uint32 state[8], const uint8 *data, uint32 blocks );
+
+#if !defined(NO_SHA256_ACCEL)
+#if (defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))) \
+	|| (defined(_MSC_VER) && _MSC_VER >= 1900 && (defined(_M_X64) || defined(_M_IX86)))
+#define SHA256_SHANI
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SHA256_TARGET_SHANI
+#else
+#include <cpuid.h>
+#define SHA256_TARGET_SHANI __attribute__((target("sha,sse4.1,ssse3")))
+#endif
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__) && (defined(__linux__) || defined(__ARM_FEATURE_CRYPTO))
+#define SHA256_ARMCE
+#include <arm_neon.h>
+#ifdef __linux__
+#include <sys/auxv.h>
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+#endif
+#ifdef __clang__
+#define SHA256_TARGET_ARMCE __attribute__((target("crypto")))
+#else
+#define SHA256_TARGET_ARMCE __attribute__((target("+crypto")))
+#endif
+#endif
+#endif /* !NO_SHA256_ACCEL */
+
 #define GET_UINT32(n,b,i)                       \
 {                                               \
     (n) = ( (uint32) (b)[(i)    ] << 24 )       \
@@ -40,6 +78,10 @@ typedef unsigned int uint32;
     (b)[(i) + 3] = (uint8) ( (n)       );       \
 }
 
+static void sha256_blocks_detect( uint32 state[8], const uint8 *data, uint32 blocks );
+
+static sha256_blocks_fn sha256_blocks = sha256_blocks_detect;
+
 void sha256_starts( sha256_context *ctx )
 {
     ctx->total[0] = 0;
@@ -55,28 +97,16 @@ void sha256_starts( sha256_context *ctx )
     ctx->state[7] = 0x5BE0CD19;
 }
 
-void sha256_process( sha256_context *ctx, uint8 data[64] )
+/*
+ * Portable implementation. The message schedule is kept in a rolling
+ * window of 16 words and the working variables stay in registers
+ * across all blocks.
+ */
+static void sha256_blocks_c( uint32 state[8], const uint8 *data, uint32 blocks )
 {
-    uint32 temp1, temp2, W[64];
+    uint32 temp1, temp2, W[16];
     uint32 A, B, C, D, E, F, G, H;
 
-    GET_UINT32( W[0],  data,  0 );
-    GET_UINT32( W[1],  data,  4 );
-    GET_UINT32( W[2],  data,  8 );
-    GET_UINT32( W[3],  data, 12 );
-    GET_UINT32( W[4],  data, 16 );
-    GET_UINT32( W[5],  data, 20 );
-    GET_UINT32( W[6],  data, 24 );
-    GET_UINT32( W[7],  data, 28 );
-    GET_UINT32( W[8],  data, 32 );
-    GET_UINT32( W[9],  data, 36 );
-    GET_UINT32( W[10], data, 40 );
-    GET_UINT32( W[11], data, 44 );
-    GET_UINT32( W[12], data, 48 );
-    GET_UINT32( W[13], data, 52 );
-    GET_UINT32( W[14], data, 56 );
-    GET_UINT32( W[15], data, 60 );
-
 #define  SHR(x,n) ((x & 0xFFFFFFFF) >> n)
 #define ROTR(x,n) (SHR(x,n) | (x << (32 - n)))
 
@@ -91,8 +121,9 @@ void sha256_process( sha256_context *ctx, uint8 data[64] )
 
 #define R(t)                                    \
 (                                               \
-    W[t] = S1(W[t -  2]) + W[t -  7] +          \
-           S0(W[t - 15]) + W[t - 16]            \
+    W[(t) & 15] += S1(W[((t) -  2) & 15]) +     \
+                   W[((t) -  7) & 15] +         \
+                   S0(W[((t) - 15) & 15])       \
 )
 
 #define P(a,b,c,d,e,f,g,h,x,K)                  \
@@ -102,93 +133,312 @@ void sha256_process( sha256_context *ctx, uint8 data[64] )
     d += temp1; h = temp1 + temp2;              \
 }
 
-    A = ctx->state[0];
-    B = ctx->state[1];
-    C = ctx->state[2];
-    D = ctx->state[3];
-    E = ctx->state[4];
-    F = ctx->state[5];
-    G = ctx->state[6];
-    H = ctx->state[7];
-
-    P( A, B, C, D, E, F, G, H, W[ 0], 0x428A2F98 );
-    P( H, A, B, C, D, E, F, G, W[ 1], 0x71374491 );
-    P( G, H, A, B, C, D, E, F, W[ 2], 0xB5C0FBCF );
-    P( F, G, H, A, B, C, D, E, W[ 3], 0xE9B5DBA5 );
-    P( E, F, G, H, A, B, C, D, W[ 4], 0x3956C25B );
-    P( D, E, F, G, H, A, B, C, W[ 5], 0x59F111F1 );
-    P( C, D, E, F, G, H, A, B, W[ 6], 0x923F82A4 );
-    P( B, C, D, E, F, G, H, A, W[ 7], 0xAB1C5ED5 );
-    P( A, B, C, D, E, F, G, H, W[ 8], 0xD807AA98 );
-    P( H, A, B, C, D, E, F, G, W[ 9], 0x12835B01 );
-    P( G, H, A, B, C, D, E, F, W[10], 0x243185BE );
-    P( F, G, H, A, B, C, D, E, W[11], 0x550C7DC3 );
-    P( E, F, G, H, A, B, C, D, W[12], 0x72BE5D74 );
-    P( D, E, F, G, H, A, B, C, W[13], 0x80DEB1FE );
-    P( C, D, E, F, G, H, A, B, W[14], 0x9BDC06A7 );
-    P( B, C, D, E, F, G, H, A, W[15], 0xC19BF174 );
-    P( A, B, C, D, E, F, G, H, R(16), 0xE49B69C1 );
-    P( H, A, B, C, D, E, F, G, R(17), 0xEFBE4786 );
-    P( G, H, A, B, C, D, E, F, R(18), 0x0FC19DC6 );
-    P( F, G, H, A, B, C, D, E, R(19), 0x240CA1CC );
-    P( E, F, G, H, A, B, C, D, R(20), 0x2DE92C6F );
-    P( D, E, F, G, H, A, B, C, R(21), 0x4A7484AA );
-    P( C, D, E, F, G, H, A, B, R(22), 0x5CB0A9DC );
-    P( B, C, D, E, F, G, H, A, R(23), 0x76F988DA );
-    P( A, B, C, D, E, F, G, H, R(24), 0x983E5152 );
-    P( H, A, B, C, D, E, F, G, R(25), 0xA831C66D );
-    P( G, H, A, B, C, D, E, F, R(26), 0xB00327C8 );
-    P( F, G, H, A, B, C, D, E, R(27), 0xBF597FC7 );
-    P( E, F, G, H, A, B, C, D, R(28), 0xC6E00BF3 );
-    P( D, E, F, G, H, A, B, C, R(29), 0xD5A79147 );
-    P( C, D, E, F, G, H, A, B, R(30), 0x06CA6351 );
-    P( B, C, D, E, F, G, H, A, R(31), 0x14292967 );
-    P( A, B, C, D, E, F, G, H, R(32), 0x27B70A85 );
-    P( H, A, B, C, D, E, F, G, R(33), 0x2E1B2138 );
-    P( G, H, A, B, C, D, E, F, R(34), 0x4D2C6DFC );
-    P( F, G, H, A, B, C, D, E, R(35), 0x53380D13 );
-    P( E, F, G, H, A, B, C, D, R(36), 0x650A7354 );
-    P( D, E, F, G, H, A, B, C, R(37), 0x766A0ABB );
-    P( C, D, E, F, G, H, A, B, R(38), 0x81C2C92E );
-    P( B, C, D, E, F, G, H, A, R(39), 0x92722C85 );
-    P( A, B, C, D, E, F, G, H, R(40), 0xA2BFE8A1 );
-    P( H, A, B, C, D, E, F, G, R(41), 0xA81A664B );
-    P( G, H, A, B, C, D, E, F, R(42), 0xC24B8B70 );
-    P( F, G, H, A, B, C, D, E, R(43), 0xC76C51A3 );
-    P( E, F, G, H, A, B, C, D, R(44), 0xD192E819 );
-    P( D, E, F, G, H, A, B, C, R(45), 0xD6990624 );
-    P( C, D, E, F, G, H, A, B, R(46), 0xF40E3585 );
-    P( B, C, D, E, F, G, H, A, R(47), 0x106AA070 );
-    P( A, B, C, D, E, F, G, H, R(48), 0x19A4C116 );
-    P( H, A, B, C, D, E, F, G, R(49), 0x1E376C08 );
-    P( G, H, A, B, C, D, E, F, R(50), 0x2748774C );
-    P( F, G, H, A, B, C, D, E, R(51), 0x34B0BCB5 );
-    P( E, F, G, H, A, B, C, D, R(52), 0x391C0CB3 );
-    P( D, E, F, G, H, A, B, C, R(53), 0x4ED8AA4A );
-    P( C, D, E, F, G, H, A, B, R(54), 0x5B9CCA4F );
-    P( B, C, D, E, F, G, H, A, R(55), 0x682E6FF3 );
-    P( A, B, C, D, E, F, G, H, R(56), 0x748F82EE );
-    P( H, A, B, C, D, E, F, G, R(57), 0x78A5636F );
-    P( G, H, A, B, C, D, E, F, R(58), 0x84C87814 );
-    P( F, G, H, A, B, C, D, E, R(59), 0x8CC70208 );
-    P( E, F, G, H, A, B, C, D, R(60), 0x90BEFFFA );
-    P( D, E, F, G, H, A, B, C, R(61), 0xA4506CEB );
-    P( C, D, E, F, G, H, A, B, R(62), 0xBEF9A3F7 );
-    P( B, C, D, E, F, G, H, A, R(63), 0xC67178F2 );
-
-    ctx->state[0] += A;
-    ctx->state[1] += B;
-    ctx->state[2] += C;
-    ctx->state[3] += D;
-    ctx->state[4] += E;
-    ctx->state[5] += F;
-    ctx->state[6] += G;
-    ctx->state[7] += H;
+    A = state[0];
+    B = state[1];
+    C = state[2];
+    D = state[3];
+    E = state[4];
+    F = state[5];
+    G = state[6];
+    H = state[7];
+
+    while( blocks-- )
+    {
+        GET_UINT32( W[0],  data,  0 );
+        GET_UINT32( W[1],  data,  4 );
+        GET_UINT32( W[2],  data,  8 );
+        GET_UINT32( W[3],  data, 12 );
+        GET_UINT32( W[4],  data, 16 );
+        GET_UINT32( W[5],  data, 20 );
+        GET_UINT32( W[6],  data, 24 );
+        GET_UINT32( W[7],  data, 28 );
+        GET_UINT32( W[8],  data, 32 );
+        GET_UINT32( W[9],  data, 36 );
+        GET_UINT32( W[10], data, 40 );
+        GET_UINT32( W[11], data, 44 );
+        GET_UINT32( W[12], data, 48 );
+        GET_UINT32( W[13], data, 52 );
+        GET_UINT32( W[14], data, 56 );
+        GET_UINT32( W[15], data, 60 );
+
+        P( A, B, C, D, E, F, G, H, W[ 0], 0x428A2F98 );
+        P( H, A, B, C, D, E, F, G, W[ 1], 0x71374491 );
+        P( G, H, A, B, C, D, E, F, W[ 2], 0xB5C0FBCF );
+        P( F, G, H, A, B, C, D, E, W[ 3], 0xE9B5DBA5 );
+        P( E, F, G, H, A, B, C, D, W[ 4], 0x3956C25B );
+        P( D, E, F, G, H, A, B, C, W[ 5], 0x59F111F1 );
+        P( C, D, E, F, G, H, A, B, W[ 6], 0x923F82A4 );
+        P( B, C, D, E, F, G, H, A, W[ 7], 0xAB1C5ED5 );
+        P( A, B, C, D, E, F, G, H, W[ 8], 0xD807AA98 );
+        P( H, A, B, C, D, E, F, G, W[ 9], 0x12835B01 );
+        P( G, H, A, B, C, D, E, F, W[10], 0x243185BE );
+        P( F, G, H, A, B, C, D, E, W[11], 0x550C7DC3 );
+        P( E, F, G, H, A, B, C, D, W[12], 0x72BE5D74 );
+        P( D, E, F, G, H, A, B, C, W[13], 0x80DEB1FE );
+        P( C, D, E, F, G, H, A, B, W[14], 0x9BDC06A7 );
+        P( B, C, D, E, F, G, H, A, W[15], 0xC19BF174 );
+        P( A, B, C, D, E, F, G, H, R(16), 0xE49B69C1 );
+        P( H, A, B, C, D, E, F, G, R(17), 0xEFBE4786 );
+        P( G, H, A, B, C, D, E, F, R(18), 0x0FC19DC6 );
+        P( F, G, H, A, B, C, D, E, R(19), 0x240CA1CC );
+        P( E, F, G, H, A, B, C, D, R(20), 0x2DE92C6F );
+        P( D, E, F, G, H, A, B, C, R(21), 0x4A7484AA );
+        P( C, D, E, F, G, H, A, B, R(22), 0x5CB0A9DC );
+        P( B, C, D, E, F, G, H, A, R(23), 0x76F988DA );
+        P( A, B, C, D, E, F, G, H, R(24), 0x983E5152 );
+        P( H, A, B, C, D, E, F, G, R(25), 0xA831C66D );
+        P( G, H, A, B, C, D, E, F, R(26), 0xB00327C8 );
+        P( F, G, H, A, B, C, D, E, R(27), 0xBF597FC7 );
+        P( E, F, G, H, A, B, C, D, R(28), 0xC6E00BF3 );
+        P( D, E, F, G, H, A, B, C, R(29), 0xD5A79147 );
+        P( C, D, E, F, G, H, A, B, R(30), 0x06CA6351 );
+        P( B, C, D, E, F, G, H, A, R(31), 0x14292967 );
+        P( A, B, C, D, E, F, G, H, R(32), 0x27B70A85 );
+        P( H, A, B, C, D, E, F, G, R(33), 0x2E1B2138 );
+        P( G, H, A, B, C, D, E, F, R(34), 0x4D2C6DFC );
+        P( F, G, H, A, B, C, D, E, R(35), 0x53380D13 );
+        P( E, F, G, H, A, B, C, D, R(36), 0x650A7354 );
+        P( D, E, F, G, H, A, B, C, R(37), 0x766A0ABB );
+        P( C, D, E, F, G, H, A, B, R(38), 0x81C2C92E );
+        P( B, C, D, E, F, G, H, A, R(39), 0x92722C85 );
+        P( A, B, C, D, E, F, G, H, R(40), 0xA2BFE8A1 );
+        P( H, A, B, C, D, E, F, G, R(41), 0xA81A664B );
+        P( G, H, A, B, C, D, E, F, R(42), 0xC24B8B70 );
+        P( F, G, H, A, B, C, D, E, R(43), 0xC76C51A3 );
+        P( E, F, G, H, A, B, C, D, R(44), 0xD192E819 );
+        P( D, E, F, G, H, A, B, C, R(45), 0xD6990624 );
+        P( C, D, E, F, G, H, A, B, R(46), 0xF40E3585 );
+        P( B, C, D, E, F, G, H, A, R(47), 0x106AA070 );
+        P( A, B, C, D, E, F, G, H, R(48), 0x19A4C116 );
+        P( H, A, B, C, D, E, F, G, R(49), 0x1E376C08 );
+        P( G, H, A, B, C, D, E, F, R(50), 0x2748774C );
+        P( F, G, H, A, B, C, D, E, R(51), 0x34B0BCB5 );
+        P( E, F, G, H, A, B, C, D, R(52), 0x391C0CB3 );
+        P( D, E, F, G, H, A, B, C, R(53), 0x4ED8AA4A );
+        P( C, D, E, F, G, H, A, B, R(54), 0x5B9CCA4F );
+        P( B, C, D, E, F, G, H, A, R(55), 0x682E6FF3 );
+        P( A, B, C, D, E, F, G, H, R(56), 0x748F82EE );
+        P( H, A, B, C, D, E, F, G, R(57), 0x78A5636F );
+        P( G, H, A, B, C, D, E, F, R(58), 0x84C87814 );
+        P( F, G, H, A, B, C, D, E, R(59), 0x8CC70208 );
+        P( E, F, G, H, A, B, C, D, R(60), 0x90BEFFFA );
+        P( D, E, F, G, H, A, B, C, R(61), 0xA4506CEB );
+        P( C, D, E, F, G, H, A, B, R(62), 0xBEF9A3F7 );
+        P( B, C, D, E, F, G, H, A, R(63), 0xC67178F2 );
+
+        A = state[0] += A;
+        B = state[1] += B;
+        C = state[2] += C;
+        D = state[3] += D;
+        E = state[4] += E;
+        F = state[5] += F;
+        G = state[6] += G;
+        H = state[7] += H;
+
+        data += 64;
+    }
+}
+
+#if defined(SHA256_SHANI) || defined(SHA256_ARMCE)
+static const uint32 sha256_k[64] =
+{
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+#endif
+
+#ifdef SHA256_SHANI
+/*
+ * x86 SHA extensions. The state is kept as ABEF/CDGH as required by
+ * SHA256RNDS2, each step performs four rounds.
+ */
+SHA256_TARGET_SHANI
+static void sha256_blocks_shani( uint32 state[8], const uint8 *data, uint32 blocks )
+{
+    const __m128i MASK = _mm_set_epi64x( 0x0C0D0E0F08090A0BULL, 0x0405060700010203ULL );
+    __m128i STATE0, STATE1, ABEF_SAVE, CDGH_SAVE;
+    __m128i MSG, MSG0, MSG1, MSG2, MSG3, TMP;
+    int i;
+
+    TMP    = _mm_loadu_si128( (const __m128i *) &state[0] );
+    STATE1 = _mm_loadu_si128( (const __m128i *) &state[4] );
+    TMP    = _mm_shuffle_epi32( TMP, 0xB1 );            /* CDAB */
+    STATE1 = _mm_shuffle_epi32( STATE1, 0x1B );         /* EFGH */
+    STATE0 = _mm_alignr_epi8( TMP, STATE1, 8 );         /* ABEF */
+    STATE1 = _mm_blend_epi16( STATE1, TMP, 0xF0 );      /* CDGH */
+
+    while( blocks-- )
+    {
+        ABEF_SAVE = STATE0;
+        CDGH_SAVE = STATE1;
+
+        MSG0 = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *) ( data +  0 ) ), MASK );
+        MSG1 = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *) ( data + 16 ) ), MASK );
+        MSG2 = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *) ( data + 32 ) ), MASK );
+        MSG3 = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *) ( data + 48 ) ), MASK );
+
+        for( i = 0; i < 16; i++ )
+        {
+            MSG    = _mm_add_epi32( MSG0, _mm_loadu_si128( (const __m128i *) &sha256_k[4 * i] ) );
+            STATE1 = _mm_sha256rnds2_epu32( STATE1, STATE0, MSG );
+            MSG    = _mm_shuffle_epi32( MSG, 0x0E );
+            STATE0 = _mm_sha256rnds2_epu32( STATE0, STATE1, MSG );
+
+            /* W[t..t+3] = sigma1(W[t-2]) + W[t-7] + sigma0(W[t-15]) + W[t-16] */
+            if( i < 12 )
+            {
+                MSG0 = _mm_add_epi32( _mm_sha256msg1_epu32( MSG0, MSG1 ),
+                                      _mm_alignr_epi8( MSG3, MSG2, 4 ) );
+                MSG0 = _mm_sha256msg2_epu32( MSG0, MSG3 );
+            }
+
+            TMP  = MSG0;
+            MSG0 = MSG1;
+            MSG1 = MSG2;
+            MSG2 = MSG3;
+            MSG3 = TMP;
+        }
+
+        STATE0 = _mm_add_epi32( STATE0, ABEF_SAVE );
+        STATE1 = _mm_add_epi32( STATE1, CDGH_SAVE );
+
+        data += 64;
+    }
+
+    TMP    = _mm_shuffle_epi32( STATE0, 0x1B );         /* FEBA */
+    STATE1 = _mm_shuffle_epi32( STATE1, 0xB1 );         /* DCHG */
+    STATE0 = _mm_blend_epi16( TMP, STATE1, 0xF0 );      /* DCBA */
+    STATE1 = _mm_alignr_epi8( STATE1, TMP, 8 );         /* HGFE */
+
+    _mm_storeu_si128( (__m128i *) &state[0], STATE0 );
+    _mm_storeu_si128( (__m128i *) &state[4], STATE1 );
+}
+
+static int sha256_have_shani( void )
+{
+#ifdef _MSC_VER
+    int regs[4];
+
+    __cpuid( regs, 0 );
+    if( regs[0] < 7 )
+        return 0;
+    __cpuid( regs, 1 );
+    if( !( regs[2] & ( 1 << 19 ) ) || !( regs[2] & ( 1 << 9 ) ) )  /* SSE4.1, SSSE3 */
+        return 0;
+    __cpuidex( regs, 7, 0 );
+    return ( regs[1] & ( 1 << 29 ) ) != 0;                         /* SHA */
+#else
+    unsigned int eax, ebx, ecx, edx;
+
+    if( __get_cpuid_max( 0, 0 ) < 7 )
+        return 0;
+    __cpuid( 1, eax, ebx, ecx, edx );
+    if( !( ecx & ( 1 << 19 ) ) || !( ecx & ( 1 << 9 ) ) )          /* SSE4.1, SSSE3 */
+        return 0;
+    __cpuid_count( 7, 0, eax, ebx, ecx, edx );
+    return ( ebx & ( 1 << 29 ) ) != 0;                             /* SHA */
+#endif
+}
+#endif /* SHA256_SHANI */
+
+#ifdef SHA256_ARMCE
+/*
+ * ARMv8 cryptography extensions, each step performs four rounds.
+ */
+SHA256_TARGET_ARMCE
+static void sha256_blocks_armce( uint32 state[8], const uint8 *data, uint32 blocks )
+{
+    uint32x4_t STATE0, STATE1, ABCD_SAVE, EFGH_SAVE;
+    uint32x4_t MSG0, MSG1, MSG2, MSG3, TMP0, TMP1;
+    int i;
+
+    STATE0 = vld1q_u32( &state[0] );
+    STATE1 = vld1q_u32( &state[4] );
+
+    while( blocks-- )
+    {
+        ABCD_SAVE = STATE0;
+        EFGH_SAVE = STATE1;
+
+        MSG0 = vreinterpretq_u32_u8( vrev32q_u8( vld1q_u8( data +  0 ) ) );
+        MSG1 = vreinterpretq_u32_u8( vrev32q_u8( vld1q_u8( data + 16 ) ) );
+        MSG2 = vreinterpretq_u32_u8( vrev32q_u8( vld1q_u8( data + 32 ) ) );
+        MSG3 = vreinterpretq_u32_u8( vrev32q_u8( vld1q_u8( data + 48 ) ) );
+
+        for( i = 0; i < 16; i++ )
+        {
+            TMP0 = vaddq_u32( MSG0, vld1q_u32( &sha256_k[4 * i] ) );
+
+            /* W[t..t+3] = sigma1(W[t-2]) + W[t-7] + sigma0(W[t-15]) + W[t-16] */
+            if( i < 12 )
+                MSG0 = vsha256su1q_u32( vsha256su0q_u32( MSG0, MSG1 ), MSG2, MSG3 );
+
+            TMP1   = STATE0;
+            STATE0 = vsha256hq_u32( STATE0, STATE1, TMP0 );
+            STATE1 = vsha256h2q_u32( STATE1, TMP1, TMP0 );
+
+            TMP1 = MSG0;
+            MSG0 = MSG1;
+            MSG1 = MSG2;
+            MSG2 = MSG3;
+            MSG3 = TMP1;
+        }
+
+        STATE0 = vaddq_u32( STATE0, ABCD_SAVE );
+        STATE1 = vaddq_u32( STATE1, EFGH_SAVE );
+
+        data += 64;
+    }
+
+    vst1q_u32( &state[0], STATE0 );
+    vst1q_u32( &state[4], STATE1 );
+}
+
+static int sha256_have_armce( void )
+{
+#if defined(__ARM_FEATURE_CRYPTO)
+    return 1;
+#else
+    return ( getauxval( AT_HWCAP ) & HWCAP_SHA2 ) != 0;
+#endif
+}
+#endif /* SHA256_ARMCE */
+
+/*
+ * Select the block function on first use. Concurrent first calls
+ * all store the same pointer, so no locking is required.
+ */
+static void sha256_blocks_detect( uint32 state[8], const uint8 *data, uint32 blocks )
+{
+    sha256_blocks_fn fn = sha256_blocks_c;
+
+#ifdef SHA256_SHANI
+    if( sha256_have_shani() )
+        fn = sha256_blocks_shani;
+#endif
+#ifdef SHA256_ARMCE
+    if( sha256_have_armce() )
+        fn = sha256_blocks_armce;
+#endif
+
+    sha256_blocks = fn;
+    fn( state, data, blocks );
+}
+
+void sha256_process( sha256_context *ctx, uint8 data[64] )
+{
+    sha256_blocks( ctx->state, data, 1 );
 }
 
 void sha256_update( sha256_context *ctx, uint8 *input, uint32 length )
 {
-    uint32 left, fill;
+    uint32 left, fill, blocks;
 
     if( ! length ) return;
 
@@ -205,17 +455,19 @@ void sha256_update( sha256_context *ctx, uint8 *input, uint32 length )
     {
         memcpy( (void *) (ctx->buffer + left),
                 (void *) input, fill );
-        sha256_process( ctx, ctx->buffer );
+        sha256_blocks( ctx->state, ctx->buffer, 1 );
         length -= fill;
         input  += fill;
         left = 0;
     }
 
-    while( length >= 64 )
+    /* hash all complete blocks in place */
+    blocks = length >> 6;
+    if( blocks )
     {
-        sha256_process( ctx, input );
-        length -= 64;
-        input  += 64;
+        sha256_blocks( ctx->state, input, blocks );
+        length -= blocks << 6;
+        input  += blocks << 6;
     }
 
     if( length )
@@ -260,7 +260,7 @@ int SC_ProcessAPDU(
 	uint8 *inData, int inLen,
 	uint16 *sw1sw2)
 {
-	uint8 scr[4 + 3 + 3 + MAX_OUT_IN];
+	uint8 scr[4 + 3 + 3 + MAX_APDU_DATA];
 	int rc;
 #ifdef CTAPI
 	uint16 len;
@@ -41,6 +41,7 @@ extern "C" {
 /* utility functions */
 
 #define MAX_OUT_IN 256
+#define MAX_APDU_DATA 512 /* largest command or response data (RSA-4k signature) */
 typedef unsigned char uint8;
 typedef unsigned short uint16;
 